@@ -43,6 +43,102 @@
 //_i variables are the times associated with the respective samples.Reset time and UTC time.
 //Blocks to process is optional. If not supplied the entire file is processed. 
 
+//Options are name/value pairs after filename, length_blocks and csv.
+//parse_sdcard_mex_p(filename, length_blocks, csv, 'verify', 1, 'threads', 8);
+//  verify   1 scans the image for corruption without decoding samples.
+//           The report is written to verify_report.csv.
+//  threads  Number of threads for the verify scan. Default is one per core.
+//  streams  Comma separated streams to decode, e.g. 'gps,status,imu'.
+//           Names are status, gps, gyro, accel, mag, imu, audio and all.
+//           Default is all. Other segments are walked but not decoded,
+//           time stamped or written, and their outputs come back empty.
+//           Status and time pulse segments are still read since every
+//           sample time depends on them.
+//  wav            Also write the audio to this WAV file, one channel per
+//                 active microphone at 56250 Hz. Files past 4 GB are
+//                 written as RF64.
+//  wav_dc         1 removes the mean of each channel from the WAV file.
+//  wav_normalize  1 scales the WAV file so its largest peak is just under
+//                 full scale. With wav_dc or wav_normalize the audio is
+//                 read once more before the parse to find the levels.
+//  flac           Also write the audio losslessly compressed to this FLAC
+//                 file, one channel per active microphone at 56250 Hz.
+//                 Frames are encoded on the threads given by threads.
+//  resample       Rate in Hz for the WAV and FLAC files, e.g. 48000 or
+//                 16000. The audio is resampled as it is decoded. The
+//                 audio outputs and .bin files keep the 56250 Hz samples.
+//  overview       1 writes a min/max/RMS overview of each selected sample
+//                 stream at 1 ms, 10 ms, 100 ms and 1 s for plotting long
+//                 recordings. The files are listed in overview.csv.
+//  features       1 writes mel band energies of the audio, 40 bands from
+//                 1024 sample Hann windowed FFT frames every 512 samples,
+//                 to features_audio_l.bin and features_audio_r.bin as
+//                 float32 dB rows. features_times.bin has the audio time
+//                 of each frame's center and features_mel.csv the bands.
+//  events         1 detects loud acoustic events against a running noise
+//                 floor and lists them in events.csv with the sample
+//                 range, peak level and audio time of each end.
+//  event_db       dB over the noise floor that starts an event. Default
+//                 is 12. The event ends once the level stays under half
+//                 of this for 20 frames of 512 samples.
+//  event_clips    1 also writes each event to event_NNNNN.wav with 10
+//                 frames of audio ahead of it.
+//  imu_units      1 writes the IMU in physical units to gyro_xyz.bin
+//                 (dps), xl_xyz.bin (g) and mag_xyz.bin (gauss) as X, Y, Z
+//                 float32 rows, one per row of the matching _times.bin.
+//  imu_mif        LSM9DS1 startup register MIF file the collar was built
+//                 with. The full scales are read from it. Default is the
+//                 power on scales of 245 dps, 2 g and 4 gauss, which the
+//                 shipped MIF files leave unchanged.
+//  imu_offsets    3 x 3 offsets taken off after scaling, one row each for
+//                 gyro, accel and mag and one column each for X, Y and Z.
+//  fusion         1 estimates the collar orientation from the gyro, accel
+//                 and mag with a Madgwick filter, one float32 row of qw, qx,
+//                 qy, qz, roll, pitch and yaw (degrees) per gyro sample in
+//                 orientation.bin, the times in orientation_times.bin.
+//                 Uses the imu_mif scales and imu_offsets.
+//  fusion_beta    Filter gain. Default is 0.1; lower trusts the gyro more.
+//  merge          1 writes merged.bin, every audio_r sample, IMU sample and
+//                 nav_sol, tm2 and tim_tp packet in GPS time order. Each
+//                 record is 9 uint32: stream (0 audio, 1 gyro, 2 accel,
+//                 3 mag, 4 nav_sol, 5 tm2, 6 tim_tp), the gps_time row and
+//                 the record's row in its own output as low and high words.
+//                 Packet rows hold their reset time and their own GPS time.
+//  merge_window   Window length in ms for merged_windows.csv, which gives
+//                 for each window the first row and count of every stream
+//                 (and of merged.bin) so all sensors can be read a window
+//                 at a time. 1000 gives 1 s frames.
+//  track          1 converts the nav_sol fixes to latitude, longitude and
+//                 height and writes track.csv, track.gpx and track.geojson
+//                 with the fix GPS time (UTC in the GPX and GeoJSON). Use
+//                 with 'streams','gps,status' for a GPS only pass.
+//  track_fix      Lowest fixtype kept, 2 for 2D or 3 for 3D. Default 3.
+//  track_pacc     Largest position accuracy kept in m. Default 50.
+//  reorder        Sorts the blocks by sequence number into this file
+//                 first, dropping repeated blocks, and parses that. For
+//                 dumps taken out of order or pieced together. The index
+//                 is sorted on disk beside the file when it passes 96 MB,
+//                 about 2 GB of image. Unwritten blocks are left out. The
+//                 file may not be the image or one of the dumps.
+//  dumps          Other dumps of the same card, comma separated, merged
+//                 with the image into the reorder file. Blocks held by
+//                 more than one are kept once, from the image or else the
+//                 earliest dump listed. Repeats that differ are counted as
+//                 conflicts. sd_image_merge does the same without a parse.
+
+//Called with outputs nothing but block_errors.csv and perf_report.json is
+//written. Audio is returned as int16 columns, segments as uint32, the IMU
+//streams as N x 3 int16 in the ZYX order stored, and the packets as 1x1
+//structs with a column per field, each field in its own integer class
+//(ecefx int32, fixtype uint8, status_t uint64 and so on). The _i and _timemarks outputs are N x 6
+//uint32 in gps_time field order. Called without outputs the .bin (and
+//.csv) files are written as before.
+
+//Every parse writes perf_report.json with the time spent reading, walking,
+//decoding, back annotating and in each writer, and the count and bytes of
+//each segment type. Build with -DSD_PERF_SEGMENTS to also time the decode
+//of each segment type, which slows the decode.
+
 
 //TODO:
 //CHECK YOUR CALLOCS!
@@ -94,6 +190,7 @@
 
 
 #include <cstdlib>
+#include <cstdio>
 #include <fstream>
 #include <string>
 #include <cerrno>
@@ -103,8 +200,28 @@
 #include <iomanip>
 #include <chrono>
 #include <iterator>
+#include <thread>
 #include <intrin.h>
 
+#include "sd_load.h"
+#include "sd_layout.h"
+#include "sd_block.h"
+#include "sd_packets.h"
+#include "sd_perf.h"
+#include "sd_wav.h"
+#include "sd_flac.h"
+#include "sd_resample.h"
+#include "sd_overview.h"
+#include "sd_features.h"
+#include "sd_events.h"
+#include "sd_imu.h"
+#include "sd_fusion.h"
+#include "sd_merge.h"
+#include "sd_track.h"
+#include "sd_clock.h"
+#include "sd_status.h"
+#include "sd_reorder.h"
+
 #include "matrix.h"
 #include "mex.h"
 #include "mat.h"
@@ -127,15 +244,138 @@ using std::cout;
   };
 
 
-  struct tim_tp_packet {
-    uint32_t reset_time_week;
-    uint32_t reset_time_ms;
-    uint32_t reset_time_ns;
-    uint32_t gps_time_week;
-    uint32_t gps_time_ms;
-    uint32_t gps_time_ns;
+
+  //Streams that can be selected with the streams option.
+  enum stream_flag {
+    STREAM_STATUS = 0x01,
+    STREAM_GPS = 0x02,
+    STREAM_GYRO = 0x04,
+    STREAM_ACCEL = 0x08,
+    STREAM_MAG = 0x10,
+    STREAM_AUDIO = 0x20,
+    STREAM_IMU = STREAM_GYRO | STREAM_ACCEL | STREAM_MAG,
+    STREAM_ALL = 0x3F
+  };
+
+
+  //Optional name/value arguments.
+  struct parse_options {
+    int verify;
+    int threads;
+    int streams;
+    std::string wav;
+    int wav_dc;
+    int wav_normalize;
+    std::string flac;
+    int resample;
+    int overview;
+    int features;
+    int events;
+    double event_db;
+    int event_clips;
+    int imu_units;
+    std::string imu_mif;
+    double imu_offsets[3][3];
+    int fusion;
+    double fusion_beta;
+    int merge;
+    int merge_window;
+    int track;
+    int track_fix;
+    double track_pacc;
+    std::string reorder;
+    vector<std::string> dumps;
+  };
+
+
+  //Verify scan state for one contiguous range of blocks.
+  //The first and last sequence numbers and status times are kept
+  //so the ranges can be checked against each other afterwards.
+  struct verify_range {
+    uint64_t first_block;
+    uint64_t end_block;
+    uint64_t blocks_written;
+    uint64_t blocks_unwritten;
+    uint64_t segment_counts[BLOCK_SEG_TYPES];
+    uint64_t segment_bytes[BLOCK_SEG_TYPES];
+    int num_mics;
+    uint64_t audio_first_samples;
+    uint64_t audio_second_samples;
+    int has_sequence;
+    uint32_t first_sequence;
+    uint32_t first_sequence_block;
+    uint32_t last_sequence;
+    int has_status;
+    uint64_t first_status_time;
+    uint32_t first_status_block;
+    uint32_t first_status_sequence;
+    uint64_t last_status_time;
+    vector<block_error> errors;
+
+    //Status segments of no known layout. The decode leaves these out.
+    uint64_t status_unknown;
+
+    //Set if the range could not be read in full.
+    int failed;
+  };
+
+
+  //Outputs in the order they are returned to MATLAB.
+  enum mex_output_index {
+    OUT_AUDIO_L = 0,
+    OUT_AUDIO_R,
+    OUT_SEGMENTS,
+    OUT_GYRO,
+    OUT_XL,
+    OUT_MAG,
+    OUT_STATUS,
+    OUT_TM,
+    OUT_NAV,
+    OUT_TP,
+    OUT_GYRO_I,
+    OUT_XL_I,
+    OUT_MAG_I,
+    OUT_GYRO_TIMEMARKS,
+    OUT_STATUS_TIMEMARKS,
+    OUT_AUD_I,
+    OUT_COUNT
   };
 
+  //Packet structs and time arrays among the outputs.
+  const int OUT_PACKET_TYPES = 4;
+  const int OUT_TIME_ARRAYS = 6;
+
+
+  //Arrays handed back to MATLAB when called with outputs.
+  //Each is created once at full size from the counting pass and filled
+  //in place, rows are the sizes and counts how far each is filled.
+  //Pointers are NULL for outputs that weren't asked for.
+  struct mex_outputs {
+    int16_t* audio_l;
+    int16_t* audio_r;
+    uint32_t* sequence;
+    uint64_t audio_l_rows;
+    uint64_t audio_r_rows;
+    uint64_t sequence_rows;
+    uint64_t audio_l_count;
+    uint64_t audio_r_count;
+    uint64_t sequence_count;
+
+    //Gyro, accel then mag. rows x 3, axes in the order stored.
+    int16_t* imu[3];
+    uint64_t imu_rows[3];
+    uint64_t imu_words[3];
+
+    //Status, tm, nav_sol then tim_tp. 1x1 structs with a column per field.
+    mxArray* packets[OUT_PACKET_TYPES];
+    uint64_t packet_rows[OUT_PACKET_TYPES];
+    uint64_t packet_count[OUT_PACKET_TYPES];
+
+    //gyro_i through aud_i. rows x 6 in gps_time field order.
+    uint32_t* times[OUT_TIME_ARRAYS];
+    uint64_t time_rows[OUT_TIME_ARRAYS];
+    uint64_t time_count[OUT_TIME_ARRAYS];
+  };
 
 
 //Masks as defined in the vhdl code. 
@@ -147,17 +387,39 @@ using std::cout;
 gps_time populate_gps_time(uint64_t);
 //Back annotate every sample in stream to ms/ns.
 //Fill in adjusted absolute gps times. 
-int back_annotate(vector<gps_time>&, vector<tim_tp_packet>&, vector<int>&, int, int);
+int back_annotate(vector<gps_time>&, clock_model&, vector<int>&, vector<uint64_t>&, uint64_t, int, int);
+//Read one name/value option pair into the options.
+int parse_option(const mxArray*, const mxArray*, parse_options&);
+int parse_stream_list(const std::string&, int&);
+//Whether a segment type is decoded for the selected streams.
+int stream_selected(int, int);
+//Scan the image for corruption across threads without decoding samples.
+int verify_image(const std::string&, uint64_t, int, int, vector<block_error>&, verify_range&);
+void verify_range_worker(const std::string&, verify_range*);
+//Create every requested output at the size the counting pass found.
+int create_outputs(int, mxArray**, const verify_range&, uint64_t, int, vector<packet_column>*[], mex_outputs&);
+mxArray* create_column_struct(vector<packet_column>&, uint64_t);
+mxClassID column_class_id(int);
+//Append one chunk of packets or times to the outputs.
+void copy_out_columns(mxArray*, vector<packet_column>&, size_t, uint64_t, uint64_t&);
+void copy_out_time_columns(vector<gps_time>&, uint32_t*, uint64_t, uint64_t&);
+//Zero whatever the parse did not fill.
+void finish_outputs(mex_outputs&);
 int copy_out_uint32(int, int, int, gps_time*, mxArray**);
 int write_int_vector_csv(const std::string&, vector<int>&,int);
 int write_uint32_vector_csv(const std::string&, gps_time*);
-int write_out_struct_csv(const std::string&, int32_t*, std::vector<const std::string>&, int, int,int);
-int write_out_struct_csv(const std::string&, uint64_t*, std::vector<const std::string>&, int, int, int);
 int write_out_struct_csv(const std::string&, uint32_t*, std::vector<const std::string>&, int, int, int);
 int write_int_vector_binary(const std::string&, vector<int>&);
-int write_out_struct_binary(const std::string&, uint64_t*, std::vector<const std::string>&, int, int, int);
 int write_out_struct_binary(const std::string&, uint32_t*, std::vector<const std::string>&, int, int, int);
-int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std::string>&, int, int, int);
+//Packet columns back out as the rows the old packet structs wrote.
+int write_columns_csv(const std::string&, vector<packet_column>&, size_t, int);
+int write_columns_binary(const std::string&, vector<packet_column>&, size_t, int);
+//Queue one chunk of audio for the WAV and FLAC writers, resampled first
+//when a resampler is given.
+template <typename T>
+void add_audio_chunk(wav_writer*, flac_writer*, resampler*, int, const T*, size_t, const T*, size_t);
+template <typename T>
+void add_audio_channel(wav_writer*, flac_writer*, int, const T*, size_t);
 
 // *  the gateway routine.  */
  void mexFunction( int nlhs, mxArray *plhs[],
@@ -175,7 +437,38 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
   uint64_t read_size = max_read_size;
 
 
-  switch (nrhs){
+  parse_options options;
+  options.verify = 0;
+  options.threads = 0;
+  options.streams = STREAM_ALL;
+  options.wav_dc = 0;
+  options.wav_normalize = 0;
+  options.resample = 0;
+  options.overview = 0;
+  options.features = 0;
+  options.events = 0;
+  options.event_db = 12.0;
+  options.event_clips = 0;
+  options.imu_units = 0;
+  options.fusion = 0;
+  options.fusion_beta = 0.1;
+  options.merge = 0;
+  options.merge_window = 0;
+  options.track = 0;
+  options.track_fix = TRACK_FIX_3D;
+  options.track_pacc = 50.0;
+  for (int s = 0; s < 3; s++) {
+    for (int a = 0; a < 3; a++) {
+      options.imu_offsets[s][a] = 0.0;
+    }
+  }
+
+  if (nrhs > 3 && ((nrhs - 3) % 2) != 0) {
+    mexPrintf("Options must be name/value pairs\n");
+    return;
+  }
+
+  switch (nrhs > 3 ? 3 : nrhs){
 
     case 0:
     {
@@ -201,6 +494,17 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
     }
     }
 
+  for (int i = 3; i < nrhs; i = i + 2) {
+    if (parse_option(prhs[i], prhs[i + 1], options) != 0) {
+      return;
+    }
+  }
+
+  if (nlhs > OUT_COUNT) {
+    mexPrintf("At most %d outputs are returned\n", OUT_COUNT);
+    return;
+  }
+
 
   //Names to store variables in mat
   const std::string seq_matvar_name = "sequence_number";
@@ -216,6 +520,8 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
   
   //Time the operation using a newer C++ library.
   std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  perf_report& perf = sd_perf();
+  perf_reset(perf);
   //Get the filename from the matlab call.
   std::string filename (mxArrayToString(prhs[0])); 
 
@@ -271,126 +577,23 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
   // constant gps_time_bytes_c     : natural :=
                 // natural ((gps_time_bits_c - 1) / 8) + 1 ;
 
-  int BLOCK_SEQNO_BYTES = 4;
-  int BLOCK_SIZE = 512;
-  int SEG_TRAILER_SIZE = 2;
-  int AUDIO_WORD_BYTES = 2;
-
-
-  int IMU_AXIS_WORD_LENGTH_BYTES = 2;
-  int IMU_GYRO_SEG_BYTES = 3 * IMU_AXIS_WORD_LENGTH_BYTES;
-  int IMU_ACCEL_SEG_BYTES = 3 * IMU_AXIS_WORD_LENGTH_BYTES;
-  int IMU_MAG_SEG_BYTES = 3 * IMU_AXIS_WORD_LENGTH_BYTES;
-
-
-  //Status Segment Constants Pullsed from flashblock.vhd
-  int status_compile_length = 4;
-  int status_commit_length = 4;
-  int gps_time_length = 9;
-  int rtc_time_legnth = 4;
-  int num_mics_length = 1;
-  int status_type_length = 1;
-
-  int status_compile_offset = 0;
-  int status_commit_offset = status_compile_offset + status_compile_length;
-  int status_packet_time_offset = status_commit_offset + status_commit_length;
-  int status_accel_time_offset = status_packet_time_offset + gps_time_length;
-  int status_mag_time_offset = status_accel_time_offset + gps_time_length;
-  int status_gyro_time_offset = status_mag_time_offset + gps_time_length;
-  int status_temp_time_offset = status_gyro_time_offset + gps_time_length;
-  int status_audio_time_offset = status_temp_time_offset + gps_time_length;
-  int status_rtc_time_offset = status_audio_time_offset + gps_time_length;
-  int status_num_mics_offset = status_rtc_time_offset + rtc_time_legnth;
-  int status_type_offset = status_num_mics_offset + status_type_length;
-
-  int num_mics_active = 2;
-
-  //All the defined segment identifiers. 
-  //Taken from flashblock.vhd.
-
-  char PADDING_BYTE = 0x00;
-
-
-  char BLOCK_SEG_UNUSED = 0x01;
-  char BLOCK_SEG_STATUS = 0x02;
-  char BLOCK_SEG_GPS_TIME_MARK = 0x03;
-  char BLOCK_SEG_GPS_POSITION = 0x04;
-  char BLOCK_SEG_IMU_GYRO = 0x05;
-  char BLOCK_SEG_IMU_ACCEL = 0x06;
-  char BLOCK_SEG_IMU_MAG = 0x07;
-  char BLOCK_SEG_IMU_TEMP = 0x0A;
-  char BLOCK_SEG_EVENT = 0x0B;
-  char BLOCK_SEG_AUDIO = 0x08;
-  char BLOCK_SEG_GPS_TIME_PULSE = 0x0D;
-
-  //Refer to msg_ubx_nav_sol_pkg.vhd
-  //and u-blox 7
-  //Receiver Description
-  //Including Protocol Specification V14
-  int itow_length = 4;  //U4
-  int ftow_length = 4;  //I4
-  int munsol_week_length = 2; //I2
-  int gps_fix_type_length = 1;  //U1
-  int ecefx_length = 4;  //I4
-  int ecefy_length = 4;  //I4
-  int ecefz_length = 4;  //I4
-  int pAcc_length = 4;  //U4
-  int positiondop_length = 2;  //U2
-  int numsv_length = 1;  //U1
-  int posttime_length = gps_time_length;  //9 Bytes GPS -- Still working on this. 
-
-  int itow_offset = 0;
-  int ftow_offset = itow_offset + itow_length;
-  int munsol_week_offset = ftow_offset + ftow_length;
-  int gps_fix_type_offset = munsol_week_offset + munsol_week_length;
-  int ecefx_offset = gps_fix_type_offset + gps_fix_type_length;
-  int ecefy_offset = ecefx_offset + ecefx_length;
-  int ecefz_offset = ecefy_offset + ecefy_length;
-  int pAcc_offset = ecefz_offset + ecefz_length;
-  int positiondop_offset = pAcc_offset + pAcc_length;
-  int numsv_offset = positiondop_offset + positiondop_length;
-  int posttime_offset = numsv_offset + numsv_length;
-
-  int nav_sol_total_length = 39;
-
-
-  //Refer to msg_ubx_tim_tm2_pkg.vhd
-  // and u-blox 7
-  // Receiver Description
-  //Including Protocol Specification V14
-  int tm2_flags_length = 1;      //X1 -- Interpreted as U1
-  int tm2_wnF_length = 2;        //U2
-  int tm2_towmsF_length = 4;      //U4
-  int tm2_towsubmsF_length = 4;      //U4
-  int tm2_accest_length = 4;        //U4
-  int tm2_marktime_length = gps_time_length;      //GPS 9 Bytes.
-
-  int tm2_flags_offset = 0;
-  int tm2_wnF_offset = tm2_flags_offset + tm2_flags_length;
-  int tm2_towmsF_offset = tm2_wnF_offset + tm2_wnF_length;
-  int tm2_towsubmsF_offset = tm2_towmsF_offset + tm2_towmsF_length;
-  int tm2_accest_offset = tm2_towsubmsF_offset + tm2_towsubmsF_length;
-  int tm2_marktime_offset = tm2_accest_offset + tm2_accest_length;
-
-
-  int tim_tm2_total_length = 24;
-  
-  //The timepulse packet defined by GPS developer is two GPS times back to 
-  //back. The tim_tp packet is not retained. 
-  //See gps_message_ctl_pkg.vhd for the location of the two GPS times in 
-  //GPS memory. 
+  //Block layout constants are in sd_block.h.
 
-  //I only process bottom 8 bytes. Since the time is stored little endian
-  //I can index 0-8 and leave off the top bytes. 
-  int tp_fpga_time_length = gps_time_length;    //GPS 9 Bytes.
-  int tp_timepulse_length = gps_time_length;  //GPS 9 Bytes.
 
-  
+  //Segment layouts are in sd_layout.h, generated by sd_layout_gen.py
+  //from flashblock.vhd and the msg_ubx_*_pkg.vhd GPS message packages.
+  //nav_sol and tim_tm2 fields are as in u-blox 7 Receiver Description
+  //Including Protocol Specification V14.
+  //Times are 9 bytes. nav_sol, tim_tm2 and tim_tp are split whole with
+  //load_gps_time. The status and sample times keep the bottom 8 bytes as
+  //raw columns and go through populate_gps_time, which takes 14 bits of
+  //week. The ninth byte holds only the top 2 bits of the week, zero until
+  //week 16384 (year 2294), so nothing is lost and the raw status columns
+  //keep their 8 byte width.
 
-  int tp_fpga_offset = 0;
-  int tp_timepulse_offset = tp_fpga_offset + tp_timepulse_length;
+  int num_mics_active = 2;
 
-  int tim_tp_total_length = 18;
+  //All the defined segment identifiers are in sd_block.h.
   
   
   
@@ -402,140 +605,36 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
 
 
-  //Structs are defined all one data size.
-  //I can iterate over members easily with a pointer.
-  struct status_packet {
-    uint64_t commit;
-    uint64_t compile;
-    uint64_t status_t;
-    uint64_t accel_t;
-    uint64_t gyro_t;
-    uint64_t mag_t;
-    uint64_t temp_t;
-    uint64_t audio_t;
-    uint64_t rtc_t;
-    uint64_t mics_active;
-    uint64_t status_type;
-  };
-
-  vector<status_packet> status_packets;
-  status_packet cur_status_packet;
-  int status_packet_field_count = 11;
-  std::vector<const std::string> status_field_names{ "commit",
-    "compile",
-    "status_t",
-    "accel_t",
-    "gyro_t",
-    "mag_t",
-    "temp_t",
-    "audio_t",
-    "rtc_t",
-    "mics_active",
-    "status_type"
-  };
-
-  //mxCreateStructMatrix needs a **char. This is how I make that. 
-  //StackExchange help here. 
-  std::vector<const char*> status_names_pointers;
-  for (size_t i = 0; i < status_field_names.size(); ++i){
-    status_names_pointers.push_back(const_cast<char*>(status_field_names[i].c_str()));
-  }
-
+  //Packets are kept a typed column per field, see sd_packets.h.
+  //The column lists are rebuilt before each use since appending moves
+  //the data.
+  status_columns status_packets;
+  tm_columns tm_packets;
+  nav_sol_columns navsol_packets;
+  tim_tp_columns tim_tp_packets;
 
+  //Status segment layouts met so far, see sd_status.h.
+  status_registry status_lookup;
+  status_registry_init(status_lookup);
 
-  struct tm_packet {
-    int flags;
-    int wnF;
-    int towmsF;
-    int towsubmsF;
-    int accestns;
-    int reset_time_week;
-    int reset_time_ms;
-    int reset_time_ns;
-  };
-
-  vector<tm_packet> tm_packets;
-  tm_packet cur_tm_packet;
-  int tm_packet_field_count = 8;
-  std::vector<const std::string> tm_field_names{ "flags",
-    "wnF",
-    "towmsF",
-    "towsubmsF",
-    "accestns",
-    "reset_time_week",
-    "reset_time_ms",
-    "reset_time_ns"
-  };
-
-  //mxCreateStructMatrix needs a **char. This is how I make that. 
-  //StackExchange help here. 
-  std::vector<const char*> tm_names_pointers;
-  for (size_t i = 0; i < tm_field_names.size(); ++i){
-    tm_names_pointers.push_back(const_cast<char*>(tm_field_names[i].c_str()));
-  }
-
+  //Reset to GPS time model fed by the tim_tp packets, see sd_clock.h.
+  clock_model clock;
+  clock_init(clock);
 
-  struct nav_sol_packet {
-
-    int itow;
-    int ftow;
-    int weekepoch;
-    int fixtype;
-    int ecefx;
-    int ecefy;
-    int ecefz;
-    int pacc;
-    int posdop;
-    int numsv;
-    int reset_time_week;
-    int reset_time_ms;
-    int reset_time_ns;
-  };
+  //Power cycle segment of each status and tim_tp packet of the chunk, and
+  //of the samples ahead of the chunk's first status packet.
+  clock_restarts restarts;
+  clock_restarts_init(restarts);
+  vector<uint64_t> status_segments;
+  vector<uint64_t> tim_tp_segments;
+  uint64_t chunk_segment = 0;
 
-  vector<nav_sol_packet> navsol_packets;
-  nav_sol_packet cur_navsol_packet;
-  int navsol_packet_field_count = 13;
-
-  std::vector<const std::string> navsol_field_names{ "itow",
-    "ftow",
-    "weekepoch",
-    "fixtype",
-    "ecefx",
-    "ecefy",
-    "ecefz",
-    "pacc",
-    "posdop",
-    "numsv",
-    "reset_time_week",
-    "reset_time_ms",
-    "reset_time_ns"
-  };
+  vector<packet_column> status_column_list;
+  vector<packet_column> tm_column_list;
+  vector<packet_column> navsol_column_list;
+  vector<packet_column> tim_tp_column_list;
 
-  std::vector<const char*> navsol_names_pointers;
-  for (size_t i = 0; i < navsol_field_names.size(); ++i){
-    navsol_names_pointers.push_back(const_cast<char*>(navsol_field_names[i].c_str()));
-  }
-  
-  
-  vector<tim_tp_packet> tim_tp_packets;
-  tim_tp_packet cur_tim_tp_packet;
-  int tim_tp_field_count = 6;
-
-  std::vector<const std::string> tim_tp_field_names{  "reset_time_week",
-    "reset_time_ms",
-    "reset_time_ns",
-    "gps_week",
-    "gps_ms",
-    "gps_submsns",
-  };
 
-  std::vector<const char*> tim_tp_names_pointers;
-  for (size_t i = 0; i < tim_tp_field_names.size(); ++i){
-    tim_tp_names_pointers.push_back(const_cast<char*>(tim_tp_field_names[i].c_str()));
-  }
-  
-  
-  
 
   vector<int> audio_l;
   vector<int> audio_r;
@@ -564,20 +663,12 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
   vector<gps_time> mag_time_mark;
   vector<gps_time> audio_time_mark;
 
-  gps_time tm2_gps_time;
-  gps_time nav_gps_time;
-  gps_time tp_fpga_time;
-  gps_time tp_timepulse_time;
   
 	uint64_t recent_gyro_time = 0;
 	uint64_t recent_accel_time = 0;
 	uint64_t recent_mag_time = 0;
 	uint64_t recent_audio_time = 0;
 
-  uint64_t tm2_time = 0;
-  uint64_t nav_time = 0;
-  uint64_t tp_time = 0;
-  uint64_t fpga_time = 0;
  
 
   //Debug Stuff
@@ -591,6 +682,8 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
   vector<int> g_packets_num {  };
   int aud_packets = -1;
   int aud_packets_loc;
+  int audio_samples;
+  gps_time cur_audio_time;
   int new_status_segment;
   vector<int> aud_packets_num {  };
 
@@ -602,22 +695,36 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
   int block_start;
   int block_success;
+  int block_reason;
   int segment_length;
+  int error_offset;
+
+  //Corruption report. Counts are kept for the summary at the end.
+  vector<block_error> block_errors;
+  block_error cur_block_error;
+  uint32_t block_error_counts[BLOCK_ERR_COUNT] = { 0 };
+  int block_error_field_count = 4;
+  std::vector<const std::string> block_error_field_names{ "block_number",
+    "sequence",
+    "reason",
+    "offset"
+  };
 
   int k = 0;
 
-  int end_sample;
   int begin_sample;
 
   uint64_t file_length = 0;
 
   vector<int> packet_start_locations;
-  vector<int> packet_end_locations;
   vector<int> packet_lengths;
   vector<int> packet_types;
 
 
-  std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+  //The image read, the reassembled copy when reorder is given.
+  std::string image = filename;
+
+  std::ifstream in(image.c_str(), std::ios::in | std::ios::binary);
   std::vector<unsigned char> contents;
 
 
@@ -647,6 +754,374 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
     }
   }
 
+  if (!options.dumps.empty() && options.reorder.empty()) {
+    mexPrintf("dumps needs a reorder file to merge into\n");
+    return;
+  }
+
+  if (!options.reorder.empty()) {
+    in.close();
+
+    //Dumps past the image are merged whole.
+    vector<std::string> images(1, filename);
+    vector<uint64_t> image_lengths(1, file_length);
+    for (size_t d = 0; d < options.dumps.size(); d++) {
+      std::ifstream dump(options.dumps[d].c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+      if (!dump) {
+        mexPrintf("Could not open %s\n", options.dumps[d].c_str());
+        return;
+      }
+      images.push_back(options.dumps[d]);
+      image_lengths.push_back((uint64_t)dump.tellg());
+    }
+
+    int overwritten = reorder_output_input(images, options.reorder);
+    if (overwritten >= 0) {
+      mexPrintf("reorder file %s would overwrite %s\n", options.reorder.c_str(), images[overwritten].c_str());
+      return;
+    }
+
+    reorder_stats reorder;
+    if (reorder_images(images, image_lengths, options.reorder, reorder) != 0) {
+      mexPrintf("Could not reorder %s into %s\n", filename.c_str(), options.reorder.c_str());
+      return;
+    }
+    mexPrintf("Reordered %llu blocks from %d images, %llu out of order, %llu duplicates, %llu conflicts and %llu unwritten dropped, %d sorted runs, %llu reads\n",
+              (unsigned long long)reorder.blocks, reorder.images, (unsigned long long)reorder.out_of_order,
+              (unsigned long long)reorder.duplicates, (unsigned long long)reorder.conflicts,
+              (unsigned long long)reorder.unwritten,
+              reorder.runs, (unsigned long long)reorder.reads);
+
+    image = options.reorder;
+    file_length = reorder.kept * BLOCK_SIZE;
+    in.open(image.c_str(), std::ios::in | std::ios::binary);
+  }
+
+
+  if (options.verify) {
+    in.close();
+
+    vector<block_error> verify_errors;
+    verify_range verify_totals;
+    if (verify_image(image, file_length, options.threads, num_mics_active, verify_errors, verify_totals) != 0) {
+      mexPrintf("Could not read %s to verify it\n", image.c_str());
+      return;
+    }
+
+    uint32_t verify_counts[BLOCK_ERR_COUNT] = { 0 };
+    for (size_t i = 0; i < verify_errors.size(); i++) {
+      verify_counts[verify_errors[i].reason]++;
+    }
+
+    //Each verify run writes a fresh report.
+    std::remove("verify_report.csv");
+    write_out_struct_csv("verify_report.csv", (uint32_t*)verify_errors.data(), block_error_field_names, (int)verify_errors.size(), block_error_field_count, 1);
+
+    std::chrono::steady_clock::time_point verify_end = std::chrono::steady_clock::now();
+    double verify_seconds = std::chrono::duration_cast<std::chrono::milliseconds> (verify_end - begin).count() / 1000.0;
+
+    mexPrintf("Blocks written : %llu\n", (unsigned long long)verify_totals.blocks_written);
+    mexPrintf("Blocks unwritten : %llu\n", (unsigned long long)verify_totals.blocks_unwritten);
+    mexPrintf("Segments by type :\n");
+    for (int i = 0; i < BLOCK_SEG_TYPES; i++) {
+      if (verify_totals.segment_counts[i] != 0) {
+        mexPrintf("    0x%02X : %llu\n", i, (unsigned long long)verify_totals.segment_counts[i]);
+      }
+    }
+    if (verify_totals.status_unknown != 0) {
+      mexPrintf("Status segments of no known layout : %llu\n", (unsigned long long)verify_totals.status_unknown);
+    }
+    mexPrintf("Problems found : %u\n", (unsigned)verify_errors.size());
+    for (int i = BLOCK_OK + 1; i < BLOCK_ERR_COUNT; i++) {
+      if (verify_counts[i] != 0) {
+        mexPrintf("    %s : %u\n", block_error_names[i], verify_counts[i]);
+      }
+    }
+    mexPrintf("Verify took %.1f s (%.1f MB/s)\n", verify_seconds,
+              verify_seconds > 0 ? (file_length / (1024.0 * 1024.0)) / verify_seconds : 0.0);
+    return;
+  }
+
+
+  //Called with outputs everything is returned to MATLAB and no sample
+  //files are written. The image is counted first, reusing the verify
+  //scan, so each output is created once at full size and the decode
+  //writes straight into it.
+  int output_mode = (nlhs > 0);
+  mex_outputs out;
+
+  if (output_mode) {
+    vector<block_error> count_errors;
+    verify_range counts;
+    vector<packet_column>* packet_columns[OUT_PACKET_TYPES] = { &status_column_list,
+      &tm_column_list,
+      &navsol_column_list,
+      &tim_tp_column_list
+    };
+
+    list_columns(status_packets, status_column_list);
+    list_columns(tm_packets, tm_column_list);
+    list_columns(navsol_packets, navsol_column_list);
+    list_columns(tim_tp_packets, tim_tp_column_list);
+
+    if (verify_image(image, file_length, options.threads, num_mics_active, count_errors, counts) != 0) {
+      mexPrintf("Could not read %s to size the outputs\n", image.c_str());
+      return;
+    }
+    create_outputs(nlhs, plhs, counts, file_length / BLOCK_SIZE, options.streams, packet_columns, out);
+  }
+
+
+  //The WAV file is written a chunk at a time alongside the parse. Levels
+  //for DC removal and normalization have to be known before the first
+  //sample goes out, so they come from a pass over the audio segments.
+  wav_writer wav;
+  int wav_output = 0;
+  flac_writer flac;
+  int flac_output = 0;
+  uint64_t audio_l_sent = 0;
+  uint64_t audio_r_sent = 0;
+
+  //Both files are written at the resampled rate when one is asked for.
+  resampler rate_converter;
+  int resample_output = 0;
+  int audio_file_rate = audio_sample_rate;
+
+  if (options.resample > 0 && options.resample != audio_sample_rate) {
+    if (options.wav.empty() && options.flac.empty()) {
+      mexPrintf("resample only applies to the wav and flac files\n");
+    }
+    else if (resample_init(rate_converter, num_mics_active, audio_sample_rate, options.resample) != 0) {
+      mexPrintf("Cannot resample %d Hz to %d Hz\n", audio_sample_rate, options.resample);
+    }
+    else {
+      resample_output = 1;
+      audio_file_rate = options.resample;
+    }
+  }
+
+  if (!options.wav.empty()) {
+    if (!(options.streams & STREAM_AUDIO)) {
+      mexPrintf("Audio is not selected, %s is not written\n", options.wav.c_str());
+    }
+    else if (output_mode && nlhs <= OUT_AUDIO_R) {
+      //The WAV file is filled from the audio outputs as they are decoded.
+      mexPrintf("audio_l and audio_r must be returned to write %s\n", options.wav.c_str());
+    }
+    else if (wav_open(wav, options.wav, num_mics_active, audio_file_rate) != 0) {
+      mexPrintf("Could not create %s\n", options.wav.c_str());
+    }
+    else {
+      wav_output = 1;
+      if (options.wav_dc || options.wav_normalize) {
+        wav_levels levels;
+        perf_scope wav_scan_timer(perf.writers["wav_scan"], file_length);
+        if (wav_scan_levels(image, file_length, num_mics_active, levels) != 0) {
+          mexPrintf("Could not scan %s for audio levels, the WAV is not leveled\n", image.c_str());
+        }
+        else {
+          wav_set_levels(wav, levels, options.wav_dc, options.wav_normalize);
+        }
+      }
+    }
+  }
+
+  if (!options.flac.empty()) {
+    if (!(options.streams & STREAM_AUDIO)) {
+      mexPrintf("Audio is not selected, %s is not written\n", options.flac.c_str());
+    }
+    else if (output_mode && nlhs <= OUT_AUDIO_R) {
+      mexPrintf("audio_l and audio_r must be returned to write %s\n", options.flac.c_str());
+    }
+    else if (flac_open(flac, options.flac, num_mics_active, audio_file_rate, options.threads) != 0) {
+      mexPrintf("Could not create %s\n", options.flac.c_str());
+    }
+    else {
+      flac_output = 1;
+    }
+  }
+
+  //Overview of each sample stream, built a chunk at a time like the audio
+  //files. Streams that are not decoded or not returned are left out.
+  overview_stream overview_audio[2];
+  overview_stream overview_imu[3];
+  int overview_audio_active[2] = { 0, 0 };
+  int overview_imu_active[3] = { 0, 0, 0 };
+  uint64_t overview_audio_sent[2] = { 0, 0 };
+  uint64_t overview_imu_sent[3] = { 0, 0, 0 };
+  vector<overview_stream*> overview_streams;
+
+  if (options.overview) {
+    const char* imu_names[3] = { "gyro", "accel", "mag" };
+    const int imu_rates[3] = { gyro_sample_rate, accel_sample_rate, mag_sample_rate };
+    const int imu_stream_flags[3] = { STREAM_GYRO, STREAM_ACCEL, STREAM_MAG };
+    int overview_error = 0;
+
+    if (options.streams & STREAM_AUDIO) {
+      overview_audio_active[0] = (num_mics_active == 2) && (!output_mode || out.audio_l != NULL);
+      overview_audio_active[1] = (!output_mode || out.audio_r != NULL);
+      for (int c = 0; c < 2; c++) {
+        if (overview_audio_active[c] &&
+            overview_open(overview_audio[c], (c == 0) ? "audio_l" : "audio_r", audio_sample_rate, 1) != 0) {
+          overview_audio_active[c] = 0;
+          overview_error = 1;
+        }
+        if (overview_audio_active[c]) {
+          overview_streams.push_back(&overview_audio[c]);
+        }
+      }
+    }
+    for (int i = 0; i < 3; i++) {
+      overview_imu_active[i] = (options.streams & imu_stream_flags[i]) && (!output_mode || out.imu[i] != NULL);
+      if (overview_imu_active[i] && overview_open(overview_imu[i], imu_names[i], imu_rates[i], 3) != 0) {
+        overview_imu_active[i] = 0;
+        overview_error = 1;
+      }
+      if (overview_imu_active[i]) {
+        overview_streams.push_back(&overview_imu[i]);
+      }
+    }
+    if (overview_error != 0) {
+      mexPrintf("Could not create all the overview files, the streams that failed are left out\n");
+    }
+  }
+
+  //Spectral features of the audio, frames carried across chunks.
+  feature_extractor features;
+  int feature_output = 0;
+  uint64_t feature_audio_sent[2] = { 0, 0 };
+
+  if (options.features) {
+    vector<std::string> feature_files;
+    if (num_mics_active == 2) {
+      feature_files.push_back("features_audio_l.bin");
+    }
+    feature_files.push_back("features_audio_r.bin");
+
+    if (!(options.streams & STREAM_AUDIO)) {
+      mexPrintf("Audio is not selected, features are not written\n");
+    }
+    else if (output_mode && nlhs <= OUT_AUDIO_R) {
+      mexPrintf("audio_l and audio_r must be returned to write features\n");
+    }
+    else if (feature_open(features, feature_files, "features_times.bin", "features_mel.csv",
+                          audio_sample_rate, gps_time_field_count, options.threads) != 0) {
+      mexPrintf("Could not create the feature files\n");
+      feature_close(features);
+    }
+    else {
+      feature_output = 1;
+    }
+  }
+
+  //Acoustic events, detected on all active microphones together.
+  event_detector events;
+  int event_output = 0;
+  uint64_t event_audio_sent[2] = { 0, 0 };
+
+  if (options.events || options.event_clips) {
+    if (!(options.streams & STREAM_AUDIO)) {
+      mexPrintf("Audio is not selected, events are not detected\n");
+    }
+    else if (output_mode && nlhs <= OUT_AUDIO_R) {
+      mexPrintf("audio_l and audio_r must be returned to detect events\n");
+    }
+    else if (event_open(events, "events.csv", num_mics_active, audio_sample_rate, gps_time_names_pointers.data(),
+                        gps_time_field_count, options.event_db, options.event_clips) != 0) {
+      mexPrintf("Could not create events.csv\n");
+    }
+    else {
+      event_output = 1;
+    }
+  }
+
+  //IMU in physical units, converted from the stored words a chunk at a
+  //time.
+  imu_unit_writer imu_units[3];
+  int imu_units_active[3] = { 0, 0, 0 };
+  uint64_t imu_units_sent[3] = { 0, 0, 0 };
+  imu_scale scale;
+
+  imu_default_scale(scale);
+  if ((options.imu_units || options.fusion) && !options.imu_mif.empty() && imu_read_mif(options.imu_mif, scale) != 0) {
+    mexPrintf("Could not read the full scales from %s, using the power on scales\n", options.imu_mif.c_str());
+    imu_default_scale(scale);
+  }
+
+  if (options.imu_units) {
+    const char* unit_files[3] = { "gyro_xyz.bin", "xl_xyz.bin", "mag_xyz.bin" };
+    const int imu_stream_flags[3] = { STREAM_GYRO, STREAM_ACCEL, STREAM_MAG };
+
+    for (int i = 0; i < 3; i++) {
+      if (!(options.streams & imu_stream_flags[i]) || (output_mode && out.imu[i] == NULL)) {
+        continue;
+      }
+      if (imu_units_open(imu_units[i], unit_files[i], scale.sensitivity[i], options.imu_offsets[i]) != 0) {
+        mexPrintf("Could not create %s\n", unit_files[i]);
+      }
+      else {
+        imu_units_active[i] = 1;
+      }
+    }
+  }
+
+  //Orientation, stepped once per gyro sample as the chunks are decoded.
+  fusion_filter fusion;
+  int fusion_output = 0;
+  uint64_t fusion_sent[3] = { 0, 0, 0 };
+
+  if (options.fusion) {
+    if ((options.streams & STREAM_IMU) != STREAM_IMU) {
+      mexPrintf("gyro, accel and mag must all be selected for fusion\n");
+    }
+    else if (output_mode && (out.imu[0] == NULL || out.imu[1] == NULL || out.imu[2] == NULL)) {
+      mexPrintf("gyro, xl and mag must be returned for fusion\n");
+    }
+    else if (fusion_open(fusion, "orientation.bin", "orientation_times.bin", gyro_sample_rate,
+                         options.fusion_beta, gps_time_field_count) != 0) {
+      mexPrintf("Could not create orientation.bin\n");
+      fusion_close(fusion);
+    }
+    else {
+      fusion_output = 1;
+    }
+  }
+
+  //GPS track from the nav_sol fixes of each chunk.
+  track_writer track;
+  int track_output = 0;
+
+  if (options.track) {
+    if (!(options.streams & STREAM_GPS)) {
+      mexPrintf("GPS is not selected, the track is not written\n");
+    }
+    else if (track_open(track, "track.csv", "track.gpx", "track.geojson", filename,
+                        options.track_fix, options.track_pacc) != 0) {
+      mexPrintf("Could not create the track files\n");
+    }
+    else {
+      track_output = 1;
+    }
+  }
+
+  //Time ordered merge of the streams. Packet time rows are built here for
+  //each chunk from the packets' reset and GPS times.
+  const char* merge_stream_names[7] = { "audio", "gyro", "accel", "mag", "nav_sol", "tm2", "tim_tp" };
+  stream_merger merger;
+  int merge_output = 0;
+  vector<gps_time> merge_packet_times[3];
+
+  if (options.merge || options.merge_window > 0) {
+    if (merge_open(merger, merge_stream_names, 7, options.merge ? "merged.bin" : "",
+                   "merged_windows.csv", options.merge_window) != 0) {
+      mexPrintf("Could not create the merge files\n");
+      merge_close(merger);
+    }
+    else {
+      merge_output = 1;
+    }
+  }
+
 
   int start_of_parse = 1;
 
@@ -669,7 +1144,10 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
     
   in.seekg(file_loc);
   contents.resize(read_size);
-  in.read(reinterpret_cast<char*>(&contents[0]), read_size);
+  {
+    perf_scope read_timer(perf.read, read_size);
+    in.read(reinterpret_cast<char*>(&contents[0]), read_size);
+  }
 
   //Reset File Byte Pointer.
   k = 0;
@@ -695,10 +1173,31 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
     if ((k % BLOCK_SIZE) == 0) {
       block_success = 1;
+      block_reason = BLOCK_OK;
+
+      //A short read at the end of the image leaves a partial block.
+      //Nothing past the end of contents may be touched.
+      if (k + BLOCK_SIZE > contents.size()) {
+        cur_block_error.block_number = uint32_t((file_loc + k) / BLOCK_SIZE);
+        cur_block_error.sequence = 0;
+        cur_block_error.reason = BLOCK_ERR_TRUNCATED;
+        cur_block_error.offset = 0;
+        block_errors.push_back(cur_block_error);
+        block_error_counts[BLOCK_ERR_TRUNCATED]++;
+        break;
+      }
 
-      uint32_t segment = *reinterpret_cast<const uint32_t*>(&contents[k]);
+      uint32_t segment = load_u32(&contents[k]);
 
-      sequence_number.push_back(int(segment));
+      if (output_mode) {
+        if (out.sequence != NULL && out.sequence_count < out.sequence_rows) {
+          out.sequence[out.sequence_count] = segment;
+        }
+        out.sequence_count++;
+      }
+      else {
+        sequence_number.push_back(int(segment));
+      }
 
       if ((segment % 500) == 0) {
 
@@ -709,18 +1208,20 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
         // //mexCallMATLAB(drawnow);
         // //mexEvalString("drawnow");
       }
-      if (segment == 0)
+      //Both all zeros and all ones are left by formatting. 
+      if (segment == 0 || segment == 0xFFFFFFFF)
       {
         //Bad sequence number. Skip empty block.
+        perf.blocks_unwritten++;
         k = k + 512;
         continue;
       }
 
       else
       {
-        //Jump to end of block. Process in reverse.
+        //Walk the block in reverse.
         block_start = k;
-        k = k + 511;
+        perf.blocks++;
       }
     }
 
@@ -728,120 +1229,60 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
       //Process all the nonpadding packet_start locations and lengths. 
 
-    while (k != block_start + BLOCK_SEQNO_BYTES - 1) {
-
-      segment_length = contents[k];
-
-      if (contents[k - 1] == BLOCK_SEG_UNUSED) {
-        //Jump padding
-        k = k - segment_length - SEG_TRAILER_SIZE;
-      }
-
-      else
-      {
-        if (contents[k - 1] == BLOCK_SEG_IMU_GYRO) {
-          packet_lengths.push_back(segment_length);
-          begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
-          packet_end_locations.push_back(k - SEG_TRAILER_SIZE);
-          packet_start_locations.push_back(k - SEG_TRAILER_SIZE - segment_length + 1);
-          packet_types.push_back(BLOCK_SEG_IMU_GYRO);
-          k = begin_sample - 1;
-        }
-
-        else if (contents[k - 1] == BLOCK_SEG_STATUS) {
-          packet_lengths.push_back(segment_length);
-          begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
-          packet_end_locations.push_back(k - SEG_TRAILER_SIZE);
-          packet_start_locations.push_back(k - SEG_TRAILER_SIZE - segment_length + 1);
-          packet_types.push_back(BLOCK_SEG_STATUS);
-
-          k = begin_sample - 1;
-
-
-        }
-        else if (contents[k - 1] == BLOCK_SEG_GPS_POSITION)
-        {
-          packet_lengths.push_back(segment_length);
-          begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
-          packet_end_locations.push_back(k - SEG_TRAILER_SIZE);
-          packet_start_locations.push_back(k - SEG_TRAILER_SIZE - segment_length + 1);
-          packet_types.push_back(BLOCK_SEG_GPS_POSITION);
-
-          k = begin_sample - 1;
-
-        }
-
-        else if (contents[k - 1] == BLOCK_SEG_GPS_TIME_MARK) {
-          packet_lengths.push_back(segment_length);
-          begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
-          packet_end_locations.push_back(k - SEG_TRAILER_SIZE);
-          packet_start_locations.push_back(k - SEG_TRAILER_SIZE - segment_length + 1);
-          packet_types.push_back(BLOCK_SEG_GPS_TIME_MARK);
-          k = begin_sample - 1;
-        }
-        else if (contents[k - 1] == BLOCK_SEG_GPS_TIME_PULSE) {
-          packet_lengths.push_back(segment_length);
-          begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
-          packet_end_locations.push_back(k - SEG_TRAILER_SIZE);
-          packet_start_locations.push_back(k - SEG_TRAILER_SIZE - segment_length + 1);
-          packet_types.push_back(BLOCK_SEG_GPS_TIME_PULSE);
-          k = begin_sample - 1;
-        }
-
-        else if (contents[k - 1] == BLOCK_SEG_IMU_ACCEL) {
-          packet_lengths.push_back(segment_length);
-          begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
-          packet_end_locations.push_back(k - SEG_TRAILER_SIZE);
-          packet_start_locations.push_back(k - SEG_TRAILER_SIZE - segment_length + 1);
-          packet_types.push_back(BLOCK_SEG_IMU_ACCEL);
-
-          k = begin_sample - 1;
-
-        }
-        else if (contents[k - 1] == BLOCK_SEG_IMU_MAG)
-        {
-          packet_lengths.push_back(segment_length);
-          begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
-          packet_end_locations.push_back(k - SEG_TRAILER_SIZE);
-          packet_start_locations.push_back(k - SEG_TRAILER_SIZE - segment_length + 1);
-          packet_types.push_back(BLOCK_SEG_IMU_MAG);
-
-          k = begin_sample - 1;
-
-        }
-        else if (contents[k - 1] == BLOCK_SEG_AUDIO) {
-          packet_lengths.push_back(segment_length);
-          begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
-
-          packet_end_locations.push_back(k - SEG_TRAILER_SIZE);
-          packet_start_locations.push_back(k - SEG_TRAILER_SIZE - segment_length + 1);
-          packet_types.push_back(BLOCK_SEG_AUDIO);
-
-          k = begin_sample - 1;
+    {
+      perf_scope walk_timer(perf.walk, BLOCK_SIZE);
+      block_reason = walk_block(&contents[0], block_start, packet_start_locations, packet_lengths, packet_types, error_offset);
+    }
 
-        }
+    if (block_reason != BLOCK_OK) {
+      //A block error has occured. 
+      //Drop the whole block and resync on the next block boundary. 
+      cur_block_error.block_number = uint32_t((file_loc + block_start) / BLOCK_SIZE);
+      cur_block_error.sequence = load_u32(&contents[block_start]);
+      cur_block_error.reason = block_reason;
+      cur_block_error.offset = error_offset;
+      block_errors.push_back(cur_block_error);
+      block_error_counts[block_reason]++;
+      block_success = 0;
+      perf.blocks_dropped++;
 
-      }
+      k = block_start + BLOCK_SIZE;
 
+      packet_start_locations.clear();
+      packet_types.clear();
+      packet_lengths.clear();
+      continue;
     }
 
     //Process the block in the foward direction. 
+    std::chrono::steady_clock::time_point decode_start = std::chrono::steady_clock::now();
     for (int i = packet_types.size()-1; i >= 0; i--) {
 
+        //Deselected streams are stepped over without touching the payload.
+        if (!stream_selected(packet_types[i], options.streams)) {
+          continue;
+        }
+
+#ifdef SD_PERF_SEGMENTS
+        perf_scope decode_timer(perf.decode[packet_types[i] & (BLOCK_SEG_TYPES - 1)], packet_lengths[i]);
+#else
+        perf_count(perf.decode[packet_types[i] & (BLOCK_SEG_TYPES - 1)], packet_lengths[i]);
+#endif
+
           //Reminder that IMU is stored ZYX on the SD Card. 
           //Two bytes (I2) little endian for each axis.
         if (packet_types[i] == BLOCK_SEG_IMU_GYRO) {
 
 
-           end_sample = packet_end_locations[i];
             begin_sample = packet_start_locations[i];
             segment_length = packet_lengths[i];
-
-            for (int i_imu = 0; i_imu < segment_length; i_imu = i_imu + IMU_AXIS_WORD_LENGTH_BYTES)
-            {
-              int16_t gyro = *reinterpret_cast<const int16_t*>(&contents[begin_sample + i_imu]);
-
-              gyro_segment_stream.push_back(gyro);
+            if (output_mode) {
+              if (out.imu[0] != NULL) {
+                decode_imu_segment_columns(&contents[0], begin_sample, segment_length, out.imu[0], out.imu_rows[0], out.imu_words[0]);
+              }
+            }
+            else {
+              decode_imu_segment(&contents[0], begin_sample, segment_length, gyro_segment_stream);
             }
 
             gyro_time.push_back(populate_gps_time(recent_gyro_time));
@@ -853,48 +1294,33 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
         else if (packet_types[i] == BLOCK_SEG_STATUS) {
 
-          end_sample = packet_end_locations[i];
             begin_sample = packet_start_locations[i];
             segment_length = packet_lengths[i];
 
-            //Okay to cast the 9 byte length to 64 bits, top bits are not used. 
-
-            cur_status_packet.compile = *reinterpret_cast<const uint32_t*>(&contents[begin_sample + status_compile_offset]);
-            cur_status_packet.commit = *reinterpret_cast<const uint32_t*>(&contents[begin_sample + status_commit_offset]);
-
-            cur_status_packet.status_t = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + status_packet_time_offset]);
-
-            cur_status_packet.accel_t = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + status_accel_time_offset]);
-
-            cur_status_packet.gyro_t = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + status_gyro_time_offset]);
-
-            cur_status_packet.mag_t = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + status_mag_time_offset]);
-
-            cur_status_packet.temp_t = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + status_temp_time_offset]);
-
-            cur_status_packet.audio_t = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + status_audio_time_offset]);
-
-            cur_status_packet.rtc_t = *reinterpret_cast<const uint32_t*>(&contents[begin_sample + status_rtc_time_offset]);
-
-            cur_status_packet.mics_active = *reinterpret_cast<const uint8_t*>(&contents[begin_sample + status_num_mics_offset]);
-
-            cur_status_packet.status_type = *reinterpret_cast<const uint8_t*>(&contents[begin_sample + status_type_offset]);
-
+            //Decode with the layout of the build that wrote it, see
+            //sd_status.h.
+            const status_schema* schema = status_find(status_lookup, &contents[begin_sample], segment_length);
+            if (schema == NULL) {
+              continue;
+            }
+            schema->decode(&contents[begin_sample], status_packets);
 
-            status_packets.push_back(cur_status_packet);
 
             //Update the recent sample times. 
-            recent_gyro_time = cur_status_packet.gyro_t;
-            recent_accel_time = cur_status_packet.accel_t;
-            recent_mag_time = cur_status_packet.mag_t;
-            recent_audio_time = cur_status_packet.audio_t;
+            recent_gyro_time = status_packets.gyro_t.back();
+            recent_accel_time = status_packets.accel_t.back();
+            recent_mag_time = status_packets.mag_t.back();
+            recent_audio_time = status_packets.audio_t.back();
 
 
-            status_p_time_mark.push_back(populate_gps_time(cur_status_packet.status_t));
-            gyro_time_mark.push_back(populate_gps_time(cur_status_packet.gyro_t));
-            accel_time_mark.push_back(populate_gps_time(cur_status_packet.accel_t));
-            mag_time_mark.push_back(populate_gps_time(cur_status_packet.mag_t));
-            audio_time_mark.push_back(populate_gps_time(cur_status_packet.audio_t));
+            status_p_time_mark.push_back(populate_gps_time(status_packets.status_t.back()));
+            status_segments.push_back(clock_track_reset(restarts, clock_ns(status_p_time_mark.back().week_num,
+                                                                           status_p_time_mark.back().milli_num,
+                                                                           status_p_time_mark.back().nano_num)));
+            gyro_time_mark.push_back(populate_gps_time(status_packets.gyro_t.back()));
+            accel_time_mark.push_back(populate_gps_time(status_packets.accel_t.back()));
+            mag_time_mark.push_back(populate_gps_time(status_packets.mag_t.back()));
+            audio_time_mark.push_back(populate_gps_time(status_packets.audio_t.back()));
 
             //Mark where the status packet occured.
             xl_packets_num.push_back(xl_packets);
@@ -905,136 +1331,58 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
             
 
           }
-        else if (packet_types[i] == BLOCK_SEG_GPS_POSITION)
-          {
-            end_sample = packet_end_locations[i];
-              begin_sample = packet_start_locations[i];
-              segment_length = packet_lengths[i];
-
-
-            cur_navsol_packet.itow = *reinterpret_cast<const uint32_t*>(&contents[begin_sample + itow_offset]);
-            cur_navsol_packet.ftow = *reinterpret_cast<const int32_t*>(&contents[begin_sample + ftow_offset]);
-            cur_navsol_packet.weekepoch = *reinterpret_cast<const int16_t*>(&contents[begin_sample + munsol_week_offset]);
-
-            cur_navsol_packet.fixtype = *reinterpret_cast<const uint8_t*>(&contents[begin_sample + gps_fix_type_offset]);
-            cur_navsol_packet.ecefx = *reinterpret_cast<const int32_t*>(&contents[begin_sample + ecefx_offset]);
-            cur_navsol_packet.ecefy = *reinterpret_cast<const int32_t*>(&contents[begin_sample + ecefy_offset]);
-            cur_navsol_packet.ecefz = *reinterpret_cast<const int32_t*>(&contents[begin_sample + ecefz_offset]);
+        else if (packet_types[i] == BLOCK_SEG_GPS_POSITION) {
+            decode_nav_sol_segment(&contents[0], packet_start_locations[i], navsol_packets);
+          }
+        else if (packet_types[i] == BLOCK_SEG_GPS_TIME_MARK) {
+            decode_tim_tm2_segment(&contents[0], packet_start_locations[i], tm_packets);
+          }
+        else if (packet_types[i] == BLOCK_SEG_GPS_TIME_PULSE) {
+            decode_tim_tp_segment(&contents[0], packet_start_locations[i], tim_tp_packets);
+            tim_tp_segments.push_back(clock_track_reset(restarts, clock_ns(tim_tp_packets.reset_time_week.back(),
+                                                                           tim_tp_packets.reset_time_ms.back(),
+                                                                           tim_tp_packets.reset_time_ns.back())));
+          }
+          
 
-            cur_navsol_packet.pacc = *reinterpret_cast<const uint32_t*>(&contents[begin_sample + pAcc_offset]);
-            cur_navsol_packet.posdop = *reinterpret_cast<const uint16_t*>(&contents[begin_sample + positiondop_offset]);
-            cur_navsol_packet.numsv = *reinterpret_cast<const uint8_t*>(&contents[begin_sample + numsv_offset]);
+          //Reminder that IMU is stored ZYX on the SD Card. 
+          //Two bytes (I2) little endian for each axis.
+        else if (packet_types[i] == BLOCK_SEG_IMU_ACCEL) {
 
 
+            begin_sample = packet_start_locations[i];
+            segment_length = packet_lengths[i];
+            if (output_mode) {
+              if (out.imu[1] != NULL) {
+                decode_imu_segment_columns(&contents[0], begin_sample, segment_length, out.imu[1], out.imu_rows[1], out.imu_words[1]);
+              }
+            }
+            else {
+              decode_imu_segment(&contents[0], begin_sample, segment_length, accel_segment_stream);
+            }
+            accel_time.push_back(populate_gps_time(recent_accel_time));
 
-            nav_time = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + posttime_offset]);
 
-            //Parse the larger time into week/ms/ns.
-            nav_gps_time = populate_gps_time(nav_time);
-            //Insert it into the tm2 structure and add to array. 
-            cur_navsol_packet.reset_time_week = nav_gps_time.week_num;
-            cur_navsol_packet.reset_time_ms = nav_gps_time.milli_num;
-            cur_navsol_packet.reset_time_ns = nav_gps_time.nano_num;
+            xl_packets = xl_packets + 1;
 
-            navsol_packets.push_back(cur_navsol_packet);
 
           }
+          //Reminder that IMU is stored ZYX on the SD Card. 
+          //Two bytes (I2) little endian for each axis.
+        else if (packet_types[i] == BLOCK_SEG_IMU_MAG)
+          {
 
-        else if (packet_types[i] == BLOCK_SEG_GPS_TIME_MARK) {
 
 
-          end_sample = packet_end_locations[i];
             begin_sample = packet_start_locations[i];
             segment_length = packet_lengths[i];
-
-
-            cur_tm_packet.flags = *reinterpret_cast<const uint8_t*>(&contents[begin_sample + tm2_flags_offset]);
-            cur_tm_packet.wnF = *reinterpret_cast<const uint16_t*>(&contents[begin_sample + tm2_wnF_offset]);
-            cur_tm_packet.towmsF = *reinterpret_cast<const uint32_t*>(&contents[begin_sample + tm2_towmsF_offset]);
-            cur_tm_packet.towsubmsF = *reinterpret_cast<const uint32_t*>(&contents[begin_sample + tm2_towsubmsF_offset]);
-            cur_tm_packet.accestns = *reinterpret_cast<const uint32_t*>(&contents[begin_sample + tm2_accest_offset]);
-
-            tm2_time = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + tm2_marktime_offset]);
-            //Parse the larger time into week/ms/ns.
-            tm2_gps_time = populate_gps_time(tm2_time);
-            //Insert it into the tm2 structure and add to array. 
-            cur_tm_packet.reset_time_week = tm2_gps_time.week_num;
-            cur_tm_packet.reset_time_ms = tm2_gps_time.milli_num;
-            cur_tm_packet.reset_time_ns= tm2_gps_time.nano_num;
-
-
-            tm_packets.push_back(cur_tm_packet);
-            
-          }
-        else if (packet_types[i] == BLOCK_SEG_GPS_TIME_PULSE) {
-
-
-          end_sample = packet_end_locations[i];
-            begin_sample = packet_start_locations[i];
-            segment_length = packet_lengths[i];
-
-            fpga_time = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + tp_fpga_offset]);
-
-            
-            tp_fpga_time =  populate_gps_time(fpga_time);
-            cur_tim_tp_packet.reset_time_week = tp_fpga_time.week_num;
-            cur_tim_tp_packet.reset_time_ms = tp_fpga_time.milli_num;
-            cur_tim_tp_packet.reset_time_ns= tp_fpga_time.nano_num;
-            
-            tp_time = *reinterpret_cast<const uint64_t*>(&contents[begin_sample + tp_timepulse_offset]);
-
-            //Parse the larger time into week/ms/ns.
-            tp_timepulse_time = populate_gps_time(tp_time);
-            //Insert it into the tp2 structure and add to array. 
-            cur_tim_tp_packet.gps_time_week = tp_timepulse_time.week_num;
-            cur_tim_tp_packet.gps_time_ms = tp_timepulse_time.milli_num;
-            cur_tim_tp_packet.gps_time_ns = tp_timepulse_time.nano_num;
-
-
-            tim_tp_packets.push_back(cur_tim_tp_packet);
-            
-
-          }
-          
-
-          //Reminder that IMU is stored ZYX on the SD Card. 
-          //Two bytes (I2) little endian for each axis.
-        else if (packet_types[i] == BLOCK_SEG_IMU_ACCEL) {
-
-
-          end_sample = packet_end_locations[i];
-            begin_sample = packet_start_locations[i];
-            segment_length = packet_lengths[i];
-
-            
-            for (int i_imu = 0; i_imu < segment_length; i_imu = i_imu + IMU_AXIS_WORD_LENGTH_BYTES)
-            {
-              int16_t accel = *reinterpret_cast<const int16_t*>(&contents[begin_sample + i_imu]);
-              accel_segment_stream.push_back(accel);
+            if (output_mode) {
+              if (out.imu[2] != NULL) {
+                decode_imu_segment_columns(&contents[0], begin_sample, segment_length, out.imu[2], out.imu_rows[2], out.imu_words[2]);
+              }
             }
-            accel_time.push_back(populate_gps_time(recent_accel_time));
-
-
-            xl_packets = xl_packets + 1;
-
-
-          }
-          //Reminder that IMU is stored ZYX on the SD Card. 
-          //Two bytes (I2) little endian for each axis.
-        else if (packet_types[i] == BLOCK_SEG_IMU_MAG)
-          {
-
-
-
-            end_sample = packet_end_locations[i];
-            begin_sample = packet_start_locations[i];
-            segment_length = packet_lengths[i];
-
-
-            for (int i_imu = 0; i_imu < segment_length; i_imu = i_imu + IMU_AXIS_WORD_LENGTH_BYTES)
-            {
-              int16_t mag = *reinterpret_cast<const int16_t*>(&contents[begin_sample + i_imu]);
-              mag_segment_stream.push_back(mag);
+            else {
+              decode_imu_segment(&contents[0], begin_sample, segment_length, mag_segment_stream);
             }
             mag_time.push_back(populate_gps_time(recent_mag_time));
             mag_packets = mag_packets + 1;
@@ -1045,46 +1393,39 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
           }
         else if (packet_types[i] == BLOCK_SEG_AUDIO) {
-          end_sample = packet_end_locations[i];
             begin_sample = packet_start_locations[i];
             segment_length = packet_lengths[i];
 
 
-            for (int a_i = 0; a_i < segment_length; a_i = a_i + (AUDIO_WORD_BYTES*num_mics_active))
-            {
-              audio_r.push_back(*reinterpret_cast<const int16_t*>(&contents[begin_sample + a_i]));
-              aud_packets = aud_packets + 1;
-              audio_time.push_back(populate_gps_time(recent_audio_time));
+            if (output_mode) {
+              audio_samples = decode_audio_segment_columns(&contents[0], begin_sample, segment_length, num_mics_active,
+                                                           out.audio_r, out.audio_r_rows, out.audio_r_count,
+                                                           out.audio_l, out.audio_l_rows, out.audio_l_count);
+            }
+            else {
+              audio_samples = decode_audio_segment(&contents[0], begin_sample, segment_length, num_mics_active, audio_r, audio_l);
             }
 
-
-
-
-            for (int a_i = AUDIO_WORD_BYTES; a_i < segment_length; a_i = a_i + (AUDIO_WORD_BYTES*num_mics_active))
+            cur_audio_time = populate_gps_time(recent_audio_time);
+            for (int a_i = 0; a_i < audio_samples; a_i++)
             {
-              audio_l.push_back(*reinterpret_cast<const int16_t*>(&contents[begin_sample + a_i]));
+              aud_packets = aud_packets + 1;
+              audio_time.push_back(cur_audio_time);
             }
 
 
 
           }
-          //         else
-          //            //A block error has occured. 
-          //            k
-          //            error_loc = [error_loc k];
-          //            k = block_start + 512;
-          //            block_success = 0;
-          //            break;
         }
+    perf_stop(perf.decode_blocks, decode_start, BLOCK_SIZE);
 
 
 
 
       //Jump to start of next block.
-      k = k + 509;
+      k = block_start + BLOCK_SIZE;
 
 
-      packet_end_locations.clear();
       packet_start_locations.clear();
       packet_types.clear();
       packet_lengths.clear();
@@ -1103,10 +1444,28 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
 
        //Fill in sensor time series information.
-       back_annotate(gyro_time, tim_tp_packets, g_packets_num, gyro_ms, gyro_ns);
-       back_annotate(accel_time, tim_tp_packets, xl_packets_num, accel_ms, accel_ns);
-       back_annotate(mag_time, tim_tp_packets, mag_packets_num, mag_ms, mag_ns);
-       back_annotate(audio_time, tim_tp_packets, aud_packets_num, audio_ms, audio_ns);
+       {
+         clock_start_chunk(clock);
+         for (size_t i = 0; i < packet_rows(tim_tp_packets); i++) {
+           clock_add_pulse(clock, tim_tp_segments[i], tim_tp_packets.reset_time_week[i], tim_tp_packets.reset_time_ms[i], tim_tp_packets.reset_time_ns[i],
+                           tim_tp_packets.gps_time_week[i], tim_tp_packets.gps_time_ms[i], tim_tp_packets.gps_time_ns[i]);
+         }
+
+         perf_scope back_annotate_timer(perf.back_annotate,
+           (gyro_time.size() + accel_time.size() + mag_time.size() + audio_time.size()) * sizeof(gps_time));
+         if (options.streams & STREAM_GYRO) {
+           back_annotate(gyro_time, clock, g_packets_num, status_segments, chunk_segment, gyro_ms, gyro_ns);
+         }
+         if (options.streams & STREAM_ACCEL) {
+           back_annotate(accel_time, clock, xl_packets_num, status_segments, chunk_segment, accel_ms, accel_ns);
+         }
+         if (options.streams & STREAM_MAG) {
+           back_annotate(mag_time, clock, mag_packets_num, status_segments, chunk_segment, mag_ms, mag_ns);
+         }
+         if (options.streams & STREAM_AUDIO) {
+           back_annotate(audio_time, clock, aud_packets_num, status_segments, chunk_segment, audio_ms, audio_ns);
+         }
+       }
          //Populate the XL/G/Mag with proper sample times. 
          //Iterate through the vectors and back annotate on time changes
          //given the sample rate.s 
@@ -1115,48 +1474,358 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
        
        
-      write_int_vector_binary("audio_l.bin", audio_l);
-      write_int_vector_binary("audio_r.bin", audio_r);
-      write_int_vector_binary("segment_number.bin", sequence_number);
-      write_int_vector_binary("gyro_stream.bin", gyro_segment_stream);
-      write_int_vector_binary("accel_stream.bin", accel_segment_stream);
-      write_int_vector_binary("mag_stream.bin", mag_segment_stream);
-
-	   write_out_struct_binary("status_packets.bin", (uint64_t*)&(status_packets[0]), status_field_names, (int)status_packets.size(), status_packet_field_count, start_of_parse);
-	   write_out_struct_binary("navsol_packets.bin", (int32_t*)&(navsol_packets[0]), navsol_field_names, (int)navsol_packets.size(), navsol_packet_field_count, start_of_parse);
-	   write_out_struct_binary("tm_packets.bin", (int32_t*)&(tm_packets[0]), tm_field_names, (int)tm_packets.size(), tm_packet_field_count, start_of_parse);
-     write_out_struct_binary("tim_tp_packets.bin", (int32_t*)&(tim_tp_packets[0]), tim_tp_field_names, (int)tim_tp_packets.size(), tim_tp_field_count, start_of_parse);
-     
-     
-     write_out_struct_binary("gyro_times.bin", (uint32_t*)&(gyro_time[0]), gps_time_field_names, gyro_time.size(), gps_time_field_count, start_of_parse);
-	   write_out_struct_binary("xl_times.bin", (uint32_t*)&(accel_time[0]), gps_time_field_names, accel_time.size(), gps_time_field_count, start_of_parse);
-	   write_out_struct_binary("mag_times.bin", (uint32_t*)&(mag_time[0]), gps_time_field_names, mag_time.size(), gps_time_field_count, start_of_parse);
-	   write_out_struct_binary("status_p_time_mark.bin", (uint32_t*)&(status_p_time_mark[0]), gps_time_field_names, status_p_time_mark.size(), gps_time_field_count, start_of_parse);
-     write_out_struct_binary("audio_times.bin", (uint32_t*)&(audio_time[0]), gps_time_field_names, audio_time.size(), gps_time_field_count, start_of_parse);
-     
-     if(csv)
-     {
-    write_int_vector_csv("audio_l.csv", audio_l,start_of_parse);
-    write_int_vector_csv("audio_r.csv", audio_r,start_of_parse);
-    write_int_vector_csv("segment_number.csv", sequence_number,start_of_parse);
-    write_int_vector_csv("gyro_stream.csv", gyro_segment_stream,start_of_parse);
-    write_int_vector_csv("accel_stream.csv", accel_segment_stream,start_of_parse);
-    write_int_vector_csv("mag_stream.csv", mag_segment_stream,start_of_parse);
-     
-     
-	   write_out_struct_csv("tim_tp_packets.csv", (int32_t*)&(tim_tp_packets[0]), tim_tp_field_names, (int)tim_tp_packets.size(), tim_tp_field_count, start_of_parse);
-	   write_out_struct_csv("navsol_packets.csv", (int32_t*)&(navsol_packets[0]), navsol_field_names, (int)navsol_packets.size(), navsol_packet_field_count, start_of_parse);
-	   write_out_struct_csv("tm_packets.csv", (int32_t*)&(tm_packets[0]), tm_field_names, (int)tm_packets.size(), tm_packet_field_count, start_of_parse);
-	   write_out_struct_csv("status_packets.csv", (uint64_t*)&(status_packets[0]), status_field_names, (int)status_packets.size(), status_packet_field_count, start_of_parse);
-
-	   write_out_struct_csv("gyro_times.csv", (uint32_t*)&(gyro_time[0]), gps_time_field_names, gyro_time.size(), gps_time_field_count, start_of_parse);
-	   write_out_struct_csv("xl_times.csv", (uint32_t*)&(accel_time[0]), gps_time_field_names, accel_time.size(), gps_time_field_count, start_of_parse);
-	   write_out_struct_csv("mag_times.csv", (uint32_t*)&(mag_time[0]), gps_time_field_names, mag_time.size(), gps_time_field_count, start_of_parse);
-	   write_out_struct_csv("gyro_times.csv", (uint32_t*)&(gyro_time_mark[0]), gps_time_field_names, gyro_time_mark.size(), gps_time_field_count, start_of_parse);
-	   write_out_struct_csv("status_p_time_mark.csv", (uint32_t*)&(status_p_time_mark[0]), gps_time_field_names, status_p_time_mark.size(), gps_time_field_count, start_of_parse);
-    //write_out_struct_csv("audio_times.csv", (uint32_t*)&(audio_time[0]), gps_time_field_names, audio_time.size(), gps_time_field_count, start_of_parse);
-    }
-     
+      if (output_mode) {
+        list_columns(status_packets, status_column_list);
+        list_columns(tm_packets, tm_column_list);
+        list_columns(navsol_packets, navsol_column_list);
+        list_columns(tim_tp_packets, tim_tp_column_list);
+
+        //Status and time pulse packets are read for every stream but only
+        //returned when selected. Deselected sample streams are empty.
+        if (options.streams & STREAM_STATUS) {
+          copy_out_columns(out.packets[0], status_column_list, packet_rows(status_packets), out.packet_rows[0], out.packet_count[0]);
+          copy_out_time_columns(gyro_time_mark, out.times[3], out.time_rows[3], out.time_count[3]);
+          copy_out_time_columns(status_p_time_mark, out.times[4], out.time_rows[4], out.time_count[4]);
+        }
+        if (options.streams & STREAM_GPS) {
+          copy_out_columns(out.packets[1], tm_column_list, packet_rows(tm_packets), out.packet_rows[1], out.packet_count[1]);
+          copy_out_columns(out.packets[2], navsol_column_list, packet_rows(navsol_packets), out.packet_rows[2], out.packet_count[2]);
+          copy_out_columns(out.packets[3], tim_tp_column_list, packet_rows(tim_tp_packets), out.packet_rows[3], out.packet_count[3]);
+        }
+
+        copy_out_time_columns(gyro_time, out.times[0], out.time_rows[0], out.time_count[0]);
+        copy_out_time_columns(accel_time, out.times[1], out.time_rows[1], out.time_count[1]);
+        copy_out_time_columns(mag_time, out.times[2], out.time_rows[2], out.time_count[2]);
+        copy_out_time_columns(audio_time, out.times[5], out.time_rows[5], out.time_count[5]);
+      }
+      else {
+        //Files are only written for the selected streams so a run for
+        //one stream doesn't leave stale files from another.
+        list_columns(status_packets, status_column_list);
+        list_columns(tm_packets, tm_column_list);
+        list_columns(navsol_packets, navsol_column_list);
+        list_columns(tim_tp_packets, tim_tp_column_list);
+
+        write_int_vector_binary("segment_number.bin", sequence_number);
+
+        if (options.streams & STREAM_AUDIO) {
+          write_int_vector_binary("audio_l.bin", audio_l);
+          write_int_vector_binary("audio_r.bin", audio_r);
+          write_out_struct_binary("audio_times.bin", (uint32_t*)&(audio_time[0]), gps_time_field_names, audio_time.size(), gps_time_field_count, start_of_parse);
+        }
+        if (options.streams & STREAM_GYRO) {
+          write_int_vector_binary("gyro_stream.bin", gyro_segment_stream);
+          write_out_struct_binary("gyro_times.bin", (uint32_t*)&(gyro_time[0]), gps_time_field_names, gyro_time.size(), gps_time_field_count, start_of_parse);
+        }
+        if (options.streams & STREAM_ACCEL) {
+          write_int_vector_binary("accel_stream.bin", accel_segment_stream);
+          write_out_struct_binary("xl_times.bin", (uint32_t*)&(accel_time[0]), gps_time_field_names, accel_time.size(), gps_time_field_count, start_of_parse);
+        }
+        if (options.streams & STREAM_MAG) {
+          write_int_vector_binary("mag_stream.bin", mag_segment_stream);
+          write_out_struct_binary("mag_times.bin", (uint32_t*)&(mag_time[0]), gps_time_field_names, mag_time.size(), gps_time_field_count, start_of_parse);
+        }
+
+        //Status fields are written 8 bytes wide and the rest 4 so the files
+        //still read with read_binary_files.m.
+        if (options.streams & STREAM_STATUS) {
+          write_columns_binary("status_packets.bin", status_column_list, packet_rows(status_packets), 8);
+          write_out_struct_binary("status_p_time_mark.bin", (uint32_t*)&(status_p_time_mark[0]), gps_time_field_names, status_p_time_mark.size(), gps_time_field_count, start_of_parse);
+        }
+        if (options.streams & STREAM_GPS) {
+          write_columns_binary("navsol_packets.bin", navsol_column_list, packet_rows(navsol_packets), 4);
+          write_columns_binary("tm_packets.bin", tm_column_list, packet_rows(tm_packets), 4);
+          write_columns_binary("tim_tp_packets.bin", tim_tp_column_list, packet_rows(tim_tp_packets), 4);
+        }
+
+        if (csv) {
+          write_int_vector_csv("segment_number.csv", sequence_number,start_of_parse);
+
+          if (options.streams & STREAM_AUDIO) {
+            write_int_vector_csv("audio_l.csv", audio_l,start_of_parse);
+            write_int_vector_csv("audio_r.csv", audio_r,start_of_parse);
+            //write_out_struct_csv("audio_times.csv", (uint32_t*)&(audio_time[0]), gps_time_field_names, audio_time.size(), gps_time_field_count, start_of_parse);
+          }
+          if (options.streams & STREAM_GYRO) {
+            write_int_vector_csv("gyro_stream.csv", gyro_segment_stream,start_of_parse);
+            write_out_struct_csv("gyro_times.csv", (uint32_t*)&(gyro_time[0]), gps_time_field_names, gyro_time.size(), gps_time_field_count, start_of_parse);
+          }
+          if (options.streams & STREAM_ACCEL) {
+            write_int_vector_csv("accel_stream.csv", accel_segment_stream,start_of_parse);
+            write_out_struct_csv("xl_times.csv", (uint32_t*)&(accel_time[0]), gps_time_field_names, accel_time.size(), gps_time_field_count, start_of_parse);
+          }
+          if (options.streams & STREAM_MAG) {
+            write_int_vector_csv("mag_stream.csv", mag_segment_stream,start_of_parse);
+            write_out_struct_csv("mag_times.csv", (uint32_t*)&(mag_time[0]), gps_time_field_names, mag_time.size(), gps_time_field_count, start_of_parse);
+          }
+          if (options.streams & STREAM_STATUS) {
+            write_columns_csv("status_packets.csv", status_column_list, packet_rows(status_packets), start_of_parse);
+            write_out_struct_csv("gyro_times.csv", (uint32_t*)&(gyro_time_mark[0]), gps_time_field_names, gyro_time_mark.size(), gps_time_field_count, start_of_parse);
+            write_out_struct_csv("status_p_time_mark.csv", (uint32_t*)&(status_p_time_mark[0]), gps_time_field_names, status_p_time_mark.size(), gps_time_field_count, start_of_parse);
+          }
+          if (options.streams & STREAM_GPS) {
+            write_columns_csv("tim_tp_packets.csv", tim_tp_column_list, packet_rows(tim_tp_packets), start_of_parse);
+            write_columns_csv("navsol_packets.csv", navsol_column_list, packet_rows(navsol_packets), start_of_parse);
+            write_columns_csv("tm_packets.csv", tm_column_list, packet_rows(tm_packets), start_of_parse);
+          }
+        }
+      }
+
+     //Audio for the WAV and FLAC files. In output mode it is taken from
+     //the part of the audio outputs filled since the last chunk.
+     if (wav_output || flac_output) {
+       perf_scope audio_timer(perf.writers[resample_output ? "resample" : "audio_queue"]);
+       if (output_mode) {
+         uint64_t l_end = std::min(out.audio_l_count, out.audio_l_rows);
+         uint64_t r_end = std::min(out.audio_r_count, out.audio_r_rows);
+         add_audio_chunk(wav_output ? &wav : NULL, flac_output ? &flac : NULL,
+                         resample_output ? &rate_converter : NULL, num_mics_active,
+                         out.audio_l + audio_l_sent, (size_t)(l_end - audio_l_sent),
+                         out.audio_r + audio_r_sent, (size_t)(r_end - audio_r_sent));
+         audio_l_sent = l_end;
+         audio_r_sent = r_end;
+       }
+       else {
+         add_audio_chunk(wav_output ? &wav : NULL, flac_output ? &flac : NULL,
+                         resample_output ? &rate_converter : NULL, num_mics_active,
+                         audio_l.data(), audio_l.size(), audio_r.data(), audio_r.size());
+       }
+     }
+
+     if (wav_output) {
+       perf_scope wav_timer(perf.writers["wav"]);
+       wav_timer.bytes = (uint64_t)(wav.pending[0].size()) * wav.channels * sizeof(int16_t);
+       if (wav_flush(wav) != 0) {
+         mexPrintf("Write to %s failed\n", options.wav.c_str());
+         wav_close(wav);
+         wav_output = 0;
+       }
+     }
+
+     if (flac_output) {
+       perf_scope flac_timer(perf.writers["flac"]);
+       flac_timer.bytes = (uint64_t)(flac.pending[0].size()) * flac.channels * sizeof(int16_t);
+       if (flac_flush(flac) != 0) {
+         mexPrintf("Write to %s failed\n", options.flac.c_str());
+         flac_close(flac);
+         flac_output = 0;
+       }
+     }
+
+     if (options.overview) {
+       perf_scope overview_timer(perf.writers["overview"]);
+
+       for (int c = 0; c < 2; c++) {
+         if (!overview_audio_active[c]) {
+           continue;
+         }
+         if (output_mode) {
+           int16_t* column = (c == 0) ? out.audio_l : out.audio_r;
+           uint64_t end = (c == 0) ? std::min(out.audio_l_count, out.audio_l_rows) : std::min(out.audio_r_count, out.audio_r_rows);
+           const int16_t* samples[1] = { column + overview_audio_sent[c] };
+           overview_add(overview_audio[c], samples, (size_t)(end - overview_audio_sent[c]), 1);
+           overview_audio_sent[c] = end;
+         }
+         else {
+           vector<int>& chunk = (c == 0) ? audio_l : audio_r;
+           const int* samples[1] = { chunk.data() };
+           overview_add(overview_audio[c], samples, chunk.size(), 1);
+         }
+       }
+
+       //IMU words are interleaved by axis in the chunk vectors and one
+       //column per axis in the outputs.
+       vector<int>* imu_chunks[3] = { &gyro_segment_stream, &accel_segment_stream, &mag_segment_stream };
+       for (int i = 0; i < 3; i++) {
+         if (!overview_imu_active[i]) {
+           continue;
+         }
+         if (output_mode) {
+           uint64_t end = std::min(out.imu_words[i] / 3, out.imu_rows[i]);
+           const int16_t* axes[3];
+           for (int a = 0; a < 3; a++) {
+             axes[a] = out.imu[i] + a * out.imu_rows[i] + overview_imu_sent[i];
+           }
+           overview_add(overview_imu[i], axes, (size_t)(end - overview_imu_sent[i]), 1);
+           overview_imu_sent[i] = end;
+         }
+         else if (imu_chunks[i]->size() >= 3) {
+           const int* axes[3] = { imu_chunks[i]->data(), imu_chunks[i]->data() + 1, imu_chunks[i]->data() + 2 };
+           overview_add(overview_imu[i], axes, imu_chunks[i]->size() / 3, 3);
+         }
+       }
+     }
+
+     //Frame times come from audio_time, one row per audio_r sample.
+     if (feature_output) {
+       perf_scope feature_timer(perf.writers["features"]);
+       if (output_mode) {
+         uint64_t l_end = std::min(out.audio_l_count, out.audio_l_rows);
+         uint64_t r_end = std::min(out.audio_r_count, out.audio_r_rows);
+         if (num_mics_active == 2) {
+           feature_add_samples(features, 0, out.audio_l + feature_audio_sent[0], (size_t)(l_end - feature_audio_sent[0]));
+           feature_add_samples(features, 1, out.audio_r + feature_audio_sent[1], (size_t)(r_end - feature_audio_sent[1]));
+         }
+         else {
+           feature_add_samples(features, 0, out.audio_r + feature_audio_sent[1], (size_t)(r_end - feature_audio_sent[1]));
+         }
+         feature_audio_sent[0] = l_end;
+         feature_audio_sent[1] = r_end;
+       }
+       else if (num_mics_active == 2) {
+         feature_add_samples(features, 0, audio_l.data(), audio_l.size());
+         feature_add_samples(features, 1, audio_r.data(), audio_r.size());
+       }
+       else {
+         feature_add_samples(features, 0, audio_r.data(), audio_r.size());
+       }
+       feature_add_times(features, (uint32_t*)audio_time.data(), audio_time.size());
+
+       feature_timer.bytes = (uint64_t)features.pending[0].size() * features.channels * sizeof(int16_t);
+       if (feature_flush(features) != 0) {
+         mexPrintf("Writing the feature files failed\n");
+         feature_close(features);
+         feature_output = 0;
+       }
+     }
+
+     if (event_output) {
+       perf_scope event_timer(perf.writers["events"]);
+       if (output_mode) {
+         uint64_t l_end = std::min(out.audio_l_count, out.audio_l_rows);
+         uint64_t r_end = std::min(out.audio_r_count, out.audio_r_rows);
+         if (num_mics_active == 2) {
+           event_add_samples(events, 0, out.audio_l + event_audio_sent[0], (size_t)(l_end - event_audio_sent[0]));
+           event_add_samples(events, 1, out.audio_r + event_audio_sent[1], (size_t)(r_end - event_audio_sent[1]));
+         }
+         else {
+           event_add_samples(events, 0, out.audio_r + event_audio_sent[1], (size_t)(r_end - event_audio_sent[1]));
+         }
+         event_audio_sent[0] = l_end;
+         event_audio_sent[1] = r_end;
+       }
+       else if (num_mics_active == 2) {
+         event_add_samples(events, 0, audio_l.data(), audio_l.size());
+         event_add_samples(events, 1, audio_r.data(), audio_r.size());
+       }
+       else {
+         event_add_samples(events, 0, audio_r.data(), audio_r.size());
+       }
+       event_add_times(events, (uint32_t*)audio_time.data(), audio_time.size());
+
+       event_timer.bytes = (uint64_t)events.pending[0].size() * events.channels * sizeof(int16_t);
+       event_flush(events);
+     }
+
+     //The outputs hold one int16 column per stored axis, Z first.
+     if (options.imu_units) {
+       perf_scope imu_units_timer(perf.writers["imu_units"]);
+       vector<int>* imu_chunks[3] = { &gyro_segment_stream, &accel_segment_stream, &mag_segment_stream };
+       for (int i = 0; i < 3; i++) {
+         if (!imu_units_active[i]) {
+           continue;
+         }
+         int result = 0;
+         if (output_mode) {
+           uint64_t end = std::min(out.imu_words[i] / 3, out.imu_rows[i]);
+           const int16_t* z = out.imu[i] + imu_units_sent[i];
+           result = imu_units_add(imu_units[i], z, z + out.imu_rows[i], z + 2 * out.imu_rows[i],
+                                  (size_t)(end - imu_units_sent[i]), 1);
+           imu_units_timer.bytes = imu_units_timer.bytes + (end - imu_units_sent[i]) * 3 * sizeof(float);
+           imu_units_sent[i] = end;
+         }
+         else if (imu_chunks[i]->size() >= 3) {
+           const int* z = imu_chunks[i]->data();
+           result = imu_units_add(imu_units[i], z, z + 1, z + 2, imu_chunks[i]->size() / 3, 3);
+           imu_units_timer.bytes = imu_units_timer.bytes + (imu_chunks[i]->size() / 3) * 3 * sizeof(float);
+         }
+         if (result != 0) {
+           mexPrintf("Write to %s failed\n", imu_units[i].filename.c_str());
+           imu_units_close(imu_units[i]);
+           imu_units_active[i] = 0;
+         }
+       }
+     }
+
+     if (track_output) {
+       perf_scope track_timer(perf.writers["track"]);
+       track_add(track, packet_rows(navsol_packets), navsol_packets.ecefx.data(), navsol_packets.ecefy.data(),
+                 navsol_packets.ecefz.data(), navsol_packets.pacc.data(), navsol_packets.fixtype.data(),
+                 navsol_packets.numsv.data(), navsol_packets.weekepoch.data(), navsol_packets.itow.data(),
+                 navsol_packets.ftow.data());
+     }
+
+     if (merge_output) {
+       perf_scope merge_timer(perf.writers["merge"]);
+       uint64_t records_before = merger.records;
+
+       for (int p = 0; p < 3; p++) {
+         merge_packet_times[p].clear();
+       }
+       for (size_t i = 0; i < packet_rows(navsol_packets); i++) {
+         gps_time time = { navsol_packets.reset_time_week[i], navsol_packets.reset_time_ms[i], navsol_packets.reset_time_ns[i],
+                           (uint32_t)navsol_packets.weekepoch[i], navsol_packets.itow[i], (uint32_t)navsol_packets.ftow[i] };
+         merge_packet_times[0].push_back(time);
+       }
+       for (size_t i = 0; i < packet_rows(tm_packets); i++) {
+         gps_time time = { tm_packets.reset_time_week[i], tm_packets.reset_time_ms[i], tm_packets.reset_time_ns[i],
+                           tm_packets.wnF[i], tm_packets.towmsF[i], tm_packets.towsubmsF[i] };
+         merge_packet_times[1].push_back(time);
+       }
+       for (size_t i = 0; i < packet_rows(tim_tp_packets); i++) {
+         gps_time time = { tim_tp_packets.reset_time_week[i], tim_tp_packets.reset_time_ms[i], tim_tp_packets.reset_time_ns[i],
+                           tim_tp_packets.gps_time_week[i], tim_tp_packets.gps_time_ms[i], tim_tp_packets.gps_time_ns[i] };
+         merge_packet_times[2].push_back(time);
+       }
+
+       vector<gps_time>* merge_times[7] = { &audio_time, &gyro_time, &accel_time, &mag_time,
+                                            &merge_packet_times[0], &merge_packet_times[1], &merge_packet_times[2] };
+       for (int s = 0; s < 7; s++) {
+         merge_add(merger, s, (uint32_t*)merge_times[s]->data(), merge_times[s]->size());
+       }
+       if (merge_flush(merger) != 0) {
+         mexPrintf("Writing merged.bin failed\n");
+         merge_close(merger);
+         merge_output = 0;
+       }
+       merge_timer.bytes = (merger.records - records_before) * MERGE_RECORD_WORDS * sizeof(uint32_t);
+     }
+
+     //Each sensor's times are one row per sample of this chunk.
+     if (fusion_output) {
+       perf_scope fusion_timer(perf.writers["fusion"]);
+       vector<int>* imu_chunks[3] = { &gyro_segment_stream, &accel_segment_stream, &mag_segment_stream };
+       for (int i = 0; i < 3; i++) {
+         if (output_mode) {
+           uint64_t end = std::min(out.imu_words[i] / 3, out.imu_rows[i]);
+           const int16_t* z = out.imu[i] + fusion_sent[i];
+           fusion_add_samples(fusion, i, z, z + out.imu_rows[i], z + 2 * out.imu_rows[i],
+                              (size_t)(end - fusion_sent[i]), 1, scale.sensitivity[i], options.imu_offsets[i]);
+           fusion_sent[i] = end;
+         }
+         else if (imu_chunks[i]->size() >= 3) {
+           const int* z = imu_chunks[i]->data();
+           fusion_add_samples(fusion, i, z, z + 1, z + 2, imu_chunks[i]->size() / 3, 3,
+                              scale.sensitivity[i], options.imu_offsets[i]);
+         }
+       }
+       fusion_add_times(fusion, FUSION_GYRO, (uint32_t*)gyro_time.data(), gyro_time.size());
+       fusion_add_times(fusion, FUSION_MAG, (uint32_t*)mag_time.data(), mag_time.size());
+
+       uint64_t rows_before = fusion.rows;
+       if (fusion_flush(fusion) != 0) {
+         mexPrintf("Writing orientation.bin failed\n");
+         fusion_close(fusion);
+         fusion_output = 0;
+       }
+       fusion_timer.bytes = (fusion.rows - rows_before) * FUSION_COLUMNS * sizeof(float);
+     }
+
+
+
+     //The corruption report is always kept as csv so it can be read by eye.
+     write_out_struct_csv("block_errors.csv", (uint32_t*)block_errors.data(), block_error_field_names, (int)block_errors.size(), block_error_field_count, start_of_parse);
+
 
 
 	   start_of_parse = 0;
@@ -1167,16 +1836,17 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 	   gyro_segment_stream.clear();
 	   accel_segment_stream.clear();
 	   mag_segment_stream.clear();
-	   tim_tp_packets.clear();
-	   navsol_packets.clear();
-	   tm_packets.clear();
-	   status_packets.clear();
+	   clear_packets(tim_tp_packets);
+	   clear_packets(navsol_packets);
+	   clear_packets(tm_packets);
+	   clear_packets(status_packets);
 	   gyro_time.clear();
 	   accel_time.clear();
 	   mag_time.clear();
 	   gyro_time_mark.clear(); 
 	   status_p_time_mark.clear();
 	   audio_time.clear();
+	   block_errors.clear();
 
 
 	   g_packets_num.clear();
@@ -1184,6 +1854,11 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 	   mag_packets_num.clear();
 	   aud_packets_num.clear();
 
+	   //The next chunk's first samples were stamped by this one's last status.
+	   chunk_segment = status_segments.empty() ? chunk_segment : status_segments.back();
+	   status_segments.clear();
+	   tim_tp_segments.clear();
+
 
 
 	    xl_packets = -1;
@@ -1195,6 +1870,118 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 		}
 		in.close();
 
+    if (output_mode) {
+      finish_outputs(out);
+    }
+
+    if (status_lookup.unknown != 0 || status_layouts_seen(status_lookup) > 1) {
+      mexPrintf("Status segments by layout :\n");
+      for (int s = 0; s < STATUS_SCHEMA_COUNT; s++) {
+        if (status_lookup.counts[s] != 0) {
+          mexPrintf("    %s : %llu\n", status_schemas[s].name, (unsigned long long)status_lookup.counts[s]);
+        }
+      }
+      mexPrintf("    unknown, left out : %llu\n", (unsigned long long)status_lookup.unknown);
+    }
+
+    if (clock.pulses != 0) {
+      mexPrintf("Clock model from %llu time pulses, drift %.3f ppm, %llu GPS time steps, %llu power cycles\n",
+                (unsigned long long)clock.pulses, clock.drift * 1.0e6, (unsigned long long)clock.steps,
+                (unsigned long long)clock.restarts);
+    }
+
+    if (options.overview) {
+      int overview_result = 0;
+      for (size_t i = 0; i < overview_streams.size(); i++) {
+        overview_result |= overview_close(*overview_streams[i]);
+      }
+      overview_result |= overview_write_index(overview_streams, "overview.csv");
+      if (overview_result != 0) {
+        mexPrintf("Writing the overview files failed\n");
+      }
+    }
+
+    if (feature_output) {
+      if (feature_close(features) != 0) {
+        mexPrintf("Writing the feature files failed\n");
+      }
+      else {
+        mexPrintf("Wrote %llu feature frames\n", (unsigned long long)features.frames);
+      }
+    }
+
+    if (event_output) {
+      if (event_close(events) != 0) {
+        mexPrintf("Writing events.csv failed\n");
+      }
+      else {
+        mexPrintf("Found %llu acoustic events\n", (unsigned long long)events.events);
+      }
+    }
+
+    if (track_output) {
+      if (track_close(track) != 0) {
+        mexPrintf("Writing the track files failed\n");
+      }
+      else {
+        mexPrintf("Wrote %llu track points, %llu fixes left out\n", (unsigned long long)track.points,
+                  (unsigned long long)track.rejected);
+      }
+    }
+
+    if (merge_output) {
+      if (merge_close(merger) != 0) {
+        mexPrintf("Writing merged.bin failed\n");
+      }
+      else {
+        mexPrintf("Merged %llu records\n", (unsigned long long)merger.records);
+      }
+    }
+
+    if (fusion_output) {
+      if (fusion_close(fusion) != 0) {
+        mexPrintf("Writing orientation.bin failed\n");
+      }
+      else {
+        mexPrintf("Wrote %llu orientation rows\n", (unsigned long long)fusion.rows);
+      }
+    }
+
+    for (int i = 0; i < 3; i++) {
+      if (imu_units_active[i] && imu_units_close(imu_units[i]) != 0) {
+        mexPrintf("Write to %s failed\n", imu_units[i].filename.c_str());
+      }
+    }
+
+    //The last input samples are still in the resampler's filter.
+    if (resample_output && (wav_output || flac_output)) {
+      for (int c = 0; c < rate_converter.channels; c++) {
+        vector<int16_t> tail;
+        resample_finish(rate_converter, c, tail);
+        add_audio_channel(wav_output ? &wav : NULL, flac_output ? &flac : NULL, c, tail.data(), tail.size());
+      }
+    }
+
+    if (wav_output) {
+      if (wav_close(wav) != 0) {
+        mexPrintf("Write to %s failed\n", options.wav.c_str());
+      }
+      else {
+        mexPrintf("Wrote %llu frames to %s\n", (unsigned long long)wav.frames, options.wav.c_str());
+      }
+    }
+
+    if (flac_output) {
+      if (flac_close(flac) != 0) {
+        mexPrintf("Write to %s failed\n", options.flac.c_str());
+      }
+      else {
+        mexPrintf("Wrote %llu frames to %s, %.1f%% of 16 bit PCM\n", (unsigned long long)flac.samples,
+                  options.flac.c_str(),
+                  flac.samples > 0 ? (100.0 * flac.bytes_written) / (flac.samples * flac.channels * 2) : 0.0);
+      }
+    }
+
 
 
 
@@ -1425,6 +2212,18 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
        printf("audio_r is %d MB\n", (audio_r.size() * sizeof(int)) / (1024 * 1024));
        printf("Audio_Time is %d MB\n", (audio_time.size() * sizeof(uint32_t) * 6) / (1024 * 1024));
 
+    //Summary of the corruption report. Details are in block_errors.csv.
+    uint32_t total_block_errors = 0;
+    for (int i = BLOCK_OK + 1; i < BLOCK_ERR_COUNT; i++) {
+      total_block_errors = total_block_errors + block_error_counts[i];
+    }
+    mexPrintf("Blocks dropped as corrupt : %u\n", total_block_errors);
+    for (int i = BLOCK_OK + 1; i < BLOCK_ERR_COUNT; i++) {
+      if (block_error_counts[i] != 0) {
+        mexPrintf("    %s : %u\n", block_error_names[i], block_error_counts[i]);
+      }
+    }
+
     cout << "Finished Processing File" << std::endl;
 
 
@@ -1432,6 +2231,17 @@ int write_out_struct_binary(const std::string&, int32_t*, std::vector<const std:
 
     std::cout << "Time difference = " << std::chrono::duration_cast<std::chrono::seconds> (end - begin).count() << std::endl;
     mexPrintf("Total Time difference = %d\n",std::chrono::duration_cast<std::chrono::seconds> (end - begin).count());
+
+    //Per stage timings for comparing parser versions.
+    perf.bytes = perf.read.bytes;
+    if (perf_write_json(perf, "perf_report.json", filename) != 0) {
+      mexPrintf("Could not write perf_report.json\n");
+    }
+    double parse_seconds = std::chrono::duration<double>(end - begin).count();
+    if (parse_seconds > 0) {
+      mexPrintf("Parsed %.0f blocks/s, %.1f MB/s\n", perf.blocks / parse_seconds,
+                (perf.bytes / (1024.0 * 1024.0)) / parse_seconds);
+    }
     //mexPrintf("Matlab Copy difference = %d\n",std::chrono::duration_cast<std::chrono::seconds> (end - start_matlab_copy).count());
 
 
@@ -1528,134 +2338,774 @@ return cur_time_seconds;
   }
 
 
-  //Bback annotate all samples with ms and ns they occured at
-  //using the status packets latest time marks. 
+  //Back annotate all samples with the ms and ns they occured at using the
+  //status packets' latest time marks, and give each its GPS time from the
+  //clock model in the same pass.
+  //
+  //The samples after one mark up to the next are stamped with the time of
+  //the sample after them. The last takes that time and each one before it
+  //a sample period less, so a run is evenly spaced and gets its GPS times
+  //a pulse at a time. Samples outside a run keep their stamps and are
+  //looked up one by one. A run is cut where it crosses a power cycle.
+  //
+  //Each sample is looked up in the power cycle segment of the status
+  //packet that stamped it, the last one before it, or that of the samples
+  //ahead of the chunk's first status packet. A run takes the segment of
+  //the sample after it, whose time it was stamped back from.
+  uint64_t sample_segment(const vector<int>& update_marks, const vector<uint64_t>& status_segments,
+                          uint64_t chunk_segment, size_t sample)
+  {
+    size_t marks = std::lower_bound(update_marks.begin(), update_marks.end(), (int)sample) - update_marks.begin();
+    return (marks == 0) ? chunk_segment : status_segments[marks - 1];
+  }
 
 
+  void annotate_stamped(vector<gps_time>& reset_time, clock_model& clock, const vector<int>& update_marks,
+                        const vector<uint64_t>& status_segments, uint64_t chunk_segment, size_t begin, size_t end)
+  {
+    const size_t stride = sizeof(gps_time) / sizeof(uint32_t);
+
+    for (size_t j = begin; j < end; j++) {
+      clock_annotate_run(clock, sample_segment(update_marks, status_segments, chunk_segment, j),
+                         clock_ns(reset_time[j].week_num, reset_time[j].milli_num, reset_time[j].nano_num), 0, 1,
+                         &reset_time[j].gps_week_num, &reset_time[j].gps_milli_num, &reset_time[j].gps_nano_num, stride);
+    }
+  }
 
-  //Search through the time mark segments and calculate a time offset for
-  //a given chunk of samples. 
 
+  int back_annotate(vector<gps_time>& reset_time, clock_model& clock, vector<int>& update_marks,
+                    vector<uint64_t>& status_segments, uint64_t chunk_segment, int sample_rate_ms, int sample_rate_ns)
+  {
+    const int64_t period_ns = (int64_t)sample_rate_ms * 1000000LL + sample_rate_ns;
+    const size_t stride = sizeof(gps_time) / sizeof(uint32_t);
+    const size_t samples = reset_time.size();
+
+    //First sample not given its GPS time yet.
+    size_t next = 0;
+
+    clock_rewind(clock);
+
+    for (size_t i = 0; i + 1 < update_marks.size(); i++)
+    {
+      size_t begin = std::max((size_t)update_marks[i] + 1, next);
+      size_t end = update_marks[i + 1];
+      if (end < begin || end + 1 >= samples) {
+        continue;
+      }
+
+      int64_t anchor = clock_ns(reset_time[end + 1].week_num, reset_time[end + 1].milli_num, reset_time[end + 1].nano_num);
+      int64_t first = anchor - (int64_t)(end - begin) * period_ns;
+      uint64_t run_segment = sample_segment(update_marks, status_segments, chunk_segment, end + 1);
+      uint64_t stamp_segment = sample_segment(update_marks, status_segments, chunk_segment, begin);
+
+      annotate_stamped(reset_time, clock, update_marks, status_segments, chunk_segment, next, begin);
+
+      //A run over a power cycle. The reset time starts again from zero, so
+      //the samples stamped back to before zero are still in the cycle
+      //before and carry on from the time their status packet stamped.
+      size_t cut = begin;
+      if (run_segment != stamp_segment && first < 0 && period_ns > 0) {
+        cut = begin + std::min(end - begin + 1, (size_t)((period_ns - 1 - first) / period_ns));
+        int64_t stamp = clock_ns(reset_time[begin].week_num, reset_time[begin].milli_num, reset_time[begin].nano_num);
+
+        for (size_t j = begin; j < cut; j++) {
+          clock_split(stamp + (int64_t)(j - begin + 1) * period_ns,
+                      reset_time[j].week_num, reset_time[j].milli_num, reset_time[j].nano_num);
+        }
+        clock_annotate_run(clock, stamp_segment, stamp + period_ns, period_ns, cut - begin,
+                           &reset_time[begin].gps_week_num, &reset_time[begin].gps_milli_num, &reset_time[begin].gps_nano_num, stride);
+      }
+
+      for (size_t j = cut; j <= end; j++) {
+        clock_split(first + (int64_t)(j - begin) * period_ns,
+                    reset_time[j].week_num, reset_time[j].milli_num, reset_time[j].nano_num);
+      }
+      if (cut <= end) {
+        clock_annotate_run(clock, run_segment, first + (int64_t)(cut - begin) * period_ns, period_ns, end - cut + 1,
+                           &reset_time[cut].gps_week_num, &reset_time[cut].gps_milli_num, &reset_time[cut].gps_nano_num, stride);
+      }
+      next = end + 1;
+    }
+    annotate_stamped(reset_time, clock, update_marks, status_segments, chunk_segment, next, samples);
 
+    return 1;
+  }
 
 
 
-  int back_annotate(vector<gps_time>& reset_time, vector<tim_tp_packet>& tim_tp_packets, vector<int>& update_marks, int sample_rate_ms, int sample_rate_ns)
+  //Options are checked by name. Unknown names stop the run so a typo
+  //does not silently parse the whole card.
+  int parse_option(const mxArray* name_array, const mxArray* value_array, parse_options& options)
   {
-    int begin = 0;
-    int end = 0;
-    int resume = 0;
-    int64_t ms_count = 0;
-    int64_t ns_count = 0;
+    if (!mxIsChar(name_array)) {
+      mexPrintf("Option names must be strings\n");
+      return 1;
+    }
 
-    int offset_ms;
-    int offset_week;
-    int offset_ns;
-    int gps_reset_time;
-    int result;
+    std::string name(mxArrayToString(name_array));
 
-    vector<int> packet_number;
-    vector<int> packet_offset;
+    if (name == "verify") {
+      options.verify = int(mxGetScalar(value_array));
+    }
+    else if (name == "threads") {
+      options.threads = int(mxGetScalar(value_array));
+    }
+    else if (name == "streams") {
+      if (!mxIsChar(value_array)) {
+        mexPrintf("streams must be a string such as 'gps,status,imu'\n");
+        return 1;
+      }
+      return parse_stream_list(std::string(mxArrayToString(value_array)), options.streams);
+    }
+    else if (name == "wav") {
+      if (!mxIsChar(value_array)) {
+        mexPrintf("wav must be a filename\n");
+        return 1;
+      }
+      options.wav = std::string(mxArrayToString(value_array));
+    }
+    else if (name == "reorder") {
+      if (!mxIsChar(value_array)) {
+        mexPrintf("reorder must be a filename\n");
+        return 1;
+      }
+      options.reorder = std::string(mxArrayToString(value_array));
+    }
+    else if (name == "dumps") {
+      if (!mxIsChar(value_array)) {
+        mexPrintf("dumps must be a comma separated list of filenames\n");
+        return 1;
+      }
+      std::string list(mxArrayToString(value_array));
+      size_t start = 0;
+      while (start <= list.size()) {
+        size_t comma = list.find(',', start);
+        if (comma == std::string::npos) {
+          comma = list.size();
+        }
+        if (comma > start) {
+          options.dumps.push_back(list.substr(start, comma - start));
+        }
+        start = comma + 1;
+      }
+    }
+    else if (name == "flac") {
+      if (!mxIsChar(value_array)) {
+        mexPrintf("flac must be a filename\n");
+        return 1;
+      }
+      options.flac = std::string(mxArrayToString(value_array));
+    }
+    else if (name == "overview") {
+      options.overview = int(mxGetScalar(value_array));
+    }
+    else if (name == "features") {
+      options.features = int(mxGetScalar(value_array));
+    }
+    else if (name == "events") {
+      options.events = int(mxGetScalar(value_array));
+    }
+    else if (name == "event_db") {
+      options.event_db = mxGetScalar(value_array);
+    }
+    else if (name == "event_clips") {
+      options.event_clips = int(mxGetScalar(value_array));
+    }
+    else if (name == "imu_units") {
+      options.imu_units = int(mxGetScalar(value_array));
+    }
+    else if (name == "imu_mif") {
+      if (!mxIsChar(value_array)) {
+        mexPrintf("imu_mif must be a filename\n");
+        return 1;
+      }
+      options.imu_mif = std::string(mxArrayToString(value_array));
+    }
+    else if (name == "imu_offsets") {
+      if (!mxIsDouble(value_array) || mxGetNumberOfElements(value_array) != 9) {
+        mexPrintf("imu_offsets must be a 3 x 3 matrix\n");
+        return 1;
+      }
+      //Matlab matrices are column major.
+      const double* offsets = mxGetPr(value_array);
+      for (int s = 0; s < 3; s++) {
+        for (int a = 0; a < 3; a++) {
+          options.imu_offsets[s][a] = offsets[s + a * 3];
+        }
+      }
+    }
+    else if (name == "fusion") {
+      options.fusion = int(mxGetScalar(value_array));
+    }
+    else if (name == "fusion_beta") {
+      options.fusion_beta = mxGetScalar(value_array);
+    }
+    else if (name == "merge") {
+      options.merge = int(mxGetScalar(value_array));
+    }
+    else if (name == "merge_window") {
+      options.merge_window = int(mxGetScalar(value_array));
+    }
+    else if (name == "track") {
+      options.track = int(mxGetScalar(value_array));
+    }
+    else if (name == "track_fix") {
+      options.track_fix = int(mxGetScalar(value_array));
+    }
+    else if (name == "track_pacc") {
+      options.track_pacc = mxGetScalar(value_array);
+    }
+    else if (name == "resample") {
+      options.resample = int(mxGetScalar(value_array));
+    }
+    else if (name == "wav_dc") {
+      options.wav_dc = int(mxGetScalar(value_array));
+    }
+    else if (name == "wav_normalize") {
+      options.wav_normalize = int(mxGetScalar(value_array));
+    }
+    else {
+      mexPrintf("Unknown option %s\n", name.c_str());
+      return 1;
+    }
 
-    int debug;
+    return 0;
+  }
 
-    for (int i = 0; i < (update_marks.size() - 1); i++)
-    {
 
-      //Begin update. 
-      begin = (update_marks)[i];
-      //if (begin == 0)
-      //{}
-      //else
-      //{ begin = begin + 1; }
-      end = (update_marks)[i + 1];
-
-      ms_count = (reset_time)[end + 1].milli_num;
-      ns_count = (reset_time)[end + 1].nano_num;
-      for (int j = end; j > begin; j--)
-      {
-        //Subtract nanoseconds and check for rollover of millisecond.
+  //Read a comma separated list of stream names into stream flags.
+  int parse_stream_list(const std::string& list, int& streams)
+  {
+    size_t begin = 0;
 
-        (reset_time)[j].milli_num = ms_count;
-        (reset_time)[j].nano_num = ns_count;
+    streams = 0;
+    while (begin <= list.size()) {
+      size_t end = list.find(',', begin);
+      if (end == std::string::npos) {
+        end = list.size();
+      }
+      std::string name = list.substr(begin, end - begin);
+      begin = end + 1;
 
+      if (name == "status") {
+        streams = streams | STREAM_STATUS;
+      }
+      else if (name == "gps") {
+        streams = streams | STREAM_GPS;
+      }
+      else if (name == "gyro") {
+        streams = streams | STREAM_GYRO;
+      }
+      else if (name == "accel" || name == "xl") {
+        streams = streams | STREAM_ACCEL;
+      }
+      else if (name == "mag") {
+        streams = streams | STREAM_MAG;
+      }
+      else if (name == "imu") {
+        streams = streams | STREAM_IMU;
+      }
+      else if (name == "audio") {
+        streams = streams | STREAM_AUDIO;
+      }
+      else if (name == "all") {
+        streams = streams | STREAM_ALL;
+      }
+      else if (!name.empty()) {
+        mexPrintf("Unknown stream %s\n", name.c_str());
+        return 1;
+      }
+    }
+
+    if (streams == 0) {
+      mexPrintf("No streams selected\n");
+      return 1;
+    }
+    return 0;
+  }
+
+
+  //Status and time pulse segments carry the times every sample stream is
+  //back annotated from so they are always read.
+  int stream_selected(int segment_type, int streams)
+  {
+    switch (segment_type) {
+    case BLOCK_SEG_GPS_TIME_MARK:
+    case BLOCK_SEG_GPS_POSITION:
+      return (streams & STREAM_GPS) != 0;
+    case BLOCK_SEG_IMU_GYRO:
+      return (streams & STREAM_GYRO) != 0;
+    case BLOCK_SEG_IMU_ACCEL:
+      return (streams & STREAM_ACCEL) != 0;
+    case BLOCK_SEG_IMU_MAG:
+      return (streams & STREAM_MAG) != 0;
+    case BLOCK_SEG_AUDIO:
+      return (streams & STREAM_AUDIO) != 0;
+    }
+    return 1;
+  }
+
+
+  //Check one range of blocks. Runs on its own thread with its own file
+  //handle and buffer. Nothing in here may call back into MATLAB.
+  void verify_range_worker(const std::string& filename, verify_range* range)
+  {
+    //Read 4MB at a time. Enough to keep the disk streaming.
+    const uint64_t chunk_blocks = 8192;
+
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    vector<unsigned char> contents;
+    status_registry status_lookup;
+
+    status_registry_init(status_lookup);
+    if (!in) {
+      range->failed = 1;
+      return;
+    }
+
+    vector<int> packet_start_locations;
+    vector<int> packet_lengths;
+    vector<int> packet_types;
+    int error_offset;
+    int block_reason;
+    block_error cur_error;
+
+    for (uint64_t block = range->first_block; block < range->end_block; block = block + chunk_blocks) {
+
+      uint64_t blocks = std::min(chunk_blocks, range->end_block - block);
+      contents.resize(blocks * BLOCK_SIZE);
+      in.seekg(block * BLOCK_SIZE);
+      in.read(reinterpret_cast<char*>(&contents[0]), contents.size());
+      if ((uint64_t)in.gcount() != contents.size()) {
+        range->failed = 1;
+        break;
+      }
+
+      for (uint64_t b = 0; b < blocks; b++) {
 
-        ms_count = ms_count - sample_rate_ms;
-        ns_count = ns_count - sample_rate_ns;
+        int block_start = int(b * BLOCK_SIZE);
+        uint32_t sequence = load_u32(&contents[block_start]);
 
-        if (ns_count < 0)
-        {
-          ms_count = ms_count - 1;
-          ns_count = int(1E6) - abs(ns_count);
+        if (block_unwritten(sequence)) {
+          range->blocks_unwritten++;
+          continue;
         }
+        range->blocks_written++;
 
-                ////Adjust the ns count depending on ms rollover.
+        cur_error.block_number = uint32_t(block + b);
+        cur_error.sequence = sequence;
+        cur_error.offset = 0;
 
-                //result = ns_count - offset_ns;
+        //Blocks are written with consecutive sequence numbers.
+        if (range->has_sequence && sequence != range->last_sequence + 1) {
+          cur_error.reason = BLOCK_ERR_SEQUENCE;
+          range->errors.push_back(cur_error);
+        }
+        if (!range->has_sequence) {
+          range->has_sequence = 1;
+          range->first_sequence = sequence;
+          range->first_sequence_block = cur_error.block_number;
+        }
+        range->last_sequence = sequence;
 
-                //  if (result >= 0 ){
+        packet_start_locations.clear();
+        packet_lengths.clear();
+        packet_types.clear();
 
-                //    (reset_time)[j].gps_nano_num = result;
-                //  }
-                //  else{
-                //    (reset_time)[j].gps_milli_num = (reset_time)[j].gps_milli_num - 1;
+        block_reason = walk_block(&contents[0], block_start, packet_start_locations, packet_lengths, packet_types, error_offset);
 
-                //   (reset_time)[j].gps_nano_num = int(1E6) - abs(result);
+        if (block_reason != BLOCK_OK) {
+          cur_error.reason = block_reason;
+          cur_error.offset = error_offset;
+          range->errors.push_back(cur_error);
+          continue;
+        }
 
+        //Segments come back last to first.
+        for (int i = int(packet_types.size()) - 1; i >= 0; i--) {
 
-                //  }
+          range->segment_counts[packet_types[i] & (BLOCK_SEG_TYPES - 1)]++;
+          range->segment_bytes[packet_types[i] & (BLOCK_SEG_TYPES - 1)] += packet_lengths[i];
 
-              }
+          if (packet_types[i] == BLOCK_SEG_AUDIO) {
+            count_audio_segment(packet_lengths[i], range->num_mics, range->audio_first_samples, range->audio_second_samples);
+          }
 
-            packet_number.push_back(end-begin);
-            packet_offset.push_back((reset_time)[begin+1].milli_num - (reset_time)[begin].milli_num);
+          if (packet_types[i] == BLOCK_SEG_STATUS) {
 
-            debug = (reset_time)[begin + 1].milli_num - (reset_time)[begin].milli_num;
+            //Same lookup as the decode so the counts agree.
+            const status_schema* schema = status_find(status_lookup, &contents[packet_start_locations[i]], packet_lengths[i]);
+            if (schema == NULL) {
+              range->status_unknown++;
+              continue;
+            }
 
+            uint64_t status_time = load_gps_word(&contents[packet_start_locations[i] + schema->fpga_time]);
+            gps_time status_gps_time = populate_gps_time(status_time);
+
+            //Fields must be in range and time must not run backwards.
+            //Raw times compare in order since week, ms and ns are packed
+            //from the top down.
+            if (status_gps_time.milli_num >= 604800000 ||
+                status_gps_time.nano_num >= 1000000 ||
+                (range->has_status && status_time < range->last_status_time)) {
+              cur_error.reason = BLOCK_ERR_STATUS_TIME;
+              cur_error.offset = packet_start_locations[i] - block_start;
+              range->errors.push_back(cur_error);
+            }
 
+            if (!range->has_status) {
+              range->has_status = 1;
+              range->first_status_time = status_time;
+              range->first_status_block = cur_error.block_number;
+              range->first_status_sequence = sequence;
+            }
+            range->last_status_time = status_time;
           }
+        }
+      }
+    }
 
+    in.close();
+  }
 
-    if (tim_tp_packets.size() != 0)
-    { 
-    //Now update all absolute//gps times.
-    int k = 0;
-    offset_ms = (tim_tp_packets)[k].gps_time_ms - (tim_tp_packets)[k].reset_time_ms;
-    offset_week = (tim_tp_packets)[k].gps_time_week - (tim_tp_packets)[k].reset_time_week;
-    offset_ns = 0;
 
+  //Split the image into one contiguous range per thread. Each thread
+  //walks its own blocks, then the range edges are checked in order so
+  //the report comes out sorted by block number.
+  //Returns 0, or -1 if any range could not be read in full.
+  int verify_image(const std::string& filename, uint64_t file_length, int threads, int num_mics, vector<block_error>& errors, verify_range& totals)
+  {
+    uint64_t total_blocks = file_length / BLOCK_SIZE;
 
-    for (int j = 0; j < reset_time.size(); j++)
-    {
+    if (threads <= 0) {
+      threads = int(std::thread::hardware_concurrency());
+    }
+    if (threads <= 0) {
+      threads = 1;
+    }
+    if (uint64_t(threads) > total_blocks) {
+      threads = (total_blocks == 0) ? 1 : int(total_blocks);
+    }
 
-      int test = (tim_tp_packets)[k + 1].reset_time_ms;
-      int test_2 = (reset_time)[j].milli_num;
+    vector<verify_range> ranges(threads);
+    vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+      verify_range& range = ranges[t];
+      range.first_block = (total_blocks * t) / threads;
+      range.end_block = (total_blocks * (t + 1)) / threads;
+      range.blocks_written = 0;
+      range.blocks_unwritten = 0;
+      std::fill(range.segment_counts, range.segment_counts + BLOCK_SEG_TYPES, 0);
+      std::fill(range.segment_bytes, range.segment_bytes + BLOCK_SEG_TYPES, 0);
+      range.num_mics = num_mics;
+      range.audio_first_samples = 0;
+      range.audio_second_samples = 0;
+      range.has_sequence = 0;
+      range.has_status = 0;
+      range.last_sequence = 0;
+      range.last_status_time = 0;
+      range.status_unknown = 0;
+      range.failed = 0;
+    }
 
-      if (test < test_2)
-      {
-        if (k < tim_tp_packets.size()-1)
-        {
-          k = k + 1;
+    for (int t = 0; t < threads; t++) {
+      workers.push_back(std::thread(verify_range_worker, std::cref(filename), &ranges[t]));
+    }
+    for (int t = 0; t < threads; t++) {
+      workers[t].join();
+    }
+    for (int t = 0; t < threads; t++) {
+      if (ranges[t].failed) {
+        return -1;
+      }
+    }
+
+    totals.blocks_written = 0;
+    totals.blocks_unwritten = 0;
+    std::fill(totals.segment_counts, totals.segment_counts + BLOCK_SEG_TYPES, 0);
+    std::fill(totals.segment_bytes, totals.segment_bytes + BLOCK_SEG_TYPES, 0);
+    totals.num_mics = num_mics;
+    totals.audio_first_samples = 0;
+    totals.audio_second_samples = 0;
+    totals.status_unknown = 0;
+
+    int have_sequence = 0;
+    uint32_t last_sequence = 0;
+    int have_status = 0;
+    uint64_t last_status_time = 0;
+    block_error cur_error;
+
+    for (int t = 0; t < threads; t++) {
+      verify_range& range = ranges[t];
+
+      //Check where this range picks up from the one before it.
+      if (range.has_sequence) {
+        if (have_sequence && range.first_sequence != last_sequence + 1) {
+          cur_error.block_number = range.first_sequence_block;
+          cur_error.sequence = range.first_sequence;
+          cur_error.reason = BLOCK_ERR_SEQUENCE;
+          cur_error.offset = 0;
+          errors.push_back(cur_error);
+        }
+        have_sequence = 1;
+        last_sequence = range.last_sequence;
+      }
+
+      if (range.has_status) {
+        if (have_status && range.first_status_time < last_status_time) {
+          cur_error.block_number = range.first_status_block;
+          cur_error.sequence = range.first_status_sequence;
+          cur_error.reason = BLOCK_ERR_STATUS_TIME;
+          cur_error.offset = 0;
+          errors.push_back(cur_error);
         }
-        offset_ms = (tim_tp_packets)[k].gps_time_ms - (tim_tp_packets)[k].reset_time_ms;
-        offset_week = (tim_tp_packets)[k].gps_time_week - (tim_tp_packets)[k].reset_time_week;
+        have_status = 1;
+        last_status_time = range.last_status_time;
+      }
+
+      errors.insert(errors.end(), range.errors.begin(), range.errors.end());
 
+      totals.blocks_written = totals.blocks_written + range.blocks_written;
+      totals.blocks_unwritten = totals.blocks_unwritten + range.blocks_unwritten;
+      for (int i = 0; i < BLOCK_SEG_TYPES; i++) {
+        totals.segment_counts[i] = totals.segment_counts[i] + range.segment_counts[i];
+        totals.segment_bytes[i] = totals.segment_bytes[i] + range.segment_bytes[i];
       }
+      totals.audio_first_samples = totals.audio_first_samples + range.audio_first_samples;
+      totals.audio_second_samples = totals.audio_second_samples + range.audio_second_samples;
+      totals.status_unknown = totals.status_unknown + range.status_unknown;
+    }
 
+    //A partial block at the end of the image.
+    if ((file_length % BLOCK_SIZE) != 0) {
+      cur_error.block_number = uint32_t(total_blocks);
+      cur_error.sequence = 0;
+      cur_error.reason = BLOCK_ERR_TRUNCATED;
+      cur_error.offset = 0;
+      errors.push_back(cur_error);
+    }
 
-      (reset_time)[j].gps_week_num = (reset_time)[j].week_num + offset_week;
-      (reset_time)[j].gps_milli_num = (reset_time)[j].milli_num + offset_ms;
-      (reset_time)[j].gps_nano_num = (reset_time)[j].nano_num + offset_ns;
+    return 0;
+  }
 
 
+  //Create every output asked for at the size found by the counting pass.
+  //Outputs past nlhs are left NULL in out and skipped by the decode.
+  //Deselected streams are created with no rows.
+  int create_outputs(int nlhs, mxArray** plhs, const verify_range& counts, uint64_t blocks,
+                     int streams, vector<packet_column>* packet_columns[], mex_outputs& out)
+  {
+    const int imu_streams[3] = { STREAM_GYRO, STREAM_ACCEL, STREAM_MAG };
+    const int packet_streams[OUT_PACKET_TYPES] = { STREAM_STATUS, STREAM_GPS, STREAM_GPS, STREAM_GPS };
+    const int time_streams[OUT_TIME_ARRAYS] = { STREAM_GYRO, STREAM_ACCEL, STREAM_MAG,
+      STREAM_STATUS, STREAM_STATUS, STREAM_AUDIO
+    };
+
+    const int imu_types[3] = { BLOCK_SEG_IMU_GYRO, BLOCK_SEG_IMU_ACCEL, BLOCK_SEG_IMU_MAG };
+    const int packet_types[OUT_PACKET_TYPES] = { BLOCK_SEG_STATUS,
+      BLOCK_SEG_GPS_TIME_MARK,
+      BLOCK_SEG_GPS_POSITION,
+      BLOCK_SEG_GPS_TIME_PULSE
+    };
+
+    out.audio_l = NULL;
+    out.audio_r = NULL;
+    out.sequence = NULL;
+    out.audio_l_rows = (streams & STREAM_AUDIO) ? counts.audio_second_samples : 0;
+    out.audio_r_rows = (streams & STREAM_AUDIO) ? counts.audio_first_samples : 0;
+    out.sequence_rows = blocks;
+    out.audio_l_count = 0;
+    out.audio_r_count = 0;
+    out.sequence_count = 0;
+
+    if (nlhs > OUT_AUDIO_L) {
+      plhs[OUT_AUDIO_L] = mxCreateUninitNumericMatrix((size_t)out.audio_l_rows, 1, mxINT16_CLASS, mxREAL);
+      out.audio_l = (int16_t*)mxGetData(plhs[OUT_AUDIO_L]);
     }
+    if (nlhs > OUT_AUDIO_R) {
+      plhs[OUT_AUDIO_R] = mxCreateUninitNumericMatrix((size_t)out.audio_r_rows, 1, mxINT16_CLASS, mxREAL);
+      out.audio_r = (int16_t*)mxGetData(plhs[OUT_AUDIO_R]);
+    }
+    if (nlhs > OUT_SEGMENTS) {
+      plhs[OUT_SEGMENTS] = mxCreateUninitNumericMatrix((size_t)out.sequence_rows, 1, mxUINT32_CLASS, mxREAL);
+      out.sequence = (uint32_t*)mxGetData(plhs[OUT_SEGMENTS]);
     }
 
+    //Three words to a sample, a trailing partial sample gets its own row.
+    for (int i = 0; i < 3; i++) {
+      uint64_t words = counts.segment_bytes[imu_types[i]] / IMU_AXIS_WORD_LENGTH_BYTES;
+      out.imu[i] = NULL;
+      out.imu_rows[i] = (streams & imu_streams[i]) ? (words + 2) / 3 : 0;
+      out.imu_words[i] = 0;
+      if (nlhs > OUT_GYRO + i) {
+        plhs[OUT_GYRO + i] = mxCreateUninitNumericMatrix((size_t)out.imu_rows[i], 3, mxINT16_CLASS, mxREAL);
+        out.imu[i] = (int16_t*)mxGetData(plhs[OUT_GYRO + i]);
+      }
+    }
 
+    //Status segments of no known layout are not decoded.
+    uint64_t status_rows = counts.segment_counts[(int)BLOCK_SEG_STATUS] - counts.status_unknown;
+
+    for (int i = 0; i < OUT_PACKET_TYPES; i++) {
+      out.packets[i] = NULL;
+      uint64_t rows = (packet_types[i] == BLOCK_SEG_STATUS) ? status_rows : counts.segment_counts[packet_types[i]];
+      out.packet_rows[i] = (streams & packet_streams[i]) ? rows : 0;
+      out.packet_count[i] = 0;
+      if (nlhs > OUT_STATUS + i) {
+        out.packets[i] = create_column_struct(*packet_columns[i], out.packet_rows[i]);
+        plhs[OUT_STATUS + i] = out.packets[i];
+      }
+    }
 
-    return 1;
+    //One time per IMU segment, per status segment or per audio sample.
+    out.time_rows[0] = counts.segment_counts[(int)BLOCK_SEG_IMU_GYRO];
+    out.time_rows[1] = counts.segment_counts[(int)BLOCK_SEG_IMU_ACCEL];
+    out.time_rows[2] = counts.segment_counts[(int)BLOCK_SEG_IMU_MAG];
+    out.time_rows[3] = status_rows;
+    out.time_rows[4] = status_rows;
+    out.time_rows[5] = counts.audio_first_samples;
+
+    for (int i = 0; i < OUT_TIME_ARRAYS; i++) {
+      if ((streams & time_streams[i]) == 0) {
+        out.time_rows[i] = 0;
+      }
+      out.times[i] = NULL;
+      out.time_count[i] = 0;
+      if (nlhs > OUT_GYRO_I + i) {
+        plhs[OUT_GYRO_I + i] = mxCreateUninitNumericMatrix((size_t)out.time_rows[i], 6, mxUINT32_CLASS, mxREAL);
+        out.times[i] = (uint32_t*)mxGetData(plhs[OUT_GYRO_I + i]);
+      }
+    }
+
+    return 0;
+  }
+
+
+  //A 1x1 struct with one rows x 1 column per field, each of its own type.
+  mxArray* create_column_struct(vector<packet_column>& columns, uint64_t rows)
+  {
+    vector<const char*> field_names;
+
+    for (size_t j = 0; j < columns.size(); j++) {
+      field_names.push_back(columns[j].name);
+    }
+
+    mxArray* result = mxCreateStructMatrix(1, 1, (int)field_names.size(), &field_names[0]);
+
+    for (size_t j = 0; j < columns.size(); j++) {
+      mxSetFieldByNumber(result, 0, (int)j,
+                         mxCreateUninitNumericMatrix((size_t)rows, 1, column_class_id(columns[j].type), mxREAL));
+    }
+    return result;
+  }
+
+
+  mxClassID column_class_id(int type)
+  {
+    switch (type) {
+    case COLUMN_UINT8:   return mxUINT8_CLASS;
+    case COLUMN_INT16:   return mxINT16_CLASS;
+    case COLUMN_UINT16:  return mxUINT16_CLASS;
+    case COLUMN_INT32:   return mxINT32_CLASS;
+    case COLUMN_UINT32:  return mxUINT32_CLASS;
     }
+    return mxUINT64_CLASS;
+  }
+
 
+  //Append length rows of each column to the struct starting at row count.
+  void copy_out_columns(mxArray* out, vector<packet_column>& columns, size_t length,
+                        uint64_t rows, uint64_t& count)
+  {
+    if (out != NULL && count < rows) {
+      size_t copy_rows = (size_t)std::min<uint64_t>(length, rows - count);
+      for (size_t j = 0; j < columns.size(); j++) {
+        int bytes = column_type_bytes(columns[j].type);
+        char* column = (char*)mxGetData(mxGetFieldByNumber(out, 0, (int)j));
+        if (copy_rows != 0) {
+          memcpy(column + count * bytes, columns[j].data, copy_rows * bytes);
+        }
+      }
+    }
+    count = count + length;
+  }
+
+
+  //Append times to a rows x 6 matrix, column major in gps_time field order.
+  void copy_out_time_columns(vector<gps_time>& times, uint32_t* out, uint64_t rows, uint64_t& count)
+  {
+    if (out != NULL) {
+      for (size_t i = 0; i < times.size() && count + i < rows; i++) {
+        out[0 * rows + count + i] = times[i].week_num;
+        out[1 * rows + count + i] = times[i].milli_num;
+        out[2 * rows + count + i] = times[i].nano_num;
+        out[3 * rows + count + i] = times[i].gps_week_num;
+        out[4 * rows + count + i] = times[i].gps_milli_num;
+        out[5 * rows + count + i] = times[i].gps_nano_num;
+      }
+    }
+    count = count + times.size();
+  }
+
+
+  //Zero the tail of anything the parse filled less of than counted.
+  //That only happens if the image changed between the two passes.
+  void finish_outputs(mex_outputs& out)
+  {
+    int short_outputs = 0;
+
+    if (out.audio_l != NULL && out.audio_l_count < out.audio_l_rows) {
+      std::fill(out.audio_l + out.audio_l_count, out.audio_l + out.audio_l_rows, 0);
+    }
+    if (out.audio_r != NULL && out.audio_r_count < out.audio_r_rows) {
+      std::fill(out.audio_r + out.audio_r_count, out.audio_r + out.audio_r_rows, 0);
+    }
+    if (out.sequence != NULL && out.sequence_count < out.sequence_rows) {
+      std::fill(out.sequence + out.sequence_count, out.sequence + out.sequence_rows, 0);
+    }
+    short_outputs += (out.audio_l_count != out.audio_l_rows);
+    short_outputs += (out.audio_r_count != out.audio_r_rows);
+    short_outputs += (out.sequence_count != out.sequence_rows);
+
+    for (int i = 0; i < 3; i++) {
+      //A partial last sample leaves cells in the last row.
+      if (out.imu[i] != NULL) {
+        for (uint64_t word = out.imu_words[i]; word < out.imu_rows[i] * 3; word++) {
+          out.imu[i][(word % 3) * out.imu_rows[i] + word / 3] = 0;
+        }
+      }
+      short_outputs += ((out.imu_words[i] + 2) / 3 != out.imu_rows[i]);
+    }
+
+    for (int i = 0; i < OUT_PACKET_TYPES; i++) {
+      if (out.packets[i] != NULL && out.packet_count[i] < out.packet_rows[i]) {
+        int fields = mxGetNumberOfFields(out.packets[i]);
+        for (int j = 0; j < fields; j++) {
+          mxArray* column = mxGetFieldByNumber(out.packets[i], 0, j);
+          size_t size = mxGetElementSize(column);
+          memset((char*)mxGetData(column) + out.packet_count[i] * size, 0,
+                 (size_t)(out.packet_rows[i] - out.packet_count[i]) * size);
+        }
+      }
+      short_outputs += (out.packet_count[i] != out.packet_rows[i]);
+    }
+
+    for (int i = 0; i < OUT_TIME_ARRAYS; i++) {
+      if (out.times[i] != NULL && out.time_count[i] < out.time_rows[i]) {
+        for (int j = 0; j < 6; j++) {
+          std::fill(out.times[i] + j * out.time_rows[i] + out.time_count[i],
+                    out.times[i] + (j + 1) * out.time_rows[i], 0);
+        }
+      }
+      short_outputs += (out.time_count[i] != out.time_rows[i]);
+    }
+
+    if (short_outputs != 0) {
+      mexPrintf("Warning: %d outputs did not match the counting pass, the image may have changed\n", short_outputs);
+    }
+  }
 
 
 	int copy_out_uint32(int m, int n, int lfs_num, gps_time* time_ptr, mxArray** plhs)
@@ -1682,6 +3132,7 @@ return cur_time_seconds;
   int write_int_vector_csv(const std::string& input, vector<int>& vector_in, int start_of_parse)
 
   {
+    perf_scope write_timer(sd_perf().writers[input]);
     std::ofstream myfile;
 	myfile.open(input, std::ios::out | std::ios::app);
   if (start_of_parse){
@@ -1691,7 +3142,9 @@ return cur_time_seconds;
     
     for (int k = 0; k < vector_in.size(); k++)
     {
-      myfile << std::to_string(vector_in[k]) << "\n";
+      std::string value = std::to_string(vector_in[k]);
+      myfile << value << "\n";
+      write_timer.bytes = write_timer.bytes + value.size() + 1;
     }
     myfile.close();
 
@@ -1702,6 +3155,7 @@ return cur_time_seconds;
     int write_int_vector_binary(const std::string& input, vector<int>& vector_in)
 
   {
+    perf_scope write_timer(sd_perf().writers[input], vector_in.size() * sizeof(int));
     std::ofstream myfile;
 	myfile.open(input, std::ios::out | std::ios::binary | std::ios::app );
   const char* pointer = 0;
@@ -1718,61 +3172,12 @@ return cur_time_seconds;
   
   
 
-  int write_out_struct_csv(const std::string& input, int32_t* input_vector_of_structures, std::vector<const std::string>&field_names, int length, int field_count, int start_of_parse)
-
-  {
-	  std::ofstream myfile;
-	  myfile.open(input, std::ios::out | std::ios::app);
-	  if (start_of_parse){
-		  for (int k = 0; k < field_count; k++)
-		  {
-			  myfile << field_names[k] << ',';
-		  }
-	  myfile << '\n';
-	}
-
-	int32_t* offset = input_vector_of_structures;
-	for (int i = 0; i<length; i++) {
-		for (int j = 0; j < field_count; j++){
-
-			myfile << std::to_string(*(offset)) << ',';
-			offset++;
-		}
-		myfile << '\n';
-	}
-    myfile.close();
-    return 0;
-  }
-
-  int write_out_struct_csv(const std::string& input, uint64_t* input_vector_of_structures, std::vector<const std::string>&field_names, int length, int field_count, int start_of_parse)
-
-  {
-    std::ofstream myfile;
-	myfile.open(input, std::ios::out | std::ios::app);
-	if (start_of_parse){
-		for (int k = 0; k < field_count; k++)
-		{
-			myfile << field_names[k] << ',';
-		}
-		myfile << '\n';
-	}
 
-	uint64_t* offset = input_vector_of_structures;
-	for (int i = 0; i<length; i++) {
-		for (int j = 0; j < field_count; j++){
-
-			myfile << std::to_string(*(offset)) << ',';
-			offset++;
-		}
-		myfile << '\n';
-	}
-    myfile.close();
-    return 0;
-  }
 
   int write_out_struct_csv(const std::string& input, uint32_t* input_vector_of_structures, std::vector<const std::string>&field_names, int length, int field_count, int start_of_parse)
 
   {
+    perf_scope write_timer(sd_perf().writers[input]);
 	  std::ofstream myfile;
 	  myfile.open(input, std::ios::out | std::ios::app);
 	  if (start_of_parse){
@@ -1787,7 +3192,11 @@ return cur_time_seconds;
 	  for (int i = 0; i<length; i++) {
 		  for (int j = 0; j < field_count; j++){
 
-			  myfile << std::to_string(*(offset)) << ',';
+			  std::string value = std::to_string(*(offset));
+
+			  myfile << value << ',';
+
+			  write_timer.bytes = write_timer.bytes + value.size() + 1;
 			  offset++;
 		  }
 		  myfile << '\n';
@@ -1796,19 +3205,21 @@ return cur_time_seconds;
 	  return 0;
   }
   
-  int write_out_struct_binary(const std::string& input, uint64_t* input_vector_of_structures, std::vector<const std::string>&field_names, int length, int field_count, int start_of_parse)
+  
+  int write_out_struct_binary(const std::string& input, uint32_t* input_vector_of_structures, std::vector<const std::string>&field_names, int length, int field_count, int start_of_parse)
 
   {
+    perf_scope write_timer(sd_perf().writers[input], uint64_t(length) * field_count * sizeof(uint32_t));
     std::ofstream myfile;
 	myfile.open(input, std::ios::out | std::ios::binary | std::ios::app);
   
-	uint64_t* offset = input_vector_of_structures;
+	uint32_t* offset = input_vector_of_structures;
   const char* pointer = 0;
   pointer = reinterpret_cast<const char*>(offset);
 	for (int i = 0; i<length; i++) {
 		for (int j = 0; j < field_count; j++){
 
-      myfile.write(pointer, sizeof(uint64_t));
+      myfile.write(pointer, sizeof(uint32_t));
 			offset++;
       pointer = reinterpret_cast<const char*>(offset);
       
@@ -1818,49 +3229,102 @@ return cur_time_seconds;
     return 0;
   }
   
-  int write_out_struct_binary(const std::string& input, uint32_t* input_vector_of_structures, std::vector<const std::string>&field_names, int length, int field_count, int start_of_parse)
-
+  //One line per packet, fields in list order.
+  int write_columns_csv(const std::string& input, vector<packet_column>& columns, size_t length, int start_of_parse)
   {
+    perf_scope write_timer(sd_perf().writers[input]);
     std::ofstream myfile;
-	myfile.open(input, std::ios::out | std::ios::binary | std::ios::app);
-  
-	uint32_t* offset = input_vector_of_structures;
-  const char* pointer = 0;
-  pointer = reinterpret_cast<const char*>(offset);
-	for (int i = 0; i<length; i++) {
-		for (int j = 0; j < field_count; j++){
+    myfile.open(input, std::ios::out | std::ios::app);
+    if (start_of_parse) {
+      for (size_t k = 0; k < columns.size(); k++) {
+        myfile << columns[k].name << ',';
+      }
+      myfile << '\n';
+    }
 
-      myfile.write(pointer, sizeof(uint32_t));
-			offset++;
-      pointer = reinterpret_cast<const char*>(offset);
-      
-		}
-	}
+    for (size_t i = 0; i < length; i++) {
+      for (size_t j = 0; j < columns.size(); j++) {
+        std::string value = column_string(columns[j], i);
+        myfile << value << ',';
+        write_timer.bytes = write_timer.bytes + value.size() + 1;
+      }
+      myfile << '\n';
+    }
     myfile.close();
     return 0;
   }
-  
-    int write_out_struct_binary(const std::string& input, int32_t* input_vector_of_structures, std::vector<const std::string>&field_names, int length, int field_count, int start_of_parse)
 
+
+  //One row per packet with every field widened to field_bytes, little
+  //endian, the same layout the packet structs were written with.
+  int write_columns_binary(const std::string& input, vector<packet_column>& columns, size_t length, int field_bytes)
   {
-    std::ofstream myfile;
-	myfile.open(input, std::ios::out | std::ios::binary | std::ios::app);
-  
-	int32_t* offset = input_vector_of_structures;
-  const char* pointer = 0;
-  pointer = reinterpret_cast<const char*>(offset);
-	for (int i = 0; i<length; i++) {
-		for (int j = 0; j < field_count; j++){
+    perf_scope write_timer(sd_perf().writers[input], uint64_t(length) * columns.size() * field_bytes);
+    vector<char> buffer(length * columns.size() * field_bytes);
+    char* row = buffer.data();
+
+    for (size_t i = 0; i < length; i++) {
+      for (size_t j = 0; j < columns.size(); j++) {
+        uint64_t bits = column_bits(columns[j], i);
+        memcpy(row, &bits, field_bytes);
+        row = row + field_bytes;
+      }
+    }
 
-      myfile.write(pointer, sizeof(int32_t));
-			offset++;
-      pointer = reinterpret_cast<const char*>(offset);
-      
-		}
-	}
+    std::ofstream myfile;
+    myfile.open(input, std::ios::out | std::ios::binary | std::ios::app);
+    if (!buffer.empty()) {
+      myfile.write(buffer.data(), buffer.size());
+    }
     myfile.close();
     return 0;
   }
+
+
+  //Two microphones go out as left then right, one as a single channel
+  //from audio_r. Either writer may be NULL, and so may the resampler.
+  template <typename T>
+  void add_audio_chunk(wav_writer* wav, flac_writer* flac, resampler* rate_converter, int num_mics_active,
+                       const T* audio_l, size_t l_samples, const T* audio_r, size_t r_samples)
+  {
+    const T* channel_data[2] = { audio_r, NULL };
+    size_t channel_samples[2] = { r_samples, 0 };
+    int channels = 1;
+    vector<int16_t> resampled;
+
+    if (num_mics_active == 2) {
+      channel_data[0] = audio_l;
+      channel_data[1] = audio_r;
+      channel_samples[0] = l_samples;
+      channel_samples[1] = r_samples;
+      channels = 2;
+    }
+
+    for (int c = 0; c < channels; c++) {
+      if (rate_converter != NULL) {
+        resampled.clear();
+        resample_process(*rate_converter, c, channel_data[c], channel_samples[c], resampled);
+        add_audio_channel(wav, flac, c, resampled.data(), resampled.size());
+      }
+      else {
+        add_audio_channel(wav, flac, c, channel_data[c], channel_samples[c]);
+      }
+    }
+  }
+
+
+  template <typename T>
+  void add_audio_channel(wav_writer* wav, flac_writer* flac, int channel, const T* samples, size_t count)
+  {
+    if (wav != NULL) {
+      wav_add_samples(*wav, channel, samples, count);
+    }
+    if (flac != NULL) {
+      flac_add_samples(*flac, channel, samples, count);
+    }
+  }
+
+
   
 
   
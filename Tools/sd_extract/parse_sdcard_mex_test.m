@@ -10,6 +10,11 @@
 file = 'monkey_collar'
 file_mat = [file '.mat']
 filename = ['E:\User\Globus\monkey_master\monkey_2_trial_2\dump\' file '.bin']
+
+%Field dumps can't be shared. Without one, make a synthetic image with
+%sd_image_gen (see sd_image_gen.cpp) and parse that instead.
+%   sd_image_gen synthetic_collar.bin --mb 300
+% filename = 'synthetic_collar.bin'
 if exist(filename, 'file')
 length_mB = 300;
 length_blocks = (length_mB*1024*1024)/ ( 512);
@@ -19,6 +24,70 @@ csv = 0;
 % [audio_l,audio_r,segments,gyro,xl,mag,status_p,tm_p,nav_p,tp_p,gyro_i,xl_i,mag_i,gyro_timemarks,status_p_timemarks,aud_i] ... 
 %     = parse_sdcard_mex_p_mem(filename,length_blocks);
 
+%With outputs nothing but block_errors.csv is written. Audio comes back
+%int16, gyro/xl/mag as N x 3 int16 (ZYX as stored) and the packets as
+%structs of columns, e.g. status_p.status_t(k).
+% [audio_l,audio_r,segments,gyro,xl,mag,status_p,tm_p,nav_p,tp_p] ...
+%     = parse_sdcard_mex_p(filename,length_blocks,csv);
+
+%Quick integrity scan of the image before a long parse.
+%Writes verify_report.csv. No samples are decoded.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'verify',1);
+
+%GPS and status only. Audio and IMU segments are stepped over.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'streams','gps,status');
+
+%Audio straight to a WAV file (RF64 past 4 GB) with the mean removed and
+%scaled to full scale, in place of the audiowrite below.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'wav','collar.wav','wav_dc',1,'wav_normalize',1);
+
+%Lossless FLAC copy of the audio for the archive. Reads back with
+%audioread('collar.flac','native').
+% parse_sdcard_mex_p(filename,length_blocks,csv,'flac','collar.flac');
+
+%Same again at 48 kHz, resampled during the parse.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'flac','collar_48k.flac','resample',48000);
+
+%Min/max/RMS overview for plotting the whole recording. overview.csv
+%lists the files; each is int16 rows of [min max rms] per channel.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'overview',1);
+% fid = fopen('overview_audio_r_100ms.bin'); ov = reshape(fread(fid,'int16=>int16'),3,[])'; fclose(fid);
+% plot([ov(:,1) ov(:,2)]);
+
+%Mel band energies in dB, 40 per frame, without keeping the raw audio.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'features',1,'streams','audio,status');
+% fid = fopen('features_audio_r.bin'); mel = reshape(fread(fid,'single=>single'),40,[]); fclose(fid);
+% imagesc(mel); axis xy;
+
+%Acoustic events over the noise floor, each clip saved as its own WAV.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'events',1,'event_db',15,'event_clips',1);
+% ev = readtable('events.csv');
+
+%IMU in dps, g and gauss as X Y Z rows, full scales from the startup MIF.
+% mif = '../../Source_Code/MainCollar/IMU_LSM9DS1/LSM9DS1_Register_Settings_Startup_Memory.mif';
+% parse_sdcard_mex_p(filename,length_blocks,csv,'imu_units',1,'imu_mif',mif,'imu_offsets',zeros(3));
+% fid = fopen('gyro_xyz.bin'); gyro_dps = reshape(fread(fid,'single=>single'),3,[])'; fclose(fid);
+
+%Orientation from the gyro, accel and mag. Columns are qw qx qy qz roll pitch yaw.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'fusion',1,'fusion_beta',0.05,'imu_mif',mif);
+% fid = fopen('orientation.bin'); orient = reshape(fread(fid,'single=>single'),7,[])'; fclose(fid);
+% plot(orient(:,7));
+
+%Every stream merged in GPS time order, with a 1 s window index over them.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'merge',1,'merge_window',1000);
+% fid = fopen('merged.bin'); merged = reshape(fread(fid,'uint32=>uint32'),9,[])'; fclose(fid);
+% windows = readtable('merged_windows.csv');
+
+%GPS only pass for the deployment track, 3D fixes within 20 m.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'streams','gps,status','track',1,'track_pacc',20);
+% trk = readtable('track.csv'); plot(trk.longitude, trk.latitude);
+
+%Image dumped out of order, blocks sorted back by sequence number first.
+% parse_sdcard_mex_p(filename,length_blocks,csv,'reorder','reordered.bin');
+
+%Field and lab reads of the same card merged, each block once.
+% parse_sdcard_mex_p('field_read.bin',length_blocks,csv,'reorder','card.bin','dumps','lab_read.bin');
+
 parse_sdcard_mex_p(filename,length_blocks,csv);
 % 
 % [audio_l,audio_r,segments,gyro,xl,mag,status_p,tm_p,nav_p,tp_p,gyro_i,xl_i,mag_i,gyro_timemarks,status_p_timemarks,aud_i,gyro_i_test] ... 
@@ -27,6 +96,28 @@ parse_sdcard_mex_p(filename,length_blocks,csv);
 
 end
 
+%Clock model across a power cycle. The FPGA clock starts again from zero,
+%so each cycle must be placed on its own time pulses and the GPS times of
+%every stream, and the merged order over them, keep going forward
+%through the restart.
+%   sd_image_gen synthetic_restart.bin --mb 64 --restarts 1
+restart_file = fullfile(pwd, 'synthetic_restart.bin');
+if exist(restart_file, 'file')
+check_folder = tempname;
+mkdir(check_folder);
+old_folder = cd(check_folder);
+parse_sdcard_mex_p(restart_file,(64*1024*1024)/512,0,'merge',1);
+for times_file = {'gyro_times.bin','xl_times.bin','mag_times.bin','audio_times.bin'}
+  fid = fopen(times_file{1}); t = reshape(fread(fid,'uint32=>uint32'),6,[])'; fclose(fid);
+  gps = [int64(t(:,4))*604800000 + int64(typecast(t(:,5),'int32')), int64(t(:,6))];
+  assert(issorted(gps,'rows'), '%s runs back in GPS time', times_file{1});
+end
+fid = fopen('merged.bin'); merged = reshape(fread(fid,'uint32=>uint32'),9,[])'; fclose(fid);
+keys = [int64(merged(:,5))*604800000 + int64(typecast(merged(:,6),'int32')), int64(merged(:,7))];
+assert(issorted(keys,'rows'), 'merged.bin runs back in GPS time');
+cd(old_folder);
+end
+
 % 
 % mean_audio = double(audio_r) / abs(max(double(audio_r)));
 % mean_audio = mean_audio-mean(mean_audio);
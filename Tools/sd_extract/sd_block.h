@@ -0,0 +1,409 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_block.h
+// --!@brief      SD card block layout and segment walker for the collar image
+// --!@details    Constants are taken from FlashBlock.vhd.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Everything here is header only so the MEX file still builds with a
+//single "mex parse_sdcard_mex_p.cpp". Nothing in here calls MATLAB.
+
+//Each block is a 4 byte sequence number followed by segments.
+//Every segment is followed by a two byte trailer, type then length.
+//The last two bytes of a block are always a trailer so the block is
+//walked from the end back to the sequence number.
+
+#ifndef SD_BLOCK_H
+#define SD_BLOCK_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "sd_layout.h"
+#include "sd_load.h"
+#include "sd_packets.h"
+#include "sd_status.h"
+
+
+  const int BLOCK_SEQNO_BYTES = 4;
+  const int BLOCK_SIZE = 512;
+  const int SEG_TRAILER_SIZE = 2;
+  const int AUDIO_WORD_BYTES = 2;
+
+  //Bytes of segment data in a block, excluding the sequence number.
+  const int BLOCK_DATA_BYTES = BLOCK_SIZE - BLOCK_SEQNO_BYTES;
+
+  const int IMU_AXIS_WORD_LENGTH_BYTES = 2;
+  const int IMU_GYRO_SEG_BYTES = 3 * IMU_AXIS_WORD_LENGTH_BYTES;
+  const int IMU_ACCEL_SEG_BYTES = 3 * IMU_AXIS_WORD_LENGTH_BYTES;
+  const int IMU_MAG_SEG_BYTES = 3 * IMU_AXIS_WORD_LENGTH_BYTES;
+
+  //All the defined segment identifiers.
+  const char PADDING_BYTE = 0x00;
+
+  const char BLOCK_SEG_UNUSED = 0x01;
+  const char BLOCK_SEG_STATUS = 0x02;
+  const char BLOCK_SEG_GPS_TIME_MARK = 0x03;
+  const char BLOCK_SEG_GPS_POSITION = 0x04;
+  const char BLOCK_SEG_IMU_GYRO = 0x05;
+  const char BLOCK_SEG_IMU_ACCEL = 0x06;
+  const char BLOCK_SEG_IMU_MAG = 0x07;
+  const char BLOCK_SEG_IMU_TEMP = 0x0A;
+  const char BLOCK_SEG_EVENT = 0x0B;
+  const char BLOCK_SEG_SHUTDOWN = 0x0C;
+  const char BLOCK_SEG_AUDIO = 0x08;
+  const char BLOCK_SEG_GPS_TIME_PULSE = 0x0D;
+
+  //Segment ids fit in the low nibble. Used to size per type tables.
+  const int BLOCK_SEG_TYPES = 16;
+
+  //Segment lengths used to check a trailer before it is trusted, from
+  //the generated layouts in sd_layout.h.
+  //GPS times are 9 bytes, see gps_time_bytes_c.
+  const int GPS_TIME_BYTES = LAYOUT_GPS_TIME_BYTES;
+  const int RTC_TIME_BYTES = status_layout::rtc_time_bytes;
+  const int STATUS_COMPILE_BYTES = status_layout::compile_bytes;
+  const int STATUS_COMMIT_BYTES = status_layout::commit_bytes;
+  const int NUM_ACTIVE_MICS_BYTES = status_layout::mics_bytes;
+
+  //Status segments of the current build. The lengths accepted come from
+  //the schemas in sd_status.h.
+  const int STATUS_SEG_BYTES = status_layout::bytes;
+
+  const int GPS_NAV_SOL_BYTES = nav_sol_layout::bytes;
+  const int GPS_TIM_TM2_BYTES = tim_tm2_layout::bytes;
+  const int GPS_TIM_TP_BYTES = tim_tp_layout::bytes;
+
+
+  //Reasons a block is flagged.
+  //The parse drops a block with a walk error whole, none of its segments
+  //are decoded. Sequence and status time reasons come from the verify pass.
+  enum block_error_reason {
+    BLOCK_OK = 0,
+    BLOCK_ERR_TRUNCATED,
+    BLOCK_ERR_TRAILER_OVERRUN,
+    BLOCK_ERR_SEGMENT_TYPE,
+    BLOCK_ERR_SEGMENT_LENGTH,
+    BLOCK_ERR_SEQUENCE,
+    BLOCK_ERR_STATUS_TIME,
+    BLOCK_ERR_COUNT
+  };
+
+  const char* const block_error_names[BLOCK_ERR_COUNT] = { "ok",
+    "truncated block",
+    "trailer overrun",
+    "bad segment type",
+    "bad segment length",
+    "sequence break",
+    "implausible status time"
+  };
+
+  //One entry of the corruption report.
+  //Block number counts 512 byte blocks from the start of the image.
+  struct block_error {
+    uint32_t block_number;
+    uint32_t sequence;
+    uint32_t reason;
+    uint32_t offset;
+  };
+
+
+  //Blocks never written hold all zeros or all ones from formatting.
+  inline bool block_unwritten(uint32_t sequence)
+  {
+    return (sequence == 0 || sequence == 0xFFFFFFFF);
+  }
+
+
+  //Check one segment trailer.
+  //Fixed length segments must hold every field the decoder reads, status
+  //segments those of the shortest known layout.
+  //Sample segments must hold whole words.
+  //Returns BLOCK_OK or the reason the segment is bad.
+  inline int check_segment(char segment_type, int segment_length)
+  {
+    if (segment_type == BLOCK_SEG_UNUSED ||
+        segment_type == BLOCK_SEG_IMU_TEMP ||
+        segment_type == BLOCK_SEG_EVENT ||
+        segment_type == BLOCK_SEG_SHUTDOWN) {
+      return BLOCK_OK;
+    }
+    else if (segment_type == BLOCK_SEG_STATUS) {
+      return (segment_length < status_min_length()) ? BLOCK_ERR_SEGMENT_LENGTH : BLOCK_OK;
+    }
+    else if (segment_type == BLOCK_SEG_GPS_POSITION) {
+      return (segment_length < GPS_NAV_SOL_BYTES) ? BLOCK_ERR_SEGMENT_LENGTH : BLOCK_OK;
+    }
+    else if (segment_type == BLOCK_SEG_GPS_TIME_MARK) {
+      return (segment_length < GPS_TIM_TM2_BYTES) ? BLOCK_ERR_SEGMENT_LENGTH : BLOCK_OK;
+    }
+    else if (segment_type == BLOCK_SEG_GPS_TIME_PULSE) {
+      return (segment_length < GPS_TIM_TP_BYTES) ? BLOCK_ERR_SEGMENT_LENGTH : BLOCK_OK;
+    }
+    else if (segment_type == BLOCK_SEG_IMU_GYRO ||
+             segment_type == BLOCK_SEG_IMU_ACCEL ||
+             segment_type == BLOCK_SEG_IMU_MAG) {
+      return ((segment_length % IMU_AXIS_WORD_LENGTH_BYTES) != 0) ? BLOCK_ERR_SEGMENT_LENGTH : BLOCK_OK;
+    }
+    else if (segment_type == BLOCK_SEG_AUDIO) {
+      return ((segment_length % AUDIO_WORD_BYTES) != 0) ? BLOCK_ERR_SEGMENT_LENGTH : BLOCK_OK;
+    }
+    return BLOCK_ERR_SEGMENT_TYPE;
+  }
+
+
+  //Walk the trailers of the block starting at contents[block_start].
+  //Every trailer is checked before it is trusted. k may never step below
+  //the sequence number and the walk must land exactly on it, which is the
+  //same as the trailers summing to the 508 data bytes. The walk is bounded
+  //by the block so a bad trailer costs at most one block.
+  //
+  //Segments that are decoded are appended last to first as start offsets
+  //into contents, lengths and types. Padding, temperature, event and
+  //shutdown segments are stepped over.
+  //Returns BLOCK_OK or the reason the block is bad. error_offset is the
+  //byte in the block where the walk stopped.
+  inline int walk_block(const unsigned char* contents, int block_start,
+                        std::vector<int>& packet_start_locations,
+                        std::vector<int>& packet_lengths,
+                        std::vector<int>& packet_types,
+                        int& error_offset)
+  {
+    int k = block_start + BLOCK_SIZE - 1;
+    int segment_length;
+    char segment_type;
+    int begin_sample;
+    int next_k;
+    int result;
+
+    while (k != block_start + BLOCK_SEQNO_BYTES - 1) {
+
+      segment_length = contents[k];
+      segment_type = contents[k - 1];
+      begin_sample = k - SEG_TRAILER_SIZE - segment_length + 1;
+      next_k = begin_sample - 1;
+
+      if (next_k < block_start + BLOCK_SEQNO_BYTES - 1) {
+        error_offset = k - block_start;
+        return BLOCK_ERR_TRAILER_OVERRUN;
+      }
+
+      result = check_segment(segment_type, segment_length);
+      if (result != BLOCK_OK) {
+        error_offset = k - block_start;
+        return result;
+      }
+
+      if (segment_type != BLOCK_SEG_UNUSED &&
+          segment_type != BLOCK_SEG_IMU_TEMP &&
+          segment_type != BLOCK_SEG_EVENT &&
+          segment_type != BLOCK_SEG_SHUTDOWN) {
+        packet_lengths.push_back(segment_length);
+        packet_start_locations.push_back(begin_sample);
+        packet_types.push_back(segment_type);
+      }
+
+      k = next_k;
+    }
+
+    error_offset = 0;
+    return BLOCK_OK;
+  }
+
+
+  //Append the axis words of one IMU segment to stream.
+  //Reminder that IMU is stored ZYX on the SD Card, two bytes little
+  //endian per axis.
+  //Returns the number of words appended.
+  inline int decode_imu_segment(const unsigned char* contents, int begin_sample,
+                                int segment_length, std::vector<int>& stream)
+  {
+    //Segments start on any byte, see sd_load.h.
+    for (int i_imu = 0; i_imu < segment_length; i_imu = i_imu + IMU_AXIS_WORD_LENGTH_BYTES)
+    {
+      stream.push_back(load_i16(&contents[begin_sample + i_imu]));
+    }
+    return segment_length / IMU_AXIS_WORD_LENGTH_BYTES;
+  }
+
+
+  //Split one audio segment into its two channels.
+  //Words are interleaved by microphone. audio_r takes the first word of
+  //every frame and audio_l the word after it.
+  //Returns the number of samples appended to audio_r, which is what the
+  //audio time and packet counts are kept against.
+  inline int decode_audio_segment(const unsigned char* contents, int begin_sample,
+                                  int segment_length, int num_mics_active,
+                                  std::vector<int>& audio_r,
+                                  std::vector<int>& audio_l)
+  {
+    int samples = 0;
+
+    for (int a_i = 0; a_i < segment_length; a_i = a_i + (AUDIO_WORD_BYTES*num_mics_active))
+    {
+      audio_r.push_back(load_i16(&contents[begin_sample + a_i]));
+      samples = samples + 1;
+    }
+
+    for (int a_i = AUDIO_WORD_BYTES; a_i < segment_length; a_i = a_i + (AUDIO_WORD_BYTES*num_mics_active))
+    {
+      audio_l.push_back(load_i16(&contents[begin_sample + a_i]));
+    }
+
+    return samples;
+  }
+
+
+  //Sample counts decode_audio_segment gives for one segment, first word of
+  //each frame then the word after it. Used to size outputs up front.
+  inline void count_audio_segment(int segment_length, int num_mics_active,
+                                  uint64_t& first_samples, uint64_t& second_samples)
+  {
+    int frame_bytes = AUDIO_WORD_BYTES * num_mics_active;
+
+    first_samples = first_samples + (segment_length + frame_bytes - 1) / frame_bytes;
+    if (segment_length > AUDIO_WORD_BYTES) {
+      second_samples = second_samples + (segment_length - AUDIO_WORD_BYTES + frame_bytes - 1) / frame_bytes;
+    }
+  }
+
+
+  //decode_imu_segment into a preallocated column major rows x 3 matrix,
+  //one column per axis in the order stored. word is the running count of
+  //words written so far. Words past the end of the matrix are dropped.
+  inline int decode_imu_segment_columns(const unsigned char* contents, int begin_sample,
+                                        int segment_length, int16_t* columns,
+                                        uint64_t rows, uint64_t& word)
+  {
+    for (int i_imu = 0; i_imu < segment_length; i_imu = i_imu + IMU_AXIS_WORD_LENGTH_BYTES)
+    {
+      if (word / 3 < rows) {
+        columns[(word % 3) * rows + word / 3] = load_i16(&contents[begin_sample + i_imu]);
+      }
+      word = word + 1;
+    }
+    return segment_length / IMU_AXIS_WORD_LENGTH_BYTES;
+  }
+
+
+  //decode_audio_segment into preallocated columns. The counts are the
+  //samples written to each so far and may not pass their sizes. A NULL
+  //column is skipped. Returns the number of audio_r samples.
+  inline int decode_audio_segment_columns(const unsigned char* contents, int begin_sample,
+                                          int segment_length, int num_mics_active,
+                                          int16_t* audio_r, uint64_t r_rows, uint64_t& r_count,
+                                          int16_t* audio_l, uint64_t l_rows, uint64_t& l_count)
+  {
+    int samples = 0;
+
+    for (int a_i = 0; a_i < segment_length; a_i = a_i + (AUDIO_WORD_BYTES*num_mics_active))
+    {
+      if (audio_r != NULL && r_count < r_rows) {
+        audio_r[r_count] = load_i16(&contents[begin_sample + a_i]);
+      }
+      r_count = r_count + 1;
+      samples = samples + 1;
+    }
+
+    for (int a_i = AUDIO_WORD_BYTES; a_i < segment_length; a_i = a_i + (AUDIO_WORD_BYTES*num_mics_active))
+    {
+      if (audio_l != NULL && l_count < l_rows) {
+        audio_l[l_count] = load_i16(&contents[begin_sample + a_i]);
+      }
+      l_count = l_count + 1;
+    }
+
+    return samples;
+  }
+
+
+  //Append one nav_sol segment to the packet columns. The walk has
+  //checked the segment holds every field read, see check_segment.
+  inline void decode_nav_sol_segment(const unsigned char* contents, int begin_sample, nav_sol_columns& packets)
+  {
+    const unsigned char* segment = &contents[begin_sample];
+    uint32_t week;
+    uint32_t ms;
+    uint32_t ns;
+
+    packets.itow.push_back(load_u32(segment + nav_sol_layout::itow));
+    packets.ftow.push_back(load_i32(segment + nav_sol_layout::ftow));
+    packets.weekepoch.push_back(load_i16(segment + nav_sol_layout::week));
+
+    packets.fixtype.push_back(load_u8(segment + nav_sol_layout::gpsfix));
+    packets.ecefx.push_back(load_i32(segment + nav_sol_layout::ecefx));
+    packets.ecefy.push_back(load_i32(segment + nav_sol_layout::ecefy));
+    packets.ecefz.push_back(load_i32(segment + nav_sol_layout::ecefz));
+
+    packets.pacc.push_back(load_u32(segment + nav_sol_layout::pacc));
+    packets.posdop.push_back(load_u16(segment + nav_sol_layout::pdop));
+    packets.numsv.push_back(load_u8(segment + nav_sol_layout::numsv));
+
+    //The reset time the position was stored at.
+    load_gps_time(segment + nav_sol_layout::postime, week, ms, ns);
+    packets.reset_time_week.push_back(week);
+    packets.reset_time_ms.push_back(ms);
+    packets.reset_time_ns.push_back(ns);
+  }
+
+
+  //Append one tim_tm2 segment to the packet columns.
+  inline void decode_tim_tm2_segment(const unsigned char* contents, int begin_sample, tm_columns& packets)
+  {
+    const unsigned char* segment = &contents[begin_sample];
+    uint32_t week;
+    uint32_t ms;
+    uint32_t ns;
+
+    packets.flags.push_back(load_u8(segment + tim_tm2_layout::flags));
+    packets.wnF.push_back(load_u16(segment + tim_tm2_layout::wnf));
+    packets.towmsF.push_back(load_u32(segment + tim_tm2_layout::towmsf));
+    packets.towsubmsF.push_back(load_u32(segment + tim_tm2_layout::towsubmsf));
+    packets.accestns.push_back(load_u32(segment + tim_tm2_layout::accest));
+
+    //The reset time of the mark.
+    load_gps_time(segment + tim_tm2_layout::marktime, week, ms, ns);
+    packets.reset_time_week.push_back(week);
+    packets.reset_time_ms.push_back(ms);
+    packets.reset_time_ns.push_back(ns);
+  }
+
+
+  //Append one tim_tp segment, the reset time of a time pulse and the GPS
+  //time of that pulse, to the packet columns.
+  inline void decode_tim_tp_segment(const unsigned char* contents, int begin_sample, tim_tp_columns& packets)
+  {
+    const unsigned char* segment = &contents[begin_sample];
+    uint32_t week;
+    uint32_t ms;
+    uint32_t ns;
+
+    load_gps_time(segment + tim_tp_layout::fpga_time, week, ms, ns);
+    packets.reset_time_week.push_back(week);
+    packets.reset_time_ms.push_back(ms);
+    packets.reset_time_ns.push_back(ns);
+
+    load_gps_time(segment + tim_tp_layout::pulse_time, week, ms, ns);
+    packets.gps_time_week.push_back(week);
+    packets.gps_time_ms.push_back(ms);
+    packets.gps_time_ns.push_back(ns);
+  }
+
+#endif
@@ -0,0 +1,334 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_block_bench.cpp
+// --!@brief      Throughput benchmarks for each stage of the SD card parse
+// --!@details    Runs on a generated image so results can be compared
+// --             between machines and parser versions.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Building, needs Google Benchmark.
+//    g++ -std=c++11 -O2 sd_block_bench.cpp -o sd_block_bench -lbenchmark -lpthread
+//
+//Running.
+//    ./sd_block_bench
+//    SD_BENCH_MB=1024 ./sd_block_bench
+//    SD_BENCH_IMAGE=dump.bin ./sd_block_bench --benchmark_filter=Read
+//
+//The image is generated once in memory with the collar defaults,
+//SD_BENCH_MB long (256 by default). The read stage needs a file, it uses
+//SD_BENCH_IMAGE if set or writes the generated image to
+//sd_block_bench.bin, which is removed again on exit. Every stage reports
+//bytes/s. Decode stages also report samples/s.
+//
+//Blocks are walked from their own start, so segment offsets stay small
+//however large the image is. Each segment keeps the block it is in.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "sd_block.h"
+#include "sd_image_gen.h"
+
+
+  //Same chunk the parser reads with.
+  const uint64_t BENCH_READ_CHUNK_BYTES = 128ULL * 1024 * 1024;
+
+
+  //The generated image and its walked segments, built on first use.
+  struct bench_image {
+    std::vector<unsigned char> contents;
+    std::vector<int> packet_start_locations;
+    std::vector<int> packet_lengths;
+    std::vector<int> packet_types;
+    std::vector<uint64_t> packet_blocks;
+    uint64_t imu_samples;
+    uint64_t audio_samples;
+    std::string filename;
+  };
+
+
+  //Generated image file to remove on exit.
+  std::string bench_file;
+
+
+  void remove_bench_file()
+  {
+    if (!bench_file.empty()) {
+      std::remove(bench_file.c_str());
+    }
+  }
+
+
+  //First byte of block b of the image.
+  inline const unsigned char* bench_block(const bench_image& image, uint64_t b)
+  {
+    return &image.contents[(size_t)(b * BLOCK_SIZE)];
+  }
+
+
+  bench_image& get_bench_image()
+  {
+    static bench_image* image = NULL;
+    gen_image_config config;
+    gen_image_state* state;
+    int error_offset;
+    const char* env;
+
+    if (image != NULL) {
+      return *image;
+    }
+
+    image = new bench_image;
+
+    gen_image_defaults(config);
+    env = getenv("SD_BENCH_MB");
+    config.blocks = ((env != NULL) ? strtoull(env, NULL, 10) : 256ULL) * 1024ULL * 1024ULL / BLOCK_SIZE;
+
+    state = new gen_image_state;
+    gen_image_begin(config, *state);
+    image->contents.resize((size_t)config.blocks * BLOCK_SIZE);
+    gen_image_fill(*state, &image->contents[0], config.blocks);
+    delete state;
+
+    image->imu_samples = 0;
+    image->audio_samples = 0;
+    for (uint64_t b = 0; b < config.blocks; b++) {
+      walk_block(bench_block(*image, b), 0,
+                 image->packet_start_locations, image->packet_lengths,
+                 image->packet_types, error_offset);
+      image->packet_blocks.resize(image->packet_types.size(), b);
+    }
+    for (size_t i = 0; i < image->packet_types.size(); i++) {
+      if (image->packet_types[i] == BLOCK_SEG_IMU_GYRO ||
+          image->packet_types[i] == BLOCK_SEG_IMU_ACCEL ||
+          image->packet_types[i] == BLOCK_SEG_IMU_MAG) {
+        image->imu_samples = image->imu_samples + image->packet_lengths[i] / IMU_AXIS_WORD_LENGTH_BYTES;
+      }
+      else if (image->packet_types[i] == BLOCK_SEG_AUDIO) {
+        image->audio_samples = image->audio_samples + image->packet_lengths[i] / AUDIO_WORD_BYTES;
+      }
+    }
+
+    env = getenv("SD_BENCH_IMAGE");
+    if (env != NULL) {
+      image->filename = env;
+    }
+    else {
+      image->filename = "sd_block_bench.bin";
+      bench_file = image->filename;
+      atexit(remove_bench_file);
+      std::ofstream out(image->filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+      out.write((const char*)&image->contents[0], image->contents.size());
+    }
+
+    return *image;
+  }
+
+
+  //Synthetic image generation itself.
+  static void BM_GenerateImage(benchmark::State& state)
+  {
+    gen_image_config config;
+    gen_image_state* gen = new gen_image_state;
+    std::vector<unsigned char> buffer((size_t)GEN_WRITE_BLOCKS * BLOCK_SIZE);
+
+    gen_image_defaults(config);
+    config.blocks = ~0ULL;
+    gen_image_begin(config, *gen);
+
+    for (auto _ : state) {
+      gen_image_fill(*gen, &buffer[0], GEN_WRITE_BLOCKS);
+      benchmark::DoNotOptimize(&buffer[0]);
+    }
+
+    state.SetBytesProcessed(state.iterations() * (int64_t)buffer.size());
+    delete gen;
+  }
+  BENCHMARK(BM_GenerateImage);
+
+
+  //Reading the image from disk in the parser's chunk size.
+  static void BM_ReadImage(benchmark::State& state)
+  {
+    bench_image& image = get_bench_image();
+    std::vector<char> chunk(BENCH_READ_CHUNK_BYTES);
+    int64_t bytes = 0;
+
+    for (auto _ : state) {
+      std::ifstream file(image.filename.c_str(), std::ios::in | std::ios::binary);
+      while (file.read(&chunk[0], chunk.size()) || file.gcount() > 0) {
+        bytes = bytes + file.gcount();
+      }
+      benchmark::DoNotOptimize(&chunk[0]);
+    }
+
+    state.SetBytesProcessed(bytes);
+  }
+  BENCHMARK(BM_ReadImage)->Unit(benchmark::kMillisecond);
+
+
+  //Trailer walk of every block.
+  static void BM_WalkBlocks(benchmark::State& state)
+  {
+    bench_image& image = get_bench_image();
+    std::vector<int> packet_start_locations;
+    std::vector<int> packet_lengths;
+    std::vector<int> packet_types;
+    uint64_t blocks = image.contents.size() / BLOCK_SIZE;
+    int64_t segments = 0;
+    int error_offset;
+
+    for (auto _ : state) {
+      for (uint64_t b = 0; b < blocks; b++) {
+        packet_start_locations.clear();
+        packet_lengths.clear();
+        packet_types.clear();
+        walk_block(bench_block(image, b), 0, packet_start_locations,
+                   packet_lengths, packet_types, error_offset);
+        segments = segments + packet_types.size();
+      }
+    }
+
+    state.SetBytesProcessed(state.iterations() * (int64_t)image.contents.size());
+    state.counters["blocks/s"] = benchmark::Counter((double)(state.iterations() * blocks),
+                                                    benchmark::Counter::kIsRate);
+    state.counters["segments/s"] = benchmark::Counter((double)segments, benchmark::Counter::kIsRate);
+  }
+  BENCHMARK(BM_WalkBlocks)->Unit(benchmark::kMillisecond);
+
+
+  //IMU word decode of every gyro, accel and mag segment.
+  static void BM_DecodeImu(benchmark::State& state)
+  {
+    bench_image& image = get_bench_image();
+    std::vector<int> stream;
+
+    stream.reserve((size_t)image.imu_samples);
+
+    for (auto _ : state) {
+      stream.clear();
+      for (size_t i = 0; i < image.packet_types.size(); i++) {
+        if (image.packet_types[i] == BLOCK_SEG_IMU_GYRO ||
+            image.packet_types[i] == BLOCK_SEG_IMU_ACCEL ||
+            image.packet_types[i] == BLOCK_SEG_IMU_MAG) {
+          decode_imu_segment(bench_block(image, image.packet_blocks[i]), image.packet_start_locations[i],
+                             image.packet_lengths[i], stream);
+        }
+      }
+      benchmark::DoNotOptimize(&stream[0]);
+    }
+
+    state.SetBytesProcessed(state.iterations() * (int64_t)image.imu_samples * IMU_AXIS_WORD_LENGTH_BYTES);
+    state.counters["samples/s"] = benchmark::Counter((double)(state.iterations() * image.imu_samples),
+                                                     benchmark::Counter::kIsRate);
+  }
+  BENCHMARK(BM_DecodeImu)->Unit(benchmark::kMillisecond);
+
+
+  //Audio de-interleave of every audio segment.
+  static void BM_DecodeAudio(benchmark::State& state)
+  {
+    bench_image& image = get_bench_image();
+    std::vector<int> audio_r;
+    std::vector<int> audio_l;
+
+    audio_r.reserve((size_t)image.audio_samples);
+    audio_l.reserve((size_t)image.audio_samples);
+
+    for (auto _ : state) {
+      audio_r.clear();
+      audio_l.clear();
+      for (size_t i = 0; i < image.packet_types.size(); i++) {
+        if (image.packet_types[i] == BLOCK_SEG_AUDIO) {
+          decode_audio_segment(bench_block(image, image.packet_blocks[i]), image.packet_start_locations[i],
+                               image.packet_lengths[i], 2, audio_r, audio_l);
+        }
+      }
+      benchmark::DoNotOptimize(&audio_r[0]);
+      benchmark::DoNotOptimize(&audio_l[0]);
+    }
+
+    state.SetBytesProcessed(state.iterations() * (int64_t)image.audio_samples * AUDIO_WORD_BYTES);
+    state.counters["samples/s"] = benchmark::Counter((double)(state.iterations() * image.audio_samples),
+                                                     benchmark::Counter::kIsRate);
+  }
+  BENCHMARK(BM_DecodeAudio)->Unit(benchmark::kMillisecond);
+
+
+  //Walk and decode together, block by block as the parser does it.
+  static void BM_WalkAndDecode(benchmark::State& state)
+  {
+    bench_image& image = get_bench_image();
+    std::vector<int> packet_start_locations;
+    std::vector<int> packet_lengths;
+    std::vector<int> packet_types;
+    std::vector<int> imu;
+    std::vector<int> audio_r;
+    std::vector<int> audio_l;
+    uint64_t blocks = image.contents.size() / BLOCK_SIZE;
+    int error_offset;
+
+    imu.reserve((size_t)image.imu_samples);
+    audio_r.reserve((size_t)image.audio_samples);
+    audio_l.reserve((size_t)image.audio_samples);
+
+    for (auto _ : state) {
+      imu.clear();
+      audio_r.clear();
+      audio_l.clear();
+      for (uint64_t b = 0; b < blocks; b++) {
+        packet_start_locations.clear();
+        packet_lengths.clear();
+        packet_types.clear();
+        const unsigned char* block = bench_block(image, b);
+        if (walk_block(block, 0, packet_start_locations,
+                       packet_lengths, packet_types, error_offset) != BLOCK_OK) {
+          continue;
+        }
+        for (int i = (int)packet_types.size() - 1; i >= 0; i--) {
+          if (packet_types[i] == BLOCK_SEG_AUDIO) {
+            decode_audio_segment(block, packet_start_locations[i],
+                                 packet_lengths[i], 2, audio_r, audio_l);
+          }
+          else if (packet_types[i] == BLOCK_SEG_IMU_GYRO ||
+                   packet_types[i] == BLOCK_SEG_IMU_ACCEL ||
+                   packet_types[i] == BLOCK_SEG_IMU_MAG) {
+            decode_imu_segment(block, packet_start_locations[i],
+                               packet_lengths[i], imu);
+          }
+        }
+      }
+      benchmark::DoNotOptimize(&imu[0]);
+      benchmark::DoNotOptimize(&audio_r[0]);
+    }
+
+    state.SetBytesProcessed(state.iterations() * (int64_t)image.contents.size());
+    state.counters["samples/s"] = benchmark::Counter((double)(state.iterations() * (image.imu_samples + image.audio_samples)),
+                                                     benchmark::Counter::kIsRate);
+  }
+  BENCHMARK(BM_WalkAndDecode)->Unit(benchmark::kMillisecond);
+
+
+  BENCHMARK_MAIN();
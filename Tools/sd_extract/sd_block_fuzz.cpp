@@ -0,0 +1,375 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_block_fuzz.cpp
+// --!@brief      Fuzz and round trip harness for the SD card block walker
+// --!@details    Exercises walk_block and the segment decoders in sd_block.h
+// --             without MATLAB.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Building.
+//
+//  libFuzzer:
+//    clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address,undefined
+//            -DSD_LIBFUZZER sd_block_fuzz.cpp -o sd_block_fuzz
+//    ./sd_block_fuzz
+//
+//  AFL:
+//    afl-clang-fast++ -std=c++11 -g -O1 sd_block_fuzz.cpp -o sd_block_fuzz
+//    afl-fuzz -i seeds -o findings ./sd_block_fuzz @@
+//
+//  Round trip check only:
+//    g++ -std=c++11 -g -O1 -fsanitize=address,undefined sd_block_fuzz.cpp
+//        -o sd_block_fuzz
+//    ./sd_block_fuzz                 (10000 random blocks)
+//    ./sd_block_fuzz -n 1000000      (any count)
+//    ./sd_block_fuzz crash_file      (replay one input)
+//
+//The first input byte picks the mode. Even bytes treat the rest of the
+//input as a raw block, which must never make the walker step outside the
+//block or hand the decoders a segment that runs past it. Odd bytes seed
+//the block generator instead and the decoded block must match what was
+//generated segment for segment.
+//
+//Status, nav_sol, tim_tm2 and tim_tp segments are decoded with the same
+//fixed offset decoders the parse uses, so a trailer that lets a short
+//packet through shows up as a read past the block.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sd_block.h"
+#include "sd_block_gen.h"
+#include "sd_load.h"
+#include "sd_status.h"
+
+
+  //The parse always runs with both microphones interleaved.
+  const int FUZZ_NUM_MICS = 2;
+
+
+  int check_packet_segment(const unsigned char* block, int type, int begin_sample,
+                           const unsigned char* expected);
+  int check_raw_block(const unsigned char* block);
+  int check_round_trip(uint32_t seed);
+  int fuzz_one_input(const uint8_t* data, size_t size);
+
+
+  //Report a failed check and hand back the failure code.
+  #define FUZZ_CHECK(cond)                                               \
+    if (!(cond)) {                                                       \
+      fprintf(stderr, "sd_block_fuzz: %s failed at line %d\n", #cond,   \
+              __LINE__);                                                 \
+      return 1;                                                          \
+    }
+
+
+  //Decode one status or GPS segment and check it gave one row. With
+  //expected, the generated segment bytes, the fields must also match them.
+  int check_packet_segment(const unsigned char* block, int type, int begin_sample,
+                           const unsigned char* expected)
+  {
+    const unsigned char* segment = &block[begin_sample];
+
+    if (type == BLOCK_SEG_STATUS) {
+      status_columns packets;
+      status_decode<status_layout>(segment, packets);
+      FUZZ_CHECK(packets.compile.size() == 1 && packets.mics_active.size() == 1);
+      if (expected != NULL) {
+        FUZZ_CHECK(packets.compile[0] == load_u32(expected + status_layout::compile));
+        FUZZ_CHECK(packets.status_t[0] == load_gps_word(expected + status_layout::fpga_time));
+        FUZZ_CHECK(packets.mics_active[0] == expected[status_layout::mics]);
+      }
+    }
+    else if (type == BLOCK_SEG_GPS_POSITION) {
+      nav_sol_columns packets;
+      decode_nav_sol_segment(block, begin_sample, packets);
+      FUZZ_CHECK(packets.itow.size() == 1 && packets.reset_time_ns.size() == 1);
+      if (expected != NULL) {
+        FUZZ_CHECK(packets.itow[0] == load_u32(expected + nav_sol_layout::itow));
+        FUZZ_CHECK(packets.numsv[0] == expected[nav_sol_layout::numsv]);
+      }
+    }
+    else if (type == BLOCK_SEG_GPS_TIME_MARK) {
+      tm_columns packets;
+      decode_tim_tm2_segment(block, begin_sample, packets);
+      FUZZ_CHECK(packets.flags.size() == 1 && packets.reset_time_ns.size() == 1);
+      if (expected != NULL) {
+        FUZZ_CHECK(packets.towmsF[0] == load_u32(expected + tim_tm2_layout::towmsf));
+        FUZZ_CHECK(packets.accestns[0] == load_u32(expected + tim_tm2_layout::accest));
+      }
+    }
+    else if (type == BLOCK_SEG_GPS_TIME_PULSE) {
+      tim_tp_columns packets;
+      decode_tim_tp_segment(block, begin_sample, packets);
+      FUZZ_CHECK(packets.reset_time_ns.size() == 1 && packets.gps_time_ns.size() == 1);
+      FUZZ_CHECK(packets.reset_time_ns[0] < (1u << GPS_TIME_NANO_BITS) &&
+                 packets.gps_time_ms[0] < (1u << GPS_TIME_MILLI_BITS));
+      if (expected != NULL) {
+        uint32_t week;
+        uint32_t ms;
+        uint32_t ns;
+        load_gps_time(expected + tim_tp_layout::pulse_time, week, ms, ns);
+        FUZZ_CHECK(packets.gps_time_week[0] == week && packets.gps_time_ms[0] == ms &&
+                   packets.gps_time_ns[0] == ns);
+      }
+    }
+
+    return 0;
+  }
+
+
+  //Walk an arbitrary block and decode whatever it accepts.
+  //The block lives in its own BLOCK_SIZE buffer so ASan flags any read
+  //past the end.
+  int check_raw_block(const unsigned char* block)
+  {
+    std::vector<int> packet_start_locations;
+    std::vector<int> packet_lengths;
+    std::vector<int> packet_types;
+    std::vector<int> stream;
+    std::vector<int> audio_r;
+    std::vector<int> audio_l;
+    int error_offset = -1;
+    int reason;
+    int prev_start = BLOCK_SIZE;
+
+    reason = walk_block(block, 0, packet_start_locations, packet_lengths,
+                        packet_types, error_offset);
+
+    FUZZ_CHECK(reason >= BLOCK_OK && reason < BLOCK_ERR_COUNT);
+
+    if (reason != BLOCK_OK) {
+      FUZZ_CHECK(error_offset >= BLOCK_SEQNO_BYTES && error_offset < BLOCK_SIZE);
+      return 0;
+    }
+
+    FUZZ_CHECK(error_offset == 0);
+    FUZZ_CHECK(packet_start_locations.size() == packet_lengths.size());
+    FUZZ_CHECK(packet_start_locations.size() == packet_types.size());
+
+    //Segments come back last to first and may not overlap.
+    for (size_t i = 0; i < packet_start_locations.size(); i++) {
+      int begin_sample = packet_start_locations[i];
+      int segment_length = packet_lengths[i];
+
+      FUZZ_CHECK(begin_sample >= BLOCK_SEQNO_BYTES);
+      FUZZ_CHECK(begin_sample + segment_length + SEG_TRAILER_SIZE <= prev_start);
+      FUZZ_CHECK(check_segment((char)packet_types[i], segment_length) == BLOCK_OK);
+      prev_start = begin_sample;
+
+      if (packet_types[i] == BLOCK_SEG_IMU_GYRO ||
+          packet_types[i] == BLOCK_SEG_IMU_ACCEL ||
+          packet_types[i] == BLOCK_SEG_IMU_MAG) {
+        stream.clear();
+        decode_imu_segment(block, begin_sample, segment_length, stream);
+        FUZZ_CHECK((int)stream.size() * IMU_AXIS_WORD_LENGTH_BYTES == segment_length);
+      }
+      else if (packet_types[i] == BLOCK_SEG_AUDIO) {
+        audio_r.clear();
+        audio_l.clear();
+        decode_audio_segment(block, begin_sample, segment_length, FUZZ_NUM_MICS,
+                             audio_r, audio_l);
+        FUZZ_CHECK((int)(audio_r.size() + audio_l.size()) * AUDIO_WORD_BYTES == segment_length);
+      }
+      else if (check_packet_segment(block, packet_types[i], begin_sample, NULL) != 0) {
+        return 1;
+      }
+    }
+
+    return 0;
+  }
+
+
+  //Generate a block, walk it and check every segment comes back.
+  int check_round_trip(uint32_t seed)
+  {
+    std::mt19937 rng(seed);
+    std::vector<gen_segment> segments;
+    std::vector<int> packet_start_locations;
+    std::vector<int> packet_lengths;
+    std::vector<int> packet_types;
+    std::vector<int> stream;
+    std::vector<int> audio_r;
+    std::vector<int> audio_l;
+    std::vector<gen_segment> expected;
+    unsigned char* block = new unsigned char[BLOCK_SIZE];
+    uint32_t sequence = seed | 1;
+    uint32_t read_sequence;
+    int error_offset = -1;
+    int reason;
+    int failed = 0;
+
+    gen_random_block(rng, sequence, segments, block);
+
+    //Only the decoded kinds come back from the walk.
+    for (size_t i = segments.size(); i > 0; i--) {
+      char type = segments[i - 1].type;
+      if (type != BLOCK_SEG_UNUSED && type != BLOCK_SEG_IMU_TEMP &&
+          type != BLOCK_SEG_EVENT && type != BLOCK_SEG_SHUTDOWN) {
+        expected.push_back(segments[i - 1]);
+      }
+    }
+
+    std::memcpy(&read_sequence, block, BLOCK_SEQNO_BYTES);
+    reason = walk_block(block, 0, packet_start_locations, packet_lengths,
+                        packet_types, error_offset);
+
+    if (read_sequence != sequence || reason != BLOCK_OK ||
+        packet_start_locations.size() != expected.size()) {
+      failed = 1;
+    }
+
+    for (size_t i = 0; !failed && i < expected.size(); i++) {
+      const gen_segment& segment = expected[i];
+      int begin_sample = packet_start_locations[i];
+      int segment_length = packet_lengths[i];
+
+      if (packet_types[i] != segment.type ||
+          segment_length != (int)segment.data.size() ||
+          (segment_length > 0 &&
+           std::memcmp(&block[begin_sample], &segment.data[0], segment_length) != 0)) {
+        failed = 1;
+        break;
+      }
+
+      if (segment.type == BLOCK_SEG_IMU_GYRO ||
+          segment.type == BLOCK_SEG_IMU_ACCEL ||
+          segment.type == BLOCK_SEG_IMU_MAG) {
+        stream.clear();
+        decode_imu_segment(block, begin_sample, segment_length, stream);
+        for (size_t w = 0; w < stream.size(); w++) {
+          int16_t word = (int16_t)(segment.data[2 * w] | (segment.data[2 * w + 1] << 8));
+          if (stream[w] != word) {
+            failed = 1;
+          }
+        }
+      }
+      else if (segment.type == BLOCK_SEG_AUDIO) {
+        audio_r.clear();
+        audio_l.clear();
+        decode_audio_segment(block, begin_sample, segment_length, FUZZ_NUM_MICS,
+                             audio_r, audio_l);
+        if ((int)audio_r.size() * 2 * AUDIO_WORD_BYTES != segment_length ||
+            audio_l.size() != audio_r.size()) {
+          failed = 1;
+        }
+        for (size_t w = 0; !failed && w < audio_r.size(); w++) {
+          const unsigned char* frame = &segment.data[2 * AUDIO_WORD_BYTES * w];
+          if (audio_r[w] != (int16_t)(frame[0] | (frame[1] << 8)) ||
+              audio_l[w] != (int16_t)(frame[2] | (frame[3] << 8))) {
+            failed = 1;
+          }
+        }
+      }
+      else if (check_packet_segment(block, segment.type, begin_sample, &segment.data[0]) != 0) {
+        failed = 1;
+      }
+    }
+
+    if (failed) {
+      fprintf(stderr, "sd_block_fuzz: round trip failed for seed %u, walk result %s\n",
+              seed, block_error_names[reason]);
+    }
+    else {
+      //Anything the generator writes must also pass the raw checks.
+      failed = check_raw_block(block);
+    }
+
+    delete[] block;
+    return failed;
+  }
+
+
+  int fuzz_one_input(const uint8_t* data, size_t size)
+  {
+    unsigned char* block;
+    uint32_t seed = 0;
+    int failed;
+
+    if (size < 1) {
+      return 0;
+    }
+
+    if ((data[0] & 1) == 0) {
+      block = new unsigned char[BLOCK_SIZE];
+      std::memset(block, PADDING_BYTE, BLOCK_SIZE);
+      std::memcpy(block, data + 1, (size - 1 < (size_t)BLOCK_SIZE) ? size - 1 : BLOCK_SIZE);
+      failed = check_raw_block(block);
+      delete[] block;
+      return failed;
+    }
+
+    std::memcpy(&seed, data + 1, (size - 1 < sizeof(seed)) ? size - 1 : sizeof(seed));
+    return check_round_trip(seed);
+  }
+
+
+#ifdef SD_LIBFUZZER
+
+  extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+  {
+    if (fuzz_one_input(data, size) != 0) {
+      abort();
+    }
+    return 0;
+  }
+
+#else
+
+  int main(int argc, char* argv[])
+  {
+    int count = 10000;
+    int failures = 0;
+
+    if (argc == 2 && std::string(argv[1]) != "-n") {
+      std::ifstream input(argv[1], std::ios::in | std::ios::binary);
+      if (!input) {
+        fprintf(stderr, "sd_block_fuzz: cannot open %s\n", argv[1]);
+        return 2;
+      }
+      std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)),
+                                std::istreambuf_iterator<char>());
+      if (fuzz_one_input(data.empty() ? NULL : &data[0], data.size()) != 0) {
+        abort();
+      }
+      return 0;
+    }
+
+    if (argc == 3 && std::string(argv[1]) == "-n") {
+      count = atoi(argv[2]);
+    }
+
+    for (int i = 0; i < count; i++) {
+      failures = failures + check_round_trip((uint32_t)i);
+    }
+
+    printf("sd_block_fuzz: %d of %d generated blocks round tripped\n",
+           count - failures, count);
+
+    return (failures == 0) ? 0 : 1;
+  }
+
+#endif
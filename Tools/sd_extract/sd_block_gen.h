@@ -0,0 +1,186 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_block_gen.h
+// --!@brief      Synthetic SD card block builder for testing the block walker
+// --!@details    Blocks are laid out the same way FlashBlock.vhd writes them.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//FlashBlock writes each segment's data followed by its trailer, type then
+//length, starting right after the sequence number. Whatever room is left
+//at the end of the block is filled with unused segments so the last two
+//bytes of the block are always a trailer.
+
+#ifndef SD_BLOCK_GEN_H
+#define SD_BLOCK_GEN_H
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "sd_block.h"
+
+
+  //Largest length a trailer can hold.
+  const int SEG_MAX_LENGTH = 255;
+
+  //One segment as the collar would have buffered it.
+  struct gen_segment {
+    char type;
+    std::vector<unsigned char> data;
+  };
+
+
+  //Fill block from byte k to the end with unused segments.
+  //The bytes being covered are left as they are.
+  //Returns 0, or -1 if a single byte is left, which can never be padded.
+  inline int pad_block(unsigned char* block, int k)
+  {
+    int remaining = BLOCK_SIZE - k;
+    int pad_length;
+
+    if (remaining == 1) {
+      return -1;
+    }
+
+    //Each unused segment covers at most 255 + 2 bytes. Never leave a single
+    //byte behind for the last one.
+    while (remaining > 0) {
+      pad_length = remaining - SEG_TRAILER_SIZE;
+      if (pad_length > SEG_MAX_LENGTH) {
+        pad_length = (remaining - (SEG_MAX_LENGTH + SEG_TRAILER_SIZE) == 1) ?
+                     SEG_MAX_LENGTH - 1 : SEG_MAX_LENGTH;
+      }
+      k = k + pad_length;
+      block[k] = BLOCK_SEG_UNUSED;
+      block[k + 1] = (unsigned char)pad_length;
+      k = k + SEG_TRAILER_SIZE;
+      remaining = BLOCK_SIZE - k;
+    }
+
+    return 0;
+  }
+
+
+  //Lay out segments in a block in the order given and pad the rest.
+  //block must hold BLOCK_SIZE bytes.
+  //Returns 0, or -1 if the segments do not fit. A single byte left over
+  //can never be padded so that does not fit either.
+  inline int build_block(uint32_t sequence, const std::vector<gen_segment>& segments,
+                         unsigned char* block)
+  {
+    int k = BLOCK_SEQNO_BYTES;
+
+    std::memset(block, PADDING_BYTE, BLOCK_SIZE);
+    std::memcpy(block, &sequence, BLOCK_SEQNO_BYTES);
+
+    for (size_t i = 0; i < segments.size(); i++) {
+      int length = (int)segments[i].data.size();
+
+      if (length > SEG_MAX_LENGTH || k + length + SEG_TRAILER_SIZE > BLOCK_SIZE) {
+        return -1;
+      }
+      if (length > 0) {
+        std::memcpy(&block[k], &segments[i].data[0], length);
+      }
+      block[k + length] = segments[i].type;
+      block[k + length + 1] = (unsigned char)length;
+      k = k + length + SEG_TRAILER_SIZE;
+    }
+
+    return pad_block(block, k);
+  }
+
+
+  //Length of a randomly generated segment of the given type.
+  //Fixed segments use the length the collar writes. IMU segments are one
+  //three axis sample and audio a whole number of stereo frames.
+  inline int gen_segment_length(char type, std::mt19937& rng)
+  {
+    if (type == BLOCK_SEG_STATUS) {
+      return STATUS_SEG_BYTES;
+    }
+    else if (type == BLOCK_SEG_GPS_POSITION) {
+      return GPS_NAV_SOL_BYTES;
+    }
+    else if (type == BLOCK_SEG_GPS_TIME_MARK) {
+      return GPS_TIM_TM2_BYTES;
+    }
+    else if (type == BLOCK_SEG_GPS_TIME_PULSE) {
+      return GPS_TIM_TP_BYTES;
+    }
+    else if (type == BLOCK_SEG_IMU_GYRO) {
+      return IMU_GYRO_SEG_BYTES;
+    }
+    else if (type == BLOCK_SEG_IMU_ACCEL) {
+      return IMU_ACCEL_SEG_BYTES;
+    }
+    else if (type == BLOCK_SEG_IMU_MAG) {
+      return IMU_MAG_SEG_BYTES;
+    }
+    else if (type == BLOCK_SEG_AUDIO) {
+      return 2 * AUDIO_WORD_BYTES * (int)(rng() % 64);
+    }
+    return (int)(rng() % 32);
+  }
+
+
+  //Fill a block with random segments of every kind the collar writes.
+  //segments receives what was placed, in block order.
+  inline void gen_random_block(std::mt19937& rng, uint32_t sequence,
+                               std::vector<gen_segment>& segments,
+                               unsigned char* block)
+  {
+    const char types[] = { BLOCK_SEG_STATUS, BLOCK_SEG_GPS_TIME_MARK,
+                           BLOCK_SEG_GPS_POSITION, BLOCK_SEG_IMU_GYRO,
+                           BLOCK_SEG_IMU_ACCEL, BLOCK_SEG_IMU_MAG,
+                           BLOCK_SEG_AUDIO, BLOCK_SEG_GPS_TIME_PULSE,
+                           BLOCK_SEG_IMU_TEMP, BLOCK_SEG_EVENT,
+                           BLOCK_SEG_SHUTDOWN, BLOCK_SEG_UNUSED };
+    const int type_count = sizeof(types) / sizeof(types[0]);
+    int used = BLOCK_SEQNO_BYTES;
+    int attempts = (int)(rng() % 24);
+
+    segments.clear();
+
+    for (int i = 0; i < attempts; i++) {
+      gen_segment segment;
+      int length;
+
+      segment.type = types[rng() % type_count];
+      length = gen_segment_length(segment.type, rng);
+
+      //Keep the room left zero or at least a trailer.
+      if (BLOCK_SIZE - (used + length + SEG_TRAILER_SIZE) < 0 ||
+          BLOCK_SIZE - (used + length + SEG_TRAILER_SIZE) == 1) {
+        continue;
+      }
+
+      segment.data.resize(length);
+      for (int b = 0; b < length; b++) {
+        segment.data[b] = (unsigned char)rng();
+      }
+      used = used + length + SEG_TRAILER_SIZE;
+      segments.push_back(segment);
+    }
+
+    build_block(sequence, segments, block);
+  }
+
+#endif
@@ -0,0 +1,303 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_clock.h
+// --!@brief      FPGA clock to GPS time model built from the time pulses
+// --!@details    Tracks the offset between the collar's reset time and GPS
+// --             time at each time pulse and the rate it drifts at, so any
+// --             reset time can be turned into GPS time to the nanosecond.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//A tim_tp packet gives the reset time the FPGA latched a time pulse at and
+//the GPS time of that pulse. Their difference is the clock offset at that
+//instant. It changes slowly as the FPGA oscillator drifts against GPS.
+//
+//Between two pulses the offset is taken as a straight line from one to the
+//other. Past the last pulse it is carried on at the drift rate, a running
+//average of the slopes between pulses, and before the first pulse the
+//first slope is run backwards. A slope over CLOCK_MAX_DRIFT is not a
+//drift but the GPS time being set again, so that step is held at the left
+//pulse's offset carried on at the drift rate until the pulse after it.
+//
+//The FPGA clock starts again from zero at every power up, so the reset
+//times of one card only go forward within a power cycle. Each cycle is a
+//segment of the model with its own pulses and its own drift, and every
+//lookup names the segment it is in. Segments are numbered by
+//clock_track_reset from the status and time pulse reset times in the
+//order they are read, so samples and pulses of one cycle share a number.
+//
+//The model lives for the whole parse. Only the last pulse of a chunk is
+//kept into the next one, so samples ahead of a chunk's first pulse still
+//sit on the line from the previous chunk. The pulses of a cycle that has
+//ended stay until then as well, for the samples of that chunk still in
+//it, and are dropped with the rest at the next chunk.
+//
+//Times are in nanoseconds from week 0, with the ms taken as signed since
+//back annotation can leave a few samples before ms 0 of their week.
+//Lookups go through a cursor so a stream swept in time order is a merge
+//join against the pulses rather than a search per sample. Runs of evenly
+//spaced samples are looked up once per pulse they span, not per sample.
+
+#ifndef SD_CLOCK_H
+#define SD_CLOCK_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+  const int64_t CLOCK_WEEK_NS = 604800LL * 1000000000LL;
+
+  //Drift more than this (1000 ppm) between pulses is a step in GPS time.
+  const double CLOCK_MAX_DRIFT = 1.0e-3;
+
+  //Weight of each new slope in the running drift.
+  const double CLOCK_DRIFT_GAIN = 0.25;
+
+  //Reset times read back by less than this are packets of different types
+  //written a little out of time order, not a power cycle.
+  const int64_t CLOCK_RESTART_NS = 1000000000LL;
+
+
+  struct clock_model {
+    //Segment, reset time, offset to GPS time and slope to the next pulse
+    //of the pulses kept, in segment then reset time order.
+    std::vector<uint64_t> segment;
+    std::vector<int64_t> reset;
+    std::vector<int64_t> offset;
+    std::vector<double> slope;
+
+    double drift;
+    int have_drift;
+    uint64_t pulses;
+    uint64_t steps;
+    uint64_t restarts;
+    size_t cursor;
+  };
+
+
+  //Power cycle numbering over the reset times in the order they are read.
+  struct clock_restarts {
+    uint64_t segment;
+    int64_t latest;
+    int have_latest;
+  };
+
+
+  inline void clock_init(clock_model& model)
+  {
+    model.segment.clear();
+    model.reset.clear();
+    model.offset.clear();
+    model.slope.clear();
+    model.drift = 0.0;
+    model.have_drift = 0;
+    model.pulses = 0;
+    model.steps = 0;
+    model.restarts = 0;
+    model.cursor = 0;
+  }
+
+
+  inline void clock_restarts_init(clock_restarts& restarts)
+  {
+    restarts.segment = 0;
+    restarts.latest = 0;
+    restarts.have_latest = 0;
+  }
+
+
+  inline int64_t clock_ns(uint32_t week, uint32_t ms, uint32_t ns)
+  {
+    return (int64_t)week * CLOCK_WEEK_NS + (int64_t)(int32_t)ms * 1000000LL + (int64_t)ns;
+  }
+
+
+  //The segment of a reset time read from the image, status and time pulse
+  //times alike, taken in the order they are read. A time well behind the
+  //latest starts the next segment.
+  inline uint64_t clock_track_reset(clock_restarts& restarts, int64_t reset)
+  {
+    if (restarts.have_latest && reset < restarts.latest - CLOCK_RESTART_NS) {
+      restarts.segment = restarts.segment + 1;
+      restarts.latest = reset;
+    }
+    else if (!restarts.have_latest || reset > restarts.latest) {
+      restarts.latest = reset;
+    }
+    restarts.have_latest = 1;
+    return restarts.segment;
+  }
+
+
+  //Drop all but the last pulse ahead of a new chunk's pulses.
+  inline void clock_start_chunk(clock_model& model)
+  {
+    if (model.reset.size() > 1) {
+      size_t drop = model.reset.size() - 1;
+      model.segment.erase(model.segment.begin(), model.segment.begin() + drop);
+      model.reset.erase(model.reset.begin(), model.reset.begin() + drop);
+      model.offset.erase(model.offset.begin(), model.offset.begin() + drop);
+      model.slope.erase(model.slope.begin(), model.slope.begin() + drop);
+    }
+    model.cursor = 0;
+  }
+
+
+  //Add a time pulse of a segment. Pulses must come in segment order and
+  //in reset time order within one, any that don't are ignored. The first
+  //pulse of a new segment starts a new line and its drift is learned again.
+  inline void clock_add_pulse(clock_model& model, uint64_t segment, uint32_t reset_week, uint32_t reset_ms, uint32_t reset_ns,
+                              uint32_t gps_week, uint32_t gps_ms, uint32_t gps_ns)
+  {
+    int64_t reset = clock_ns(reset_week, reset_ms, reset_ns);
+    int64_t offset = clock_ns(gps_week, gps_ms, gps_ns) - reset;
+    size_t last = model.reset.size();
+
+    if (last > 0 && segment < model.segment[last - 1]) {
+      return;
+    }
+    if (last > 0 && segment > model.segment[last - 1]) {
+      model.drift = 0.0;
+      model.have_drift = 0;
+      model.restarts = model.restarts + 1;
+    }
+    else if (last > 0) {
+      if (reset <= model.reset[last - 1]) {
+        return;
+      }
+
+      double slope = (double)(offset - model.offset[last - 1]) / (double)(reset - model.reset[last - 1]);
+      if (std::fabs(slope) > CLOCK_MAX_DRIFT) {
+        model.slope[last - 1] = model.drift;
+        model.steps = model.steps + 1;
+      }
+      else {
+        model.slope[last - 1] = slope;
+        model.drift = model.have_drift ? model.drift + (slope - model.drift) * CLOCK_DRIFT_GAIN : slope;
+        model.have_drift = 1;
+      }
+    }
+
+    model.segment.push_back(segment);
+    model.reset.push_back(reset);
+    model.offset.push_back(offset);
+    model.slope.push_back(model.drift);
+    model.pulses = model.pulses + 1;
+  }
+
+
+  //Start a sweep through a stream's samples.
+  inline void clock_rewind(clock_model& model)
+  {
+    model.cursor = 0;
+  }
+
+
+  //Move the cursor to the pulse of a segment whose line covers a reset
+  //time and give the reset time that line ends at, INT64_MAX for the last
+  //of the segment. Returns 0, or -1 if the segment has no pulses.
+  inline int clock_seek(clock_model& model, uint64_t segment, int64_t reset, size_t& k, int64_t& until)
+  {
+    size_t first = std::lower_bound(model.segment.begin(), model.segment.end(), segment) - model.segment.begin();
+    size_t end = std::upper_bound(model.segment.begin() + first, model.segment.end(), segment) - model.segment.begin();
+
+    if (first == end) {
+      return -1;
+    }
+
+    size_t last = end - 1;
+    k = std::min(std::max(model.cursor, first), last);
+    while (k < last && model.reset[k + 1] <= reset) {
+      k = k + 1;
+    }
+    while (k > first && model.reset[k] > reset) {
+      k = k - 1;
+    }
+    model.cursor = k;
+    until = (k < last) ? model.reset[k + 1] : INT64_MAX;
+    return 0;
+  }
+
+
+  //Offset to add to a reset time of a segment in ns to get GPS time.
+  //Returns 0, or -1 if the segment has no pulses.
+  inline int clock_offset(clock_model& model, uint64_t segment, int64_t reset, int64_t& offset)
+  {
+    int64_t until;
+    size_t k;
+
+    if (clock_seek(model, segment, reset, k, until) != 0) {
+      return -1;
+    }
+    offset = model.offset[k] + (int64_t)std::llround(model.slope[k] * (double)(reset - model.reset[k]));
+    return 0;
+  }
+
+
+  //Split ns from week 0 into week, ms in the week and ns in the ms.
+  inline void clock_split(int64_t time, uint32_t& week, uint32_t& ms, uint32_t& ns)
+  {
+    int64_t weeks = time / CLOCK_WEEK_NS;
+    if (time % CLOCK_WEEK_NS < 0) {
+      weeks = weeks - 1;
+    }
+    int64_t in_week = time - weeks * CLOCK_WEEK_NS;
+
+    week = uint32_t(weeks);
+    ms = uint32_t(in_week / 1000000LL);
+    ns = uint32_t(in_week % 1000000LL);
+  }
+
+
+  //Give the GPS time of count samples of a segment period ns apart from
+  //reset time first, written to week, ms and ns each stride words apart.
+  //The run is cut where it crosses a pulse and each piece is filled from
+  //that pulse's line with no further lookups. Nothing is written without
+  //a pulse in the segment.
+  inline void clock_annotate_run(clock_model& model, uint64_t segment, int64_t first, int64_t period, size_t count,
+                                 uint32_t* week, uint32_t* ms, uint32_t* ns, size_t stride)
+  {
+    size_t done = 0;
+    while (done < count) {
+      int64_t reset = first + (int64_t)done * period;
+      int64_t until;
+      size_t k;
+      if (clock_seek(model, segment, reset, k, until) != 0) {
+        return;
+      }
+      size_t pieces = count - done;
+
+      if (period > 0 && until != INT64_MAX) {
+        pieces = std::min(pieces, (size_t)((until - reset + period - 1) / period));
+      }
+
+      const int64_t offset = model.offset[k];
+      const int64_t pulse = model.reset[k];
+      const double slope = model.slope[k];
+      for (size_t i = done; i < done + pieces; i++) {
+        int64_t sample = first + (int64_t)i * period;
+        int64_t time = sample + offset + (int64_t)std::llround(slope * (double)(sample - pulse));
+        clock_split(time, week[i * stride], ms[i * stride], ns[i * stride]);
+      }
+      done = done + pieces;
+    }
+  }
+
+#endif
@@ -0,0 +1,320 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_events.h
+// --!@brief      Energy based acoustic event detector for the collar audio
+// --!@details    Finds the loud stretches of a recording as it is parsed and
+// --             lists them with their times, optionally saving each one as
+// --             a short WAV clip.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//The audio is taken EVENT_FRAME samples at a time and the mean square of
+//all channels is compared in dB against a running noise floor. The floor
+//follows quiet frames down quickly and loud ones up slowly, so it sits on
+//the background level and only drifts up under long sustained sound.
+//
+//An event starts when a frame is on_db over the floor and ends once
+//EVENT_HANGOVER frames in a row have been under off_db over it, off_db
+//being half of on_db. Its end is the end of the last frame over off_db.
+//Events of fewer than EVENT_MIN_FRAMES loud frames are dropped.
+//
+//Each event is a row of the index with its first and last sample, peak
+//level and the time rows of both ends. Times are passed in as opaque rows
+//of time_words uint32 as with the features.
+//
+//With clips on, every event is also written to event_NNNNN.wav starting
+//EVENT_PREROLL frames ahead of it and running through the hangover.
+
+#ifndef SD_EVENTS_H
+#define SD_EVENTS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "sd_wav.h"
+
+
+  const int EVENT_FRAME = 512;
+  const int EVENT_HANGOVER = 20;
+  const int EVENT_PREROLL = 10;
+  const int EVENT_MIN_FRAMES = 2;
+  const int EVENT_MAX_CHANNELS = 2;
+
+  //Fraction of the distance to the frame level the floor moves per frame.
+  const double EVENT_FLOOR_FALL = 0.1;
+  const double EVENT_FLOOR_RISE = 0.001;
+
+
+  struct event_detector {
+    int channels;
+    int sample_rate;
+    int time_words;
+    double on_db;
+    double off_db;
+
+    double floor_db;
+    int have_floor;
+
+    //Samples and time rows from pending_first_sample on. Frames are taken
+    //from position, and EVENT_PREROLL frames before it are kept for clips.
+    std::vector<int16_t> pending[EVENT_MAX_CHANNELS];
+    std::vector<uint32_t> pending_times;
+    uint64_t pending_first_sample;
+    size_t position;
+
+    int active;
+    uint64_t start_sample;
+    uint64_t end_sample;
+    uint64_t loud_frames;
+    int quiet_frames;
+    double peak_db;
+    double start_floor_db;
+    std::vector<uint32_t> start_time;
+    std::vector<uint32_t> end_time;
+
+    FILE* index;
+    uint64_t events;
+
+    int clips;
+    int clip_open;
+    wav_writer clip;
+    std::string clip_name;
+  };
+
+
+  //Open the index and write its header. time_names are the names of the
+  //time_words fields of a time row.
+  //Returns 0, or -1 if the index could not be created.
+  inline int event_open(event_detector& detector, const std::string& filename, int channels,
+                        int sample_rate, const char* const* time_names, int time_words,
+                        double on_db, int clips)
+  {
+    detector.channels = std::min(std::max(channels, 1), EVENT_MAX_CHANNELS);
+    detector.sample_rate = sample_rate;
+    detector.time_words = time_words;
+    detector.on_db = on_db;
+    detector.off_db = on_db / 2.0;
+    detector.floor_db = 0.0;
+    detector.have_floor = 0;
+    for (int c = 0; c < EVENT_MAX_CHANNELS; c++) {
+      detector.pending[c].clear();
+    }
+    detector.pending_times.clear();
+    detector.pending_first_sample = 0;
+    detector.position = 0;
+    detector.active = 0;
+    detector.events = 0;
+    detector.clips = clips;
+    detector.clip_open = 0;
+
+    detector.index = fopen(filename.c_str(), "w");
+    if (detector.index == NULL) {
+      return -1;
+    }
+
+    fprintf(detector.index, "event,start_sample,end_sample,seconds,peak_db,floor_db,clip");
+    for (int i = 0; i < time_words; i++) {
+      fprintf(detector.index, ",start_%s", time_names[i]);
+    }
+    for (int i = 0; i < time_words; i++) {
+      fprintf(detector.index, ",end_%s", time_names[i]);
+    }
+    fprintf(detector.index, "\n");
+    return 0;
+  }
+
+
+  template <typename T>
+  inline void event_add_samples(event_detector& detector, int channel, const T* samples, size_t count)
+  {
+    std::vector<int16_t>& pending = detector.pending[channel];
+    size_t first = pending.size();
+
+    pending.resize(first + count);
+    for (size_t i = 0; i < count; i++) {
+      pending[first + i] = (int16_t)samples[i];
+    }
+  }
+
+
+  //Queue the time rows of count samples, shared by all channels.
+  inline void event_add_times(event_detector& detector, const uint32_t* times, size_t count)
+  {
+    detector.pending_times.insert(detector.pending_times.end(), times, times + count * detector.time_words);
+  }
+
+
+  //Append count samples from offset in pending to the open clip.
+  inline void event_clip_samples(event_detector& detector, size_t offset, size_t count)
+  {
+    for (int c = 0; c < detector.channels; c++) {
+      wav_add_samples(detector.clip, c, detector.pending[c].data() + offset, count);
+    }
+    wav_flush(detector.clip);
+  }
+
+
+  inline void event_copy_time(const event_detector& detector, size_t offset, std::vector<uint32_t>& time)
+  {
+    const uint32_t* row = &detector.pending_times[offset * detector.time_words];
+    time.assign(row, row + detector.time_words);
+  }
+
+
+  //Write the index row of the event in progress and close its clip.
+  inline void event_finish(event_detector& detector)
+  {
+    detector.active = 0;
+
+    if (detector.clip_open) {
+      wav_close(detector.clip);
+      detector.clip_open = 0;
+    }
+
+    if (detector.loud_frames < (uint64_t)EVENT_MIN_FRAMES) {
+      if (detector.clips) {
+        std::remove(detector.clip_name.c_str());
+      }
+      return;
+    }
+
+    detector.events = detector.events + 1;
+    fprintf(detector.index, "%llu,%llu,%llu,%.4f,%.2f,%.2f,%s",
+            (unsigned long long)detector.events, (unsigned long long)detector.start_sample,
+            (unsigned long long)detector.end_sample,
+            (detector.end_sample - detector.start_sample) / (double)detector.sample_rate,
+            detector.peak_db, detector.start_floor_db,
+            detector.clips ? detector.clip_name.c_str() : "");
+    for (int i = 0; i < detector.time_words; i++) {
+      fprintf(detector.index, ",%u", detector.start_time[i]);
+    }
+    for (int i = 0; i < detector.time_words; i++) {
+      fprintf(detector.index, ",%u", detector.end_time[i]);
+    }
+    fprintf(detector.index, "\n");
+  }
+
+
+  //Run every whole frame queued so far through the detector.
+  inline void event_flush(event_detector& detector)
+  {
+    size_t available = detector.pending_times.size() / detector.time_words;
+
+    for (int c = 0; c < detector.channels; c++) {
+      available = std::min(available, detector.pending[c].size());
+    }
+
+    while (detector.position + EVENT_FRAME <= available) {
+      size_t offset = detector.position;
+      uint64_t frame_sample = detector.pending_first_sample + offset;
+      double sum_squares = 0.0;
+
+      for (int c = 0; c < detector.channels; c++) {
+        const int16_t* x = detector.pending[c].data() + offset;
+        for (int i = 0; i < EVENT_FRAME; i++) {
+          sum_squares = sum_squares + (double)x[i] * x[i];
+        }
+      }
+      double level_db = 10.0 * std::log10(sum_squares / ((double)EVENT_FRAME * detector.channels) + 1.0);
+
+      if (!detector.have_floor) {
+        detector.floor_db = level_db;
+        detector.have_floor = 1;
+      }
+
+      if (!detector.active && level_db > detector.floor_db + detector.on_db) {
+        detector.active = 1;
+        detector.start_sample = frame_sample;
+        detector.loud_frames = 0;
+        detector.quiet_frames = 0;
+        detector.peak_db = level_db;
+        detector.start_floor_db = detector.floor_db;
+        event_copy_time(detector, offset, detector.start_time);
+
+        if (detector.clips) {
+          char name[32];
+          size_t preroll = std::min(offset, (size_t)EVENT_PREROLL * EVENT_FRAME);
+          snprintf(name, sizeof(name), "event_%05llu.wav", (unsigned long long)(detector.events + 1));
+          detector.clip_name = name;
+          detector.clip_open = (wav_open(detector.clip, detector.clip_name, detector.channels, detector.sample_rate) == 0);
+          if (detector.clip_open) {
+            event_clip_samples(detector, offset - preroll, preroll);
+          }
+        }
+      }
+
+      if (detector.active) {
+        if (detector.clip_open) {
+          event_clip_samples(detector, offset, EVENT_FRAME);
+        }
+        if (level_db >= detector.floor_db + detector.off_db) {
+          detector.loud_frames = detector.loud_frames + 1;
+          detector.quiet_frames = 0;
+          detector.peak_db = std::max(detector.peak_db, level_db);
+          detector.end_sample = frame_sample + EVENT_FRAME;
+          event_copy_time(detector, offset + EVENT_FRAME - 1, detector.end_time);
+        }
+        else {
+          detector.quiet_frames = detector.quiet_frames + 1;
+          if (detector.quiet_frames >= EVENT_HANGOVER) {
+            event_finish(detector);
+          }
+        }
+      }
+
+      double step = (level_db < detector.floor_db) ? EVENT_FLOOR_FALL : EVENT_FLOOR_RISE;
+      detector.floor_db = detector.floor_db + (level_db - detector.floor_db) * step;
+      detector.position = detector.position + EVENT_FRAME;
+    }
+
+    //Keep the pre-roll ahead of the next frame.
+    size_t keep_from = detector.position - std::min(detector.position, (size_t)EVENT_PREROLL * EVENT_FRAME);
+    if (keep_from > 0) {
+      for (int c = 0; c < detector.channels; c++) {
+        detector.pending[c].erase(detector.pending[c].begin(), detector.pending[c].begin() + keep_from);
+      }
+      detector.pending_times.erase(detector.pending_times.begin(),
+                                   detector.pending_times.begin() + keep_from * detector.time_words);
+      detector.pending_first_sample = detector.pending_first_sample + keep_from;
+      detector.position = detector.position - keep_from;
+    }
+  }
+
+
+  //End an event still going at the end of the recording and close the
+  //index.
+  //Returns 0, or -1 on a write error.
+  inline int event_close(event_detector& detector)
+  {
+    if (detector.active) {
+      event_finish(detector);
+    }
+    if (detector.index == NULL) {
+      return -1;
+    }
+
+    int result = (fclose(detector.index) == 0) ? 0 : -1;
+    detector.index = NULL;
+    return result;
+  }
+
+#endif
@@ -0,0 +1,383 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_features.h
+// --!@brief      STFT mel band energies of the collar audio
+// --!@details    Overlapping Hann windowed FFT frames reduced to mel band
+// --             energies as the card is parsed, so routine spectral
+// --             analysis doesn't need the raw audio.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Frames are FEATURE_FRAME samples long every FEATURE_HOP samples. Each is
+//Hann windowed, transformed and its power spectrum summed into
+//FEATURE_MELS triangular bands evenly spaced in mel from 0 Hz to half the
+//sample rate. Band energies are written in dB of int16 units squared, one
+//float32 row per frame for each channel.
+//
+//Each frame also gets the time row of its center sample. Times are passed
+//in as opaque rows of time_words uint32 so the gps_time layout stays in
+//the parser, and are written out the same way.
+//
+//Samples and times that don't fill a frame carry over to the next chunk.
+//The frames of a chunk are independent and split between threads.
+
+#ifndef SD_FEATURES_H
+#define SD_FEATURES_H
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+  const int FEATURE_FRAME = 1024;
+  const int FEATURE_HOP = 512;
+  const int FEATURE_MELS = 40;
+  const int FEATURE_MAX_CHANNELS = 2;
+  const double FEATURE_PI = 3.14159265358979323846;
+
+  //Floor added to band energies so silence gives a finite dB value.
+  const double FEATURE_FLOOR = 1e-10;
+
+
+  struct feature_extractor {
+    int channels;
+    int sample_rate;
+    int threads;
+    int time_words;
+
+    std::vector<float> window;
+    std::vector<std::complex<float> > twiddles;
+    std::vector<int> bit_reverse;
+
+    //Band b covers FFT bins band_first[b] on with weights from
+    //band_weights[band_offset[b]].
+    std::vector<int> band_first;
+    std::vector<int> band_offset;
+    std::vector<int> band_bins;
+    std::vector<float> band_weights;
+    std::vector<double> band_edges_hz;
+
+    std::vector<float> pending[FEATURE_MAX_CHANNELS];
+    std::vector<uint32_t> pending_times;
+
+    FILE* files[FEATURE_MAX_CHANNELS];
+    FILE* time_file;
+    uint64_t frames;
+  };
+
+
+  inline double feature_mel(double hz)
+  {
+    return 2595.0 * std::log10(1.0 + hz / 700.0);
+  }
+
+  inline double feature_hz(double mel)
+  {
+    return 700.0 * (std::pow(10.0, mel / 2595.0) - 1.0);
+  }
+
+
+  //Window, FFT tables and mel filters for the sample rate.
+  inline void feature_tables(feature_extractor& features)
+  {
+    int log_size = 0;
+    double bin_hz = (double)features.sample_rate / FEATURE_FRAME;
+    double top_mel = feature_mel(features.sample_rate / 2.0);
+
+    while ((1 << log_size) < FEATURE_FRAME) {
+      log_size = log_size + 1;
+    }
+
+    features.window.resize(FEATURE_FRAME);
+    for (int i = 0; i < FEATURE_FRAME; i++) {
+      features.window[i] = (float)(0.5 - 0.5 * std::cos(2.0 * FEATURE_PI * i / FEATURE_FRAME));
+    }
+
+    features.bit_reverse.resize(FEATURE_FRAME);
+    for (int i = 0; i < FEATURE_FRAME; i++) {
+      int reversed = 0;
+      for (int b = 0; b < log_size; b++) {
+        reversed = reversed | (((i >> b) & 1) << (log_size - 1 - b));
+      }
+      features.bit_reverse[i] = reversed;
+    }
+
+    features.twiddles.resize(FEATURE_FRAME / 2);
+    for (int i = 0; i < FEATURE_FRAME / 2; i++) {
+      double angle = -2.0 * FEATURE_PI * i / FEATURE_FRAME;
+      features.twiddles[i] = std::complex<float>((float)std::cos(angle), (float)std::sin(angle));
+    }
+
+    features.band_edges_hz.resize(FEATURE_MELS + 2);
+    for (int b = 0; b < FEATURE_MELS + 2; b++) {
+      features.band_edges_hz[b] = feature_hz(top_mel * b / (FEATURE_MELS + 1));
+    }
+
+    features.band_first.assign(FEATURE_MELS, 0);
+    features.band_offset.assign(FEATURE_MELS, 0);
+    features.band_bins.assign(FEATURE_MELS, 0);
+    features.band_weights.clear();
+    for (int b = 0; b < FEATURE_MELS; b++) {
+      double low = features.band_edges_hz[b];
+      double center = features.band_edges_hz[b + 1];
+      double high = features.band_edges_hz[b + 2];
+      features.band_first[b] = -1;
+      features.band_offset[b] = (int)features.band_weights.size();
+      for (int k = 0; k <= FEATURE_FRAME / 2; k++) {
+        double hz = k * bin_hz;
+        double weight = 0.0;
+        if (hz > low && hz <= center) {
+          weight = (hz - low) / (center - low);
+        }
+        else if (hz > center && hz < high) {
+          weight = (high - hz) / (high - center);
+        }
+        if (weight > 0.0) {
+          if (features.band_first[b] < 0) {
+            features.band_first[b] = k;
+          }
+          //Bins between the first and this one with no weight are kept as
+          //zeros so each band is one contiguous run.
+          while (features.band_first[b] + features.band_bins[b] < k) {
+            features.band_weights.push_back(0.0f);
+            features.band_bins[b] = features.band_bins[b] + 1;
+          }
+          features.band_weights.push_back((float)weight);
+          features.band_bins[b] = features.band_bins[b] + 1;
+        }
+      }
+      //Low bands narrower than a bin take the nearest bin.
+      if (features.band_first[b] < 0) {
+        features.band_first[b] = std::min(FEATURE_FRAME / 2, (int)std::floor(center / bin_hz + 0.5));
+        features.band_weights.push_back(1.0f);
+        features.band_bins[b] = 1;
+      }
+    }
+  }
+
+
+  //In place radix-2 FFT of FEATURE_FRAME points.
+  inline void feature_fft(const feature_extractor& features, std::complex<float>* x)
+  {
+    for (int i = 0; i < FEATURE_FRAME; i++) {
+      int j = features.bit_reverse[i];
+      if (j > i) {
+        std::swap(x[i], x[j]);
+      }
+    }
+
+    for (int size = 2; size <= FEATURE_FRAME; size = size * 2) {
+      int half = size / 2;
+      int step = FEATURE_FRAME / size;
+      for (int start = 0; start < FEATURE_FRAME; start = start + size) {
+        for (int k = 0; k < half; k++) {
+          std::complex<float> t = features.twiddles[k * step] * x[start + k + half];
+          x[start + k + half] = x[start + k] - t;
+          x[start + k] = x[start + k] + t;
+        }
+      }
+    }
+  }
+
+
+  //Mel band energies in dB of one frame starting at samples.
+  inline void feature_frame(const feature_extractor& features, const float* samples,
+                            std::vector<std::complex<float> >& spectrum, float* bands)
+  {
+    std::vector<float> power(FEATURE_FRAME / 2 + 1);
+
+    spectrum.resize(FEATURE_FRAME);
+    for (int i = 0; i < FEATURE_FRAME; i++) {
+      spectrum[i] = std::complex<float>(samples[i] * features.window[i], 0.0f);
+    }
+    feature_fft(features, spectrum.data());
+
+    //Scaled so a full scale sine gives its amplitude squared over 2 summed
+    //across its bins, independent of the frame length.
+    double scale = 2.0 / ((double)FEATURE_FRAME * FEATURE_FRAME * 0.375);
+    for (int k = 0; k <= FEATURE_FRAME / 2; k++) {
+      power[k] = (float)(std::norm(spectrum[k]) * scale);
+    }
+
+    for (int b = 0; b < FEATURE_MELS; b++) {
+      const float* weights = &features.band_weights[features.band_offset[b]];
+      const float* bins = &power[features.band_first[b]];
+      double energy = 0.0;
+      for (int k = 0; k < features.band_bins[b]; k++) {
+        energy = energy + weights[k] * bins[k];
+      }
+      bands[b] = (float)(10.0 * std::log10(energy + FEATURE_FLOOR));
+    }
+  }
+
+
+  //Open the feature files, one per channel, the time file and a list of
+  //the band edges.
+  //Returns 0, or -1 if a file could not be created.
+  inline int feature_open(feature_extractor& features, const std::vector<std::string>& filenames,
+                          const std::string& time_filename, const std::string& band_filename,
+                          int sample_rate, int time_words, int threads)
+  {
+    features.channels = std::min((int)filenames.size(), FEATURE_MAX_CHANNELS);
+    features.sample_rate = sample_rate;
+    features.time_words = time_words;
+    features.threads = (threads > 0) ? threads : int(std::thread::hardware_concurrency());
+    if (features.threads <= 0) {
+      features.threads = 1;
+    }
+    features.frames = 0;
+    features.pending_times.clear();
+    feature_tables(features);
+
+    int result = 0;
+    for (int c = 0; c < FEATURE_MAX_CHANNELS; c++) {
+      features.pending[c].clear();
+      features.files[c] = NULL;
+      if (c < features.channels) {
+        features.files[c] = fopen(filenames[c].c_str(), "wb");
+        result = (features.files[c] == NULL) ? -1 : result;
+      }
+    }
+    features.time_file = fopen(time_filename.c_str(), "wb");
+    result = (features.time_file == NULL) ? -1 : result;
+
+    FILE* bands = fopen(band_filename.c_str(), "w");
+    if (bands == NULL) {
+      return -1;
+    }
+    fprintf(bands, "band,low_hz,center_hz,high_hz\n");
+    for (int b = 0; b < FEATURE_MELS; b++) {
+      fprintf(bands, "%d,%.2f,%.2f,%.2f\n", b + 1, features.band_edges_hz[b],
+              features.band_edges_hz[b + 1], features.band_edges_hz[b + 2]);
+    }
+    fprintf(bands, "#frame %d samples, hop %d samples, %d Hz\n", FEATURE_FRAME, FEATURE_HOP, sample_rate);
+    if (fclose(bands) != 0) {
+      result = -1;
+    }
+    return result;
+  }
+
+
+  //Queue samples of one channel.
+  template <typename T>
+  inline void feature_add_samples(feature_extractor& features, int channel, const T* samples, size_t count)
+  {
+    std::vector<float>& pending = features.pending[channel];
+    size_t first = pending.size();
+
+    pending.resize(first + count);
+    for (size_t i = 0; i < count; i++) {
+      pending[first + i] = (float)samples[i];
+    }
+  }
+
+  //Queue the time rows of count samples, shared by all channels.
+  inline void feature_add_times(feature_extractor& features, const uint32_t* times, size_t count)
+  {
+    features.pending_times.insert(features.pending_times.end(), times, times + count * features.time_words);
+  }
+
+
+  inline void feature_worker(const feature_extractor* features, int channel, size_t frames,
+                             int stride, int offset, std::vector<float>* bands)
+  {
+    std::vector<std::complex<float> > spectrum;
+
+    for (size_t f = offset; f < frames; f = f + stride) {
+      feature_frame(*features, features->pending[channel].data() + f * FEATURE_HOP, spectrum,
+                    bands->data() + f * FEATURE_MELS);
+    }
+  }
+
+
+  //Compute and write every frame the queued samples allow.
+  //Returns 0, or -1 on a write error.
+  inline int feature_flush(feature_extractor& features)
+  {
+    size_t available = features.pending_times.size() / features.time_words;
+    std::vector<float> bands;
+    int result = 0;
+
+    for (int c = 0; c < features.channels; c++) {
+      available = std::min(available, features.pending[c].size());
+    }
+    if (available < (size_t)FEATURE_FRAME) {
+      return 0;
+    }
+
+    size_t frames = (available - FEATURE_FRAME) / FEATURE_HOP + 1;
+    int threads = (int)std::min((size_t)features.threads, frames);
+
+    for (int c = 0; c < features.channels; c++) {
+      std::vector<std::thread> workers;
+      bands.resize(frames * FEATURE_MELS);
+      for (int t = 1; t < threads; t++) {
+        workers.push_back(std::thread(feature_worker, &features, c, frames, threads, t, &bands));
+      }
+      feature_worker(&features, c, frames, threads, 0, &bands);
+      for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+      }
+      if (fwrite(bands.data(), sizeof(float), bands.size(), features.files[c]) != bands.size()) {
+        result = -1;
+      }
+    }
+
+    for (size_t f = 0; f < frames; f++) {
+      const uint32_t* center = &features.pending_times[(f * FEATURE_HOP + FEATURE_FRAME / 2) * features.time_words];
+      if (fwrite(center, sizeof(uint32_t), features.time_words, features.time_file) != (size_t)features.time_words) {
+        result = -1;
+      }
+    }
+
+    size_t used = frames * FEATURE_HOP;
+    for (int c = 0; c < features.channels; c++) {
+      features.pending[c].erase(features.pending[c].begin(), features.pending[c].begin() + used);
+    }
+    features.pending_times.erase(features.pending_times.begin(),
+                                 features.pending_times.begin() + used * features.time_words);
+    features.frames = features.frames + frames;
+    return result;
+  }
+
+
+  //Close the files. Samples short of a whole frame at the end are dropped.
+  //Returns 0, or -1 on a write error.
+  inline int feature_close(feature_extractor& features)
+  {
+    int result = 0;
+
+    for (int c = 0; c < features.channels; c++) {
+      if (features.files[c] != NULL && fclose(features.files[c]) != 0) {
+        result = -1;
+      }
+      features.files[c] = NULL;
+    }
+    if (features.time_file != NULL && fclose(features.time_file) != 0) {
+      result = -1;
+    }
+    features.time_file = NULL;
+    return result;
+  }
+
+#endif
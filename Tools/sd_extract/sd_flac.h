@@ -0,0 +1,697 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_flac.h
+// --!@brief      Streaming FLAC encoder for the collar audio channels
+// --!@details    Lossless compression of the decoded audio with the FLAC
+// --             fixed predictors and Rice coded residuals, frames encoded
+// --             in parallel.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Writes a standard .flac file so it plays and decodes with the usual
+//tools (flac, ffmpeg, sox, MATLAB audioread) without anything from here.
+//
+//Each frame holds FLAC_BLOCK_SIZE samples per channel. Every channel of a
+//frame is tried with the fixed polynomial predictors of order 0 to 4 and
+//the one with the smallest residual is kept. The residual is Rice coded
+//in partitions with the parameter picked per partition. Two channels are
+//also tried as left/side, side/right and mid/side.
+//
+//Frames don't depend on each other, so whole blocks are split between
+//threads and written back in order. Samples that don't fill a block wait
+//for the next chunk, and the last short block is written on close.
+//
+//The MD5 of the audio in STREAMINFO is left as zero, which the format
+//allows and decoders take as not known.
+
+#ifndef SD_FLAC_H
+#define SD_FLAC_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+  const int FLAC_MAX_CHANNELS = 2;
+  const int FLAC_BLOCK_SIZE = 4096;
+  const int FLAC_BITS = 16;
+  const int FLAC_MAX_FIXED_ORDER = 4;
+  const int FLAC_MAX_PARTITION_ORDER = 8;
+  const int FLAC_MAX_RICE_PARAMETER = 14;
+  const int FLAC_STREAMINFO_BYTES = 34;
+
+  //Blocks encoded by each thread per flush, bounding the memory held by
+  //encoded frames waiting to be written.
+  const int FLAC_BLOCKS_PER_THREAD = 64;
+
+  enum flac_channel_assignment {
+    FLAC_INDEPENDENT = 0,
+    FLAC_LEFT_SIDE = 8,
+    FLAC_SIDE_RIGHT = 9,
+    FLAC_MID_SIDE = 10
+  };
+
+  enum flac_subframe_type {
+    FLAC_SUBFRAME_CONSTANT = 0x00,
+    FLAC_SUBFRAME_VERBATIM = 0x01,
+    FLAC_SUBFRAME_FIXED = 0x08
+  };
+
+
+  //MSB first bit packer for one frame.
+  struct flac_bits {
+    std::vector<uint8_t> bytes;
+    uint64_t accumulator;
+    int count;
+  };
+
+
+  struct flac_writer {
+    FILE* file;
+    int channels;
+    int sample_rate;
+    int threads;
+
+    uint64_t samples;
+    uint64_t frame_number;
+    uint32_t min_frame_bytes;
+    uint32_t max_frame_bytes;
+    uint64_t bytes_written;
+
+    std::vector<int32_t> pending[FLAC_MAX_CHANNELS];
+  };
+
+
+  inline void flac_bits_reset(flac_bits& bits)
+  {
+    bits.bytes.clear();
+    bits.accumulator = 0;
+    bits.count = 0;
+  }
+
+
+  //Append the low n bits of value, n up to 32.
+  inline void flac_put_bits(flac_bits& bits, uint32_t value, int n)
+  {
+    if (n == 0) {
+      return;
+    }
+    bits.accumulator = (bits.accumulator << n) | (value & (0xFFFFFFFFULL >> (32 - n)));
+    bits.count = bits.count + n;
+    while (bits.count >= 8) {
+      bits.count = bits.count - 8;
+      bits.bytes.push_back((uint8_t)(bits.accumulator >> bits.count));
+    }
+  }
+
+
+  inline void flac_put_signed(flac_bits& bits, int32_t value, int n)
+  {
+    flac_put_bits(bits, (uint32_t)value, n);
+  }
+
+
+  //q zero bits then a one.
+  inline void flac_put_unary(flac_bits& bits, uint32_t q)
+  {
+    while (q >= 32) {
+      flac_put_bits(bits, 0, 32);
+      q = q - 32;
+    }
+    flac_put_bits(bits, 1, (int)q + 1);
+  }
+
+
+  inline void flac_align(flac_bits& bits)
+  {
+    if (bits.count != 0) {
+      flac_put_bits(bits, 0, 8 - bits.count);
+    }
+  }
+
+
+  inline uint8_t flac_crc8(const uint8_t* data, size_t length)
+  {
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < length; i++) {
+      crc = crc ^ data[i];
+      for (int b = 0; b < 8; b++) {
+        crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+      }
+    }
+    return crc;
+  }
+
+
+  inline uint16_t flac_crc16(const uint8_t* data, size_t length)
+  {
+    uint16_t crc = 0;
+
+    for (size_t i = 0; i < length; i++) {
+      crc = crc ^ (uint16_t)(data[i] << 8);
+      for (int b = 0; b < 8; b++) {
+        crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+      }
+    }
+    return crc;
+  }
+
+
+  //Zigzag so small negative residuals code as small values.
+  inline uint32_t flac_fold(int32_t value)
+  {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+  }
+
+
+  //Residual of the fixed predictor of the given order for samples
+  //order..n-1.
+  inline void flac_fixed_residual(const int32_t* x, int n, int order, int32_t* residual)
+  {
+    switch (order) {
+    case 0:
+      for (int i = 0; i < n; i++) residual[i] = x[i];
+      break;
+    case 1:
+      for (int i = 1; i < n; i++) residual[i - 1] = x[i] - x[i - 1];
+      break;
+    case 2:
+      for (int i = 2; i < n; i++) residual[i - 2] = x[i] - 2 * x[i - 1] + x[i - 2];
+      break;
+    case 3:
+      for (int i = 3; i < n; i++) residual[i - 3] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+      break;
+    case 4:
+      for (int i = 4; i < n; i++) residual[i - 4] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+      break;
+    }
+  }
+
+
+  //Bits for count folded residuals summing to sum, Rice coded with
+  //parameter k. Close to exact and needs only the sum.
+  inline uint64_t flac_rice_bits(uint64_t sum, int count, int k)
+  {
+    return (uint64_t)count * (k + 1) + (sum >> k) - (k > 0 ? count / 2 : 0);
+  }
+
+
+  //Best parameter for one partition, searched around the estimate from
+  //the mean folded value.
+  inline int flac_rice_parameter(uint64_t sum, int count, uint64_t& bits)
+  {
+    int estimate = 0;
+    int best = 0;
+
+    while (estimate < FLAC_MAX_RICE_PARAMETER && ((uint64_t)count << (estimate + 1)) < sum) {
+      estimate = estimate + 1;
+    }
+
+    bits = UINT64_MAX;
+    for (int k = std::max(0, estimate - 1); k <= std::min(FLAC_MAX_RICE_PARAMETER, estimate + 1); k++) {
+      uint64_t k_bits = flac_rice_bits(sum, count, k);
+      if (k_bits < bits) {
+        bits = k_bits;
+        best = k;
+      }
+    }
+    return best;
+  }
+
+
+  //Partition order and parameters for the residual of an n sample block
+  //with the given predictor order. The folded sums of the smallest
+  //partitions are taken once and added pairwise for each larger size.
+  //Returns the estimated residual size in bits.
+  inline uint64_t flac_plan_residual(const int32_t* residual, int n, int order,
+                                     int& partition_order, std::vector<int>& parameters)
+  {
+    std::vector<uint64_t> sums;
+    std::vector<int> trial;
+    uint64_t best_bits = UINT64_MAX;
+    int max_order = 0;
+
+    while (max_order < FLAC_MAX_PARTITION_ORDER && (n % (2 << max_order)) == 0 &&
+           (n >> (max_order + 1)) > order) {
+      max_order = max_order + 1;
+    }
+
+    int partitions = 1 << max_order;
+    const int32_t* next = residual;
+    sums.assign(partitions, 0);
+    for (int i = 0; i < partitions; i++) {
+      int count = (n >> max_order) - (i == 0 ? order : 0);
+      for (int j = 0; j < count; j++) {
+        sums[i] = sums[i] + flac_fold(next[j]);
+      }
+      next = next + count;
+    }
+
+    partition_order = 0;
+    for (int p = max_order; p >= 0; p--) {
+      uint64_t total = 6;
+
+      trial.resize(1 << p);
+      for (int i = 0; i < (1 << p); i++) {
+        int count = (n >> p) - (i == 0 ? order : 0);
+        uint64_t bits;
+        trial[i] = flac_rice_parameter(sums[i], count, bits);
+        total = total + 4 + bits;
+      }
+      if (total < best_bits) {
+        best_bits = total;
+        partition_order = p;
+        parameters = trial;
+      }
+
+      for (int i = 0; i < (1 << p) / 2; i++) {
+        sums[i] = sums[2 * i] + sums[2 * i + 1];
+      }
+    }
+    return best_bits;
+  }
+
+
+  //Fixed predictor order with the smallest sum of absolute residuals,
+  //which is the sum as well.
+  inline int flac_fixed_order(const int32_t* x, int n, uint64_t& cost)
+  {
+    uint64_t costs[FLAC_MAX_FIXED_ORDER + 1] = { 0 };
+    int best = 0;
+
+    if (n <= FLAC_MAX_FIXED_ORDER) {
+      cost = 0;
+      for (int i = 0; i < n; i++) {
+        cost = cost + (uint64_t)std::abs(x[i]);
+      }
+      return 0;
+    }
+
+    for (int i = FLAC_MAX_FIXED_ORDER; i < n; i++) {
+      int32_t e0 = x[i];
+      int32_t e1 = e0 - x[i - 1];
+      int32_t e2 = e1 - (x[i - 1] - x[i - 2]);
+      int32_t e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+      int32_t e4 = e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]);
+      costs[0] = costs[0] + (uint64_t)std::abs(e0);
+      costs[1] = costs[1] + (uint64_t)std::abs(e1);
+      costs[2] = costs[2] + (uint64_t)std::abs(e2);
+      costs[3] = costs[3] + (uint64_t)std::abs(e3);
+      costs[4] = costs[4] + (uint64_t)std::abs(e4);
+    }
+    for (int order = 1; order <= FLAC_MAX_FIXED_ORDER; order++) {
+      if (costs[order] < costs[best]) {
+        best = order;
+      }
+    }
+    cost = costs[best];
+    return best;
+  }
+
+
+  //Smallest subframe for one channel. bps is 17 for a side channel.
+  inline void flac_encode_subframe(flac_bits& bits, const int32_t* x, int n, int bps,
+                                   std::vector<int32_t>& residual)
+  {
+    int constant = 1;
+    int partition_order;
+    std::vector<int> parameters;
+    uint64_t cost;
+
+    for (int i = 1; i < n && constant; i++) {
+      constant = (x[i] == x[0]);
+    }
+    if (constant) {
+      flac_put_bits(bits, FLAC_SUBFRAME_CONSTANT << 1, 8);
+      flac_put_signed(bits, x[0], bps);
+      return;
+    }
+
+    int order = flac_fixed_order(x, n, cost);
+    residual.resize(n);
+    flac_fixed_residual(x, n, order, residual.data());
+    uint64_t fixed_bits = (uint64_t)order * bps + flac_plan_residual(residual.data(), n, order, partition_order, parameters);
+
+    if (fixed_bits >= (uint64_t)n * bps) {
+      flac_put_bits(bits, FLAC_SUBFRAME_VERBATIM << 1, 8);
+      for (int i = 0; i < n; i++) {
+        flac_put_signed(bits, x[i], bps);
+      }
+      return;
+    }
+
+    flac_put_bits(bits, (FLAC_SUBFRAME_FIXED | order) << 1, 8);
+    for (int i = 0; i < order; i++) {
+      flac_put_signed(bits, x[i], bps);
+    }
+
+    flac_put_bits(bits, 0, 2);
+    flac_put_bits(bits, partition_order, 4);
+
+    const int32_t* next = residual.data();
+    for (int p = 0; p < (1 << partition_order); p++) {
+      int count = (n >> partition_order) - (p == 0 ? order : 0);
+      int k = parameters[p];
+      flac_put_bits(bits, k, 4);
+      for (int i = 0; i < count; i++) {
+        uint32_t folded = flac_fold(next[i]);
+        flac_put_unary(bits, folded >> k);
+        flac_put_bits(bits, folded, k);
+      }
+      next = next + count;
+    }
+  }
+
+
+  //UTF-8 style coding of the frame number.
+  inline void flac_put_frame_number(flac_bits& bits, uint64_t number)
+  {
+    if (number < 0x80) {
+      flac_put_bits(bits, (uint32_t)number, 8);
+      return;
+    }
+
+    int bytes = 2;
+    while (bytes < 7 && number >= (1ULL << (5 * bytes + 1))) {
+      bytes = bytes + 1;
+    }
+    uint32_t lead = (0xFF00 >> bytes) & 0xFF;
+    flac_put_bits(bits, lead | (uint32_t)(number >> (6 * (bytes - 1))), 8);
+    for (int i = bytes - 2; i >= 0; i--) {
+      flac_put_bits(bits, 0x80 | (uint32_t)((number >> (6 * i)) & 0x3F), 8);
+    }
+  }
+
+
+  //Encode one frame of n samples per channel into bytes.
+  inline void flac_encode_frame(const int32_t* const* channel_data, int channels, int n,
+                                int sample_rate, uint64_t frame_number, std::vector<uint8_t>& bytes)
+  {
+    flac_bits bits;
+    std::vector<int32_t> residual;
+    std::vector<int32_t> mid;
+    std::vector<int32_t> side;
+    int assignment = channels - 1;
+    int block_size_code = (n == FLAC_BLOCK_SIZE) ? 12 : 7;
+    int rate_code = (sample_rate < 65536) ? 13 : 0;
+
+    flac_bits_reset(bits);
+    bits.bytes.reserve((size_t)n * channels * 2 + 32);
+
+    if (channels == 2) {
+      const int32_t* left = channel_data[0];
+      const int32_t* right = channel_data[1];
+      mid.resize(n);
+      side.resize(n);
+      for (int i = 0; i < n; i++) {
+        mid[i] = (left[i] + right[i]) >> 1;
+        side[i] = left[i] - right[i];
+      }
+
+      uint64_t left_cost;
+      uint64_t right_cost;
+      uint64_t mid_cost;
+      uint64_t side_cost;
+      flac_fixed_order(left, n, left_cost);
+      flac_fixed_order(right, n, right_cost);
+      flac_fixed_order(mid.data(), n, mid_cost);
+      flac_fixed_order(side.data(), n, side_cost);
+      uint64_t best = left_cost + right_cost;
+
+      if (left_cost + side_cost < best) {
+        best = left_cost + side_cost;
+        assignment = FLAC_LEFT_SIDE;
+      }
+      if (side_cost + right_cost < best) {
+        best = side_cost + right_cost;
+        assignment = FLAC_SIDE_RIGHT;
+      }
+      if (mid_cost + side_cost < best) {
+        best = mid_cost + side_cost;
+        assignment = FLAC_MID_SIDE;
+      }
+    }
+
+    //Header. Sync, fixed block size, block size and rate codes, channel
+    //assignment and 16 bit samples.
+    flac_put_bits(bits, 0xFFF8, 16);
+    flac_put_bits(bits, block_size_code, 4);
+    flac_put_bits(bits, rate_code, 4);
+    flac_put_bits(bits, assignment, 4);
+    flac_put_bits(bits, 4, 3);
+    flac_put_bits(bits, 0, 1);
+    flac_put_frame_number(bits, frame_number);
+    if (block_size_code == 7) {
+      flac_put_bits(bits, n - 1, 16);
+    }
+    if (rate_code == 13) {
+      flac_put_bits(bits, sample_rate, 16);
+    }
+    flac_put_bits(bits, flac_crc8(bits.bytes.data(), bits.bytes.size()), 8);
+
+    switch (assignment) {
+    case FLAC_LEFT_SIDE:
+      flac_encode_subframe(bits, channel_data[0], n, FLAC_BITS, residual);
+      flac_encode_subframe(bits, side.data(), n, FLAC_BITS + 1, residual);
+      break;
+    case FLAC_SIDE_RIGHT:
+      flac_encode_subframe(bits, side.data(), n, FLAC_BITS + 1, residual);
+      flac_encode_subframe(bits, channel_data[1], n, FLAC_BITS, residual);
+      break;
+    case FLAC_MID_SIDE:
+      flac_encode_subframe(bits, mid.data(), n, FLAC_BITS, residual);
+      flac_encode_subframe(bits, side.data(), n, FLAC_BITS + 1, residual);
+      break;
+    default:
+      for (int c = 0; c < channels; c++) {
+        flac_encode_subframe(bits, channel_data[c], n, FLAC_BITS, residual);
+      }
+      break;
+    }
+
+    flac_align(bits);
+    uint16_t crc = flac_crc16(bits.bytes.data(), bits.bytes.size());
+    flac_put_bits(bits, crc, 16);
+
+    bytes.swap(bits.bytes);
+  }
+
+
+  inline void flac_put_streaminfo(const flac_writer& flac, uint8_t* info)
+  {
+    flac_bits bits;
+    uint32_t min_frame = (flac.min_frame_bytes == UINT32_MAX) ? 0 : flac.min_frame_bytes;
+
+    flac_bits_reset(bits);
+    flac_put_bits(bits, FLAC_BLOCK_SIZE, 16);
+    flac_put_bits(bits, FLAC_BLOCK_SIZE, 16);
+    flac_put_bits(bits, min_frame, 24);
+    flac_put_bits(bits, flac.max_frame_bytes, 24);
+    flac_put_bits(bits, flac.sample_rate, 20);
+    flac_put_bits(bits, flac.channels - 1, 3);
+    flac_put_bits(bits, FLAC_BITS - 1, 5);
+    flac_put_bits(bits, (uint32_t)(flac.samples >> 32), 4);
+    flac_put_bits(bits, (uint32_t)flac.samples, 32);
+    for (int i = 0; i < 4; i++) {
+      flac_put_bits(bits, 0, 32);
+    }
+    memcpy(info, bits.bytes.data(), FLAC_STREAMINFO_BYTES);
+  }
+
+
+  //Open filename and write the stream marker and a STREAMINFO to be
+  //filled in on close. threads of 0 uses one per core.
+  //Returns 0, or -1 if the file could not be created.
+  inline int flac_open(flac_writer& flac, const std::string& filename, int channels,
+                       int sample_rate, int threads)
+  {
+    uint8_t header[8 + FLAC_STREAMINFO_BYTES];
+
+    flac.file = fopen(filename.c_str(), "wb");
+    flac.channels = std::min(std::max(channels, 1), FLAC_MAX_CHANNELS);
+    flac.sample_rate = sample_rate;
+    flac.threads = (threads > 0) ? threads : int(std::thread::hardware_concurrency());
+    if (flac.threads <= 0) {
+      flac.threads = 1;
+    }
+    flac.samples = 0;
+    flac.frame_number = 0;
+    flac.min_frame_bytes = UINT32_MAX;
+    flac.max_frame_bytes = 0;
+    flac.bytes_written = 0;
+    for (int c = 0; c < FLAC_MAX_CHANNELS; c++) {
+      flac.pending[c].clear();
+    }
+    if (flac.file == NULL) {
+      return -1;
+    }
+
+    //Last metadata block, type 0 STREAMINFO.
+    memcpy(header, "fLaC", 4);
+    header[4] = 0x80;
+    header[5] = 0;
+    header[6] = 0;
+    header[7] = FLAC_STREAMINFO_BYTES;
+    flac_put_streaminfo(flac, &header[8]);
+
+    if (fwrite(header, 1, sizeof(header), flac.file) != sizeof(header)) {
+      fclose(flac.file);
+      flac.file = NULL;
+      return -1;
+    }
+    flac.bytes_written = sizeof(header);
+    return 0;
+  }
+
+
+  //Queue samples for one channel. They are encoded by flac_flush.
+  template <typename T>
+  inline void flac_add_samples(flac_writer& flac, int channel, const T* samples, size_t count)
+  {
+    std::vector<int32_t>& pending = flac.pending[channel];
+    size_t first = pending.size();
+
+    pending.resize(first + count);
+    for (size_t i = 0; i < count; i++) {
+      pending[first + i] = (int16_t)samples[i];
+    }
+  }
+
+
+  inline void flac_encode_worker(const flac_writer* flac, size_t first_block, size_t blocks,
+                                 int stride, int offset, std::vector<std::vector<uint8_t> >* frames)
+  {
+    for (size_t b = offset; b < blocks; b = b + stride) {
+      const int32_t* channel_data[FLAC_MAX_CHANNELS];
+      for (int c = 0; c < flac->channels; c++) {
+        channel_data[c] = flac->pending[c].data() + (first_block + b) * FLAC_BLOCK_SIZE;
+      }
+      flac_encode_frame(channel_data, flac->channels, FLAC_BLOCK_SIZE, flac->sample_rate,
+                        flac->frame_number + b, (*frames)[b]);
+    }
+  }
+
+
+  //Encode and write every whole block queued so far, and with last set
+  //the short block left at the end as well.
+  //Returns 0, or -1 on a write error.
+  inline int flac_flush(flac_writer& flac, int last = 0)
+  {
+    size_t frames = flac.pending[0].size();
+    size_t done = 0;
+    std::vector<std::vector<uint8_t> > encoded;
+
+    if (flac.file == NULL) {
+      return -1;
+    }
+
+    for (int c = 1; c < flac.channels; c++) {
+      frames = std::min(frames, flac.pending[c].size());
+    }
+
+    size_t whole_blocks = frames / FLAC_BLOCK_SIZE;
+    size_t batch = (size_t)flac.threads * FLAC_BLOCKS_PER_THREAD;
+
+    while (done < whole_blocks) {
+      size_t blocks = std::min(batch, whole_blocks - done);
+      int threads = (int)std::min((size_t)flac.threads, blocks);
+      std::vector<std::thread> workers;
+
+      encoded.assign(blocks, std::vector<uint8_t>());
+      for (int t = 1; t < threads; t++) {
+        workers.push_back(std::thread(flac_encode_worker, &flac, done, blocks, threads, t, &encoded));
+      }
+      flac_encode_worker(&flac, done, blocks, threads, 0, &encoded);
+      for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+      }
+
+      for (size_t b = 0; b < blocks; b++) {
+        if (fwrite(encoded[b].data(), 1, encoded[b].size(), flac.file) != encoded[b].size()) {
+          return -1;
+        }
+        flac.min_frame_bytes = std::min(flac.min_frame_bytes, (uint32_t)encoded[b].size());
+        flac.max_frame_bytes = std::max(flac.max_frame_bytes, (uint32_t)encoded[b].size());
+        flac.bytes_written = flac.bytes_written + encoded[b].size();
+      }
+      flac.frame_number = flac.frame_number + blocks;
+      flac.samples = flac.samples + (uint64_t)blocks * FLAC_BLOCK_SIZE;
+      done = done + blocks;
+    }
+
+    size_t used = done * FLAC_BLOCK_SIZE;
+    size_t left = frames - used;
+
+    if (last && left > 0) {
+      const int32_t* channel_data[FLAC_MAX_CHANNELS];
+      std::vector<uint8_t> frame;
+      for (int c = 0; c < flac.channels; c++) {
+        channel_data[c] = flac.pending[c].data() + used;
+      }
+      flac_encode_frame(channel_data, flac.channels, (int)left, flac.sample_rate, flac.frame_number, frame);
+      if (fwrite(frame.data(), 1, frame.size(), flac.file) != frame.size()) {
+        return -1;
+      }
+      flac.max_frame_bytes = std::max(flac.max_frame_bytes, (uint32_t)frame.size());
+      flac.bytes_written = flac.bytes_written + frame.size();
+      flac.frame_number = flac.frame_number + 1;
+      flac.samples = flac.samples + left;
+      used = frames;
+    }
+
+    for (int c = 0; c < flac.channels; c++) {
+      flac.pending[c].erase(flac.pending[c].begin(), flac.pending[c].begin() + used);
+    }
+    return 0;
+  }
+
+
+  //Write the last block, fill in STREAMINFO and close the file. Samples
+  //of one channel beyond the end of the others are dropped.
+  //Returns 0, or -1 on a write error.
+  inline int flac_close(flac_writer& flac)
+  {
+    uint8_t info[FLAC_STREAMINFO_BYTES];
+    int result = 0;
+
+    if (flac.file == NULL) {
+      return -1;
+    }
+
+    result = flac_flush(flac, 1);
+
+    flac_put_streaminfo(flac, info);
+    if (fseek(flac.file, 8, SEEK_SET) != 0 ||
+        fwrite(info, 1, sizeof(info), flac.file) != sizeof(info)) {
+      result = -1;
+    }
+
+    if (fclose(flac.file) != 0) {
+      result = -1;
+    }
+    flac.file = NULL;
+    return result;
+  }
+
+#endif
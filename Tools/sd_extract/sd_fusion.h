@@ -0,0 +1,384 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_fusion.h
+// --!@brief      Orientation of the collar from the IMU streams
+// --!@details    Madgwick gradient descent filter over the gyroscope,
+// --             accelerometer and magnetometer, run in one pass as the
+// --             card is parsed.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//There is one filter step per gyroscope sample. The gyroscope and the
+//accelerometer run together at 952 Hz and are paired by sample number.
+//The magnetometer runs at 80 Hz, so each step uses the latest magnetometer
+//sample at or before its time, held until the next arrives. Steps before
+//the first magnetometer sample leave it out and correct only tilt.
+//
+//Samples come in as the raw stored Z, Y, X words and are scaled to X, Y, Z
+//rows a chunk at a time into queues that are reused, so the filter loop
+//itself does no allocation.
+//
+//The LSM9DS1 magnetometer X axis points the opposite way to that of the
+//accelerometer and gyroscope (data sheet figure 2), so it is negated to
+//put all three in the same frame.
+//
+//Each step writes a float32 row of qw, qx, qy, qz, roll, pitch and yaw,
+//the angles in degrees, and the time row of its gyroscope sample to the
+//times file. The step length is taken from the reset time (the first three
+//words of a time row), falling back to the nominal rate across gaps.
+
+#ifndef SD_FUSION_H
+#define SD_FUSION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+  const int FUSION_COLUMNS = 7;
+  const double FUSION_PI = 3.14159265358979323846;
+  const double FUSION_WEEK_SECONDS = 604800.0;
+
+  //Steps longer than this many nominal periods are taken as gaps.
+  const double FUSION_MAX_GAP = 8.0;
+
+
+  enum fusion_sensor {
+    FUSION_GYRO = 0,
+    FUSION_ACCEL = 1,
+    FUSION_MAG = 2
+  };
+
+
+  struct fusion_filter {
+    float q[4];
+    float beta;
+    double sample_period;
+    int time_words;
+    int started;
+    double last_time;
+
+    //Queued X, Y, Z rows in dps, g and gauss.
+    std::vector<float> gyro;
+    std::vector<float> accel;
+    std::vector<float> mag;
+    std::vector<uint32_t> gyro_times;
+    std::vector<double> mag_times;
+
+    int have_mag;
+    float held_mag[3];
+
+    FILE* file;
+    FILE* times_file;
+    uint64_t rows;
+    std::vector<float> output;
+  };
+
+
+  //Seconds since the start of the reset time weeks.
+  inline double fusion_seconds(const uint32_t* time)
+  {
+    return time[0] * FUSION_WEEK_SECONDS + time[1] * 1e-3 + time[2] * 1e-9;
+  }
+
+
+  //Returns 0, or -1 if a file could not be created.
+  inline int fusion_open(fusion_filter& filter, const std::string& filename, const std::string& times_filename,
+                         int gyro_rate, double beta, int time_words)
+  {
+    filter.q[0] = 1.0f;
+    filter.q[1] = 0.0f;
+    filter.q[2] = 0.0f;
+    filter.q[3] = 0.0f;
+    filter.beta = (float)beta;
+    filter.sample_period = 1.0 / gyro_rate;
+    filter.time_words = time_words;
+    filter.started = 0;
+    filter.last_time = 0.0;
+    filter.have_mag = 0;
+    filter.rows = 0;
+    filter.gyro.clear();
+    filter.accel.clear();
+    filter.mag.clear();
+    filter.gyro_times.clear();
+    filter.mag_times.clear();
+
+    filter.file = fopen(filename.c_str(), "wb");
+    filter.times_file = fopen(times_filename.c_str(), "wb");
+    return (filter.file == NULL || filter.times_file == NULL) ? -1 : 0;
+  }
+
+
+  //Queue count samples of one sensor given by their stored Z, Y and X
+  //words, each stride apart. scale is units per LSB and offset is X, Y, Z
+  //in those units.
+  template <typename T>
+  inline void fusion_add_samples(fusion_filter& filter, int sensor, const T* z, const T* y, const T* x,
+                                 size_t count, size_t stride, double scale, const double offset[3])
+  {
+    std::vector<float>& queue = (sensor == FUSION_GYRO) ? filter.gyro : (sensor == FUSION_ACCEL) ? filter.accel : filter.mag;
+    size_t first = queue.size();
+    const float s = (float)scale;
+    const float offset_x = (float)offset[0];
+    const float offset_y = (float)offset[1];
+    const float offset_z = (float)offset[2];
+
+    queue.resize(first + count * 3);
+    float* out = queue.data() + first;
+    for (size_t r = 0; r < count; r++) {
+      out[r * 3] = (float)x[r * stride] * s - offset_x;
+      out[r * 3 + 1] = (float)y[r * stride] * s - offset_y;
+      out[r * 3 + 2] = (float)z[r * stride] * s - offset_z;
+    }
+  }
+
+
+  //Queue the time rows of count gyroscope or magnetometer samples.
+  inline void fusion_add_times(fusion_filter& filter, int sensor, const uint32_t* times, size_t count)
+  {
+    if (sensor == FUSION_GYRO) {
+      filter.gyro_times.insert(filter.gyro_times.end(), times, times + count * filter.time_words);
+    }
+    else if (sensor == FUSION_MAG) {
+      for (size_t i = 0; i < count; i++) {
+        filter.mag_times.push_back(fusion_seconds(times + i * filter.time_words));
+      }
+    }
+  }
+
+
+  //Start from the tilt of the first accelerometer sample, heading 0.
+  inline void fusion_start(fusion_filter& filter, const float* a)
+  {
+    double roll = std::atan2((double)a[1], (double)a[2]);
+    double pitch = std::atan2(-(double)a[0], std::sqrt((double)a[1] * a[1] + (double)a[2] * a[2]));
+    double cr = std::cos(roll / 2.0);
+    double sr = std::sin(roll / 2.0);
+    double cp = std::cos(pitch / 2.0);
+    double sp = std::sin(pitch / 2.0);
+
+    filter.q[0] = (float)(cr * cp);
+    filter.q[1] = (float)(sr * cp);
+    filter.q[2] = (float)(cr * sp);
+    filter.q[3] = (float)(-sr * sp);
+  }
+
+
+  inline float fusion_inverse_sqrt(float x)
+  {
+    return 1.0f / std::sqrt(x);
+  }
+
+
+  //One Madgwick step. g is in rad/s, a and m in any units. m is NULL
+  //when there is no magnetometer sample yet.
+  inline void fusion_update(float* q, float beta, float dt, const float* g, const float* a, const float* m)
+  {
+    float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    float gx = g[0], gy = g[1], gz = g[2];
+
+    //Rate of change from the gyroscope.
+    float dq0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+    float dq1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+    float dq2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+    float dq3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+    float ax = a[0], ay = a[1], az = a[2];
+    float a_norm = ax * ax + ay * ay + az * az;
+
+    if (a_norm > 0.0f) {
+      float s0, s1, s2, s3;
+      float recip = fusion_inverse_sqrt(a_norm);
+      ax = ax * recip;
+      ay = ay * recip;
+      az = az * recip;
+
+      float mx = 0.0f, my = 0.0f, mz = 0.0f;
+      float m_norm = (m != NULL) ? m[0] * m[0] + m[1] * m[1] + m[2] * m[2] : 0.0f;
+
+      if (m_norm > 0.0f) {
+        recip = fusion_inverse_sqrt(m_norm);
+        mx = m[0] * recip;
+        my = m[1] * recip;
+        mz = m[2] * recip;
+
+        //Earth's field in the earth frame, rotated so it has no east part.
+        float _2q0mx = 2.0f * q0 * mx, _2q0my = 2.0f * q0 * my, _2q0mz = 2.0f * q0 * mz;
+        float _2q1mx = 2.0f * q1 * mx;
+        float _2q0 = 2.0f * q0, _2q1 = 2.0f * q1, _2q2 = 2.0f * q2, _2q3 = 2.0f * q3;
+        float _2q0q2 = 2.0f * q0 * q2, _2q2q3 = 2.0f * q2 * q3;
+        float q0q0 = q0 * q0, q0q1 = q0 * q1, q0q2 = q0 * q2, q0q3 = q0 * q3;
+        float q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3;
+        float q2q2 = q2 * q2, q2q3 = q2 * q3, q3q3 = q3 * q3;
+
+        float hx = mx * q0q0 - _2q0my * q3 + _2q0mz * q2 + mx * q1q1 + _2q1 * my * q2 + _2q1 * mz * q3 - mx * q2q2 - mx * q3q3;
+        float hy = _2q0mx * q3 + my * q0q0 - _2q0mz * q1 + _2q1mx * q2 - my * q1q1 + my * q2q2 + _2q2 * mz * q3 - my * q3q3;
+        float _2bx = std::sqrt(hx * hx + hy * hy);
+        float _2bz = -_2q0mx * q2 + _2q0my * q1 + mz * q0q0 + _2q1mx * q3 - mz * q1q1 + _2q2 * my * q3 - mz * q2q2 + mz * q3q3;
+        float _4bx = 2.0f * _2bx;
+        float _4bz = 2.0f * _2bz;
+
+        //Gradient of the accelerometer and magnetometer errors.
+        s0 = -_2q2 * (2.0f * q1q3 - _2q0q2 - ax) + _2q1 * (2.0f * q0q1 + _2q2q3 - ay)
+             - _2bz * q2 * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx)
+             + (-_2bx * q3 + _2bz * q1) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my)
+             + _2bx * q2 * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+        s1 = _2q3 * (2.0f * q1q3 - _2q0q2 - ax) + _2q0 * (2.0f * q0q1 + _2q2q3 - ay)
+             - 4.0f * q1 * (1.0f - 2.0f * q1q1 - 2.0f * q2q2 - az)
+             + _2bz * q3 * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx)
+             + (_2bx * q2 + _2bz * q0) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my)
+             + (_2bx * q3 - _4bz * q1) * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+        s2 = -_2q0 * (2.0f * q1q3 - _2q0q2 - ax) + _2q3 * (2.0f * q0q1 + _2q2q3 - ay)
+             - 4.0f * q2 * (1.0f - 2.0f * q1q1 - 2.0f * q2q2 - az)
+             + (-_4bx * q2 - _2bz * q0) * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx)
+             + (_2bx * q1 + _2bz * q3) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my)
+             + (_2bx * q0 - _4bz * q2) * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+        s3 = _2q1 * (2.0f * q1q3 - _2q0q2 - ax) + _2q2 * (2.0f * q0q1 + _2q2q3 - ay)
+             + (-_4bx * q3 + _2bz * q1) * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx)
+             + (-_2bx * q0 + _2bz * q2) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my)
+             + _2bx * q1 * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+      }
+      else {
+        //Gradient of the accelerometer error alone.
+        float _2q0 = 2.0f * q0, _2q1 = 2.0f * q1, _2q2 = 2.0f * q2, _2q3 = 2.0f * q3;
+        float _4q0 = 4.0f * q0, _4q1 = 4.0f * q1, _4q2 = 4.0f * q2;
+        float _8q1 = 8.0f * q1, _8q2 = 8.0f * q2;
+        float q0q0 = q0 * q0, q1q1 = q1 * q1, q2q2 = q2 * q2, q3q3 = q3 * q3;
+
+        s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+        s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+        s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+        s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+      }
+
+      float s_norm = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+      if (s_norm > 0.0f) {
+        recip = fusion_inverse_sqrt(s_norm);
+        dq0 = dq0 - beta * s0 * recip;
+        dq1 = dq1 - beta * s1 * recip;
+        dq2 = dq2 - beta * s2 * recip;
+        dq3 = dq3 - beta * s3 * recip;
+      }
+    }
+
+    q0 = q0 + dq0 * dt;
+    q1 = q1 + dq1 * dt;
+    q2 = q2 + dq2 * dt;
+    q3 = q3 + dq3 * dt;
+
+    float recip = fusion_inverse_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q[0] = q0 * recip;
+    q[1] = q1 * recip;
+    q[2] = q2 * recip;
+    q[3] = q3 * recip;
+  }
+
+
+  //Run every gyroscope and accelerometer pair queued so far and write the
+  //rows out.
+  //Returns 0, or -1 on a write error.
+  inline int fusion_flush(fusion_filter& filter)
+  {
+    size_t steps = std::min(filter.gyro.size(), filter.accel.size()) / 3;
+    size_t mag_count = std::min(filter.mag.size() / 3, filter.mag_times.size());
+    size_t mag_next = 0;
+    const float to_radians = (float)(FUSION_PI / 180.0);
+    const double to_degrees = 180.0 / FUSION_PI;
+
+    steps = std::min(steps, filter.gyro_times.size() / filter.time_words);
+    filter.output.resize(steps * FUSION_COLUMNS);
+
+    for (size_t n = 0; n < steps; n++) {
+      const uint32_t* time = &filter.gyro_times[n * filter.time_words];
+      double now = fusion_seconds(time);
+      const float* a = &filter.accel[n * 3];
+
+      while (mag_next < mag_count && filter.mag_times[mag_next] <= now) {
+        const float* m = &filter.mag[mag_next * 3];
+        filter.held_mag[0] = -m[0];
+        filter.held_mag[1] = m[1];
+        filter.held_mag[2] = m[2];
+        filter.have_mag = 1;
+        mag_next = mag_next + 1;
+      }
+
+      double dt = now - filter.last_time;
+      if (!filter.started) {
+        fusion_start(filter, a);
+        filter.started = 1;
+        dt = 0.0;
+      }
+      else if (dt <= 0.0 || dt > FUSION_MAX_GAP * filter.sample_period) {
+        dt = filter.sample_period;
+      }
+      filter.last_time = now;
+
+      const float* g = &filter.gyro[n * 3];
+      float rates[3] = { g[0] * to_radians, g[1] * to_radians, g[2] * to_radians };
+      fusion_update(filter.q, filter.beta, (float)dt, rates, a, filter.have_mag ? filter.held_mag : NULL);
+
+      const float* q = filter.q;
+      float* row = &filter.output[n * FUSION_COLUMNS];
+      row[0] = q[0];
+      row[1] = q[1];
+      row[2] = q[2];
+      row[3] = q[3];
+      row[4] = (float)(std::atan2(2.0 * (q[0] * q[1] + q[2] * q[3]), 1.0 - 2.0 * (q[1] * q[1] + q[2] * q[2])) * to_degrees);
+      row[5] = (float)(std::asin(std::max(-1.0, std::min(1.0, 2.0 * (q[0] * q[2] - q[3] * q[1])))) * to_degrees);
+      row[6] = (float)(std::atan2(2.0 * (q[0] * q[3] + q[1] * q[2]), 1.0 - 2.0 * (q[2] * q[2] + q[3] * q[3])) * to_degrees);
+    }
+
+    int result = 0;
+    if (steps > 0) {
+      if (fwrite(filter.output.data(), sizeof(float), steps * FUSION_COLUMNS, filter.file) != steps * FUSION_COLUMNS ||
+          fwrite(filter.gyro_times.data(), sizeof(uint32_t), steps * filter.time_words, filter.times_file) != steps * filter.time_words) {
+        result = -1;
+      }
+    }
+    filter.rows = filter.rows + steps;
+
+    //Magnetometer samples that are used are only needed as the held one.
+    filter.gyro.erase(filter.gyro.begin(), filter.gyro.begin() + steps * 3);
+    filter.accel.erase(filter.accel.begin(), filter.accel.begin() + steps * 3);
+    filter.gyro_times.erase(filter.gyro_times.begin(), filter.gyro_times.begin() + steps * filter.time_words);
+    filter.mag.erase(filter.mag.begin(), filter.mag.begin() + mag_next * 3);
+    filter.mag_times.erase(filter.mag_times.begin(), filter.mag_times.begin() + mag_next);
+    return result;
+  }
+
+
+  //Returns 0, or -1 on a write error.
+  inline int fusion_close(fusion_filter& filter)
+  {
+    int result = 0;
+
+    if (filter.file == NULL || fclose(filter.file) != 0) {
+      result = -1;
+    }
+    if (filter.times_file == NULL || fclose(filter.times_file) != 0) {
+      result = -1;
+    }
+    filter.file = NULL;
+    filter.times_file = NULL;
+    return result;
+  }
+
+#endif
@@ -0,0 +1,172 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_image_gen.cpp
+// --!@brief      Command line driver for the synthetic collar image generator
+// --!@details    Writes an image parse_sdcard_mex_p can read in place of a
+// --             field dump.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Building.
+//    g++ -std=c++11 -O2 sd_image_gen.cpp -o sd_image_gen
+//
+//Usage.
+//    sd_image_gen out.bin [--mb n | --blocks n] [--audio-rate hz]
+//                 [--mics 1|2] [--gyro-rate hz] [--accel-rate hz]
+//                 [--mag-rate hz] [--status-ms ms] [--gps-ms ms]
+//                 [--restarts n] [--corrupt fraction] [--drift-ppm ppm]
+//                 [--seed n]
+//
+//A 4 GB image with a power cycle every GB and one bad block in 10000.
+//    sd_image_gen big.bin --mb 4096 --restarts 3 --corrupt 0.0001
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "sd_block.h"
+#include "sd_image_gen.h"
+
+
+  int parse_gen_option(const std::string&, const char*, gen_image_config&);
+
+
+  int main(int argc, char* argv[])
+  {
+    gen_image_config config;
+    gen_image_stats stats;
+    std::string filename;
+    int result;
+
+    gen_image_defaults(config);
+
+    if (argc < 2) {
+      fprintf(stderr, "Usage: sd_image_gen out.bin [--mb n] [--blocks n] [--audio-rate hz] [--mics n]\n"
+                      "       [--gyro-rate hz] [--accel-rate hz] [--mag-rate hz] [--status-ms ms]\n"
+                      "       [--gps-ms ms] [--restarts n] [--corrupt fraction] [--drift-ppm ppm] [--seed n]\n");
+      return 2;
+    }
+
+    filename = argv[1];
+
+    for (int i = 2; i < argc; i = i + 2) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "sd_image_gen: %s needs a value\n", argv[i]);
+        return 2;
+      }
+      if (parse_gen_option(argv[i], argv[i + 1], config) != 0) {
+        return 2;
+      }
+    }
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    result = gen_image_write(config, filename, stats);
+    if (result != 0) {
+      fprintf(stderr, "sd_image_gen: could not write %s\n", filename.c_str());
+      return 1;
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1E6;
+    double megabytes = (double)stats.blocks * BLOCK_SIZE / (1024.0 * 1024.0);
+
+    printf("Blocks written : %llu (%.1f MB)\n", (unsigned long long)stats.blocks, megabytes);
+    printf("Power cycles : %llu\n", (unsigned long long)stats.restarts);
+    printf("Corrupted blocks : %llu\n", (unsigned long long)stats.corrupt_blocks);
+    printf("Audio frames : %llu\n", (unsigned long long)stats.audio_frames);
+    printf("Gyro/accel/mag samples : %llu / %llu / %llu\n",
+           (unsigned long long)stats.gyro_samples,
+           (unsigned long long)stats.accel_samples,
+           (unsigned long long)stats.mag_samples);
+    printf("Status / TP / NAV_SOL / TM2 segments : %llu / %llu / %llu / %llu\n",
+           (unsigned long long)stats.segments[(int)BLOCK_SEG_STATUS],
+           (unsigned long long)stats.segments[(int)BLOCK_SEG_GPS_TIME_PULSE],
+           (unsigned long long)stats.segments[(int)BLOCK_SEG_GPS_POSITION],
+           (unsigned long long)stats.segments[(int)BLOCK_SEG_GPS_TIME_MARK]);
+    if (seconds > 0) {
+      printf("Generated in %.2f s, %.1f MB/s\n", seconds, megabytes / seconds);
+    }
+
+    return 0;
+  }
+
+
+  //Read one --name value pair into the config.
+  //Returns 0, or -1 for an unknown name or a value out of range.
+  int parse_gen_option(const std::string& name, const char* value, gen_image_config& config)
+  {
+    if (name == "--mb") {
+      config.blocks = strtoull(value, NULL, 10) * 1024ULL * 1024ULL / BLOCK_SIZE;
+    }
+    else if (name == "--blocks") {
+      config.blocks = strtoull(value, NULL, 10);
+    }
+    else if (name == "--audio-rate") {
+      config.audio_sample_rate = atoi(value);
+    }
+    else if (name == "--mics") {
+      config.num_mics = atoi(value);
+    }
+    else if (name == "--gyro-rate") {
+      config.gyro_sample_rate = atoi(value);
+    }
+    else if (name == "--accel-rate") {
+      config.accel_sample_rate = atoi(value);
+    }
+    else if (name == "--mag-rate") {
+      config.mag_sample_rate = atoi(value);
+    }
+    else if (name == "--status-ms") {
+      config.status_period_ms = atoi(value);
+    }
+    else if (name == "--gps-ms") {
+      config.gps_period_ms = atoi(value);
+    }
+    else if (name == "--restarts") {
+      config.restarts = atoi(value);
+    }
+    else if (name == "--corrupt") {
+      config.corrupt_rate = atof(value);
+    }
+    else if (name == "--drift-ppm") {
+      config.clock_drift_ppm = atof(value);
+    }
+    else if (name == "--seed") {
+      config.seed = (uint32_t)strtoul(value, NULL, 10);
+    }
+    else {
+      fprintf(stderr, "sd_image_gen: unknown option %s\n", name.c_str());
+      return -1;
+    }
+
+    if (config.num_mics < 1 || config.num_mics > 2) {
+      fprintf(stderr, "sd_image_gen: --mics must be 1 or 2\n");
+      return -1;
+    }
+    if (config.audio_sample_rate < 1 || config.gyro_sample_rate < 1 ||
+        config.accel_sample_rate < 1 || config.mag_sample_rate < 1 ||
+        config.status_period_ms < 1 || config.gps_period_ms < 0 ||
+        config.restarts < 0 || config.corrupt_rate < 0.0 || config.corrupt_rate > 1.0) {
+      fprintf(stderr, "sd_image_gen: %s %s is out of range\n", name.c_str(), value);
+      return -1;
+    }
+
+    return 0;
+  }
@@ -0,0 +1,619 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_image_gen.h
+// --!@brief      Synthetic collar SD card image generator
+// --!@details    Produces whole images in the FlashBlock.vhd format with the
+// --             streams interleaved in time order the way the collar
+// --             writes them.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Field dumps can't be shared so throughput is measured on generated
+//images instead. The same config and seed always give the same image.
+//
+//Times on the collar are kept against the FPGA clock, which restarts at
+//zero on every power up. GPS time is that clock scaled by the drift and
+//offset by the GPS time of the power up. Time pulse packets pair the
+//two on each GPS second.
+//
+//Within a block segments go in the order their data became ready. When
+//the next one does not fit the rest of the block is padded and it goes
+//in the next block. Audio is the exception, a segment is cut down to the
+//frames that fit.
+
+#ifndef SD_IMAGE_GEN_H
+#define SD_IMAGE_GEN_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sd_block.h"
+#include "sd_block_gen.h"
+
+
+  const uint64_t GEN_NS_PER_MS = 1000000ULL;
+  const uint64_t GEN_NS_PER_SEC = 1000000000ULL;
+  const uint64_t GEN_MS_PER_WEEK = 604800000ULL;
+
+  //Blocks written per fwrite, 4 MB.
+  const int GEN_WRITE_BLOCKS = 8192;
+
+  const int GEN_SINE_TABLE_SIZE = 1024;
+
+
+  struct gen_image_config {
+    uint64_t blocks;            //Image length in 512 byte blocks.
+    int audio_sample_rate;      //Frames per second.
+    int num_mics;               //1 or 2 interleaved words per frame.
+    int gyro_sample_rate;
+    int accel_sample_rate;
+    int mag_sample_rate;
+    int status_period_ms;
+    int gps_period_ms;          //TP, NAV_SOL and TM2 period, 0 for no GPS.
+    int restarts;               //Power cycles spread evenly over the image.
+    double corrupt_rate;        //Fraction of blocks given a bad trailer.
+    double clock_drift_ppm;     //FPGA clock against GPS.
+    uint32_t first_sequence;
+    uint32_t seed;
+  };
+
+
+  //What went into the image.
+  struct gen_image_stats {
+    uint64_t blocks;
+    uint64_t corrupt_blocks;
+    uint64_t restarts;
+    uint64_t segments[BLOCK_SEG_TYPES];
+    uint64_t audio_frames;
+    uint64_t gyro_samples;
+    uint64_t accel_samples;
+    uint64_t mag_samples;
+  };
+
+
+  //One evenly sampled stream. Sample n is at n / rate seconds after the
+  //FPGA clock started.
+  struct gen_stream {
+    int rate;
+    uint64_t count;
+    uint64_t last_ns;
+  };
+
+
+  struct gen_image_state {
+    gen_image_config config;
+    std::mt19937 rng;
+    uint32_t noise;
+
+    uint32_t sequence;
+    uint64_t block_number;
+
+    gen_stream audio;
+    gen_stream gyro;
+    gen_stream accel;
+    gen_stream mag;
+    int audio_frames_per_segment;
+    uint32_t audio_phase;
+    int16_t sine_table[GEN_SINE_TABLE_SIZE];
+
+    //GPS time of FPGA time zero for this power up.
+    uint64_t boot_gps_ns;
+    double clock_scale;
+
+    uint64_t next_status_ns;
+    uint64_t next_pulse_gps_ns;
+    uint64_t next_pulse_ns;
+    int gps_part;
+
+    uint64_t next_restart_block;
+
+    gen_image_stats stats;
+  };
+
+
+  //The collar defaults, matching the rates the parser assumes.
+  inline void gen_image_defaults(gen_image_config& config)
+  {
+    config.blocks = 2048;
+    config.audio_sample_rate = 56250;
+    config.num_mics = 2;
+    config.gyro_sample_rate = 952;
+    config.accel_sample_rate = 952;
+    config.mag_sample_rate = 80;
+    config.status_period_ms = 1000;
+    config.gps_period_ms = 1000;
+    config.restarts = 0;
+    config.corrupt_rate = 0.0;
+    config.clock_drift_ppm = 0.0;
+    config.first_sequence = 1;
+    config.seed = 1;
+  }
+
+
+  //Pack a time in ns into the 9 byte week/ms/ns GPS time.
+  //The top byte is never used, see populate_gps_time.
+  inline void gen_pack_gps_time(uint64_t time_ns, unsigned char* out)
+  {
+    uint64_t total_ms = time_ns / GEN_NS_PER_MS;
+    uint64_t week = total_ms / GEN_MS_PER_WEEK;
+    uint64_t ms = total_ms % GEN_MS_PER_WEEK;
+    uint64_t ns = time_ns % GEN_NS_PER_MS;
+    uint64_t packed = (week << 50) | (ms << 20) | ns;
+
+    std::memcpy(out, &packed, sizeof(packed));
+    out[8] = 0;
+  }
+
+
+  inline uint64_t gen_stream_time(const gen_stream& stream, uint64_t n)
+  {
+    return (n * GEN_NS_PER_SEC) / (uint64_t)stream.rate;
+  }
+
+
+  inline void gen_stream_reset(gen_stream& stream, int rate)
+  {
+    stream.rate = rate;
+    stream.count = 0;
+    stream.last_ns = 0;
+  }
+
+
+  inline uint32_t gen_noise(gen_image_state& state)
+  {
+    state.noise ^= state.noise << 13;
+    state.noise ^= state.noise >> 17;
+    state.noise ^= state.noise << 5;
+    return state.noise;
+  }
+
+
+  inline int16_t gen_noise_word(gen_image_state& state, int amplitude)
+  {
+    return (int16_t)((int)(gen_noise(state) % (uint32_t)(2 * amplitude + 1)) - amplitude);
+  }
+
+
+  //FPGA time of the next time pulse, from its GPS time.
+  inline uint64_t gen_pulse_local_ns(const gen_image_state& state)
+  {
+    return (uint64_t)((double)(state.next_pulse_gps_ns - state.boot_gps_ns) / state.clock_scale);
+  }
+
+
+  inline uint64_t gen_local_to_gps_ns(const gen_image_state& state, uint64_t local_ns)
+  {
+    return state.boot_gps_ns + (uint64_t)((double)local_ns * state.clock_scale);
+  }
+
+
+  //Restart every stream at FPGA time zero.
+  inline void gen_power_up(gen_image_state& state, uint64_t boot_gps_ns)
+  {
+    const gen_image_config& config = state.config;
+    uint64_t period_ns;
+
+    gen_stream_reset(state.audio, config.audio_sample_rate);
+    gen_stream_reset(state.gyro, config.gyro_sample_rate);
+    gen_stream_reset(state.accel, config.accel_sample_rate);
+    gen_stream_reset(state.mag, config.mag_sample_rate);
+
+    state.boot_gps_ns = boot_gps_ns;
+
+    //The first status comes after the first samples are buffered.
+    state.next_status_ns = (uint64_t)config.status_period_ms * GEN_NS_PER_MS;
+
+    if (config.gps_period_ms > 0) {
+      period_ns = (uint64_t)config.gps_period_ms * GEN_NS_PER_MS;
+      state.next_pulse_gps_ns = ((boot_gps_ns / period_ns) + 1) * period_ns;
+      state.next_pulse_ns = gen_pulse_local_ns(state);
+    }
+    state.gps_part = 0;
+  }
+
+
+  inline void gen_image_begin(const gen_image_config& config, gen_image_state& state)
+  {
+    state.config = config;
+    state.rng.seed(config.seed);
+    state.noise = config.seed | 1;
+
+    state.sequence = config.first_sequence;
+    state.block_number = 0;
+
+    state.audio_frames_per_segment = SEG_MAX_LENGTH / (AUDIO_WORD_BYTES * config.num_mics);
+    state.audio_phase = 0;
+    for (int i = 0; i < GEN_SINE_TABLE_SIZE; i++) {
+      state.sine_table[i] = (int16_t)(8000.0 * std::sin(2.0 * 3.14159265358979 * i / GEN_SINE_TABLE_SIZE));
+    }
+
+    state.clock_scale = 1.0 + config.clock_drift_ppm * 1E-6;
+
+    std::memset(&state.stats, 0, sizeof(state.stats));
+
+    state.next_restart_block = (config.restarts > 0) ?
+                               config.blocks / (uint64_t)(config.restarts + 1) : 0;
+
+    //Start partway into GPS week 1900.
+    gen_power_up(state, (1900ULL * GEN_MS_PER_WEEK + 3600000ULL) * GEN_NS_PER_MS +
+                        (state.rng() % 1000) * GEN_NS_PER_MS);
+  }
+
+
+  //Bytes one segment of this kind takes, data only.
+  inline int gen_event_length(const gen_image_state& state, char type)
+  {
+    if (type == BLOCK_SEG_AUDIO) {
+      return state.audio_frames_per_segment * AUDIO_WORD_BYTES * state.config.num_mics;
+    }
+    else if (type == BLOCK_SEG_STATUS) {
+      return STATUS_SEG_BYTES;
+    }
+    else if (type == BLOCK_SEG_GPS_TIME_PULSE) {
+      return GPS_TIM_TP_BYTES;
+    }
+    else if (type == BLOCK_SEG_GPS_POSITION) {
+      return GPS_NAV_SOL_BYTES;
+    }
+    else if (type == BLOCK_SEG_GPS_TIME_MARK) {
+      return GPS_TIM_TM2_BYTES;
+    }
+    return IMU_GYRO_SEG_BYTES;
+  }
+
+
+  //The segment whose data is ready first.
+  inline char gen_next_event(const gen_image_state& state)
+  {
+    char type = BLOCK_SEG_AUDIO;
+    uint64_t when = gen_stream_time(state.audio, state.audio.count + state.audio_frames_per_segment - 1);
+    uint64_t t;
+
+    t = gen_stream_time(state.gyro, state.gyro.count);
+    if (t < when) { when = t; type = BLOCK_SEG_IMU_GYRO; }
+    t = gen_stream_time(state.accel, state.accel.count);
+    if (t < when) { when = t; type = BLOCK_SEG_IMU_ACCEL; }
+    t = gen_stream_time(state.mag, state.mag.count);
+    if (t < when) { when = t; type = BLOCK_SEG_IMU_MAG; }
+    if (state.next_status_ns < when) { when = state.next_status_ns; type = BLOCK_SEG_STATUS; }
+
+    if (state.config.gps_period_ms > 0 && state.next_pulse_ns < when) {
+      if (state.gps_part == 0) {
+        type = BLOCK_SEG_GPS_TIME_PULSE;
+      }
+      else if (state.gps_part == 1) {
+        type = BLOCK_SEG_GPS_POSITION;
+      }
+      else {
+        type = BLOCK_SEG_GPS_TIME_MARK;
+      }
+    }
+
+    return type;
+  }
+
+
+  inline void gen_imu_segment(gen_image_state& state, gen_stream& stream,
+                              int16_t z, int16_t y, int16_t x, int amplitude,
+                              unsigned char* out)
+  {
+    //Stored ZYX like the collar.
+    int16_t words[3];
+
+    words[0] = (int16_t)(z + gen_noise_word(state, amplitude));
+    words[1] = (int16_t)(y + gen_noise_word(state, amplitude));
+    words[2] = (int16_t)(x + gen_noise_word(state, amplitude));
+    std::memcpy(out, words, sizeof(words));
+
+    stream.last_ns = gen_stream_time(stream, stream.count);
+    stream.count = stream.count + 1;
+  }
+
+
+  //A tone with some noise on it. Second channel is the first inverted.
+  inline void gen_audio_segment(gen_image_state& state, int frames, unsigned char* out)
+  {
+    int16_t word;
+    int mics = state.config.num_mics;
+
+    for (int f = 0; f < frames; f++) {
+      word = (int16_t)(state.sine_table[(state.audio_phase >> 22) & (GEN_SINE_TABLE_SIZE - 1)] +
+                       gen_noise_word(state, 200));
+      std::memcpy(&out[f * AUDIO_WORD_BYTES * mics], &word, sizeof(word));
+      if (mics > 1) {
+        word = (int16_t)(-word);
+        std::memcpy(&out[f * AUDIO_WORD_BYTES * mics + AUDIO_WORD_BYTES], &word, sizeof(word));
+      }
+      //About 1 kHz at 56250.
+      state.audio_phase = state.audio_phase + 76354974U;
+    }
+
+    state.audio.count = state.audio.count + frames;
+    state.audio.last_ns = gen_stream_time(state.audio, state.audio.count - 1);
+  }
+
+
+  inline void gen_status_segment(gen_image_state& state, unsigned char* out)
+  {
+    uint32_t compile = 0x5a0c1e20;
+    uint32_t commit = 0x00c0ffee;
+    uint32_t rtc = 1420070400U + (uint32_t)(state.next_status_ns / GEN_NS_PER_SEC);
+    int k = 0;
+
+    std::memcpy(&out[k], &compile, sizeof(compile));
+    k = k + STATUS_COMPILE_BYTES;
+    std::memcpy(&out[k], &commit, sizeof(commit));
+    k = k + STATUS_COMMIT_BYTES;
+
+    //Status, accel, mag, gyro, temp then audio times.
+    gen_pack_gps_time(state.next_status_ns, &out[k]);
+    k = k + GPS_TIME_BYTES;
+    gen_pack_gps_time(state.accel.last_ns, &out[k]);
+    k = k + GPS_TIME_BYTES;
+    gen_pack_gps_time(state.mag.last_ns, &out[k]);
+    k = k + GPS_TIME_BYTES;
+    gen_pack_gps_time(state.gyro.last_ns, &out[k]);
+    k = k + GPS_TIME_BYTES;
+    gen_pack_gps_time(state.gyro.last_ns, &out[k]);
+    k = k + GPS_TIME_BYTES;
+    gen_pack_gps_time(state.audio.last_ns, &out[k]);
+    k = k + GPS_TIME_BYTES;
+
+    std::memcpy(&out[k], &rtc, sizeof(rtc));
+    k = k + RTC_TIME_BYTES;
+    out[k] = (unsigned char)state.config.num_mics;
+
+    state.next_status_ns = state.next_status_ns + (uint64_t)state.config.status_period_ms * GEN_NS_PER_MS;
+  }
+
+
+  //Time pulse. FPGA time the pulse was seen then its GPS time.
+  inline void gen_tp_segment(gen_image_state& state, unsigned char* out)
+  {
+    gen_pack_gps_time(state.next_pulse_ns, &out[0]);
+    gen_pack_gps_time(state.next_pulse_gps_ns, &out[GPS_TIME_BYTES]);
+  }
+
+
+  //Fix near Bozeman with a little wander, ECEF in cm.
+  inline void gen_nav_sol_segment(gen_image_state& state, unsigned char* out)
+  {
+    uint64_t gps_ms = state.next_pulse_gps_ns / GEN_NS_PER_MS;
+    uint32_t itow = (uint32_t)(gps_ms % GEN_MS_PER_WEEK);
+    int32_t ftow = 0;
+    int16_t week = (int16_t)(gps_ms / GEN_MS_PER_WEEK);
+    uint8_t fixtype = 3;
+    int32_t ecefx = -160300000 + gen_noise_word(state, 500);
+    int32_t ecefy = -415900000 + gen_noise_word(state, 500);
+    int32_t ecefz = 453300000 + gen_noise_word(state, 500);
+    uint32_t pacc = 500;
+    uint16_t posdop = 150;
+    uint8_t numsv = 8;
+    int k = 0;
+
+    std::memcpy(&out[k], &itow, 4);    k = k + 4;
+    std::memcpy(&out[k], &ftow, 4);    k = k + 4;
+    std::memcpy(&out[k], &week, 2);    k = k + 2;
+    out[k] = fixtype;                  k = k + 1;
+    std::memcpy(&out[k], &ecefx, 4);   k = k + 4;
+    std::memcpy(&out[k], &ecefy, 4);   k = k + 4;
+    std::memcpy(&out[k], &ecefz, 4);   k = k + 4;
+    std::memcpy(&out[k], &pacc, 4);    k = k + 4;
+    std::memcpy(&out[k], &posdop, 2);  k = k + 2;
+    out[k] = numsv;                    k = k + 1;
+    gen_pack_gps_time(state.next_pulse_ns, &out[k]);
+  }
+
+
+  //Time mark on the same second as the pulse.
+  inline void gen_tm2_segment(gen_image_state& state, unsigned char* out)
+  {
+    uint64_t gps_ms = state.next_pulse_gps_ns / GEN_NS_PER_MS;
+    uint8_t flags = 0x40;
+    uint16_t wnf = (uint16_t)(gps_ms / GEN_MS_PER_WEEK);
+    uint32_t towmsf = (uint32_t)(gps_ms % GEN_MS_PER_WEEK);
+    uint32_t towsubmsf = (uint32_t)(state.next_pulse_gps_ns % GEN_NS_PER_MS);
+    uint32_t accest = 20;
+    int k = 0;
+
+    out[k] = flags;                      k = k + 1;
+    std::memcpy(&out[k], &wnf, 2);       k = k + 2;
+    std::memcpy(&out[k], &towmsf, 4);    k = k + 4;
+    std::memcpy(&out[k], &towsubmsf, 4); k = k + 4;
+    std::memcpy(&out[k], &accest, 4);    k = k + 4;
+    gen_pack_gps_time(state.next_pulse_ns, &out[k]);
+
+    state.next_pulse_gps_ns = state.next_pulse_gps_ns + (uint64_t)state.config.gps_period_ms * GEN_NS_PER_MS;
+    state.next_pulse_ns = gen_pulse_local_ns(state);
+  }
+
+
+  //Write the trailer for a segment whose data is at block[k].
+  inline int gen_close_segment(gen_image_state& state, unsigned char* block, int k,
+                               char type, int length)
+  {
+    block[k + length] = type;
+    block[k + length + 1] = (unsigned char)length;
+    state.stats.segments[(int)type] = state.stats.segments[(int)type] + 1;
+    return k + length + SEG_TRAILER_SIZE;
+  }
+
+
+  //Damage one of the last trailers so the block walk fails or goes astray.
+  inline void gen_corrupt_block(gen_image_state& state, unsigned char* block)
+  {
+    if (state.rng() & 1) {
+      block[BLOCK_SIZE - 2] = 0x0F;
+    }
+    else {
+      block[BLOCK_SIZE - 1] = (unsigned char)(block[BLOCK_SIZE - 1] + 1 + state.rng() % 200);
+    }
+    state.stats.corrupt_blocks = state.stats.corrupt_blocks + 1;
+  }
+
+
+  //Build the next block of the image.
+  inline void gen_image_block(gen_image_state& state, unsigned char* block)
+  {
+    const gen_image_config& config = state.config;
+    int k = BLOCK_SEQNO_BYTES;
+    int room;
+    int length;
+    int frames;
+    int frame_bytes = AUDIO_WORD_BYTES * config.num_mics;
+    char type;
+    uint64_t gap_ns;
+
+    std::memset(block, PADDING_BYTE, BLOCK_SIZE);
+    std::memcpy(block, &state.sequence, BLOCK_SEQNO_BYTES);
+
+    //Power cycle. The shutdown is written first, then the clock starts again.
+    if (state.next_restart_block != 0 && state.block_number == state.next_restart_block) {
+      k = gen_close_segment(state, block, k, BLOCK_SEG_SHUTDOWN, 0);
+
+      gap_ns = (10 + state.rng() % 600) * GEN_NS_PER_SEC;
+      gen_power_up(state, gen_local_to_gps_ns(state, gen_stream_time(state.audio, state.audio.count)) + gap_ns);
+
+      state.stats.restarts = state.stats.restarts + 1;
+      state.next_restart_block = (state.stats.restarts < (uint64_t)config.restarts) ?
+                                 config.blocks * (state.stats.restarts + 1) / (uint64_t)(config.restarts + 1) : 0;
+    }
+
+    while (true) {
+      type = gen_next_event(state);
+      length = gen_event_length(state, type);
+      room = BLOCK_SIZE - k - SEG_TRAILER_SIZE;
+
+      if (type == BLOCK_SEG_AUDIO && length > room) {
+        frames = room / frame_bytes;
+        //A single byte left could never be padded.
+        if (room - frames * frame_bytes == 1) {
+          frames = frames - 1;
+        }
+        length = frames * frame_bytes;
+        if (frames < 1) {
+          break;
+        }
+      }
+      else if (length > room || room - length == 1) {
+        break;
+      }
+
+      if (type == BLOCK_SEG_AUDIO) {
+        frames = length / frame_bytes;
+        gen_audio_segment(state, frames, &block[k]);
+        state.stats.audio_frames = state.stats.audio_frames + frames;
+      }
+      else if (type == BLOCK_SEG_IMU_GYRO) {
+        gen_imu_segment(state, state.gyro, 0, 0, 0, 60, &block[k]);
+        state.stats.gyro_samples = state.stats.gyro_samples + 1;
+      }
+      else if (type == BLOCK_SEG_IMU_ACCEL) {
+        //About 1 g on z at the 2 g full scale.
+        gen_imu_segment(state, state.accel, 16384, 0, 0, 200, &block[k]);
+        state.stats.accel_samples = state.stats.accel_samples + 1;
+      }
+      else if (type == BLOCK_SEG_IMU_MAG) {
+        gen_imu_segment(state, state.mag, -1500, 300, 2200, 20, &block[k]);
+        state.stats.mag_samples = state.stats.mag_samples + 1;
+      }
+      else if (type == BLOCK_SEG_STATUS) {
+        gen_status_segment(state, &block[k]);
+      }
+      else if (type == BLOCK_SEG_GPS_TIME_PULSE) {
+        gen_tp_segment(state, &block[k]);
+        state.gps_part = 1;
+      }
+      else if (type == BLOCK_SEG_GPS_POSITION) {
+        gen_nav_sol_segment(state, &block[k]);
+        state.gps_part = 2;
+      }
+      else {
+        gen_tm2_segment(state, &block[k]);
+        state.gps_part = 0;
+      }
+
+      k = gen_close_segment(state, block, k, type, length);
+    }
+
+    pad_block(block, k);
+
+    if (config.corrupt_rate > 0.0 &&
+        (double)state.rng() < config.corrupt_rate * 4294967296.0) {
+      gen_corrupt_block(state, block);
+    }
+
+    state.sequence = state.sequence + 1;
+    state.block_number = state.block_number + 1;
+    state.stats.blocks = state.stats.blocks + 1;
+  }
+
+
+  //Fill count blocks of buffer with the next blocks of the image.
+  inline void gen_image_fill(gen_image_state& state, unsigned char* buffer, uint64_t count)
+  {
+    for (uint64_t b = 0; b < count; b++) {
+      gen_image_block(state, &buffer[b * BLOCK_SIZE]);
+    }
+  }
+
+
+  //Write a whole image to filename.
+  //Returns 0, or -1 if the file could not be written.
+  inline int gen_image_write(const gen_image_config& config, const std::string& filename,
+                             gen_image_stats& stats)
+  {
+    gen_image_state* state = new gen_image_state;
+    std::vector<unsigned char> buffer((size_t)GEN_WRITE_BLOCKS * BLOCK_SIZE);
+    uint64_t remaining = config.blocks;
+    uint64_t count;
+    int result = 0;
+    FILE* out = std::fopen(filename.c_str(), "wb");
+
+    if (out == NULL) {
+      delete state;
+      return -1;
+    }
+
+    gen_image_begin(config, *state);
+
+    while (remaining > 0) {
+      count = (remaining < (uint64_t)GEN_WRITE_BLOCKS) ? remaining : GEN_WRITE_BLOCKS;
+      gen_image_fill(*state, &buffer[0], count);
+      if (std::fwrite(&buffer[0], BLOCK_SIZE, (size_t)count, out) != count) {
+        result = -1;
+        break;
+      }
+      remaining = remaining - count;
+    }
+
+    if (std::fclose(out) != 0) {
+      result = -1;
+    }
+
+    stats = state->stats;
+    delete state;
+    return result;
+  }
+
+#endif
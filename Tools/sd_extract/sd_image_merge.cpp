@@ -0,0 +1,103 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_image_merge.cpp
+// --!@brief      Command line merge of overlapping dumps of one card
+// --!@details    Combines several images of the same card into one image in
+// --             block sequence order with every block once, ready for
+// --             parse_sdcard_mex_p.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Building.
+//    g++ -std=c++11 -O2 sd_image_merge.cpp -o sd_image_merge
+//
+//Usage.
+//    sd_image_merge out.bin first.bin [more.bin ...]
+//
+//A partial field read and a later full read of the same card.
+//    sd_image_merge card.bin field_read.bin lab_read.bin
+//
+//Where the dumps hold the same block the one from the earlier dump on the
+//command line is kept. The output is refused if it is one of the dumps.
+//The outputs of the parser are appended to, so parse the merged image
+//once into a fresh folder rather than parsing each dump into the same one.
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sd_block.h"
+#include "sd_reorder.h"
+
+
+  int main(int argc, char* argv[])
+  {
+    std::vector<std::string> inputs;
+    std::vector<uint64_t> lengths;
+    reorder_stats stats;
+
+    if (argc < 3) {
+      fprintf(stderr, "Usage: sd_image_merge out.bin first.bin [more.bin ...]\n");
+      return 2;
+    }
+
+    std::string filename = argv[1];
+
+    for (int i = 2; i < argc; i++) {
+      std::ifstream in(argv[i], std::ios::in | std::ios::binary | std::ios::ate);
+      if (!in) {
+        fprintf(stderr, "sd_image_merge: could not open %s\n", argv[i]);
+        return 1;
+      }
+      inputs.push_back(argv[i]);
+      lengths.push_back((uint64_t)in.tellg());
+    }
+
+    int overwritten = reorder_output_input(inputs, filename);
+    if (overwritten >= 0) {
+      fprintf(stderr, "sd_image_merge: %s would overwrite the input %s\n", filename.c_str(), inputs[overwritten].c_str());
+      return 2;
+    }
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    if (reorder_images(inputs, lengths, filename, stats) != 0) {
+      fprintf(stderr, "sd_image_merge: could not write %s\n", filename.c_str());
+      return 1;
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1E6;
+    double megabytes = (double)stats.blocks * BLOCK_SIZE / (1024.0 * 1024.0);
+
+    printf("Dumps : %d\n", stats.images);
+    printf("Blocks read : %llu (%.1f MB)\n", (unsigned long long)stats.blocks, megabytes);
+    printf("Blocks written : %llu\n", (unsigned long long)stats.kept);
+    printf("Duplicates dropped : %llu\n", (unsigned long long)stats.duplicates);
+    printf("Unwritten blocks dropped : %llu\n", (unsigned long long)stats.unwritten);
+    printf("Conflicting duplicates dropped : %llu\n", (unsigned long long)stats.conflicts);
+    printf("Out of order blocks : %llu\n", (unsigned long long)stats.out_of_order);
+    printf("Sorted runs on disk : %d\n", stats.runs);
+    if (seconds > 0) {
+      printf("Merged in %.2f s, %.1f MB/s\n", seconds, megabytes / seconds);
+    }
+
+    return 0;
+  }
@@ -0,0 +1,234 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_imu.h
+// --!@brief      IMU samples in physical units
+// --!@details    Scales the raw LSM9DS1 words to dps, g and gauss using the
+// --             full scale set at startup and writes them as XYZ rows.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//The collar sets the IMU up from LSM9DS1_Register_Settings_Startup_Memory.mif
+//(Source_Code/MainCollar/IMU_LSM9DS1). Word 0 of it is the number of
+//accelerometer/gyroscope registers written and word 1 the number of
+//magnetometer registers. They follow from word 2 in that order, each word
+//being the register address in the high byte and its value in the low.
+//
+//The full scales are FS_G in CTRL_REG1_G (0x10), FS_XL in CTRL_REG6_XL
+//(0x20) and FS_M in CTRL_REG2_M (0x21 of the magnetometer). Registers the
+//file doesn't write keep their power on value of 0, which is 245 dps, 2 g
+//and 4 gauss.
+//
+//The SD card holds each sample as Z, Y, X. The rows written here are X, Y,
+//Z float32 with the axis offset taken off after scaling, one row for each
+//row of the stream's times file.
+
+#ifndef SD_IMU_H
+#define SD_IMU_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+  enum imu_sensor {
+    IMU_GYRO = 0,
+    IMU_ACCEL = 1,
+    IMU_MAG = 2,
+    IMU_SENSORS = 3
+  };
+
+  const uint8_t IMU_CTRL_REG1_G = 0x10;
+  const uint8_t IMU_CTRL_REG6_XL = 0x20;
+  const uint8_t IMU_CTRL_REG2_M = 0x21;
+
+  //Sensitivity per LSB for each full scale setting, from the LSM9DS1 data
+  //sheet table 3. FS_G 10 is not available and reads as 245 dps.
+  const double IMU_GYRO_DPS[4] = { 0.00875, 0.0175, 0.00875, 0.070 };
+  const double IMU_ACCEL_G[4] = { 0.000061, 0.000732, 0.000122, 0.000244 };
+  const double IMU_MAG_GAUSS[4] = { 0.00014, 0.00029, 0.00043, 0.00058 };
+
+  //Rows converted at a time before they are written out.
+  const size_t IMU_BUFFER_ROWS = 4096;
+
+
+  //Units per LSB of each sensor.
+  struct imu_scale {
+    double sensitivity[IMU_SENSORS];
+    int full_scale[IMU_SENSORS];
+  };
+
+
+  inline void imu_set_full_scale(imu_scale& scale, int sensor, int setting)
+  {
+    const double* table = (sensor == IMU_GYRO) ? IMU_GYRO_DPS : (sensor == IMU_ACCEL) ? IMU_ACCEL_G : IMU_MAG_GAUSS;
+
+    scale.full_scale[sensor] = setting & 3;
+    scale.sensitivity[sensor] = table[setting & 3];
+  }
+
+
+  //The scales the IMU powers up with.
+  inline void imu_default_scale(imu_scale& scale)
+  {
+    for (int s = 0; s < IMU_SENSORS; s++) {
+      imu_set_full_scale(scale, s, 0);
+    }
+  }
+
+
+  //Read the full scales from a startup register MIF file.
+  //Returns 0, or -1 if the file can't be read or is not laid out as above.
+  inline int imu_read_mif(const std::string& filename, imu_scale& scale)
+  {
+    FILE* in = fopen(filename.c_str(), "r");
+    char line[256];
+    std::vector<long> words;
+    int in_content = 0;
+
+    if (in == NULL) {
+      return -1;
+    }
+
+    //Only "address : data;" lines between CONTENT BEGIN and END are kept.
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (strncmp(line, "--", 2) == 0) {
+        continue;
+      }
+      if (strstr(line, "CONTENT BEGIN") != NULL) {
+        in_content = 1;
+        continue;
+      }
+      if (!in_content || strstr(line, "END;") != NULL) {
+        continue;
+      }
+
+      char* separator = strchr(line, ':');
+      if (separator == NULL) {
+        continue;
+      }
+      unsigned long address = strtoul(line, NULL, 16);
+      unsigned long data = strtoul(separator + 1, NULL, 16);
+      if (address >= words.size()) {
+        words.resize(address + 1, 0);
+      }
+      words[address] = (long)data;
+    }
+    fclose(in);
+
+    if (words.size() < 2 || (size_t)(2 + words[0] + words[1]) > words.size()) {
+      return -1;
+    }
+
+    imu_default_scale(scale);
+    for (long i = 0; i < words[0] + words[1]; i++) {
+      int reg = (int)((words[2 + i] >> 8) & 0xFF);
+      int value = (int)(words[2 + i] & 0xFF);
+      if (i < words[0]) {
+        if (reg == IMU_CTRL_REG1_G) {
+          imu_set_full_scale(scale, IMU_GYRO, value >> 3);
+        }
+        else if (reg == IMU_CTRL_REG6_XL) {
+          imu_set_full_scale(scale, IMU_ACCEL, value >> 3);
+        }
+      }
+      else if (reg == IMU_CTRL_REG2_M) {
+        imu_set_full_scale(scale, IMU_MAG, value >> 5);
+      }
+    }
+    return 0;
+  }
+
+
+  struct imu_unit_writer {
+    std::string filename;
+    FILE* file;
+    float scale;
+    float offset[3];
+    uint64_t rows;
+    std::vector<float> buffer;
+  };
+
+
+  //offset is X, Y, Z in the converted units.
+  //Returns 0, or -1 if the file could not be created.
+  inline int imu_units_open(imu_unit_writer& writer, const std::string& filename, double sensitivity,
+                            const double offset[3])
+  {
+    writer.filename = filename;
+    writer.scale = (float)sensitivity;
+    for (int a = 0; a < 3; a++) {
+      writer.offset[a] = (float)offset[a];
+    }
+    writer.rows = 0;
+    writer.buffer.resize(IMU_BUFFER_ROWS * 3);
+    writer.file = fopen(filename.c_str(), "wb");
+    return (writer.file == NULL) ? -1 : 0;
+  }
+
+
+  //Convert count samples given by their stored Z, Y and X words, each
+  //stride apart, and write them as X, Y, Z rows.
+  //Returns 0, or -1 on a write error.
+  template <typename T>
+  inline int imu_units_add(imu_unit_writer& writer, const T* z, const T* y, const T* x, size_t count, size_t stride)
+  {
+    const float scale = writer.scale;
+    const float offset_x = writer.offset[0];
+    const float offset_y = writer.offset[1];
+    const float offset_z = writer.offset[2];
+    float* out = writer.buffer.data();
+
+    for (size_t first = 0; first < count; first = first + IMU_BUFFER_ROWS) {
+      size_t rows = std::min(IMU_BUFFER_ROWS, count - first);
+      const T* xs = x + first * stride;
+      const T* ys = y + first * stride;
+      const T* zs = z + first * stride;
+
+      //Straight multiply-subtract with no branches so it vectorizes.
+      for (size_t r = 0; r < rows; r++) {
+        out[r * 3] = (float)xs[r * stride] * scale - offset_x;
+        out[r * 3 + 1] = (float)ys[r * stride] * scale - offset_y;
+        out[r * 3 + 2] = (float)zs[r * stride] * scale - offset_z;
+      }
+
+      if (fwrite(out, sizeof(float), rows * 3, writer.file) != rows * 3) {
+        return -1;
+      }
+      writer.rows = writer.rows + rows;
+    }
+    return 0;
+  }
+
+
+  //Returns 0, or -1 on a write error.
+  inline int imu_units_close(imu_unit_writer& writer)
+  {
+    if (writer.file == NULL) {
+      return -1;
+    }
+
+    int result = (fclose(writer.file) == 0) ? 0 : -1;
+    writer.file = NULL;
+    return result;
+  }
+
+#endif
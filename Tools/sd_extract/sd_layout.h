@@ -0,0 +1,117 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_layout.h
+// --!@brief      Record layouts of the SD card segments
+// --!@details    Generated by sd_layout_gen.py from the collar VHDL. Do not
+// --             edit, rerun the script after a firmware change.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Each segment is a struct of byte offsets, each field with its size as
+//<field>_bytes and the segment length as bytes. They are all constant
+//expressions so a decoder reads at fixed offsets.
+
+#ifndef SD_LAYOUT_H
+#define SD_LAYOUT_H
+
+
+  const int LAYOUT_GPS_TIME_BYTES = 9;
+
+
+  //From FlashBlock.vhd.
+  struct status_layout {
+    static constexpr int compile = 0;
+    static constexpr int compile_bytes = 4;
+    static constexpr int commit = 4;
+    static constexpr int commit_bytes = 4;
+    static constexpr int fpga_time = 8;
+    static constexpr int fpga_time_bytes = 9;
+    static constexpr int accel_time = 17;
+    static constexpr int accel_time_bytes = 9;
+    static constexpr int mag_time = 26;
+    static constexpr int mag_time_bytes = 9;
+    static constexpr int gyro_time = 35;
+    static constexpr int gyro_time_bytes = 9;
+    static constexpr int temp_time = 44;
+    static constexpr int temp_time_bytes = 9;
+    static constexpr int audio_time = 53;
+    static constexpr int audio_time_bytes = 9;
+    static constexpr int rtc_time = 62;
+    static constexpr int rtc_time_bytes = 4;
+    static constexpr int mics = 66;
+    static constexpr int mics_bytes = 1;
+    static constexpr int bytes = 67;
+  };
+
+
+  //From msg_ubx_nav_sol_pkg.vhd.
+  struct nav_sol_layout {
+    static constexpr int itow = 0;
+    static constexpr int itow_bytes = 4;
+    static constexpr int ftow = 4;
+    static constexpr int ftow_bytes = 4;
+    static constexpr int week = 8;
+    static constexpr int week_bytes = 2;
+    static constexpr int gpsfix = 10;
+    static constexpr int gpsfix_bytes = 1;
+    static constexpr int ecefx = 11;
+    static constexpr int ecefx_bytes = 4;
+    static constexpr int ecefy = 15;
+    static constexpr int ecefy_bytes = 4;
+    static constexpr int ecefz = 19;
+    static constexpr int ecefz_bytes = 4;
+    static constexpr int pacc = 23;
+    static constexpr int pacc_bytes = 4;
+    static constexpr int pdop = 27;
+    static constexpr int pdop_bytes = 2;
+    static constexpr int numsv = 29;
+    static constexpr int numsv_bytes = 1;
+    static constexpr int postime = 30;
+    static constexpr int postime_bytes = 9;
+    static constexpr int bytes = 39;
+  };
+
+
+  //From msg_ubx_tim_tm2_pkg.vhd.
+  struct tim_tm2_layout {
+    static constexpr int flags = 0;
+    static constexpr int flags_bytes = 1;
+    static constexpr int wnf = 1;
+    static constexpr int wnf_bytes = 2;
+    static constexpr int towmsf = 3;
+    static constexpr int towmsf_bytes = 4;
+    static constexpr int towsubmsf = 7;
+    static constexpr int towsubmsf_bytes = 4;
+    static constexpr int accest = 11;
+    static constexpr int accest_bytes = 4;
+    static constexpr int marktime = 15;
+    static constexpr int marktime_bytes = 9;
+    static constexpr int bytes = 24;
+  };
+
+
+  //From gps_message_ctl_pkg.vhd.
+  struct tim_tp_layout {
+    static constexpr int fpga_time = 0;
+    static constexpr int fpga_time_bytes = 9;
+    static constexpr int pulse_time = 9;
+    static constexpr int pulse_time_bytes = 9;
+    static constexpr int bytes = 18;
+  };
+
+#endif
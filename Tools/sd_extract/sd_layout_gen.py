@@ -0,0 +1,209 @@
+# -*- coding: utf-8 -*-
+"""
+Generates sd_layout.h, the SD card record layouts used by the parser, from
+the collar's VHDL so a firmware change can't silently move a field.
+
+    python sd_layout_gen.py            rewrite sd_layout.h
+    python sd_layout_gen.py --check    exit 1 if sd_layout.h is out of date
+
+Run it after changing any of the files below. sd_layout.h is checked in so
+the MEX file still builds with a single mex command.
+
+Where the layouts come from:
+    status   FlashBlock.vhd, following the BLOCK_STATE_STATUS_* states
+             from COMPILE through end_block_state and the byte_number each
+             one writes.
+    nav_sol  msg_ubx_nav_sol_pkg.vhd <field>_offset_c/_size_c for the stored
+             fields, then the position time at msg_ubx_nav_sol_ramused_c.
+    tim_tm2  msg_ubx_tim_tm2_pkg.vhd the same way, then the mark time.
+    tim_tp   gps_message_ctl_pkg.vhd, the FPGA time and the pulse time that
+             make up msg_ram_pulsetime_size_c.
+"""
+
+import os
+import re
+import sys
+
+here = os.path.dirname(os.path.abspath(__file__))
+collar = os.path.join(here, '..', '..', 'Source_Code', 'MainCollar')
+
+sources = {
+    'clock':   os.path.join(collar, 'General', 'GPS_Clock_pkg.vhd'),
+    'block':   os.path.join(collar, 'flashblock', 'FlashBlock.vhd'),
+    'message': os.path.join(collar, 'GPS', 'gps_message_ctl_pkg.vhd'),
+    'nav_sol': os.path.join(collar, 'GPS', 'msg_ubx_nav_sol_pkg.vhd'),
+    'tim_tm2': os.path.join(collar, 'GPS', 'msg_ubx_tim_tm2_pkg.vhd'),
+}
+
+output = os.path.join(here, 'sd_layout.h')
+
+
+def strip_comments(text):
+    return re.sub(r'--[^\n]*', '', text)
+
+
+def read_constants(text, constants):
+    """Collect natural/integer constants and generic defaults as expression
+    strings, evaluated later since they refer to each other across files."""
+    pattern = r'(?:constant\s+)?(\w+)\s*:\s*(?:natural|integer|positive)\s*:=\s*([^;]+)'
+    for name, expression in re.findall(pattern, text, re.IGNORECASE):
+        # The last generic of a list ends at the list's closing bracket.
+        depth = 0
+        for i, c in enumerate(expression):
+            depth = depth + (c == '(') - (c == ')')
+            if depth < 0:
+                expression = expression[:i]
+                break
+        constants.setdefault(name.lower(), ' '.join(expression.split()))
+
+
+def evaluate(name, constants, values, depth=0):
+    name = name.lower()
+    if name in values:
+        return values[name]
+    if name not in constants or depth > 32:
+        raise KeyError('VHDL constant %s not found' % name)
+
+    expression = constants[name]
+    expression = re.sub(r'(\d+)#([0-9A-Fa-f_]+)#',
+                        lambda m: str(int(m.group(2).replace('_', ''), int(m.group(1)))), expression)
+    expression = re.sub(r'\bnatural\s*\(', '(', expression, flags=re.IGNORECASE)
+    expression = expression.replace('/', '//')
+    expression = re.sub(r'\b([A-Za-z]\w*)\b',
+                        lambda m: str(evaluate(m.group(1), constants, values, depth + 1)), expression)
+    values[name] = int(eval(expression, {'__builtins__': {}}, {}))
+    return values[name]
+
+
+def message_fields(text, prefix, constants, values):
+    """Stored fields of a UBX message package in offset order."""
+    fields = []
+    for field in re.findall(r'constant\s+' + prefix + r'_(\w+?)_offset_c\s*:', text, re.IGNORECASE):
+        offset = evaluate('%s_%s_offset_c' % (prefix, field), constants, values)
+        size = evaluate('%s_%s_size_c' % (prefix, field), constants, values)
+        fields.append((field.lower(), offset, size))
+    return sorted(fields, key=lambda f: f[1])
+
+
+def status_fields(text, constants, values):
+    """Status segment fields in the order the block state machine writes
+    them."""
+    states = {}
+    for state, body in re.findall(r'when\s+BLOCK_STATE_STATUS_(\w+)\s*=>(.*?)(?=\bwhen\b)', text, re.DOTALL):
+        size = re.search(r'byte_number\s*<=\s*TO_UNSIGNED\s*\(\s*(\w+)', body, re.IGNORECASE)
+        following = re.search(r'end_block_state\s*<=\s*BLOCK_STATE_(\w+)', body)
+        states[state] = (evaluate(size.group(1), constants, values), following.group(1) if following else '')
+
+    fields = []
+    offset = 0
+    state = 'COMPILE'
+    while state in states and len(fields) < len(states):
+        size, following = states[state]
+        fields.append((state.lower(), offset, size))
+        offset = offset + size
+        state = following[len('STATUS_'):] if following.startswith('STATUS_') else ''
+    return fields
+
+
+def emit_struct(name, source, fields, total):
+    lines = ['  //From %s.' % source, '  struct %s {' % name]
+    for field, offset, size in fields:
+        lines.append('    static constexpr int %s = %d;' % (field, offset))
+        lines.append('    static constexpr int %s_bytes = %d;' % (field, size))
+    lines.append('    static constexpr int bytes = %d;' % total)
+    lines.append('  };')
+    return lines
+
+
+def generate():
+    texts = {}
+    constants = {}
+    values = {}
+    for key, path in sources.items():
+        with open(path, 'r', errors='replace') as f:
+            texts[key] = strip_comments(f.read())
+        read_constants(texts[key], constants)
+
+    gps_time_bytes = evaluate('gps_time_bytes_c', constants, values)
+
+    status = status_fields(texts['block'], constants, values)
+    status_bytes = evaluate('STATUS_SEG_BYTES', constants, values)
+    if sum(f[2] for f in status) != status_bytes:
+        raise ValueError('status fields add to %d bytes, STATUS_SEG_BYTES is %d'
+                         % (sum(f[2] for f in status), status_bytes))
+
+    nav_sol = message_fields(texts['nav_sol'], 'MUNSol', constants, values)
+    nav_sol_used = evaluate('msg_ubx_nav_sol_ramused_c', constants, values)
+    nav_sol.append(('postime', nav_sol_used, gps_time_bytes))
+
+    tim_tm2 = message_fields(texts['tim_tm2'], 'MUTTm2', constants, values)
+    tim_tm2_used = evaluate('msg_ubx_tim_tm2_ramused_c', constants, values)
+    tim_tm2.append(('marktime', tim_tm2_used, gps_time_bytes))
+
+    pulse_bytes = evaluate('msg_ram_pulsetime_size_c', constants, values)
+    tim_tp = [('fpga_time', 0, gps_time_bytes), ('pulse_time', gps_time_bytes, pulse_bytes - gps_time_bytes)]
+
+    lines = [
+        '// ----------------------------------------------------------------------------',
+        '// --',
+        '// --!@file       sd_layout.h',
+        '// --!@brief      Record layouts of the SD card segments',
+        '// --!@details    Generated by sd_layout_gen.py from the collar VHDL. Do not',
+        '// --             edit, rerun the script after a firmware change.',
+        '// --!@copyright',
+        '// --',
+        '// --This program is free software : you can redistribute it and / or modify',
+        '// --it under the terms of the GNU General Public License as published by',
+        '// --the Free Software Foundation, either version 3 of the License, or',
+        '// --(at your option) any later version.',
+        '// --',
+        '// --This program is distributed in the hope that it will be useful,',
+        '// --but WITHOUT ANY WARRANTY; without even the implied warranty of',
+        '// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the',
+        '// --GNU General Public License for more details.',
+        '// --',
+        '// --You should have received a copy of the GNU General Public License',
+        '// --along with this program.If not, see <http://www.gnu.org/licenses/>.',
+        '// --',
+        '// ----------------------------------------------------------------------------',
+        '',
+        '',
+        '//Each segment is a struct of byte offsets, each field with its size as',
+        '//<field>_bytes and the segment length as bytes. They are all constant',
+        '//expressions so a decoder reads at fixed offsets.',
+        '',
+        '#ifndef SD_LAYOUT_H',
+        '#define SD_LAYOUT_H',
+        '',
+        '',
+        '  const int LAYOUT_GPS_TIME_BYTES = %d;' % gps_time_bytes,
+        '',
+        '',
+    ]
+    lines += emit_struct('status_layout', 'FlashBlock.vhd', status, status_bytes)
+    lines += ['', '']
+    lines += emit_struct('nav_sol_layout', 'msg_ubx_nav_sol_pkg.vhd', nav_sol, nav_sol_used + gps_time_bytes)
+    lines += ['', '']
+    lines += emit_struct('tim_tm2_layout', 'msg_ubx_tim_tm2_pkg.vhd', tim_tm2, tim_tm2_used + gps_time_bytes)
+    lines += ['', '']
+    lines += emit_struct('tim_tp_layout', 'gps_message_ctl_pkg.vhd', tim_tp, pulse_bytes)
+    lines += ['', '#endif', '']
+    return '\n'.join(lines)
+
+
+if __name__ == '__main__':
+    header = generate()
+
+    if '--check' in sys.argv[1:]:
+        current = ''
+        if os.path.exists(output):
+            with open(output, 'r') as f:
+                current = f.read()
+        if current != header:
+            print('sd_layout.h is out of date, run sd_layout_gen.py')
+            sys.exit(1)
+        sys.exit(0)
+
+    with open(output, 'w', newline='\n') as f:
+        f.write(header)
+    print('Wrote ' + output)
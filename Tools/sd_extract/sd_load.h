@@ -0,0 +1,125 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_load.h
+// --!@brief      Little endian loads from any byte of the card image
+// --!@details    Typed reads of the fields in a segment that are safe at any
+// --             alignment and on any host byte order.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Segments start on any byte, so casting a field's address to a wider type
+//is undefined and traps or splits the access on strict alignment cores.
+//A fixed size memcpy is the portable way to say "one unaligned load" and
+//x86-64 and aarch64 compilers turn it into a single mov/ldr. The card is
+//little endian, so a big endian host swaps after the load.
+//
+//GPS times are 9 bytes, 66 bits used: the ns in the low 20, the ms in the
+//next 30 and the week in the top 16 (gps_time_*bits_c in
+//GPS_Clock_pkg.vhd). load_gps_word gives the low 8 bytes, which is
+//what the raw time columns hold, and load_gps_time splits all 9 bytes.
+
+#ifndef SD_LOAD_H
+#define SD_LOAD_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SD_LOAD_BIG_ENDIAN 1
+#else
+#define SD_LOAD_BIG_ENDIAN 0
+#endif
+
+
+  const int GPS_TIME_NANO_BITS = 20;
+  const int GPS_TIME_MILLI_BITS = 30;
+  const int GPS_TIME_WEEK_BITS = 16;
+
+
+  inline uint8_t load_u8(const unsigned char* p)
+  {
+    return p[0];
+  }
+
+
+  inline uint16_t load_u16(const unsigned char* p)
+  {
+    uint16_t value;
+    std::memcpy(&value, p, sizeof(value));
+#if SD_LOAD_BIG_ENDIAN
+    value = __builtin_bswap16(value);
+#endif
+    return value;
+  }
+
+
+  inline uint32_t load_u32(const unsigned char* p)
+  {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+#if SD_LOAD_BIG_ENDIAN
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+  }
+
+
+  inline uint64_t load_u64(const unsigned char* p)
+  {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+#if SD_LOAD_BIG_ENDIAN
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+  }
+
+
+  inline int16_t load_i16(const unsigned char* p)
+  {
+    return (int16_t)load_u16(p);
+  }
+
+
+  inline int32_t load_i32(const unsigned char* p)
+  {
+    return (int32_t)load_u32(p);
+  }
+
+
+  //The low 8 bytes of a GPS time, as the raw time columns keep it.
+  inline uint64_t load_gps_word(const unsigned char* p)
+  {
+    return load_u64(p);
+  }
+
+
+  //All 9 bytes of a GPS time split into week, ms in the week and ns in
+  //the ms.
+  inline void load_gps_time(const unsigned char* p, uint32_t& week, uint32_t& ms, uint32_t& ns)
+  {
+    uint64_t low = load_u64(p);
+    uint64_t high = p[8];
+    const int week_shift = GPS_TIME_NANO_BITS + GPS_TIME_MILLI_BITS;
+
+    ns = uint32_t(low & ((1ULL << GPS_TIME_NANO_BITS) - 1));
+    ms = uint32_t((low >> GPS_TIME_NANO_BITS) & ((1ULL << GPS_TIME_MILLI_BITS) - 1));
+    week = uint32_t(((low >> week_shift) | (high << (64 - week_shift))) & ((1ULL << GPS_TIME_WEEK_BITS) - 1));
+  }
+
+#endif
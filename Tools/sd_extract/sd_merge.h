@@ -0,0 +1,361 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_merge.h
+// --!@brief      Time ordered merge of every sample and packet stream
+// --!@details    k-way merge over the GPS times of the streams as each chunk
+// --             is parsed, giving one record stream and an index of fixed
+// --             length windows across all of them.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Each stream hands over one time row per sample or packet for a chunk.
+//The rows are only looked at, not copied, until the chunk is flushed. The
+//order is by the GPS part of the row, week, ms and ns, taken as signed so
+//rows back annotated past a week or ms boundary still sort right.
+//
+//A stream's times only go forward, so nothing later from it can come
+//before the last time it gave. A flush merges every queued row up to the
+//earliest of those last times over the streams that gave rows in the
+//chunk, and carries the rest over. Streams with nothing in the chunk are
+//left out of that so a sensor that stops doesn't hold everything back.
+//What is carried is at most the spread of the streams' ends in a chunk.
+//
+//A record is 9 uint32: the stream number, the time row and the record's
+//row in that stream's own output as a low and a high word. The window
+//index has a row per window that has records, giving where each stream's
+//records in it start and how many there are.
+
+#ifndef SD_MERGE_H
+#define SD_MERGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+  const int MERGE_MAX_STREAMS = 8;
+  const int MERGE_TIME_WORDS = 6;
+  const int MERGE_RECORD_WORDS = MERGE_TIME_WORDS + 3;
+  const int64_t MERGE_WEEK_NS = 604800LL * 1000000000LL;
+
+  //Records held before they are written out.
+  const size_t MERGE_BUFFER_RECORDS = 65536;
+
+
+  struct merge_stream {
+    std::string name;
+
+    //Rows carried over from earlier chunks, ahead of the current view.
+    std::vector<uint32_t> carry;
+    size_t carry_position;
+
+    //This chunk's rows, owned by the caller.
+    const uint32_t* view;
+    size_t view_count;
+    size_t view_position;
+
+    //Row number in the stream of the next record to merge.
+    uint64_t next_index;
+    int fresh;
+    int64_t last_key;
+  };
+
+
+  struct stream_merger {
+    int stream_count;
+    merge_stream streams[MERGE_MAX_STREAMS];
+
+    FILE* file;
+    std::vector<uint32_t> buffer;
+    uint64_t records;
+    int write_error;
+
+    int64_t window_ns;
+    FILE* windows;
+    int window_open;
+    int64_t window;
+    uint64_t window_first_record;
+    uint64_t window_records;
+    uint64_t window_first[MERGE_MAX_STREAMS];
+    uint64_t window_counts[MERGE_MAX_STREAMS];
+  };
+
+
+  //Nanoseconds since GPS week 0 of a time row's GPS fields.
+  inline int64_t merge_key(const uint32_t* time)
+  {
+    return (int64_t)time[3] * MERGE_WEEK_NS + (int64_t)(int32_t)time[4] * 1000000LL + (int64_t)(int32_t)time[5];
+  }
+
+
+  inline int64_t merge_floor_divide(int64_t a, int64_t b)
+  {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+  }
+
+
+  //Open the record file and the window index. Either name may be empty to
+  //leave that output out.
+  //Returns 0, or -1 if a file could not be created.
+  inline int merge_open(stream_merger& merger, const char* const* names, int stream_count,
+                        const std::string& filename, const std::string& windows_filename, int window_ms)
+  {
+    merger.stream_count = std::min(stream_count, MERGE_MAX_STREAMS);
+    for (int s = 0; s < merger.stream_count; s++) {
+      merge_stream& stream = merger.streams[s];
+      stream.name = names[s];
+      stream.carry.clear();
+      stream.carry_position = 0;
+      stream.view = NULL;
+      stream.view_count = 0;
+      stream.view_position = 0;
+      stream.next_index = 0;
+      stream.fresh = 0;
+      stream.last_key = 0;
+    }
+    merger.records = 0;
+    merger.write_error = 0;
+    merger.buffer.clear();
+    merger.window_ns = (int64_t)window_ms * 1000000LL;
+    merger.window_open = 0;
+    merger.file = NULL;
+    merger.windows = NULL;
+
+    if (!filename.empty()) {
+      merger.file = fopen(filename.c_str(), "wb");
+      if (merger.file == NULL) {
+        return -1;
+      }
+    }
+    if (!windows_filename.empty() && merger.window_ns > 0) {
+      merger.windows = fopen(windows_filename.c_str(), "w");
+      if (merger.windows == NULL) {
+        return -1;
+      }
+      fprintf(merger.windows, "gps_week,gps_ms,first_record,records");
+      for (int s = 0; s < merger.stream_count; s++) {
+        fprintf(merger.windows, ",%s_first,%s_count", merger.streams[s].name.c_str(), merger.streams[s].name.c_str());
+      }
+      fprintf(merger.windows, "\n");
+    }
+    return 0;
+  }
+
+
+  //Hand over this chunk's count time rows of stream s. They must stay in
+  //place until the next merge_flush.
+  inline void merge_add(stream_merger& merger, int s, const uint32_t* times, size_t count)
+  {
+    merge_stream& stream = merger.streams[s];
+
+    stream.view = times;
+    stream.view_count = count;
+    stream.view_position = 0;
+    if (count > 0) {
+      stream.fresh = 1;
+      stream.last_key = merge_key(times + (count - 1) * MERGE_TIME_WORDS);
+    }
+  }
+
+
+  inline const uint32_t* merge_head(const merge_stream& stream)
+  {
+    if (stream.carry_position * MERGE_TIME_WORDS < stream.carry.size()) {
+      return &stream.carry[stream.carry_position * MERGE_TIME_WORDS];
+    }
+    if (stream.view_position < stream.view_count) {
+      return stream.view + stream.view_position * MERGE_TIME_WORDS;
+    }
+    return NULL;
+  }
+
+
+  inline void merge_advance(merge_stream& stream)
+  {
+    if (stream.carry_position * MERGE_TIME_WORDS < stream.carry.size()) {
+      stream.carry_position = stream.carry_position + 1;
+    }
+    else {
+      stream.view_position = stream.view_position + 1;
+    }
+    stream.next_index = stream.next_index + 1;
+  }
+
+
+  inline int merge_write_buffer(stream_merger& merger)
+  {
+    int result = 0;
+
+    if (merger.file != NULL && !merger.buffer.empty()) {
+      size_t written = fwrite(merger.buffer.data(), sizeof(uint32_t), merger.buffer.size(), merger.file);
+      result = (written == merger.buffer.size()) ? 0 : -1;
+    }
+    merger.buffer.clear();
+    return result;
+  }
+
+
+  inline void merge_close_window(stream_merger& merger)
+  {
+    if (!merger.window_open || merger.windows == NULL) {
+      return;
+    }
+
+    int64_t start = merger.window * merger.window_ns;
+    int64_t week = merge_floor_divide(start, MERGE_WEEK_NS);
+    int64_t ms = (start - week * MERGE_WEEK_NS) / 1000000LL;
+
+    fprintf(merger.windows, "%lld,%lld,%llu,%llu", (long long)week, (long long)ms,
+            (unsigned long long)merger.window_first_record, (unsigned long long)merger.window_records);
+    for (int s = 0; s < merger.stream_count; s++) {
+      fprintf(merger.windows, ",%llu,%llu", (unsigned long long)merger.window_first[s],
+              (unsigned long long)merger.window_counts[s]);
+    }
+    fprintf(merger.windows, "\n");
+    merger.window_open = 0;
+  }
+
+
+  inline void merge_emit(stream_merger& merger, int s, const uint32_t* time, int64_t key)
+  {
+    merge_stream& stream = merger.streams[s];
+
+    if (merger.window_ns > 0) {
+      int64_t window = merge_floor_divide(key, merger.window_ns);
+      if (!merger.window_open || window != merger.window) {
+        merge_close_window(merger);
+        merger.window_open = 1;
+        merger.window = window;
+        merger.window_first_record = merger.records;
+        merger.window_records = 0;
+        for (int i = 0; i < merger.stream_count; i++) {
+          merger.window_first[i] = merger.streams[i].next_index;
+          merger.window_counts[i] = 0;
+        }
+      }
+      if (merger.window_counts[s] == 0) {
+        merger.window_first[s] = stream.next_index;
+      }
+      merger.window_counts[s] = merger.window_counts[s] + 1;
+      merger.window_records = merger.window_records + 1;
+    }
+
+    if (merger.file != NULL) {
+      merger.buffer.push_back((uint32_t)s);
+      merger.buffer.insert(merger.buffer.end(), time, time + MERGE_TIME_WORDS);
+      merger.buffer.push_back((uint32_t)(stream.next_index & 0xFFFFFFFF));
+      merger.buffer.push_back((uint32_t)(stream.next_index >> 32));
+      if (merger.buffer.size() >= MERGE_BUFFER_RECORDS * MERGE_RECORD_WORDS && merge_write_buffer(merger) != 0) {
+        merger.write_error = 1;
+      }
+    }
+    merger.records = merger.records + 1;
+  }
+
+
+  //Merge everything that can't be overtaken by a later chunk, or
+  //everything with last set, and carry the rest.
+  //Returns 0, or -1 on a write error.
+  inline int merge_flush(stream_merger& merger, int last = 0)
+  {
+    typedef std::pair<int64_t, int> merge_entry;
+    std::priority_queue<merge_entry, std::vector<merge_entry>, std::greater<merge_entry> > heads;
+    int64_t watermark = INT64_MAX;
+    int any_fresh = 0;
+
+    for (int s = 0; s < merger.stream_count; s++) {
+      if (merger.streams[s].fresh) {
+        watermark = any_fresh ? std::min(watermark, merger.streams[s].last_key) : merger.streams[s].last_key;
+        any_fresh = 1;
+      }
+    }
+    if (last) {
+      watermark = INT64_MAX;
+    }
+    else if (!any_fresh) {
+      return 0;
+    }
+
+    for (int s = 0; s < merger.stream_count; s++) {
+      const uint32_t* head = merge_head(merger.streams[s]);
+      if (head != NULL && merge_key(head) <= watermark) {
+        heads.push(merge_entry(merge_key(head), s));
+      }
+    }
+
+    while (!heads.empty()) {
+      merge_entry entry = heads.top();
+      heads.pop();
+
+      merge_stream& stream = merger.streams[entry.second];
+      merge_emit(merger, entry.second, merge_head(stream), entry.first);
+      merge_advance(stream);
+
+      const uint32_t* head = merge_head(stream);
+      if (head != NULL && merge_key(head) <= watermark) {
+        heads.push(merge_entry(merge_key(head), entry.second));
+      }
+    }
+
+    //Keep what is left, the carry first since it is the older.
+    for (int s = 0; s < merger.stream_count; s++) {
+      merge_stream& stream = merger.streams[s];
+      stream.carry.erase(stream.carry.begin(), stream.carry.begin() + stream.carry_position * MERGE_TIME_WORDS);
+      stream.carry_position = 0;
+      if (stream.view_position < stream.view_count) {
+        stream.carry.insert(stream.carry.end(), stream.view + stream.view_position * MERGE_TIME_WORDS,
+                            stream.view + stream.view_count * MERGE_TIME_WORDS);
+      }
+      stream.view = NULL;
+      stream.view_count = 0;
+      stream.view_position = 0;
+      stream.fresh = 0;
+    }
+
+    if (merge_write_buffer(merger) != 0) {
+      merger.write_error = 1;
+    }
+    return merger.write_error ? -1 : 0;
+  }
+
+
+  //Merge what is still carried and close the files.
+  //Returns 0, or -1 on a write error.
+  inline int merge_close(stream_merger& merger)
+  {
+    int result = merge_flush(merger, 1);
+
+    merge_close_window(merger);
+    if (merger.file != NULL && fclose(merger.file) != 0) {
+      result = -1;
+    }
+    if (merger.windows != NULL && fclose(merger.windows) != 0) {
+      result = -1;
+    }
+    merger.file = NULL;
+    merger.windows = NULL;
+    return result;
+  }
+
+#endif
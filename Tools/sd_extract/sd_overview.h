@@ -0,0 +1,298 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_overview.h
+// --!@brief      Min/max/RMS overview pyramid of the sample streams
+// --!@details    Decimated copies of each stream at 1 ms, 10 ms, 100 ms and
+// --             1 s built during the parse so long recordings can be
+// --             plotted without loading every sample.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Each level is a file overview_<stream>_<level>.bin of int16 rows, one
+//row per bucket holding the min, max and RMS of each channel in turn. An
+//audio channel has 3 columns and an IMU stream of three axes 9.
+//overview.csv lists the files with their rate, bucket length and rows.
+//
+//Bucket b of a level starts at stream sample ceil(b * rate * ms / 1000)
+//and runs to the start of the next, so the rows line up with the raw .bin
+//files. That start is the first raw sample to read when drilling down.
+//
+//Buckets are filled from the samples only at the finest level. Every
+//tenth bucket closing closes one of the level above, which is built from
+//the ten below it. Levels with buckets shorter than a sample (1 ms for the
+//IMU, 10 ms for the magnetometer) are left out.
+
+#ifndef SD_OVERVIEW_H
+#define SD_OVERVIEW_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+  const int OVERVIEW_LEVELS = 4;
+  const int OVERVIEW_LEVEL_MS[OVERVIEW_LEVELS] = { 1, 10, 100, 1000 };
+  const char* const OVERVIEW_LEVEL_NAMES[OVERVIEW_LEVELS] = { "1ms", "10ms", "100ms", "1s" };
+  const int OVERVIEW_MAX_CHANNELS = 3;
+  const int OVERVIEW_COLUMNS = 3;
+
+  //Rows held per level before they are written out.
+  const size_t OVERVIEW_BUFFER_ROWS = 16384;
+
+
+  //Running min, max and sum of squares of one channel in one bucket.
+  struct overview_bucket {
+    int min;
+    int max;
+    double sum_squares;
+    uint64_t count;
+  };
+
+
+  struct overview_level {
+    int ms;
+    std::string filename;
+    FILE* file;
+    uint64_t bucket;
+    uint64_t rows;
+    overview_bucket channel[OVERVIEW_MAX_CHANNELS];
+    std::vector<int16_t> buffer;
+  };
+
+
+  struct overview_stream {
+    std::string name;
+    int rate;
+    int channels;
+    uint64_t samples;
+
+    //Sample that ends the current bucket of the finest level.
+    uint64_t next_boundary;
+
+    int level_count;
+    overview_level levels[OVERVIEW_LEVELS];
+  };
+
+
+  inline void overview_clear_bucket(overview_bucket& bucket)
+  {
+    bucket.min = INT32_MAX;
+    bucket.max = INT32_MIN;
+    bucket.sum_squares = 0.0;
+    bucket.count = 0;
+  }
+
+
+  //First sample of bucket b of a level.
+  inline uint64_t overview_bucket_start(const overview_stream& stream, int ms, uint64_t b)
+  {
+    uint64_t scaled = b * (uint64_t)stream.rate * ms;
+    return (scaled + 999) / 1000;
+  }
+
+
+  //Open the level files of one stream.
+  //Returns 0, or -1 if a file could not be created. On failure the levels
+  //already opened are closed and removed and the stream has no levels.
+  inline int overview_open(overview_stream& stream, const std::string& name, int rate, int channels)
+  {
+    stream.name = name;
+    stream.rate = rate;
+    stream.channels = std::min(channels, OVERVIEW_MAX_CHANNELS);
+    stream.samples = 0;
+    stream.level_count = 0;
+
+    for (int l = 0; l < OVERVIEW_LEVELS; l++) {
+      if ((uint64_t)rate * OVERVIEW_LEVEL_MS[l] < 1000) {
+        continue;
+      }
+      overview_level& level = stream.levels[stream.level_count];
+      level.ms = OVERVIEW_LEVEL_MS[l];
+      level.filename = "overview_" + name + "_" + OVERVIEW_LEVEL_NAMES[l] + ".bin";
+      level.file = fopen(level.filename.c_str(), "wb");
+      level.bucket = 0;
+      level.rows = 0;
+      level.buffer.clear();
+      for (int c = 0; c < OVERVIEW_MAX_CHANNELS; c++) {
+        overview_clear_bucket(level.channel[c]);
+      }
+      if (level.file == NULL) {
+        for (int opened = 0; opened < stream.level_count; opened++) {
+          fclose(stream.levels[opened].file);
+          stream.levels[opened].file = NULL;
+          remove(stream.levels[opened].filename.c_str());
+        }
+        stream.level_count = 0;
+        stream.next_boundary = UINT64_MAX;
+        return -1;
+      }
+      stream.level_count = stream.level_count + 1;
+    }
+
+    stream.next_boundary = (stream.level_count > 0) ? overview_bucket_start(stream, stream.levels[0].ms, 1) : UINT64_MAX;
+    return 0;
+  }
+
+
+  inline int overview_write_buffer(overview_level& level)
+  {
+    if (level.file == NULL) {
+      level.buffer.clear();
+      return -1;
+    }
+
+    size_t written = fwrite(level.buffer.data(), sizeof(int16_t), level.buffer.size(), level.file);
+    int result = (written == level.buffer.size()) ? 0 : -1;
+
+    level.buffer.clear();
+    return result;
+  }
+
+
+  //Write the current bucket of level l as a row and fold it into the
+  //bucket above. The bucket above closes with every tenth one here.
+  inline void overview_close_bucket(overview_stream& stream, int l)
+  {
+    overview_level& level = stream.levels[l];
+
+    if (level.channel[0].count == 0) {
+      return;
+    }
+
+    for (int c = 0; c < stream.channels; c++) {
+      overview_bucket& bucket = level.channel[c];
+      double rms = std::sqrt(bucket.sum_squares / (double)bucket.count);
+      level.buffer.push_back((int16_t)bucket.min);
+      level.buffer.push_back((int16_t)bucket.max);
+      level.buffer.push_back((int16_t)std::min(32767.0, std::floor(rms + 0.5)));
+
+      if (l + 1 < stream.level_count) {
+        overview_bucket& above = stream.levels[l + 1].channel[c];
+        above.min = std::min(above.min, bucket.min);
+        above.max = std::max(above.max, bucket.max);
+        above.sum_squares = above.sum_squares + bucket.sum_squares;
+        above.count = above.count + bucket.count;
+      }
+      overview_clear_bucket(bucket);
+    }
+    level.rows = level.rows + 1;
+    if (level.buffer.size() >= OVERVIEW_BUFFER_ROWS * OVERVIEW_COLUMNS * stream.channels) {
+      overview_write_buffer(level);
+    }
+
+    level.bucket = level.bucket + 1;
+    if (l + 1 < stream.level_count && (level.bucket % (stream.levels[l + 1].ms / level.ms)) == 0) {
+      overview_close_bucket(stream, l + 1);
+    }
+  }
+
+
+  //Add count samples of each channel. Channel c's samples are
+  //channel_data[c][0], channel_data[c][stride] and so on.
+  template <typename T>
+  inline void overview_add(overview_stream& stream, const T* const* channel_data, size_t count, size_t stride)
+  {
+    if (stream.level_count == 0) {
+      return;
+    }
+
+    overview_level& finest = stream.levels[0];
+    size_t i = 0;
+
+    while (i < count) {
+      size_t run = (size_t)std::min<uint64_t>(count - i, stream.next_boundary - stream.samples);
+
+      for (int c = 0; c < stream.channels; c++) {
+        overview_bucket& bucket = finest.channel[c];
+        const T* x = channel_data[c] + i * stride;
+        int low = bucket.min;
+        int high = bucket.max;
+        double sum_squares = 0.0;
+        for (size_t j = 0; j < run; j++) {
+          int value = (int)x[j * stride];
+          low = std::min(low, value);
+          high = std::max(high, value);
+          sum_squares = sum_squares + (double)value * value;
+        }
+        bucket.min = low;
+        bucket.max = high;
+        bucket.sum_squares = bucket.sum_squares + sum_squares;
+        bucket.count = bucket.count + run;
+      }
+
+      i = i + run;
+      stream.samples = stream.samples + run;
+      if (stream.samples == stream.next_boundary) {
+        overview_close_bucket(stream, 0);
+        stream.next_boundary = overview_bucket_start(stream, finest.ms, finest.bucket + 1);
+      }
+    }
+  }
+
+
+  //Write the partly filled buckets at the end and close the files.
+  //Returns 0, or -1 on a write error.
+  inline int overview_close(overview_stream& stream)
+  {
+    int result = 0;
+
+    for (int l = 0; l < stream.level_count; l++) {
+      overview_level& level = stream.levels[l];
+      //The partial bucket is folded into the one above before that is
+      //closed in turn.
+      overview_close_bucket(stream, l);
+      if (level.file != NULL) {
+        if (overview_write_buffer(level) != 0 || fclose(level.file) != 0) {
+          result = -1;
+        }
+        level.file = NULL;
+      }
+    }
+    return result;
+  }
+
+
+  //List the level files so a viewer can find them without knowing the
+  //naming.
+  inline int overview_write_index(const std::vector<overview_stream*>& streams, const std::string& filename)
+  {
+    FILE* out = fopen(filename.c_str(), "w");
+
+    if (out == NULL) {
+      return -1;
+    }
+
+    fprintf(out, "file,stream,channels,columns,rate_hz,bucket_ms,samples_per_bucket,rows,samples\n");
+    for (size_t s = 0; s < streams.size(); s++) {
+      const overview_stream& stream = *streams[s];
+      for (int l = 0; l < stream.level_count; l++) {
+        const overview_level& level = stream.levels[l];
+        fprintf(out, "%s,%s,%d,%d,%d,%d,%.6f,%llu,%llu\n", level.filename.c_str(), stream.name.c_str(),
+                stream.channels, stream.channels * OVERVIEW_COLUMNS, stream.rate, level.ms,
+                stream.rate * level.ms / 1000.0, (unsigned long long)level.rows,
+                (unsigned long long)stream.samples);
+      }
+    }
+
+    return (fclose(out) == 0) ? 0 : -1;
+  }
+
+#endif
@@ -0,0 +1,315 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_packets.h
+// --!@brief      Columnar storage for the status and GPS packets
+// --!@details    One typed vector per packet field in place of a vector of
+// --             structs.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Each field is kept at its own size, so a status packet is 62 bytes
+//instead of 11 uint64 and a nav_sol packet 42 bytes instead of 13
+//int32. A single field can be scanned or converted without touching
+//the rest of the packet.
+//
+//list_columns gives the name, type and data of every field in the order
+//the old structs had them. The writers and the MEX outputs work from
+//that list so they don't need to know the packet type.
+
+#ifndef SD_PACKETS_H
+#define SD_PACKETS_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+  enum packet_column_type {
+    COLUMN_UINT8 = 0,
+    COLUMN_INT16,
+    COLUMN_UINT16,
+    COLUMN_INT32,
+    COLUMN_UINT32,
+    COLUMN_UINT64
+  };
+
+
+  //One field of a packet table. data is the first row.
+  struct packet_column {
+    const char* name;
+    int type;
+    const void* data;
+  };
+
+
+  struct status_columns {
+    std::vector<uint32_t> commit;
+    std::vector<uint32_t> compile;
+    std::vector<uint64_t> status_t;
+    std::vector<uint64_t> accel_t;
+    std::vector<uint64_t> gyro_t;
+    std::vector<uint64_t> mag_t;
+    std::vector<uint64_t> temp_t;
+    std::vector<uint64_t> audio_t;
+    std::vector<uint32_t> rtc_t;
+    std::vector<uint8_t> mics_active;
+    std::vector<uint8_t> status_type;
+  };
+
+
+  struct tm_columns {
+    std::vector<uint8_t> flags;
+    std::vector<uint16_t> wnF;
+    std::vector<uint32_t> towmsF;
+    std::vector<uint32_t> towsubmsF;
+    std::vector<uint32_t> accestns;
+    std::vector<uint32_t> reset_time_week;
+    std::vector<uint32_t> reset_time_ms;
+    std::vector<uint32_t> reset_time_ns;
+  };
+
+
+  struct nav_sol_columns {
+    std::vector<uint32_t> itow;
+    std::vector<int32_t> ftow;
+    std::vector<int16_t> weekepoch;
+    std::vector<uint8_t> fixtype;
+    std::vector<int32_t> ecefx;
+    std::vector<int32_t> ecefy;
+    std::vector<int32_t> ecefz;
+    std::vector<uint32_t> pacc;
+    std::vector<uint16_t> posdop;
+    std::vector<uint8_t> numsv;
+    std::vector<uint32_t> reset_time_week;
+    std::vector<uint32_t> reset_time_ms;
+    std::vector<uint32_t> reset_time_ns;
+  };
+
+
+  //Reset (FPGA) time of a time pulse and the GPS time it marks.
+  struct tim_tp_columns {
+    std::vector<uint32_t> reset_time_week;
+    std::vector<uint32_t> reset_time_ms;
+    std::vector<uint32_t> reset_time_ns;
+    std::vector<uint32_t> gps_time_week;
+    std::vector<uint32_t> gps_time_ms;
+    std::vector<uint32_t> gps_time_ns;
+  };
+
+
+  inline int column_type_bytes(int type)
+  {
+    switch (type) {
+    case COLUMN_UINT8:   return 1;
+    case COLUMN_INT16:   return 2;
+    case COLUMN_UINT16:  return 2;
+    case COLUMN_INT32:   return 4;
+    case COLUMN_UINT32:  return 4;
+    case COLUMN_UINT64:  return 8;
+    }
+    return 0;
+  }
+
+
+  //Value of one row widened to 64 bits, sign extended for signed types.
+  //Truncating the result gives the value at any narrower width.
+  inline uint64_t column_bits(const packet_column& column, size_t row)
+  {
+    switch (column.type) {
+    case COLUMN_UINT8:   return ((const uint8_t*)column.data)[row];
+    case COLUMN_INT16:   return (uint64_t)(int64_t)((const int16_t*)column.data)[row];
+    case COLUMN_UINT16:  return ((const uint16_t*)column.data)[row];
+    case COLUMN_INT32:   return (uint64_t)(int64_t)((const int32_t*)column.data)[row];
+    case COLUMN_UINT32:  return ((const uint32_t*)column.data)[row];
+    case COLUMN_UINT64:  return ((const uint64_t*)column.data)[row];
+    }
+    return 0;
+  }
+
+
+  inline std::string column_string(const packet_column& column, size_t row)
+  {
+    uint64_t bits = column_bits(column, row);
+
+    if (column.type == COLUMN_INT16 || column.type == COLUMN_INT32) {
+      return std::to_string((long long)(int64_t)bits);
+    }
+    return std::to_string((unsigned long long)bits);
+  }
+
+
+  inline packet_column make_column(const char* name, const std::vector<uint8_t>& data)
+  {
+    packet_column column = { name, COLUMN_UINT8, data.data() };
+    return column;
+  }
+
+  inline packet_column make_column(const char* name, const std::vector<int16_t>& data)
+  {
+    packet_column column = { name, COLUMN_INT16, data.data() };
+    return column;
+  }
+
+  inline packet_column make_column(const char* name, const std::vector<uint16_t>& data)
+  {
+    packet_column column = { name, COLUMN_UINT16, data.data() };
+    return column;
+  }
+
+  inline packet_column make_column(const char* name, const std::vector<int32_t>& data)
+  {
+    packet_column column = { name, COLUMN_INT32, data.data() };
+    return column;
+  }
+
+  inline packet_column make_column(const char* name, const std::vector<uint32_t>& data)
+  {
+    packet_column column = { name, COLUMN_UINT32, data.data() };
+    return column;
+  }
+
+  inline packet_column make_column(const char* name, const std::vector<uint64_t>& data)
+  {
+    packet_column column = { name, COLUMN_UINT64, data.data() };
+    return column;
+  }
+
+
+  //Every field in file order. Data pointers are only good until the
+  //columns are next appended to or cleared.
+  inline void list_columns(const status_columns& packets, std::vector<packet_column>& columns)
+  {
+    columns.clear();
+    columns.push_back(make_column("commit", packets.commit));
+    columns.push_back(make_column("compile", packets.compile));
+    columns.push_back(make_column("status_t", packets.status_t));
+    columns.push_back(make_column("accel_t", packets.accel_t));
+    columns.push_back(make_column("gyro_t", packets.gyro_t));
+    columns.push_back(make_column("mag_t", packets.mag_t));
+    columns.push_back(make_column("temp_t", packets.temp_t));
+    columns.push_back(make_column("audio_t", packets.audio_t));
+    columns.push_back(make_column("rtc_t", packets.rtc_t));
+    columns.push_back(make_column("mics_active", packets.mics_active));
+    columns.push_back(make_column("status_type", packets.status_type));
+  }
+
+  inline void list_columns(const tm_columns& packets, std::vector<packet_column>& columns)
+  {
+    columns.clear();
+    columns.push_back(make_column("flags", packets.flags));
+    columns.push_back(make_column("wnF", packets.wnF));
+    columns.push_back(make_column("towmsF", packets.towmsF));
+    columns.push_back(make_column("towsubmsF", packets.towsubmsF));
+    columns.push_back(make_column("accestns", packets.accestns));
+    columns.push_back(make_column("reset_time_week", packets.reset_time_week));
+    columns.push_back(make_column("reset_time_ms", packets.reset_time_ms));
+    columns.push_back(make_column("reset_time_ns", packets.reset_time_ns));
+  }
+
+  inline void list_columns(const nav_sol_columns& packets, std::vector<packet_column>& columns)
+  {
+    columns.clear();
+    columns.push_back(make_column("itow", packets.itow));
+    columns.push_back(make_column("ftow", packets.ftow));
+    columns.push_back(make_column("weekepoch", packets.weekepoch));
+    columns.push_back(make_column("fixtype", packets.fixtype));
+    columns.push_back(make_column("ecefx", packets.ecefx));
+    columns.push_back(make_column("ecefy", packets.ecefy));
+    columns.push_back(make_column("ecefz", packets.ecefz));
+    columns.push_back(make_column("pacc", packets.pacc));
+    columns.push_back(make_column("posdop", packets.posdop));
+    columns.push_back(make_column("numsv", packets.numsv));
+    columns.push_back(make_column("reset_time_week", packets.reset_time_week));
+    columns.push_back(make_column("reset_time_ms", packets.reset_time_ms));
+    columns.push_back(make_column("reset_time_ns", packets.reset_time_ns));
+  }
+
+  inline void list_columns(const tim_tp_columns& packets, std::vector<packet_column>& columns)
+  {
+    columns.clear();
+    columns.push_back(make_column("reset_time_week", packets.reset_time_week));
+    columns.push_back(make_column("reset_time_ms", packets.reset_time_ms));
+    columns.push_back(make_column("reset_time_ns", packets.reset_time_ns));
+    columns.push_back(make_column("gps_week", packets.gps_time_week));
+    columns.push_back(make_column("gps_ms", packets.gps_time_ms));
+    columns.push_back(make_column("gps_submsns", packets.gps_time_ns));
+  }
+
+
+  inline size_t packet_rows(const status_columns& packets) { return packets.status_t.size(); }
+  inline size_t packet_rows(const tm_columns& packets) { return packets.flags.size(); }
+  inline size_t packet_rows(const nav_sol_columns& packets) { return packets.itow.size(); }
+  inline size_t packet_rows(const tim_tp_columns& packets) { return packets.gps_time_ms.size(); }
+
+
+  inline void clear_packets(status_columns& packets)
+  {
+    packets.commit.clear();
+    packets.compile.clear();
+    packets.status_t.clear();
+    packets.accel_t.clear();
+    packets.gyro_t.clear();
+    packets.mag_t.clear();
+    packets.temp_t.clear();
+    packets.audio_t.clear();
+    packets.rtc_t.clear();
+    packets.mics_active.clear();
+    packets.status_type.clear();
+  }
+
+  inline void clear_packets(tm_columns& packets)
+  {
+    packets.flags.clear();
+    packets.wnF.clear();
+    packets.towmsF.clear();
+    packets.towsubmsF.clear();
+    packets.accestns.clear();
+    packets.reset_time_week.clear();
+    packets.reset_time_ms.clear();
+    packets.reset_time_ns.clear();
+  }
+
+  inline void clear_packets(nav_sol_columns& packets)
+  {
+    packets.itow.clear();
+    packets.ftow.clear();
+    packets.weekepoch.clear();
+    packets.fixtype.clear();
+    packets.ecefx.clear();
+    packets.ecefy.clear();
+    packets.ecefz.clear();
+    packets.pacc.clear();
+    packets.posdop.clear();
+    packets.numsv.clear();
+    packets.reset_time_week.clear();
+    packets.reset_time_ms.clear();
+    packets.reset_time_ns.clear();
+  }
+
+  inline void clear_packets(tim_tp_columns& packets)
+  {
+    packets.reset_time_week.clear();
+    packets.reset_time_ms.clear();
+    packets.reset_time_ns.clear();
+    packets.gps_time_week.clear();
+    packets.gps_time_ms.clear();
+    packets.gps_time_ns.clear();
+  }
+
+#endif
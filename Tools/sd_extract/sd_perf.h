@@ -0,0 +1,390 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_perf.h
+// --!@brief      Scoped timers and counters for the SD card parse
+// --!@details    Collects where a parse spends its time and writes it out as
+// --             perf_report.json at the end of the run.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//A perf_scope adds the time until it goes out of scope to one counter.
+//Each is a pair of steady_clock reads, some 40 ns each, which is more
+//than decoding a 6 byte IMU segment takes. So the walk and the decode are
+//timed a block at a time and segments are only counted, calls and bytes
+//per type. Built with -DSD_PERF_SEGMENTS every segment decode is timed
+//as well, for finding which type is slow at the cost of the total.
+//
+//Peak memory is the peak of the whole process, which under MATLAB
+//includes MATLAB itself. The peak at the start of the run is kept as well
+//so the two can be compared.
+//
+//Heap allocations are only counted when built with -DSD_PERF_ALLOCS,
+//which replaces the global operator new in this module. Otherwise the
+//report holds null for them.
+
+#ifndef SD_PERF_H
+#define SD_PERF_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#include "sd_block.h"
+
+
+  //Time, calls and bytes for one stage of the parse.
+  struct perf_counter {
+    double seconds;
+    uint64_t calls;
+    uint64_t bytes;
+  };
+
+
+  struct perf_report {
+    std::chrono::steady_clock::time_point begin;
+
+    perf_counter read;
+    perf_counter walk;
+    perf_counter decode_blocks;
+    perf_counter decode[BLOCK_SEG_TYPES];
+    perf_counter back_annotate;
+    std::map<std::string, perf_counter> writers;
+
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t blocks_unwritten;
+    uint64_t blocks_dropped;
+
+    uint64_t peak_memory_start;
+  };
+
+
+#ifdef SD_PERF_ALLOCS
+  //Counted by the operator new below.
+  inline uint64_t& perf_allocation_count()
+  {
+    static uint64_t count = 0;
+    return count;
+  }
+#endif
+
+
+  //The report for the run in progress. The writers reach it here so their
+  //signatures don't change.
+  inline perf_report& sd_perf()
+  {
+    static perf_report report;
+    return report;
+  }
+
+
+  //Peak resident memory of the process in bytes, 0 if unknown.
+  inline uint64_t perf_peak_memory()
+  {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+      return (uint64_t)counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+      return 0;
+    }
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    //Linux reports kilobytes.
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+  }
+
+
+  //Start a fresh report. A MEX file stays loaded between calls so the last
+  //run's numbers have to be cleared.
+  inline void perf_reset(perf_report& report)
+  {
+    perf_counter zero = { 0.0, 0, 0 };
+
+    report.begin = std::chrono::steady_clock::now();
+    report.read = zero;
+    report.walk = zero;
+    report.decode_blocks = zero;
+    for (int i = 0; i < BLOCK_SEG_TYPES; i++) {
+      report.decode[i] = zero;
+    }
+    report.back_annotate = zero;
+    report.writers.clear();
+
+    report.bytes = 0;
+    report.blocks = 0;
+    report.blocks_unwritten = 0;
+    report.blocks_dropped = 0;
+
+    report.peak_memory_start = perf_peak_memory();
+#ifdef SD_PERF_ALLOCS
+    perf_allocation_count() = 0;
+#endif
+  }
+
+
+  //Adds the time it is alive to a counter. Bytes can be added before it
+  //goes out of scope when they aren't known up front.
+  class perf_scope {
+  public:
+    perf_scope(perf_counter& counter, uint64_t bytes = 0)
+      : counter_(counter), bytes(bytes), start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~perf_scope()
+    {
+      std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+      counter_.seconds = counter_.seconds + std::chrono::duration<double>(end - start_).count();
+      counter_.calls = counter_.calls + 1;
+      counter_.bytes = counter_.bytes + bytes;
+    }
+
+  private:
+    perf_counter& counter_;
+
+  public:
+    uint64_t bytes;
+
+  private:
+    std::chrono::steady_clock::time_point start_;
+
+    perf_scope(const perf_scope&);
+    perf_scope& operator=(const perf_scope&);
+  };
+
+
+  //Count a call and its bytes without timing it.
+  inline void perf_count(perf_counter& counter, uint64_t bytes)
+  {
+    counter.calls = counter.calls + 1;
+    counter.bytes = counter.bytes + bytes;
+  }
+
+
+  //Add the time since start, a call and bytes to a counter, for stages
+  //that don't sit in one scope.
+  inline void perf_stop(perf_counter& counter, std::chrono::steady_clock::time_point start, uint64_t bytes)
+  {
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    counter.seconds = counter.seconds + std::chrono::duration<double>(end - start).count();
+    perf_count(counter, bytes);
+  }
+
+
+  //Names used for the segment types in the report.
+  inline const char* perf_segment_name(int type)
+  {
+    switch (type) {
+    case BLOCK_SEG_UNUSED:          return "unused";
+    case BLOCK_SEG_STATUS:          return "status";
+    case BLOCK_SEG_GPS_TIME_MARK:   return "tim_tm2";
+    case BLOCK_SEG_GPS_POSITION:    return "nav_sol";
+    case BLOCK_SEG_IMU_GYRO:        return "gyro";
+    case BLOCK_SEG_IMU_ACCEL:       return "accel";
+    case BLOCK_SEG_IMU_MAG:         return "mag";
+    case BLOCK_SEG_AUDIO:           return "audio";
+    case BLOCK_SEG_IMU_TEMP:        return "temp";
+    case BLOCK_SEG_EVENT:           return "event";
+    case BLOCK_SEG_SHUTDOWN:        return "shutdown";
+    case BLOCK_SEG_GPS_TIME_PULSE:  return "tim_tp";
+    }
+    return NULL;
+  }
+
+
+  //Quote a string for JSON. Windows paths are full of backslashes.
+  inline std::string perf_json_string(const std::string& text)
+  {
+    std::string quoted = "\"";
+    char escape[8];
+
+    for (size_t i = 0; i < text.size(); i++) {
+      unsigned char c = (unsigned char)text[i];
+      if (c == '"' || c == '\\') {
+        quoted += '\\';
+        quoted += (char)c;
+      }
+      else if (c < 0x20) {
+        snprintf(escape, sizeof(escape), "\\u%04x", c);
+        quoted += escape;
+      }
+      else {
+        quoted += (char)c;
+      }
+    }
+    quoted += '"';
+    return quoted;
+  }
+
+
+  inline void perf_write_counter(FILE* out, const char* indent, const std::string& name,
+                                 const perf_counter& counter, bool last)
+  {
+    fprintf(out, "%s%s: { \"seconds\": %.6f, \"calls\": %llu, \"bytes\": %llu, \"mb_per_second\": %.3f }%s\n",
+            indent, perf_json_string(name).c_str(), counter.seconds,
+            (unsigned long long)counter.calls, (unsigned long long)counter.bytes,
+            counter.seconds > 0 ? (counter.bytes / (1024.0 * 1024.0)) / counter.seconds : 0.0,
+            last ? "" : ",");
+  }
+
+
+  //Write the report as JSON.
+  //Returns 0, or -1 if the file could not be written.
+  inline int perf_write_json(const perf_report& report, const std::string& filename,
+                             const std::string& image)
+  {
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - report.begin).count();
+    uint64_t segments = 0;
+    int last_type = -1;
+    FILE* out = fopen(filename.c_str(), "w");
+
+    if (out == NULL) {
+      return -1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"image\": %s,\n", perf_json_string(image).c_str());
+    fprintf(out, "  \"build\": \"%s %s\",\n", __DATE__, __TIME__);
+    fprintf(out, "  \"seconds\": %.6f,\n", seconds);
+    fprintf(out, "  \"bytes\": %llu,\n", (unsigned long long)report.bytes);
+    fprintf(out, "  \"blocks\": %llu,\n", (unsigned long long)report.blocks);
+    fprintf(out, "  \"blocks_unwritten\": %llu,\n", (unsigned long long)report.blocks_unwritten);
+    fprintf(out, "  \"blocks_dropped\": %llu,\n", (unsigned long long)report.blocks_dropped);
+    fprintf(out, "  \"blocks_per_second\": %.1f,\n", seconds > 0 ? report.blocks / seconds : 0.0);
+    fprintf(out, "  \"bytes_per_second\": %.1f,\n", seconds > 0 ? report.bytes / seconds : 0.0);
+
+    for (int i = 0; i < BLOCK_SEG_TYPES; i++) {
+      if (report.decode[i].calls != 0 && perf_segment_name(i) != NULL) {
+        last_type = i;
+      }
+    }
+
+    fprintf(out, "  \"segments\": {\n");
+    for (int i = 0; i < BLOCK_SEG_TYPES; i++) {
+      if (report.decode[i].calls != 0 && perf_segment_name(i) != NULL) {
+        fprintf(out, "    \"%s\": %llu%s\n", perf_segment_name(i),
+                (unsigned long long)report.decode[i].calls, i == last_type ? "" : ",");
+        segments = segments + report.decode[i].calls;
+      }
+    }
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"segments_per_second\": %.1f,\n", seconds > 0 ? segments / seconds : 0.0);
+#ifdef SD_PERF_SEGMENTS
+    fprintf(out, "  \"segment_timers\": true,\n");
+#else
+    fprintf(out, "  \"segment_timers\": false,\n");
+#endif
+
+    fprintf(out, "  \"stages\": {\n");
+    perf_write_counter(out, "    ", "read", report.read, false);
+    perf_write_counter(out, "    ", "walk", report.walk, false);
+    perf_write_counter(out, "    ", "decode_blocks", report.decode_blocks, false);
+    fprintf(out, "    \"decode\": {\n");
+    for (int i = 0; i < BLOCK_SEG_TYPES; i++) {
+      if (report.decode[i].calls != 0 && perf_segment_name(i) != NULL) {
+        perf_write_counter(out, "      ", perf_segment_name(i), report.decode[i], i == last_type);
+      }
+    }
+    fprintf(out, "    },\n");
+    perf_write_counter(out, "    ", "back_annotate", report.back_annotate, false);
+    fprintf(out, "    \"write\": {\n");
+    for (std::map<std::string, perf_counter>::const_iterator it = report.writers.begin();
+         it != report.writers.end(); ++it) {
+      std::map<std::string, perf_counter>::const_iterator next = it;
+      ++next;
+      perf_write_counter(out, "      ", it->first, it->second, next == report.writers.end());
+    }
+    fprintf(out, "    }\n");
+    fprintf(out, "  },\n");
+
+#ifdef SD_PERF_ALLOCS
+    fprintf(out, "  \"allocations\": %llu,\n", (unsigned long long)perf_allocation_count());
+#else
+    fprintf(out, "  \"allocations\": null,\n");
+#endif
+    fprintf(out, "  \"peak_memory_bytes\": %llu,\n", (unsigned long long)perf_peak_memory());
+    fprintf(out, "  \"peak_memory_start_bytes\": %llu\n", (unsigned long long)report.peak_memory_start);
+    fprintf(out, "}\n");
+
+    return (fclose(out) == 0) ? 0 : -1;
+  }
+
+
+#ifdef SD_PERF_ALLOCS
+  //Counting replacements for the global allocator. Only in this module.
+  void* operator new(std::size_t size)
+  {
+    void* memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == NULL) {
+      throw std::bad_alloc();
+    }
+    perf_allocation_count() = perf_allocation_count() + 1;
+    return memory;
+  }
+
+  void* operator new[](std::size_t size)
+  {
+    return operator new(size);
+  }
+
+  void operator delete(void* memory) noexcept
+  {
+    std::free(memory);
+  }
+
+  void operator delete[](void* memory) noexcept
+  {
+    std::free(memory);
+  }
+
+  void operator delete(void* memory, std::size_t) noexcept
+  {
+    std::free(memory);
+  }
+
+  void operator delete[](void* memory, std::size_t) noexcept
+  {
+    std::free(memory);
+  }
+#endif
+
+#endif
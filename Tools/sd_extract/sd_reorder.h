@@ -0,0 +1,489 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_reorder.h
+// --!@brief      Reassembles card images by block sequence number
+// --!@details    Sorts the blocks of one or more dumps of a card by their
+// --             sequence numbers into a new image, dropping repeats, so
+// --             dumps made out of order, or overlapping, parse as the card
+// --             wrote it.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//Every block starts with its sequence number, so the order the card wrote
+//the blocks in can be had back from any dump of them. The image is read
+//once to index each block by its sequence number, a hash of its contents
+//and its place in the file. Several dumps of the same card, a field read
+//and a later full read say, are indexed together as if one file, in the
+//order given. The index is 24 bytes a block, 48 MB per GB of image, and
+//is sorted in runs of REORDER_RUN_ENTRIES. If it all fits in one run it
+//is sorted in memory. Otherwise each sorted run is spilled to a file
+//beside the output and the runs are merged with a heap, reading each
+//through a small buffer, so the memory used does not grow with the image.
+//
+//The merge gives the blocks in sequence order. Of blocks with the same
+//number the one first in the first dump is kept and the rest dropped, so
+//where dumps overlap only the hashes are compared, nothing is decoded or
+//read twice. A repeat whose hash differs from the kept block is counted
+//as a conflict, a block that read back differently, and the most trusted
+//dump should be given first. Blocks that follow each other in a dump as
+//well are copied with one read, so an image that is mostly in order is
+//copied at close to read speed.
+//
+//The result is a plain image in the output file that everything else,
+//the verify scan and the chunked decode included, reads as it would a
+//card. A partial block at the end of a dump is left out, as are blocks
+//never written, whose sequence number is 0 or all ones. The blocks are
+//written to the output name with .tmp added, renamed over the output only
+//once all are copied, and an output that is one of the inputs, under any
+//name, is refused.
+
+#ifndef SD_REORDER_H
+#define SD_REORDER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "sd_block.h"
+#include "sd_load.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+
+  //Index entries sorted in memory at once, 96 MB of them.
+  const size_t REORDER_RUN_ENTRIES = 4 * 1024 * 1024;
+
+  //Entries read ahead from each run file during the merge.
+  const size_t REORDER_MERGE_BUFFER = 65536;
+
+  //Bytes read from the image at once while indexing and copying.
+  const size_t REORDER_READ_BYTES = 16 * 1024 * 1024;
+
+
+  struct reorder_entry {
+    uint32_t sequence;
+    uint32_t source;
+    uint32_t offset_low;
+    uint32_t offset_high;
+    uint64_t hash;
+  };
+
+
+  struct reorder_stats {
+    int images;
+    uint64_t blocks;
+    uint64_t kept;
+    uint64_t duplicates;
+
+    //Blocks with the unwritten sequence numbers, left out.
+    uint64_t unwritten;
+
+    //Repeats of a kept block's sequence number with other contents.
+    uint64_t conflicts;
+
+    //Blocks whose sequence number is below the one before them in their
+    //dump.
+    uint64_t out_of_order;
+
+    //Sorted runs spilled to files, zero if the index was sorted in memory.
+    int runs;
+
+    //Reads made copying the kept blocks.
+    uint64_t reads;
+  };
+
+
+  inline uint64_t reorder_offset(const reorder_entry& entry)
+  {
+    return ((uint64_t)entry.offset_high << 32) | entry.offset_low;
+  }
+
+
+  inline bool reorder_less(const reorder_entry& a, const reorder_entry& b)
+  {
+    if (a.sequence != b.sequence) {
+      return a.sequence < b.sequence;
+    }
+    if (a.source != b.source) {
+      return a.source < b.source;
+    }
+    return reorder_offset(a) < reorder_offset(b);
+  }
+
+
+  //64 bit hash of a block, a word at a time. Only ever compared between
+  //blocks with the same sequence number, so it need not be strong.
+  inline uint64_t reorder_hash(const unsigned char* block)
+  {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < BLOCK_SIZE; i = i + 8) {
+      hash = (hash ^ load_u64(block + i)) * 0x100000001b3ULL;
+      hash = hash ^ (hash >> 29);
+    }
+    return hash;
+  }
+
+
+  //Sequential reader of one spilled run.
+  struct reorder_run {
+    FILE* file;
+    std::vector<reorder_entry> buffer;
+    size_t position;
+    size_t count;
+  };
+
+
+  inline int reorder_run_next(reorder_run& run, reorder_entry& entry)
+  {
+    if (run.position == run.count) {
+      run.count = fread(run.buffer.data(), sizeof(reorder_entry), run.buffer.size(), run.file);
+      run.position = 0;
+      if (run.count == 0) {
+        return 0;
+      }
+    }
+    entry = run.buffer[run.position];
+    run.position = run.position + 1;
+    return 1;
+  }
+
+
+  //Copies kept blocks to the output, joining blocks that are next to each
+  //other in the input into one read.
+  struct reorder_copy {
+    std::vector<std::ifstream>* in;
+    FILE* out;
+    std::vector<unsigned char> buffer;
+    uint32_t source;
+    uint64_t start;
+    uint64_t bytes;
+    int have_last;
+    uint32_t last_sequence;
+    uint64_t last_hash;
+    reorder_stats* stats;
+  };
+
+
+  inline int reorder_copy_flush(reorder_copy& copy)
+  {
+    while (copy.bytes != 0) {
+      size_t piece = (size_t)std::min<uint64_t>(copy.bytes, copy.buffer.size());
+      std::ifstream& in = (*copy.in)[copy.source];
+      in.clear();
+      in.seekg(copy.start);
+      in.read((char*)copy.buffer.data(), piece);
+      if ((size_t)in.gcount() != piece) {
+        return -1;
+      }
+      if (fwrite(copy.buffer.data(), 1, piece, copy.out) != piece) {
+        return -1;
+      }
+      copy.stats->reads = copy.stats->reads + 1;
+      copy.start = copy.start + piece;
+      copy.bytes = copy.bytes - piece;
+    }
+    return 0;
+  }
+
+
+  //Take the next entry in sorted order, keeping it if its sequence number
+  //is new.
+  inline int reorder_copy_entry(reorder_copy& copy, const reorder_entry& entry)
+  {
+    if (copy.have_last && entry.sequence == copy.last_sequence) {
+      if (entry.hash == copy.last_hash) {
+        copy.stats->duplicates = copy.stats->duplicates + 1;
+      }
+      else {
+        copy.stats->conflicts = copy.stats->conflicts + 1;
+      }
+      return 0;
+    }
+    copy.have_last = 1;
+    copy.last_sequence = entry.sequence;
+    copy.last_hash = entry.hash;
+    copy.stats->kept = copy.stats->kept + 1;
+
+    uint64_t offset = reorder_offset(entry);
+    if (copy.bytes != 0 && entry.source == copy.source && offset == copy.start + copy.bytes) {
+      copy.bytes = copy.bytes + BLOCK_SIZE;
+      return 0;
+    }
+    if (reorder_copy_flush(copy) != 0) {
+      return -1;
+    }
+    copy.source = entry.source;
+    copy.start = offset;
+    copy.bytes = BLOCK_SIZE;
+    return 0;
+  }
+
+
+  inline int reorder_spill(std::vector<reorder_entry>& entries, const std::string& name)
+  {
+    std::sort(entries.begin(), entries.end(), reorder_less);
+
+    FILE* file = fopen(name.c_str(), "wb");
+    if (file == NULL) {
+      return -1;
+    }
+    size_t written = fwrite(entries.data(), sizeof(reorder_entry), entries.size(), file);
+    int closed = fclose(file);
+    int result = (written == entries.size() && closed == 0) ? 0 : -1;
+    entries.clear();
+    return result;
+  }
+
+
+  //True if the two names are the same file. The device and inode are
+  //compared, or the full paths on Windows, so links and other spellings of
+  //one path match. A file that does not exist is no other file.
+  inline bool reorder_same_file(const std::string& a, const std::string& b)
+  {
+#ifdef _WIN32
+    char full_a[_MAX_PATH];
+    char full_b[_MAX_PATH];
+    if (_fullpath(full_a, a.c_str(), _MAX_PATH) == NULL || _fullpath(full_b, b.c_str(), _MAX_PATH) == NULL) {
+      return a == b;
+    }
+    return _stricmp(full_a, full_b) == 0;
+#else
+    struct stat stat_a;
+    struct stat stat_b;
+    if (stat(a.c_str(), &stat_a) != 0 || stat(b.c_str(), &stat_b) != 0) {
+      return false;
+    }
+    return stat_a.st_dev == stat_b.st_dev && stat_a.st_ino == stat_b.st_ino;
+#endif
+  }
+
+
+  //Index of the input that output would overwrite, or -1 if none.
+  inline int reorder_output_input(const std::vector<std::string>& inputs, const std::string& output)
+  {
+    for (size_t i = 0; i < inputs.size(); i++) {
+      if (reorder_same_file(inputs[i], output) || reorder_same_file(inputs[i], output + ".tmp")) {
+        return (int)i;
+      }
+    }
+    return -1;
+  }
+
+
+  //Write the blocks of the first lengths[i] bytes of each inputs[i] to
+  //output in sequence order without repeats. Returns 0 or -1 if a file
+  //could not be read or written or output is one of the inputs.
+  inline int reorder_images(const std::vector<std::string>& inputs, const std::vector<uint64_t>& lengths,
+                            const std::string& output, reorder_stats& stats)
+  {
+    stats.images = (int)inputs.size();
+    stats.blocks = 0;
+    stats.kept = 0;
+    stats.duplicates = 0;
+    stats.unwritten = 0;
+    stats.conflicts = 0;
+    stats.out_of_order = 0;
+    stats.runs = 0;
+    stats.reads = 0;
+
+    if (reorder_output_input(inputs, output) >= 0) {
+      return -1;
+    }
+
+    std::vector<std::ifstream> in(inputs.size());
+    uint64_t total_blocks = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+      in[i].open(inputs[i].c_str(), std::ios::in | std::ios::binary);
+      if (!in[i]) {
+        return -1;
+      }
+      total_blocks = total_blocks + lengths[i] / BLOCK_SIZE;
+    }
+
+    //Index the blocks, spilling a sorted run each time the index fills.
+    std::vector<reorder_entry> entries;
+    std::vector<std::string> run_names;
+    std::vector<unsigned char> contents(REORDER_READ_BYTES);
+    int result = 0;
+
+    entries.reserve((size_t)std::min<uint64_t>(total_blocks, REORDER_RUN_ENTRIES));
+
+    for (size_t source = 0; source < inputs.size() && result == 0; source++) {
+      uint64_t blocks = lengths[source] / BLOCK_SIZE;
+      uint32_t previous = 0;
+
+      for (uint64_t block = 0; block < blocks && result == 0; ) {
+        size_t count = (size_t)std::min<uint64_t>(blocks - block, REORDER_READ_BYTES / BLOCK_SIZE);
+        in[source].read((char*)contents.data(), count * BLOCK_SIZE);
+        if ((size_t)in[source].gcount() != count * BLOCK_SIZE) {
+          result = -1;
+          break;
+        }
+
+        for (size_t b = 0; b < count; b++) {
+          uint64_t offset = (block + b) * BLOCK_SIZE;
+          reorder_entry entry;
+          entry.sequence = load_u32(&contents[b * BLOCK_SIZE]);
+          stats.blocks = stats.blocks + 1;
+          if (block_unwritten(entry.sequence)) {
+            stats.unwritten = stats.unwritten + 1;
+            continue;
+          }
+
+          entry.source = uint32_t(source);
+          entry.offset_low = uint32_t(offset);
+          entry.offset_high = uint32_t(offset >> 32);
+          entry.hash = reorder_hash(&contents[b * BLOCK_SIZE]);
+          if (previous != 0 && entry.sequence < previous) {
+            stats.out_of_order = stats.out_of_order + 1;
+          }
+          previous = entry.sequence;
+          entries.push_back(entry);
+
+          if (entries.size() == REORDER_RUN_ENTRIES && stats.blocks < total_blocks) {
+            run_names.push_back(output + ".run" + std::to_string(run_names.size()));
+            if (reorder_spill(entries, run_names.back()) != 0) {
+              result = -1;
+              break;
+            }
+          }
+        }
+        block = block + count;
+      }
+    }
+    contents.clear();
+    contents.shrink_to_fit();
+
+    std::string temporary = output + ".tmp";
+    FILE* out = NULL;
+    if (result == 0) {
+      out = fopen(temporary.c_str(), "wb");
+      result = (out == NULL) ? -1 : 0;
+    }
+
+    reorder_copy copy;
+    copy.in = &in;
+    copy.out = out;
+    copy.buffer.resize(REORDER_READ_BYTES);
+    copy.source = 0;
+    copy.start = 0;
+    copy.bytes = 0;
+    copy.have_last = 0;
+    copy.last_sequence = 0;
+    copy.last_hash = 0;
+    copy.stats = &stats;
+
+    if (result == 0 && run_names.empty()) {
+      std::sort(entries.begin(), entries.end(), reorder_less);
+      for (size_t i = 0; i < entries.size() && result == 0; i++) {
+        result = reorder_copy_entry(copy, entries[i]);
+      }
+    }
+    else if (result == 0) {
+      //The last run stays in memory and is merged with the spilled ones.
+      std::sort(entries.begin(), entries.end(), reorder_less);
+
+      std::vector<reorder_run> runs(run_names.size());
+      for (size_t r = 0; r < runs.size(); r++) {
+        runs[r].file = fopen(run_names[r].c_str(), "rb");
+        runs[r].buffer.resize(REORDER_MERGE_BUFFER);
+        runs[r].position = 0;
+        runs[r].count = 0;
+        if (runs[r].file == NULL) {
+          result = -1;
+        }
+      }
+
+      typedef std::pair<reorder_entry, size_t> heap_item;
+      auto later = [](const heap_item& a, const heap_item& b) { return reorder_less(b.first, a.first); };
+      std::priority_queue<heap_item, std::vector<heap_item>, decltype(later)> heap(later);
+
+      reorder_entry entry;
+      for (size_t r = 0; r < runs.size() && result == 0; r++) {
+        if (reorder_run_next(runs[r], entry)) {
+          heap.push(heap_item(entry, r));
+        }
+      }
+      size_t memory_position = 0;
+
+      while (result == 0 && (!heap.empty() || memory_position < entries.size())) {
+        if (heap.empty() || (memory_position < entries.size() && reorder_less(entries[memory_position], heap.top().first))) {
+          result = reorder_copy_entry(copy, entries[memory_position]);
+          memory_position = memory_position + 1;
+          continue;
+        }
+
+        heap_item top = heap.top();
+        heap.pop();
+        result = reorder_copy_entry(copy, top.first);
+        if (reorder_run_next(runs[top.second], entry)) {
+          heap.push(heap_item(entry, top.second));
+        }
+      }
+
+      for (size_t r = 0; r < runs.size(); r++) {
+        if (runs[r].file != NULL) {
+          fclose(runs[r].file);
+        }
+      }
+    }
+
+    for (size_t r = 0; r < run_names.size(); r++) {
+      std::remove(run_names[r].c_str());
+    }
+    stats.runs = (int)run_names.size();
+
+    if (result == 0) {
+      result = reorder_copy_flush(copy);
+    }
+    if (out != NULL && fclose(out) != 0) {
+      result = -1;
+    }
+    if (out != NULL && result != 0) {
+      std::remove(temporary.c_str());
+    }
+    else if (out != NULL) {
+#ifdef _WIN32
+      //rename does not replace an existing file on Windows.
+      std::remove(output.c_str());
+#endif
+      if (std::rename(temporary.c_str(), output.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        result = -1;
+      }
+    }
+    return result;
+  }
+
+
+  //Reassemble a single image.
+  inline int reorder_image(const std::string& input, uint64_t length, const std::string& output, reorder_stats& stats)
+  {
+    return reorder_images(std::vector<std::string>(1, input), std::vector<uint64_t>(1, length), output, stats);
+  }
+
+#endif
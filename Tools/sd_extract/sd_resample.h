@@ -0,0 +1,262 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_resample.h
+// --!@brief      Streaming polyphase resampler for the collar audio
+// --!@details    Converts the 56250 Hz microphone rate to a standard rate
+// --             a chunk at a time as the card is parsed.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//The rate change is up by L and down by M, the ratio of the two rates in
+//lowest terms. 56250 Hz to 48 kHz is 64/75 and to 16 kHz 64/225.
+//
+//The lowpass is a Kaiser windowed sinc designed at L times the input rate
+//and split into L phases. Each output sample is one phase dotted with the
+//last taps input samples. The phases are stored reversed so the dot
+//product runs forward over both arrays, which the compiler turns into
+//SIMD multiply-adds.
+//
+//The filter delay is taken out, so output sample n is at the same time as
+//input n * M / L. Every input sample gives its share of output even at the
+//end of the recording, the tail being filled out with zeros.
+
+#ifndef SD_RESAMPLE_H
+#define SD_RESAMPLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+  const int RESAMPLE_MAX_CHANNELS = 2;
+
+  //Taps per phase when the rate is not lowered. Scaled up by M/L when it
+  //is so the transition band stays the same fraction of the output rate.
+  const int RESAMPLE_TAPS = 64;
+  const int RESAMPLE_MAX_UP = 1024;
+
+  //Passband edge as a fraction of the lower of the two rates.
+  const double RESAMPLE_CUTOFF = 0.45;
+  const double RESAMPLE_KAISER_BETA = 8.0;
+  const double RESAMPLE_PI = 3.14159265358979323846;
+
+
+  //State of one channel. input starts with the zeros ahead of the first
+  //sample, next is the index of the newest sample the next output needs
+  //and phase its position between samples.
+  struct resample_channel {
+    std::vector<float> input;
+    uint64_t next;
+    int phase;
+    uint64_t samples_in;
+    uint64_t samples_out;
+  };
+
+
+  struct resampler {
+    int rate_in;
+    int rate_out;
+    int up;
+    int down;
+    int taps;
+    int channels;
+
+    //up phases of taps coefficients, each reversed.
+    std::vector<float> coefficients;
+    resample_channel channel[RESAMPLE_MAX_CHANNELS];
+  };
+
+
+  inline int resample_gcd(int a, int b)
+  {
+    while (b != 0) {
+      int t = a % b;
+      a = b;
+      b = t;
+    }
+    return a;
+  }
+
+
+  //Zeroth order modified Bessel function for the Kaiser window.
+  inline double resample_bessel_i0(double x)
+  {
+    double sum = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 50; k++) {
+      term = term * (x / (2.0 * k)) * (x / (2.0 * k));
+      sum = sum + term;
+      if (term < sum * 1e-12) {
+        break;
+      }
+    }
+    return sum;
+  }
+
+
+  inline void resample_reset_channel(resampler& r, resample_channel& channel)
+  {
+    uint64_t delay = ((uint64_t)r.taps * r.up - 1) / 2;
+
+    channel.input.assign(r.taps - 1, 0.0f);
+    channel.next = (r.taps - 1) + delay / r.up;
+    channel.phase = (int)(delay % r.up);
+    channel.samples_in = 0;
+    channel.samples_out = 0;
+  }
+
+
+  //Design the filter for rate_in to rate_out.
+  //Returns 0, or -1 if the rates don't reduce to a usable ratio.
+  inline int resample_init(resampler& r, int channels, int rate_in, int rate_out)
+  {
+    if (rate_in <= 0 || rate_out <= 0) {
+      return -1;
+    }
+
+    int divisor = resample_gcd(rate_in, rate_out);
+    r.rate_in = rate_in;
+    r.rate_out = rate_out;
+    r.up = rate_out / divisor;
+    r.down = rate_in / divisor;
+    r.channels = std::min(std::max(channels, 1), RESAMPLE_MAX_CHANNELS);
+    if (r.up > RESAMPLE_MAX_UP) {
+      return -1;
+    }
+    r.taps = RESAMPLE_TAPS * std::max(1, (r.down + r.up - 1) / r.up);
+
+    //Cutoff in cycles per sample of the upsampled rate.
+    int length = r.taps * r.up;
+    double cutoff = RESAMPLE_CUTOFF * std::min(rate_in, rate_out) / ((double)rate_in * r.up);
+    double center = (length - 1) / 2.0;
+    double window_scale = resample_bessel_i0(RESAMPLE_KAISER_BETA);
+    std::vector<double> prototype(length);
+
+    for (int i = 0; i < length; i++) {
+      double t = i - center;
+      double sinc = (t == 0.0) ? 2.0 * cutoff : std::sin(2.0 * RESAMPLE_PI * cutoff * t) / (RESAMPLE_PI * t);
+      double w = (2.0 * i) / (length - 1) - 1.0;
+      double window = resample_bessel_i0(RESAMPLE_KAISER_BETA * std::sqrt(std::max(0.0, 1.0 - w * w))) / window_scale;
+      prototype[i] = sinc * window * r.up;
+    }
+
+    //Phase p tap k is prototype[p + k * up], stored at taps - 1 - k.
+    r.coefficients.resize(length);
+    for (int p = 0; p < r.up; p++) {
+      for (int k = 0; k < r.taps; k++) {
+        r.coefficients[p * r.taps + (r.taps - 1 - k)] = (float)prototype[p + k * r.up];
+      }
+    }
+
+    for (int c = 0; c < RESAMPLE_MAX_CHANNELS; c++) {
+      resample_reset_channel(r, r.channel[c]);
+    }
+    return 0;
+  }
+
+
+  //Dot product of one phase with the input ending at x[taps - 1]. Four
+  //running sums keep the adds independent.
+  inline float resample_dot(const float* coefficients, const float* x, int taps)
+  {
+    float sum0 = 0.0f;
+    float sum1 = 0.0f;
+    float sum2 = 0.0f;
+    float sum3 = 0.0f;
+    int k = 0;
+
+    for (; k + 4 <= taps; k = k + 4) {
+      sum0 = sum0 + coefficients[k] * x[k];
+      sum1 = sum1 + coefficients[k + 1] * x[k + 1];
+      sum2 = sum2 + coefficients[k + 2] * x[k + 2];
+      sum3 = sum3 + coefficients[k + 3] * x[k + 3];
+    }
+    for (; k < taps; k++) {
+      sum0 = sum0 + coefficients[k] * x[k];
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+  }
+
+
+  inline int16_t resample_saturate(float value)
+  {
+    float rounded = std::floor(value + 0.5f);
+    return (int16_t)std::min(32767.0f, std::max(-32768.0f, rounded));
+  }
+
+
+  //Make every output the input held so far allows, up to limit outputs in
+  //total, and drop input no longer needed.
+  inline void resample_run(resampler& r, resample_channel& channel, uint64_t limit,
+                           std::vector<int16_t>& output)
+  {
+    while (channel.next < channel.input.size() && channel.samples_out < limit) {
+      const float* x = &channel.input[(size_t)(channel.next - (r.taps - 1))];
+      output.push_back(resample_saturate(resample_dot(&r.coefficients[channel.phase * r.taps], x, r.taps)));
+      channel.samples_out = channel.samples_out + 1;
+
+      channel.phase = channel.phase + r.down;
+      channel.next = channel.next + channel.phase / r.up;
+      channel.phase = channel.phase % r.up;
+    }
+
+    uint64_t keep_from = std::min<uint64_t>(channel.next, channel.input.size()) - (r.taps - 1);
+    if (keep_from > 0) {
+      channel.input.erase(channel.input.begin(), channel.input.begin() + (size_t)keep_from);
+      channel.next = channel.next - keep_from;
+    }
+  }
+
+
+  //Outputs owed for the input seen so far, rounded up.
+  inline uint64_t resample_owed(const resampler& r, const resample_channel& channel)
+  {
+    return (channel.samples_in * r.up + r.down - 1) / r.down;
+  }
+
+
+  //Resample count samples of one channel, appending to output.
+  template <typename T>
+  inline void resample_process(resampler& r, int c, const T* samples, size_t count,
+                               std::vector<int16_t>& output)
+  {
+    resample_channel& channel = r.channel[c];
+    size_t first = channel.input.size();
+
+    channel.input.resize(first + count);
+    for (size_t i = 0; i < count; i++) {
+      channel.input[first + i] = (float)samples[i];
+    }
+    channel.samples_in = channel.samples_in + count;
+
+    resample_run(r, channel, resample_owed(r, channel), output);
+  }
+
+
+  //Flush the end of one channel through the filter with zeros.
+  inline void resample_finish(resampler& r, int c, std::vector<int16_t>& output)
+  {
+    resample_channel& channel = r.channel[c];
+
+    channel.input.resize(channel.input.size() + r.taps, 0.0f);
+    resample_run(r, channel, resample_owed(r, channel), output);
+  }
+
+#endif
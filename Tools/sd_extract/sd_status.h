@@ -0,0 +1,189 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_status.h
+// --!@brief      Registry of the status segment layouts of each firmware
+// --!@details    Picks the layout of every status segment from its length
+// --             and build stamps and decodes it with a decoder made for
+// --             that layout, so cards from different builds parse alike.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//The status segment carries no version number of its own. Every build
+//starts it with the compile and commit stamps though, and the trailer
+//gives its length, so those are what a layout is looked up by.
+//
+//A schema names a layout struct, laid out as the generated ones in
+//sd_layout.h, the segment length it has and optionally the build it
+//belongs to. A schema for a build is taken over one for its length only,
+//and a zero compile stamp matches any build. Each schema has its own
+//instance of status_decode so all its offsets are constants.
+//
+//To read an older or newer build, generate its layout with
+//sd_layout_gen.py from that build's FlashBlock.vhd into a struct of its
+//own and add a row for it to status_schemas.
+//
+//Segments that match no schema are counted and left out rather than read
+//with the wrong offsets. The last match is cached since a card is almost
+//always one build throughout.
+
+#ifndef SD_STATUS_H
+#define SD_STATUS_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include "sd_layout.h"
+#include "sd_load.h"
+#include "sd_packets.h"
+
+
+  typedef void (*status_decoder)(const unsigned char* segment, status_columns& packets);
+
+
+  //Decode one status segment laid out as Layout. Times are 9 bytes and
+  //the bottom 8 are kept as the raw time columns. The ninth byte is the
+  //top 2 bits of the week, zero until week 16384, see load_gps_time.
+  template <typename Layout>
+  inline void status_decode(const unsigned char* segment, status_columns& packets)
+  {
+    packets.compile.push_back(load_u32(segment + Layout::compile));
+    packets.commit.push_back(load_u32(segment + Layout::commit));
+    packets.status_t.push_back(load_gps_word(segment + Layout::fpga_time));
+    packets.accel_t.push_back(load_gps_word(segment + Layout::accel_time));
+    packets.gyro_t.push_back(load_gps_word(segment + Layout::gyro_time));
+    packets.mag_t.push_back(load_gps_word(segment + Layout::mag_time));
+    packets.temp_t.push_back(load_gps_word(segment + Layout::temp_time));
+    packets.audio_t.push_back(load_gps_word(segment + Layout::audio_time));
+    packets.rtc_t.push_back(load_u32(segment + Layout::rtc_time));
+    packets.mics_active.push_back(load_u8(segment + Layout::mics));
+
+    //The status type is the byte after the segment, its trailer's type.
+    packets.status_type.push_back(load_u8(segment + Layout::bytes));
+  }
+
+
+  struct status_schema {
+    const char* name;
+    int length;
+    uint32_t compile;
+    uint32_t commit;
+
+    //Offset of the status packet time, read by the verify scan.
+    int fpga_time;
+    status_decoder decode;
+  };
+
+
+  const status_schema status_schemas[] = {
+    { "flashblock", status_layout::bytes, 0, 0, status_layout::fpga_time, status_decode<status_layout> }
+  };
+
+  const int STATUS_SCHEMA_COUNT = sizeof(status_schemas) / sizeof(status_schemas[0]);
+
+
+  //Shortest status segment any schema takes. Shorter ones are bad
+  //trailers; longer ones are left to status_find.
+  inline int status_min_length()
+  {
+    int shortest = status_schemas[0].length;
+    for (int s = 1; s < STATUS_SCHEMA_COUNT; s++) {
+      shortest = std::min(shortest, status_schemas[s].length);
+    }
+    return shortest;
+  }
+
+
+  struct status_registry {
+    const status_schema* last;
+    int last_length;
+    uint32_t last_compile;
+    uint32_t last_commit;
+
+    uint64_t counts[STATUS_SCHEMA_COUNT];
+    uint64_t unknown;
+  };
+
+
+  inline void status_registry_init(status_registry& registry)
+  {
+    registry.last = NULL;
+    registry.last_length = -1;
+    registry.last_compile = 0;
+    registry.last_commit = 0;
+    for (int s = 0; s < STATUS_SCHEMA_COUNT; s++) {
+      registry.counts[s] = 0;
+    }
+    registry.unknown = 0;
+  }
+
+
+  //The schema of a status segment of length bytes, or NULL if none fits.
+  inline const status_schema* status_find(status_registry& registry, const unsigned char* segment, int length)
+  {
+    uint32_t compile = 0;
+    uint32_t commit = 0;
+
+    if (length >= 8) {
+      compile = load_u32(segment);
+      commit = load_u32(segment + 4);
+    }
+
+    if (length != registry.last_length || compile != registry.last_compile || commit != registry.last_commit) {
+      const status_schema* by_length = NULL;
+      const status_schema* by_build = NULL;
+
+      for (int s = 0; s < STATUS_SCHEMA_COUNT; s++) {
+        const status_schema& schema = status_schemas[s];
+        if (schema.length != length) {
+          continue;
+        }
+        if (schema.compile == 0) {
+          by_length = (by_length == NULL) ? &schema : by_length;
+        }
+        else if (schema.compile == compile && schema.commit == commit) {
+          by_build = &schema;
+        }
+      }
+
+      registry.last = (by_build != NULL) ? by_build : by_length;
+      registry.last_length = length;
+      registry.last_compile = compile;
+      registry.last_commit = commit;
+    }
+
+    if (registry.last == NULL) {
+      registry.unknown = registry.unknown + 1;
+    }
+    else {
+      registry.counts[registry.last - status_schemas] = registry.counts[registry.last - status_schemas] + 1;
+    }
+    return registry.last;
+  }
+
+
+  //Number of schemas that have matched a segment.
+  inline int status_layouts_seen(const status_registry& registry)
+  {
+    int seen = 0;
+    for (int s = 0; s < STATUS_SCHEMA_COUNT; s++) {
+      seen = seen + (registry.counts[s] != 0);
+    }
+    return seen;
+  }
+
+#endif
@@ -0,0 +1,282 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_track.h
+// --!@brief      GPS track of the collar from the NAV-SOL fixes
+// --!@details    Converts the ECEF positions to latitude, longitude and
+// --             height a chunk at a time and writes the good fixes as CSV,
+// --             GPX and GeoJSON tracks.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//NAV-SOL gives the position as ECEF X, Y, Z in cm. The conversion to WGS84
+//latitude, longitude and height above the ellipsoid is Heikkinen's closed
+//form, which is the same straight sequence of square roots and a cube root
+//for every fix, so a chunk of fixes runs as one loop with no iteration.
+//
+//A fix is kept when its fixtype is at least min_fix and no more than 4
+//(GPS + dead reckoning), which leaves out time only fixes, and when its
+//position accuracy pacc is within max_pacc_m.
+//
+//Fix times are the receiver's own GPS time, week, itow and ftow. The GPX
+//and GeoJSON times are UTC, GPS time less the leap seconds in force.
+
+#ifndef SD_TRACK_H
+#define SD_TRACK_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+  const double TRACK_WGS84_A = 6378137.0;
+  const double TRACK_WGS84_F = 1.0 / 298.257223563;
+  const double TRACK_PI = 3.14159265358979323846;
+  const double TRACK_WEEK_SECONDS = 604800.0;
+
+  //GPS - UTC in seconds, from each GPS time (seconds since 1980-01-06) on.
+  const int TRACK_LEAP_COUNT = 5;
+  const double TRACK_LEAP_START[TRACK_LEAP_COUNT] = {
+    820108814.0,    //2006-01-01
+    914803215.0,    //2009-01-01
+    1025136016.0,   //2012-07-01
+    1119744017.0,   //2015-07-01
+    1167264018.0    //2017-01-01
+  };
+  const int TRACK_LEAP_SECONDS[TRACK_LEAP_COUNT] = { 14, 15, 16, 17, 18 };
+  const int TRACK_LEAP_BEFORE = 13;
+
+  //fixtype values of a position fix.
+  const int TRACK_FIX_2D = 2;
+  const int TRACK_FIX_3D = 3;
+  const int TRACK_FIX_GPS_DR = 4;
+
+
+  //Latitude and longitude in degrees and height in m of count ECEF
+  //positions in m.
+  inline void track_ecef_to_geodetic(const double* x, const double* y, const double* z, size_t count,
+                                     double* latitude, double* longitude, double* height)
+  {
+    const double a = TRACK_WGS84_A;
+    const double b = a * (1.0 - TRACK_WGS84_F);
+    const double e2 = TRACK_WGS84_F * (2.0 - TRACK_WGS84_F);
+    const double ep2 = (a * a - b * b) / (b * b);
+    const double big_e2 = a * a - b * b;
+    const double to_degrees = 180.0 / TRACK_PI;
+
+    for (size_t i = 0; i < count; i++) {
+      double r2 = x[i] * x[i] + y[i] * y[i];
+      double r = std::sqrt(r2);
+      double z2 = z[i] * z[i];
+
+      double f = 54.0 * b * b * z2;
+      double g = r2 + (1.0 - e2) * z2 - e2 * big_e2;
+      double c = e2 * e2 * f * r2 / (g * g * g);
+      double s = std::cbrt(1.0 + c + std::sqrt(c * c + 2.0 * c));
+      double k = s + 1.0 / s + 1.0;
+      double p = f / (3.0 * k * k * g * g);
+      double q = std::sqrt(1.0 + 2.0 * e2 * e2 * p);
+      double r0 = -(p * e2 * r) / (1.0 + q)
+                  + std::sqrt(0.5 * a * a * (1.0 + 1.0 / q) - p * (1.0 - e2) * z2 / (q * (1.0 + q)) - 0.5 * p * r2);
+      double d = r - e2 * r0;
+      double u = std::sqrt(d * d + z2);
+      double v = std::sqrt(d * d + (1.0 - e2) * z2);
+      double z0 = b * b * z[i] / (a * v);
+
+      height[i] = u * (1.0 - b * b / (a * v));
+      latitude[i] = std::atan2(z[i] + ep2 * z0, r) * to_degrees;
+      longitude[i] = std::atan2(y[i], x[i]) * to_degrees;
+    }
+  }
+
+
+  //ISO 8601 UTC time of a GPS week and seconds of week.
+  inline std::string track_utc_string(int week, double seconds)
+  {
+    double gps = week * TRACK_WEEK_SECONDS + seconds;
+    int leap = TRACK_LEAP_BEFORE;
+
+    for (int i = 0; i < TRACK_LEAP_COUNT; i++) {
+      if (gps >= TRACK_LEAP_START[i]) {
+        leap = TRACK_LEAP_SECONDS[i];
+      }
+    }
+
+    //The GPS epoch is day 3657 since 1970-01-01.
+    int64_t ms = (int64_t)std::floor((gps - leap) * 1000.0 + 0.5);
+    int64_t days = ms / 86400000LL;
+    int64_t of_day = ms % 86400000LL;
+    if (of_day < 0) {
+      of_day = of_day + 86400000LL;
+      days = days - 1;
+    }
+    days = days + 3657;
+
+    //Civil date from days since 1970-01-01.
+    int64_t shifted = days + 719468;
+    int64_t era = (shifted >= 0 ? shifted : shifted - 146096) / 146097;
+    int64_t day_of_era = shifted - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t month_index = (5 * day_of_year + 2) / 153;
+    int day = (int)(day_of_year - (153 * month_index + 2) / 5 + 1);
+    int month = (int)(month_index < 10 ? month_index + 3 : month_index - 9);
+    int year = (int)(year_of_era + era * 400 + (month <= 2 ? 1 : 0));
+
+    char text[32];
+    snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", year, month, day,
+             (int)(of_day / 3600000), (int)(of_day / 60000 % 60), (int)(of_day / 1000 % 60), (int)(of_day % 1000));
+    return std::string(text);
+  }
+
+
+  struct track_writer {
+    int min_fix;
+    double max_pacc_m;
+
+    FILE* csv;
+    FILE* gpx;
+    FILE* geojson;
+    uint64_t points;
+    uint64_t rejected;
+
+    //GeoJSON times follow the coordinates, so they are held to the end.
+    std::vector<std::string> geojson_times;
+
+    //Scratch for one chunk of fixes.
+    std::vector<double> ecef[3];
+    std::vector<double> geodetic[3];
+  };
+
+
+  //Open the three track files. name is the track name in the GPX file.
+  //Returns 0, or -1 if a file could not be created. On failure the files
+  //that did open are closed and removed, so track_close is not needed.
+  inline int track_open(track_writer& track, const std::string& csv_filename, const std::string& gpx_filename,
+                        const std::string& geojson_filename, const std::string& name, int min_fix, double max_pacc_m)
+  {
+    track.min_fix = min_fix;
+    track.max_pacc_m = max_pacc_m;
+    track.points = 0;
+    track.rejected = 0;
+    track.geojson_times.clear();
+
+    track.csv = fopen(csv_filename.c_str(), "w");
+    track.gpx = fopen(gpx_filename.c_str(), "w");
+    track.geojson = fopen(geojson_filename.c_str(), "w");
+    if (track.csv == NULL || track.gpx == NULL || track.geojson == NULL) {
+      FILE* files[3] = { track.csv, track.gpx, track.geojson };
+      const std::string* filenames[3] = { &csv_filename, &gpx_filename, &geojson_filename };
+      for (int f = 0; f < 3; f++) {
+        if (files[f] != NULL) {
+          fclose(files[f]);
+          remove(filenames[f]->c_str());
+        }
+      }
+      track.csv = NULL;
+      track.gpx = NULL;
+      track.geojson = NULL;
+      return -1;
+    }
+
+    fprintf(track.csv, "gps_week,gps_seconds,utc,latitude,longitude,height_m,pacc_m,numsv,fixtype\n");
+    fprintf(track.gpx, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(track.gpx, "<gpx creator=\"parse_sdcard_mex_p\" version=\"1.1\" xmlns=\"http://www.topografix.com/GPX/1/1\">\n");
+    std::string escaped;
+    for (size_t i = 0; i < name.size(); i++) {
+      escaped = escaped + ((name[i] == '&') ? std::string("&amp;") : (name[i] == '<') ? std::string("&lt;") :
+                           (name[i] == '>') ? std::string("&gt;") : std::string(1, name[i]));
+    }
+    fprintf(track.gpx, " <trk>\n  <name>%s</name>\n  <trkseg>\n", escaped.c_str());
+    fprintf(track.geojson, "{\"type\":\"FeatureCollection\",\"features\":[{\"type\":\"Feature\",");
+    fprintf(track.geojson, "\"geometry\":{\"type\":\"LineString\",\"coordinates\":[");
+    return 0;
+  }
+
+
+  //Add count NAV-SOL fixes. ecef is X, Y, Z in cm and pacc in cm.
+  inline void track_add(track_writer& track, size_t count, const int32_t* ecef_x, const int32_t* ecef_y,
+                        const int32_t* ecef_z, const uint32_t* pacc, const uint8_t* fixtype, const uint8_t* numsv,
+                        const int16_t* week, const uint32_t* itow, const int32_t* ftow)
+  {
+    const int32_t* ecef_cm[3] = { ecef_x, ecef_y, ecef_z };
+
+    for (int a = 0; a < 3; a++) {
+      track.ecef[a].resize(count);
+      track.geodetic[a].resize(count);
+      for (size_t i = 0; i < count; i++) {
+        track.ecef[a][i] = ecef_cm[a][i] * 0.01;
+      }
+    }
+    track_ecef_to_geodetic(track.ecef[0].data(), track.ecef[1].data(), track.ecef[2].data(), count,
+                           track.geodetic[0].data(), track.geodetic[1].data(), track.geodetic[2].data());
+
+    for (size_t i = 0; i < count; i++) {
+      double pacc_m = pacc[i] * 0.01;
+      if (fixtype[i] < track.min_fix || fixtype[i] > TRACK_FIX_GPS_DR || pacc_m > track.max_pacc_m) {
+        track.rejected = track.rejected + 1;
+        continue;
+      }
+
+      double seconds = itow[i] * 1e-3 + ftow[i] * 1e-9;
+      std::string utc = track_utc_string(week[i], seconds);
+      double latitude = track.geodetic[0][i];
+      double longitude = track.geodetic[1][i];
+      double height = track.geodetic[2][i];
+
+      fprintf(track.csv, "%d,%.9f,%s,%.8f,%.8f,%.3f,%.2f,%u,%u\n", (int)week[i], seconds, utc.c_str(),
+              latitude, longitude, height, pacc_m, (unsigned)numsv[i], (unsigned)fixtype[i]);
+      fprintf(track.gpx, "   <trkpt lat=\"%.8f\" lon=\"%.8f\">\n    <ele>%.3f</ele>\n    <time>%s</time>\n"
+              "    <fix>%s</fix>\n    <sat>%u</sat>\n   </trkpt>\n", latitude, longitude, height, utc.c_str(),
+              (fixtype[i] == TRACK_FIX_2D) ? "2d" : "3d", (unsigned)numsv[i]);
+      fprintf(track.geojson, "%s[%.8f,%.8f,%.3f]", (track.points == 0) ? "" : ",", longitude, latitude, height);
+      track.geojson_times.push_back(utc);
+      track.points = track.points + 1;
+    }
+  }
+
+
+  //Finish the GPX and GeoJSON documents and close the files.
+  //Returns 0, or -1 on a write error.
+  inline int track_close(track_writer& track)
+  {
+    int result = 0;
+
+    if (track.gpx != NULL) {
+      fprintf(track.gpx, "  </trkseg>\n </trk>\n</gpx>\n");
+      result |= (fclose(track.gpx) == 0) ? 0 : -1;
+    }
+    if (track.geojson != NULL) {
+      fprintf(track.geojson, "]},\"properties\":{\"coordTimes\":[");
+      for (size_t i = 0; i < track.geojson_times.size(); i++) {
+        fprintf(track.geojson, "%s\"%s\"", (i == 0) ? "" : ",", track.geojson_times[i].c_str());
+      }
+      fprintf(track.geojson, "]}}]}\n");
+      result |= (fclose(track.geojson) == 0) ? 0 : -1;
+    }
+    if (track.csv != NULL) {
+      result |= (fclose(track.csv) == 0) ? 0 : -1;
+    }
+    track.gpx = NULL;
+    track.geojson = NULL;
+    track.csv = NULL;
+    return result;
+  }
+
+#endif
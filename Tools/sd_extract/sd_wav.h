@@ -0,0 +1,371 @@
+// ----------------------------------------------------------------------------
+// --
+// --!@file       sd_wav.h
+// --!@brief      Streaming WAV/RF64 writer for the collar audio channels
+// --!@details    Writes decoded audio a chunk at a time so a recording of
+// --             any length is exported in bounded memory.
+// --!@copyright
+// --
+// --This program is free software : you can redistribute it and / or modify
+// --it under the terms of the GNU General Public License as published by
+// --the Free Software Foundation, either version 3 of the License, or
+// --(at your option) any later version.
+// --
+// --This program is distributed in the hope that it will be useful,
+// --but WITHOUT ANY WARRANTY; without even the implied warranty of
+// --MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// --GNU General Public License for more details.
+// --
+// --You should have received a copy of the GNU General Public License
+// --along with this program.If not, see <http://www.gnu.org/licenses/>.
+// --
+// ----------------------------------------------------------------------------
+
+
+//The file is started as a plain RIFF/WAVE with a 28 byte JUNK chunk ahead
+//of fmt. If the data grows past what a 32 bit RIFF size can hold the JUNK
+//chunk is rewritten as ds64 and the file becomes RF64 (EBU Tech 3306), so
+//files under 4 GB stay readable by everything.
+//
+//Samples are added per channel and written out as whole frames. A channel
+//that runs ahead keeps its extra samples until the others catch up.
+//
+//DC removal and gain come from wav_scan_levels, one walk over the audio
+//segments that only sums and tracks the peak of each channel.
+
+#ifndef SD_WAV_H
+#define SD_WAV_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sd_block.h"
+
+#ifdef _WIN32
+#define wav_fseek _fseeki64
+#else
+#define wav_fseek fseeko
+#endif
+
+
+  const int WAV_MAX_CHANNELS = 2;
+  const int WAV_BITS = 16;
+
+  //Offsets of the fields patched when the file is closed.
+  const long WAV_RIFF_SIZE_OFFSET = 4;
+  const long WAV_JUNK_OFFSET = 12;
+  const long WAV_DATA_SIZE_OFFSET = 76;
+  const int WAV_DS64_BYTES = 28;
+  const int WAV_HEADER_BYTES = 80;
+
+
+  //Per channel mean and peak from the pre-scan.
+  struct wav_levels {
+    int channels;
+    double sum[WAV_MAX_CHANNELS];
+    uint64_t count[WAV_MAX_CHANNELS];
+    int min[WAV_MAX_CHANNELS];
+    int max[WAV_MAX_CHANNELS];
+  };
+
+
+  struct wav_writer {
+    FILE* file;
+    int channels;
+    int sample_rate;
+    uint64_t frames;
+
+    //Applied to every sample as (x - dc) * gain.
+    double dc[WAV_MAX_CHANNELS];
+    double gain;
+
+    std::vector<int16_t> pending[WAV_MAX_CHANNELS];
+    std::vector<int16_t> frame_buffer;
+  };
+
+
+  inline void wav_put_u16(unsigned char* out, uint16_t value)
+  {
+    out[0] = (unsigned char)(value & 0xFF);
+    out[1] = (unsigned char)(value >> 8);
+  }
+
+  inline void wav_put_u32(unsigned char* out, uint32_t value)
+  {
+    for (int i = 0; i < 4; i++) {
+      out[i] = (unsigned char)((value >> (8 * i)) & 0xFF);
+    }
+  }
+
+  inline void wav_put_u64(unsigned char* out, uint64_t value)
+  {
+    for (int i = 0; i < 8; i++) {
+      out[i] = (unsigned char)((value >> (8 * i)) & 0xFF);
+    }
+  }
+
+
+  //Open filename and write a header for an empty file.
+  //Returns 0, or -1 if the file could not be created.
+  inline int wav_open(wav_writer& wav, const std::string& filename, int channels, int sample_rate)
+  {
+    unsigned char header[WAV_HEADER_BYTES];
+    int block_align = channels * (WAV_BITS / 8);
+
+    wav.file = fopen(filename.c_str(), "wb");
+    wav.channels = std::min(std::max(channels, 1), WAV_MAX_CHANNELS);
+    wav.sample_rate = sample_rate;
+    wav.frames = 0;
+    wav.gain = 1.0;
+    for (int c = 0; c < WAV_MAX_CHANNELS; c++) {
+      wav.dc[c] = 0.0;
+      wav.pending[c].clear();
+    }
+    if (wav.file == NULL) {
+      return -1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(&header[0], "RIFF", 4);
+    memcpy(&header[8], "WAVE", 4);
+    memcpy(&header[WAV_JUNK_OFFSET], "JUNK", 4);
+    wav_put_u32(&header[WAV_JUNK_OFFSET + 4], WAV_DS64_BYTES);
+
+    memcpy(&header[48], "fmt ", 4);
+    wav_put_u32(&header[52], 16);
+    wav_put_u16(&header[56], 1);
+    wav_put_u16(&header[58], (uint16_t)wav.channels);
+    wav_put_u32(&header[60], (uint32_t)sample_rate);
+    wav_put_u32(&header[64], (uint32_t)(sample_rate * block_align));
+    wav_put_u16(&header[68], (uint16_t)block_align);
+    wav_put_u16(&header[70], WAV_BITS);
+
+    memcpy(&header[72], "data", 4);
+
+    if (fwrite(header, 1, sizeof(header), wav.file) != sizeof(header)) {
+      fclose(wav.file);
+      wav.file = NULL;
+      return -1;
+    }
+    return 0;
+  }
+
+
+  //Set DC removal and gain from the pre-scan. Gain scales the largest
+  //excursion from the mean of any channel to just under full scale, one
+  //gain for all channels so their balance is kept.
+  inline void wav_set_levels(wav_writer& wav, const wav_levels& levels, int remove_dc, int normalize)
+  {
+    double peak = 0.0;
+
+    for (int c = 0; c < wav.channels && c < levels.channels; c++) {
+      if (levels.count[c] == 0) {
+        continue;
+      }
+      wav.dc[c] = remove_dc ? levels.sum[c] / (double)levels.count[c] : 0.0;
+      peak = std::max(peak, std::fabs(levels.max[c] - wav.dc[c]));
+      peak = std::max(peak, std::fabs(levels.min[c] - wav.dc[c]));
+    }
+
+    wav.gain = (normalize && peak > 0.0) ? (0.99 * 32767.0) / peak : 1.0;
+  }
+
+
+  //Queue samples for one channel. They are written by wav_flush.
+  template <typename T>
+  inline void wav_add_samples(wav_writer& wav, int channel, const T* samples, size_t count)
+  {
+    std::vector<int16_t>& pending = wav.pending[channel];
+    size_t first = pending.size();
+
+    pending.resize(first + count);
+    for (size_t i = 0; i < count; i++) {
+      pending[first + i] = (int16_t)samples[i];
+    }
+  }
+
+
+  //Write every complete frame queued so far.
+  //Returns 0, or -1 on a write error.
+  inline int wav_flush(wav_writer& wav)
+  {
+    size_t frames = wav.pending[0].size();
+    int identity = (wav.gain == 1.0);
+
+    if (wav.file == NULL) {
+      return -1;
+    }
+
+    for (int c = 1; c < wav.channels; c++) {
+      frames = std::min(frames, wav.pending[c].size());
+    }
+    for (int c = 0; c < wav.channels; c++) {
+      identity = identity && (wav.dc[c] == 0.0);
+    }
+    if (frames == 0) {
+      return 0;
+    }
+
+    wav.frame_buffer.resize(frames * wav.channels);
+    for (int c = 0; c < wav.channels; c++) {
+      const int16_t* in = wav.pending[c].data();
+      int16_t* out = wav.frame_buffer.data() + c;
+      if (identity) {
+        for (size_t i = 0; i < frames; i++) {
+          out[i * wav.channels] = in[i];
+        }
+      }
+      else {
+        for (size_t i = 0; i < frames; i++) {
+          double value = std::floor((in[i] - wav.dc[c]) * wav.gain + 0.5);
+          value = std::min(32767.0, std::max(-32768.0, value));
+          out[i * wav.channels] = (int16_t)value;
+        }
+      }
+      wav.pending[c].erase(wav.pending[c].begin(), wav.pending[c].begin() + frames);
+    }
+
+    //Samples are little endian on the card and in the file.
+    if (fwrite(wav.frame_buffer.data(), sizeof(int16_t), wav.frame_buffer.size(), wav.file) != wav.frame_buffer.size()) {
+      return -1;
+    }
+    wav.frames = wav.frames + frames;
+    return 0;
+  }
+
+
+  //Write the sizes into the header and close the file. Samples left over
+  //without a full frame are dropped.
+  //Returns 0, or -1 on a write error.
+  inline int wav_close(wav_writer& wav)
+  {
+    unsigned char field[WAV_DS64_BYTES + 8];
+    uint64_t data_bytes;
+    uint64_t riff_bytes;
+    int result = 0;
+
+    if (wav.file == NULL) {
+      return -1;
+    }
+
+    result = wav_flush(wav);
+    data_bytes = wav.frames * wav.channels * (WAV_BITS / 8);
+    riff_bytes = (WAV_HEADER_BYTES - 8) + data_bytes;
+
+    if (riff_bytes <= 0xFFFFFFFFULL) {
+      wav_put_u32(field, (uint32_t)riff_bytes);
+      wav_fseek(wav.file, WAV_RIFF_SIZE_OFFSET, SEEK_SET);
+      fwrite(field, 1, 4, wav.file);
+      wav_put_u32(field, (uint32_t)data_bytes);
+      wav_fseek(wav.file, WAV_DATA_SIZE_OFFSET, SEEK_SET);
+      fwrite(field, 1, 4, wav.file);
+    }
+    else {
+      //RF64. The 32 bit sizes are all ones and the real ones go in ds64.
+      memcpy(field, "RF64", 4);
+      wav_put_u32(&field[4], 0xFFFFFFFF);
+      wav_fseek(wav.file, 0, SEEK_SET);
+      fwrite(field, 1, 8, wav.file);
+
+      memcpy(field, "ds64", 4);
+      wav_put_u32(&field[4], WAV_DS64_BYTES);
+      wav_put_u64(&field[8], riff_bytes);
+      wav_put_u64(&field[16], data_bytes);
+      wav_put_u64(&field[24], wav.frames);
+      wav_put_u32(&field[32], 0);
+      wav_fseek(wav.file, WAV_JUNK_OFFSET, SEEK_SET);
+      fwrite(field, 1, WAV_DS64_BYTES + 8, wav.file);
+
+      wav_put_u32(field, 0xFFFFFFFF);
+      wav_fseek(wav.file, WAV_DATA_SIZE_OFFSET, SEEK_SET);
+      fwrite(field, 1, 4, wav.file);
+    }
+
+    if (fclose(wav.file) != 0) {
+      result = -1;
+    }
+    wav.file = NULL;
+    return result;
+  }
+
+
+  //Walk the audio segments of the first file_length bytes and total the
+  //mean and peak of each channel. Channel 0 is the second word of each
+  //frame (audio_l) when there are two microphones, as in the WAV file.
+  //Returns 0, or -1 if the file could not be read in full.
+  inline int wav_scan_levels(const std::string& filename, uint64_t file_length,
+                             int num_mics_active, wav_levels& levels)
+  {
+    const uint64_t chunk_blocks = 8192;
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    std::vector<unsigned char> contents;
+    std::vector<int> packet_start_locations;
+    std::vector<int> packet_lengths;
+    std::vector<int> packet_types;
+    uint64_t total_blocks = file_length / BLOCK_SIZE;
+    int frame_bytes = AUDIO_WORD_BYTES * num_mics_active;
+    int error_offset;
+
+    levels.channels = std::min(num_mics_active, WAV_MAX_CHANNELS);
+    for (int c = 0; c < WAV_MAX_CHANNELS; c++) {
+      levels.sum[c] = 0.0;
+      levels.count[c] = 0;
+      levels.min[c] = 32767;
+      levels.max[c] = -32768;
+    }
+    if (!in) {
+      return -1;
+    }
+
+    for (uint64_t block = 0; block < total_blocks; block = block + chunk_blocks) {
+      uint64_t blocks = std::min(chunk_blocks, total_blocks - block);
+      contents.resize((size_t)(blocks * BLOCK_SIZE));
+      in.seekg(block * BLOCK_SIZE);
+      in.read(reinterpret_cast<char*>(&contents[0]), contents.size());
+      if ((size_t)in.gcount() != contents.size()) {
+        return -1;
+      }
+
+      for (uint64_t b = 0; b < blocks; b++) {
+        int block_start = int(b * BLOCK_SIZE);
+        if (block_unwritten(load_u32(&contents[block_start]))) {
+          continue;
+        }
+
+        packet_start_locations.clear();
+        packet_lengths.clear();
+        packet_types.clear();
+        if (walk_block(&contents[0], block_start, packet_start_locations, packet_lengths,
+                       packet_types, error_offset) != BLOCK_OK) {
+          continue;
+        }
+
+        for (size_t i = 0; i < packet_types.size(); i++) {
+          if (packet_types[i] != BLOCK_SEG_AUDIO) {
+            continue;
+          }
+          for (int c = 0; c < levels.channels; c++) {
+            //Two microphones put audio_l, the second word, first.
+            int first = (levels.channels == 2 && c == 0) ? AUDIO_WORD_BYTES : 0;
+            for (int a_i = first; a_i < packet_lengths[i]; a_i = a_i + frame_bytes) {
+              int16_t word = load_i16(&contents[packet_start_locations[i] + a_i]);
+              levels.sum[c] = levels.sum[c] + word;
+              levels.count[c] = levels.count[c] + 1;
+              levels.min[c] = std::min(levels.min[c], (int)word);
+              levels.max[c] = std::max(levels.max[c], (int)word);
+            }
+          }
+        }
+      }
+    }
+
+    return 0;
+  }
+
+#endif